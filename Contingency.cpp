@@ -0,0 +1,225 @@
+#include "stdafx.h"
+#include "Contingency.h"
+#include "ParallelFor.h"
+#include <math.h>
+#include <limits.h>
+#include <algorithm>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+static bool moreSevere(const ct_case& a, const ct_case& b)
+{
+	if (a.islanding != b.islanding)
+		return b.islanding;
+	if (a.severity != b.severity)
+		return a.severity > b.severity;
+	return a.branch < b.branch;
+}
+
+CContingency::CContingency()
+{
+	m_run = 0;
+}
+
+bool CContingency::follow(const CPowerModel& model, int nWorkers)
+{
+	m_Workers.resize(CParallelFor::workerCount(INT_MAX, nWorkers));
+	const CPowerModel& last = m_Dc.model();
+	bool bSame = last.buses.size() == model.buses.size() && last.branches.size() == model.branches.size();
+	for (size_t l = 0; l < model.branches.size() && bSame; l++)
+	{
+		const pf_branch& a = last.branches[l];
+		const pf_branch& b = model.branches[l];
+		bSame = a.from == b.from && a.to == b.to && a.r == b.r && a.x == b.x && a.b == b.b && a.ratio == b.ratio && a.angle == b.angle;
+	}
+
+	//breakers that moved since the last run, as updates of the factorizations
+	for (size_t l = 0; l < model.branches.size() && bSame; l++)
+	{
+		bool bInService = model.branches[l].status;
+		if (last.branches[l].status == bInService)
+			continue;
+		bSame = m_Dc.setBranch((int)l, bInService, nWorkers);
+		for (size_t w = 0; w < m_Workers.size(); w++)
+			if (m_Workers[w].ready)
+				m_Workers[w].flow.setBranch((int)l, bInService);
+	}
+	if (bSame)
+		return true;
+	for (size_t w = 0; w < m_Workers.size(); w++)
+		m_Workers[w].ready = false;
+	return m_Dc.setModel(model, nWorkers, false);
+}
+
+void CContingency::injections(const CPowerModel& model, const pf_result& base)
+{
+	//what the base case's flows and shunts take out of each bus is its injection; the loads
+	//stay and the generation makes up the rest
+	int n = (int)model.buses.size();
+	std::vector<double> P(n, 0), Q(n, 0);
+	for (size_t l = 0; l < model.branches.size() && l < base.flows.size(); l++)
+	{
+		const pf_branch& br = model.branches[l];
+		if (!br.status)
+			continue;
+		P[br.from] += base.flows[l].pf;
+		Q[br.from] += base.flows[l].qf;
+		P[br.to] += base.flows[l].pt;
+		Q[br.to] += base.flows[l].qt;
+	}
+	m_Buses = model.buses;
+	m_vm.assign(n, 1.0);
+	m_va.assign(n, 0);
+	for (int k = 0; k < n && k < (int)base.vm.size(); k++)
+	{
+		double vm = base.vm[k];
+		if (vm <= 0)
+			continue;
+		pf_bus& b = m_Buses[k];
+		b.pg = P[k] + b.gs * vm * vm + b.pd;
+		b.qg = Q[k] - b.bs * vm * vm + b.qd;
+		b.vm = vm;
+		m_vm[k] = vm;
+		m_va[k] = base.va[k];
+	}
+}
+
+double CContingency::loading(const pf_branch& br, double p, double q) const
+{
+	return br.rate > 0 ? sqrt(p * p + q * q) / br.rate : 0;
+}
+
+bool CContingency::run(const CPowerModel& model, const pf_result& base, ct_result& res, const ct_options& opt)
+{
+	res = ct_result();
+	if (model.buses.empty() || base.flows.size() != model.branches.size() || !follow(model, opt.nWorkers))
+		return false;
+	const std::vector<pf_branch>& branches = model.branches;
+	int nbr = (int)branches.size();
+
+	//DC screen of every outage
+	std::vector<int> outages;
+	for (int k = 0; k < nbr; k++)
+		if (branches[k].status)
+			outages.push_back(k);
+	//loading^2 = (p^2 + q^2) / rate^2, the root only taken of the largest
+	std::vector<double> q2(nbr, 0), inv2(nbr, 0);
+	for (int l = 0; l < nbr; l++)
+		if (branches[l].rate > 0)
+		{
+			q2[l] = base.flows[l].qf * base.flows[l].qf;
+			inv2[l] = 1 / (branches[l].rate * branches[l].rate);
+		}
+	double limit2 = opt.limit * opt.limit;
+	res.cases.resize(outages.size());
+	CParallelFor::run((int)outages.size(), [&](int i, int worker)
+	{
+		ct_worker& w = m_Workers[worker];
+		ct_case& c = res.cases[i];
+		c.branch = outages[i];
+		c.islanding = c.solved = c.converged = false;
+		c.severity = -1;   //nothing flows: left out below
+		c.worst = -1;
+		c.overloads = 0;
+		if (!m_Dc.transfer(c.branch, w.phi, w.x, w.work))
+			return;
+		double d = 1 - w.phi[c.branch];
+		if (d < CT_BRIDGE)
+		{
+			c.islanding = true;
+			c.severity = 0;
+			return;
+		}
+		double shift = base.flows[c.branch].pf / d;
+		double worst = 0;
+		for (int l = 0; l < nbr; l++)
+		{
+			if (inv2[l] == 0 || l == c.branch)
+				continue;
+			//the reactive flow is taken as it was
+			double p = base.flows[l].pf + w.phi[l] * shift;
+			double s2 = (p * p + q2[l]) * inv2[l];
+			if (s2 > worst)
+			{
+				worst = s2;
+				c.worst = l;
+			}
+			c.overloads += s2 > limit2;
+		}
+		c.severity = sqrt(worst);
+	}, opt.nWorkers);
+	size_t kept = 0;
+	for (size_t i = 0; i < res.cases.size(); i++)
+		if (res.cases[i].severity >= 0)
+			res.cases[kept++] = res.cases[i];
+	res.cases.resize(kept);
+	res.screened = (int)kept;
+
+	//AC solves of the cases near their limits, the worst first
+	std::sort(res.cases.begin(), res.cases.end(), moreSevere);
+	int nSolve = 0;
+	while (nSolve < (int)res.cases.size() && nSolve < opt.maxSolves &&
+		!res.cases[nSolve].islanding && res.cases[nSolve].severity >= opt.screen)
+		nSolve++;
+	if (nSolve > 0)
+	{
+		injections(model, base);
+		m_run++;
+		pf_options ac(opt.ac);
+		ac.warmStart = true;
+		const CPowerModel& network = m_Dc.model();
+		CParallelFor::run(nSolve, [&](int i, int worker)
+		{
+			ct_worker& w = m_Workers[worker];
+			if (!w.ready)
+			{
+				w.flow.setModel(network);
+				w.ready = true;
+				w.run = 0;
+			}
+			if (w.run != m_run)
+			{
+				w.flow.setInjections(m_Buses);
+				w.run = m_run;
+			}
+			ct_case& c = res.cases[i];
+			w.flow.setBranch(c.branch, false);
+			w.flow.setStart(m_vm, m_va);
+			c.solved = true;
+			c.converged = w.flow.solve(w.res, ac);
+			if (c.converged)
+			{
+				c.severity = 0;
+				c.worst = -1;
+				c.overloads = 0;
+				for (int l = 0; l < nbr; l++)
+				{
+					if (l == c.branch || branches[l].rate <= 0)
+						continue;
+					const pf_flow& f = w.res.flows[l];
+					double s = std::max(loading(branches[l], f.pf, f.qf), loading(branches[l], f.pt, f.qt));
+					if (s > c.severity)
+					{
+						c.severity = s;
+						c.worst = l;
+					}
+					c.overloads += s > opt.limit;
+				}
+			}
+			w.flow.setBranch(c.branch, true);
+		}, opt.nWorkers);
+		std::sort(res.cases.begin(), res.cases.end(), moreSevere);
+	}
+
+	res.solved = nSolve;
+	for (size_t i = 0; i < res.cases.size(); i++)
+	{
+		res.overloaded += res.cases[i].overloads > 0;
+		res.islanding += res.cases[i].islanding;
+	}
+	TRACE(_T("CContingency::run, %d outages screened, %d solved on AC, %d with overloads, %d islanding\n"),
+		res.screened, res.solved, res.overloaded, res.islanding);
+	return true;
+}
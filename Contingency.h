@@ -0,0 +1,86 @@
+#pragma once
+//
+// N-1 contingency analysis: every branch in service taken out in turn, against a base case
+// that is a power flow solution or a state estimate. The screen is DC, by line outage
+// distribution factors: with phi the flows of one MW in at the outaged branch k's from bus
+// and out at its to bus, LODF(l, k) = phi(l) / (1 - phi(k)), and branch l carries
+// F(l) + LODF(l, k) F(k) with k out, F being the base case's own flows. phi is one solve with
+// the factorized B, so a screen is a solve per outage on the workers, each with its own
+// scratch, and the LODF matrix is never formed. phi(k) = 1 when k is the only way between
+// its ends; such an outage splits the network and is listed apart.
+//
+// The cases the screen finds near their limits are solved again on AC, the most severe
+// first. Each worker keeps a CPowerFlow of the base case whose ordering, Jacobian pattern and
+// pivots survive taking a branch out and putting it back, so a case is a Newton solve from
+// the base voltages with no setup. The base case's voltages and flows give the injections
+// the AC solves hold, so an estimate serves as well as a solution. Between runs the
+// factorizations follow breakers branch by branch, as the DC power flow does.
+//
+#include "PowerFlow.h"
+#include "DcPowerFlow.h"
+
+#define CT_BRIDGE 1e-6   // 1 - phi(k) below this is an outage that splits the network
+
+struct ct_options
+{
+	double screen;       // DC loading, of the rate, from which a case is solved on AC
+	double limit;        // loading that is an overload
+	int maxSolves;       // AC solves in one run at most, the most severe cases first
+	int nWorkers;        // as in CParallelFor
+	pf_options ac;       // of the AC solves, which always start from the base case
+
+	ct_options() : screen(0.9), limit(1.0), maxSolves(50), nWorkers(0) { ac.maxIterations = 10; ac.tolerance = 1e-6; }
+};
+
+struct ct_case
+{
+	int branch;          // taken out
+	bool islanding;      // the only way between its ends, not screened
+	bool solved;         // on AC
+	bool converged;
+	double severity;     // largest loading of another branch with a rate, AC when solved
+	int worst;           // the branch with that loading, -1 if none
+	int overloads;       // branches above the limit
+};
+
+struct ct_result
+{
+	std::vector<ct_case> cases;   // most severe first, then the islanding outages
+	int screened;                 // outages screened on DC
+	int solved;                   // cases solved on AC
+	int overloaded;               // cases with an overload
+	int islanding;
+
+	ct_result() : screened(0), solved(0), overloaded(0), islanding(0) {}
+};
+
+class CContingency
+{
+public:
+	CContingency();
+
+	// screens the outage of every branch in service of the model, whose loads and topology
+	// may have changed since the last run; base holds its voltages and flows
+	bool run(const CPowerModel& model, const pf_result& base, ct_result& res, const ct_options& opt = ct_options());
+
+private:
+	struct ct_worker
+	{
+		CPowerFlow flow;
+		bool ready;                        // flow has the topology
+		int run;                           // flow has the injections of this run
+		pf_result res;
+		std::vector<double> phi, x, work;  // DC scratch
+
+		ct_worker() : ready(false), run(0) {}
+	};
+	bool follow(const CPowerModel& model, int nWorkers);   // the topology of the model
+	void injections(const CPowerModel& model, const pf_result& base);
+	double loading(const pf_branch& br, double p, double q) const;
+
+	CDcPowerFlow m_Dc;                     // factorization only, and the topology of the last run
+	std::vector<ct_worker> m_Workers;
+	int m_run;
+	std::vector<pf_bus> m_Buses;           // the base case's injections
+	std::vector<double> m_vm, m_va;        // its voltages, 1 pu where it has none
+};
@@ -0,0 +1,591 @@
+#include "stdafx.h"
+#include "DcPowerFlow.h"
+#include "ParallelFor.h"
+#include <emmintrin.h>
+#include <math.h>
+#include <algorithm>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+static const double PI = 3.14159265358979323846;
+
+//v . x over PTDF_BLOCK entries
+static double dot(const float* v, const double* x)
+{
+	__m128d s0 = _mm_setzero_pd();
+	__m128d s1 = _mm_setzero_pd();
+	for (int i = 0; i < PTDF_BLOCK; i += 4)
+	{
+		__m128 a = _mm_loadu_ps(v + i);
+		s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_cvtps_pd(a), _mm_loadu_pd(x + i)));
+		s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(a, a)), _mm_loadu_pd(x + i + 2)));
+	}
+	s0 = _mm_add_pd(s0, s1);
+	s0 = _mm_add_sd(s0, _mm_unpackhi_pd(s0, s0));
+	return _mm_cvtsd_f64(s0);
+}
+
+CDcPowerFlow::CDcPowerFlow()
+{
+	m_nBus = 0;
+	m_nBranch = 0;
+	m_bDense = true;
+	m_bPtdf = true;
+	m_ref = -1;
+	m_bFlows = false;
+}
+
+void CDcPowerFlow::injections(const CPowerModel& model, std::vector<double>& P)
+{
+	P.resize(model.buses.size());
+	for (size_t k = 0; k < model.buses.size(); k++)
+		P[k] = model.buses[k].pg - model.buses[k].pd;
+}
+
+bool CDcPowerFlow::setModel(const CPowerModel& model, int nWorkers, bool bPtdf)
+{
+	m_Model = model;
+	m_bPtdf = bPtdf;
+	return build(nWorkers);
+}
+
+bool CDcPowerFlow::build(int nWorkers)
+{
+	const CPowerModel& model = m_Model;
+	int n = (int)model.buses.size();
+	int nbr = (int)model.branches.size();
+
+	//blocks that were in use stay in use across a topology change
+	std::vector<int> hot;
+	if (n == m_nBus)
+		for (size_t blk = 0; blk < m_Blocks.size(); blk++)
+			if (m_Blocks[blk].built)
+				hot.push_back((int)blk);
+
+	m_nBus = n;
+	m_nBranch = nbr;
+	m_bDense = m_bPtdf && (double)nbr * n <= PTDF_DENSE_LIMIT;
+	m_bFlows = false;
+	m_Blocks.clear();
+	m_from.resize(nbr);
+	m_to.resize(nbr);
+	m_y.resize(nbr);
+	m_b.resize(nbr);
+	for (int l = 0; l < nbr; l++)
+	{
+		const pf_branch& br = model.branches[l];
+		m_from[l] = br.from;
+		m_to[l] = br.to;
+		m_y[l] = br.x != 0 ? 1.0 / (br.x * (br.ratio != 0 ? br.ratio : 1.0)) : 0;
+		m_b[l] = br.status ? m_y[l] : 0;
+	}
+
+	//the first slack is the reference; buses it does not reach have no factors
+	m_ref = -1;
+	for (int k = 0; k < n && m_ref < 0; k++)
+		if (model.buses[k].type == PF_SLACK)
+			m_ref = k;
+	m_idx.assign(n, -1);
+	m_Adjp.assign(n + 1, 0);
+	for (int l = 0; l < nbr; l++)
+	{
+		m_Adjp[m_from[l] + 1]++;
+		m_Adjp[m_to[l] + 1]++;
+	}
+	for (int k = 0; k < n; k++)
+		m_Adjp[k + 1] += m_Adjp[k];
+	m_Adjl.resize(m_Adjp[n]);
+	std::vector<int> next(m_Adjp.begin(), m_Adjp.end() - 1);
+	for (int l = 0; l < nbr; l++)
+	{
+		m_Adjl[next[m_from[l]]++] = l;
+		m_Adjl[next[m_to[l]]++] = l;
+	}
+	if (m_ref < 0)
+		return false;
+	std::vector< std::vector<int> > adj(n);
+	for (int l = 0; l < nbr; l++)
+		if (m_y[l] != 0)
+		{
+			adj[m_from[l]].push_back(m_to[l]);
+			adj[m_to[l]].push_back(m_from[l]);
+		}
+	std::vector<char> active(n, 0);
+	std::vector<int> queue(1, m_ref);
+	active[m_ref] = 1;
+	for (size_t head = 0; head < queue.size(); head++)
+		for (int a = m_Adjp[queue[head]]; a < m_Adjp[queue[head] + 1]; a++)
+		{
+			int l = m_Adjl[a], k = m_from[l] == queue[head] ? m_to[l] : m_from[l];
+			if (m_b[l] != 0 && !active[k])
+			{
+				active[k] = 1;
+				queue.push_back(k);
+			}
+		}
+	for (int l = 0; l < nbr; l++)
+		if (!active[m_from[l]])
+			m_b[l] = 0;
+
+	//branches out of service between energized buses keep their place in the pattern, so
+	//switching one is an update of the factor
+	std::vector<int> order;
+	CSparseOrdering::minimumDegree(adj, order);
+	int m = 0;
+	for (int t = 0; t < n; t++)
+		if (active[order[t]] && order[t] != m_ref)
+			m_idx[order[t]] = m++;
+
+	CSparseBuilder builder(m, m);
+	for (int l = 0; l < nbr; l++)
+	{
+		if (m_y[l] == 0 || !active[m_from[l]] || !active[m_to[l]])
+			continue;
+		double b = m_b[l];
+		int f = m_idx[m_from[l]], t = m_idx[m_to[l]];
+		if (f >= 0)
+			builder.add(f, f, b);
+		if (t >= 0)
+			builder.add(t, t, b);
+		if (f >= 0 && t >= 0)
+		{
+			builder.add(f, t, -b);
+			builder.add(t, f, -b);
+		}
+	}
+	sp_matrix B;
+	builder.compress(B);
+	std::vector<int> identity(m);
+	for (int k = 0; k < m; k++)
+		identity[k] = k;
+	m_Chol = CSparseCholesky();
+	if (m > 0 && (!m_Chol.analyze(B, identity) || !m_Chol.factor(B)))
+	{
+		TRACE(_T("CDcPowerFlow::build, Singular B\n"));
+		m_idx.assign(n, -1);
+		return false;
+	}
+
+	ptdf_block empty;
+	empty.built = false;
+	m_Blocks.assign((n + PTDF_BLOCK - 1) / PTDF_BLOCK, empty);
+	if (m_bDense)
+	{
+		hot.resize(m_Blocks.size());
+		for (size_t blk = 0; blk < hot.size(); blk++)
+			hot[blk] = (int)blk;
+	}
+	buildBlocks(hot, nWorkers);
+	shifts();
+	return true;
+}
+
+void CDcPowerFlow::shifts()
+{
+	//phase shifters drive a flow of their own: F = PTDF (P - Pbusinj) + Pfinj
+	std::vector<double> Pbusinj(m_nBus, 0), F;
+	bool bShift = false;
+	m_shift.assign(m_nBranch, 0);
+	for (int l = 0; l < m_nBranch; l++)
+	{
+		const pf_branch& br = m_Model.branches[l];
+		if (br.angle == 0 || m_b[l] == 0)
+			continue;
+		m_shift[l] = -m_b[l] * br.angle * PI / 180 * m_Model.baseMVA;
+		Pbusinj[br.from] += m_shift[l];
+		Pbusinj[br.to] -= m_shift[l];
+		bShift = true;
+	}
+	if (bShift)
+	{
+		solveFlows(Pbusinj, F);
+		for (int l = 0; l < m_nBranch; l++)
+			m_shift[l] -= F[l];
+	}
+}
+
+bool CDcPowerFlow::bridge(int branch)
+{
+	//the other end is searched for from one end, without the branch, on both sides at once
+	//so a short way round is found after a few buses
+	int ends[2] = { m_from[branch], m_to[branch] };
+	m_mark.resize(m_nBus, 0);
+	std::vector<int> queue[2];
+	for (int side = 0; side < 2; side++)
+	{
+		queue[side].push_back(ends[side]);
+		m_mark[ends[side]] = side + 1;
+	}
+	bool bFound = false;
+	size_t head[2] = { 0, 0 };
+	while (!bFound && head[0] < queue[0].size() && head[1] < queue[1].size())
+	{
+		int side = queue[0].size() - head[0] <= queue[1].size() - head[1] ? 0 : 1;
+		int k = queue[side][head[side]++];
+		for (int a = m_Adjp[k]; a < m_Adjp[k + 1] && !bFound; a++)
+		{
+			int l = m_Adjl[a], j = m_from[l] == k ? m_to[l] : m_from[l];
+			if (l == branch || m_b[l] == 0 || m_mark[j] == side + 1)
+				continue;
+			if (m_mark[j] != 0)
+				bFound = true;
+			else
+			{
+				m_mark[j] = side + 1;
+				queue[side].push_back(j);
+			}
+		}
+	}
+	for (int side = 0; side < 2; side++)
+		for (size_t q = 0; q < queue[side].size(); q++)
+			m_mark[queue[side][q]] = 0;
+	return !bFound;
+}
+
+bool CDcPowerFlow::rebuild(int nWorkers)
+{
+	bool bFlows = m_bFlows;
+	if (!build(nWorkers))
+		return false;
+	if (bFlows)
+	{
+		flows(m_P, m_F);
+		m_bFlows = true;
+	}
+	return true;
+}
+
+bool CDcPowerFlow::setBranch(int branch, bool bInService, int nWorkers)
+{
+	pf_branch& br = m_Model.branches[branch];
+	if (br.status == bInService)
+		return true;
+	br.status = bInService;
+	int f = m_idx[br.from], t = m_idx[br.to];
+	bool bFrom = f >= 0 || br.from == m_ref, bTo = t >= 0 || br.to == m_ref;
+	double b = m_y[branch];
+	if (b == 0 || (!bFrom && !bTo))
+		return true;   //nothing flows, or not in the energized part either way
+	//closing onto a dead bus or opening the last way between two parts changes the islands
+	if (!bFrom || !bTo || (!bInService && bridge(branch)))
+		return rebuild(nWorkers);
+
+	//B changes by db a a^T, a = e_f - e_t; with y = B^-1 a from the factor before the change,
+	//Sherman-Morrison gives every column of the PTDF as PTDF - c w^T db / (1 + db a^T y),
+	//c(l) = b(l) (y(from l) - y(to l)) and w(k) = y(k)
+	int m = 0;
+	for (int k = 0; k < m_nBus; k++)
+		m = std::max(m, m_idx[k] + 1);
+	std::vector<double> rhs(m, 0), y;
+	if (f >= 0)
+		rhs[f] = 1;
+	if (t >= 0)
+		rhs[t] = -1;
+	m_Chol.solve(rhs, y);
+	double db = bInService ? b : -b;
+	double scale = db / (1 + db * ((f >= 0 ? y[f] : 0) - (t >= 0 ? y[t] : 0)));
+
+	std::vector<int> rows;
+	std::vector<double> values;
+	if (f >= 0)
+	{
+		rows.push_back(f);
+		values.push_back(sqrt(b));
+	}
+	if (t >= 0)
+	{
+		rows.push_back(t);
+		values.push_back(-sqrt(b));
+	}
+	if (!m_Chol.update(rows, values, !bInService))
+		return rebuild(nWorkers);
+
+	std::vector<double> c(m_nBranch, 0), w(m_Blocks.size() * PTDF_BLOCK, 0);
+	for (int k = 0; k < m_nBus; k++)
+		if (m_idx[k] >= 0)
+			w[k] = y[m_idx[k]];
+	for (int l = 0; l < m_nBranch; l++)
+		if (m_b[l] != 0 && l != branch)
+		{
+			int lf = m_idx[m_from[l]], lt = m_idx[m_to[l]];
+			c[l] = m_b[l] * ((lf >= 0 ? y[lf] : 0) - (lt >= 0 ? y[lt] : 0)) * scale;
+		}
+	double rowScale = bInService ? b * scale / db : 0;   //the branch's own row, b w / (1 + db a^T y)
+	m_b[branch] = bInService ? b : 0;
+
+	if (m_bFlows)
+	{ //the flows follow by the same formula, w . P once
+		double wP = 0;
+		for (int k = 0; k < m_nBus; k++)
+			wP += w[k] * m_P[k];
+		for (int l = 0; l < m_nBranch; l++)
+			m_F[l] -= c[l] * wP + m_shift[l];
+		m_F[branch] = rowScale * wP;
+	}
+	std::vector<int> blocks;
+	for (size_t blk = 0; blk < m_Blocks.size(); blk++)
+		if (m_Blocks[blk].built)
+			blocks.push_back((int)blk);
+	CParallelFor::run((int)blocks.size(), [&](int i, int)
+	{
+		ptdf_block& block = m_Blocks[blocks[i]];
+		const double* wb = &w[blocks[i] * PTDF_BLOCK];
+		if (m_bDense)
+		{
+			float* v = &block.values[0];
+			for (int l = 0; l < m_nBranch; l++, v += PTDF_BLOCK)
+			{
+				if (l == branch)
+					for (int j = 0; j < PTDF_BLOCK; j++)
+						v[j] = (float)(rowScale * wb[j]);
+				else if (c[l] != 0)
+					for (int j = 0; j < PTDF_BLOCK; j++)
+						v[j] -= (float)(c[l] * wb[j]);
+			}
+			return;
+		}
+		//rows left out were below PTDF_DROP and are taken as 0, which is what leaving them out
+		//meant; the change may bring some of them in and take others out
+		double wMax = 0;
+		for (int j = 0; j < PTDF_BLOCK; j++)
+			wMax = std::max(wMax, fabs(wb[j]));
+		std::vector<int> rows;
+		std::vector<float> values;
+		size_t r = 0;
+		float v[PTDF_BLOCK];
+		for (int l = 0; l < m_nBranch; l++)
+		{
+			bool bStored = r < block.rows.size() && block.rows[r] == l;
+			if (!bStored && l != branch && fabs(c[l]) * wMax < PTDF_DROP)
+				continue;
+			for (int j = 0; j < PTDF_BLOCK; j++)
+				v[j] = l == branch ? (float)(rowScale * wb[j]) :
+					(bStored ? block.values[r * PTDF_BLOCK + j] : 0.0f) - (float)(c[l] * wb[j]);
+			r += bStored;
+			bool bKeep = false;
+			for (int j = 0; j < PTDF_BLOCK && !bKeep; j++)
+				bKeep = fabs(v[j]) >= PTDF_DROP;
+			if (bKeep)
+			{
+				rows.push_back(l);
+				values.insert(values.end(), v, v + PTDF_BLOCK);
+			}
+		}
+		block.rows.swap(rows);
+		block.values.swap(values);
+	}, nWorkers);
+	shifts();
+	if (m_bFlows)
+		for (int l = 0; l < m_nBranch; l++)
+			m_F[l] += m_shift[l];
+	return true;
+}
+
+void CDcPowerFlow::buildBlock(int blk, solve_scratch& s)
+{
+	ptdf_block& block = m_Blocks[blk];
+	std::vector<float> values((size_t)m_nBranch * PTDF_BLOCK, 0.0f);
+	for (int j = 0; j < PTDF_BLOCK; j++)
+	{
+		int k = blk * PTDF_BLOCK + j;
+		if (k >= m_nBus || m_idx[k] < 0)
+			continue;
+		std::fill(s.rhs.begin(), s.rhs.end(), 0.0);
+		s.rhs[m_idx[k]] = 1;
+		m_Chol.solve(s.rhs, s.x, s.work);
+		for (int l = 0; l < m_nBranch; l++)
+		{
+			if (m_b[l] == 0)
+				continue;
+			int f = m_idx[m_from[l]], t = m_idx[m_to[l]];
+			double d = (f >= 0 ? s.x[f] : 0) - (t >= 0 ? s.x[t] : 0);
+			values[(size_t)l * PTDF_BLOCK + j] = (float)(m_b[l] * d);
+		}
+	}
+
+	block.rows.clear();
+	if (m_bDense)
+		block.values.swap(values);
+	else
+	{
+		block.values.clear();
+		for (int l = 0; l < m_nBranch; l++)
+		{
+			const float* v = &values[(size_t)l * PTDF_BLOCK];
+			bool bKeep = false;
+			for (int j = 0; j < PTDF_BLOCK && !bKeep; j++)
+				bKeep = fabs(v[j]) >= PTDF_DROP;
+			if (bKeep)
+			{
+				block.rows.push_back(l);
+				block.values.insert(block.values.end(), v, v + PTDF_BLOCK);
+			}
+		}
+	}
+	block.built = true;
+}
+
+void CDcPowerFlow::buildBlocks(const std::vector<int>& blocks, int nWorkers)
+{
+	int m = 0;
+	for (int k = 0; k < m_nBus; k++)
+		m = std::max(m, m_idx[k] + 1);
+	std::vector<solve_scratch> scratch(CParallelFor::workerCount((int)blocks.size(), nWorkers));
+	for (size_t w = 0; w < scratch.size(); w++)
+		scratch[w].rhs.resize(m);
+	CParallelFor::run((int)blocks.size(), [&](int i, int worker)
+	{
+		buildBlock(blocks[i], scratch[worker]);
+	}, nWorkers);
+}
+
+size_t CDcPowerFlow::entries() const
+{
+	size_t n = 0;
+	for (size_t blk = 0; blk < m_Blocks.size(); blk++)
+		n += m_Blocks[blk].values.size();
+	return n;
+}
+
+double CDcPowerFlow::ptdf(int branch, int bus)
+{
+	int blk = bus / PTDF_BLOCK;
+	if (!m_Blocks[blk].built)
+		buildBlocks(std::vector<int>(1, blk), 1);
+	const ptdf_block& block = m_Blocks[blk];
+	size_t row = branch;
+	if (!m_bDense)
+	{
+		std::vector<int>::const_iterator it = std::lower_bound(block.rows.begin(), block.rows.end(), branch);
+		if (it == block.rows.end() || *it != branch)
+			return 0;
+		row = it - block.rows.begin();
+	}
+	return block.values[row * PTDF_BLOCK + bus % PTDF_BLOCK];
+}
+
+void CDcPowerFlow::column(int bus, std::vector<double>& out)
+{
+	out.assign(m_nBranch, 0);
+	std::vector<int> buses(1, bus);
+	std::vector<double> one(1, 1.0);
+	update(buses, one, out);
+}
+
+void CDcPowerFlow::solveFlows(const std::vector<double>& P, std::vector<double>& F) const
+{
+	int m = 0;
+	for (int k = 0; k < m_nBus; k++)
+		m = std::max(m, m_idx[k] + 1);
+	std::vector<double> rhs(m, 0), x, work;
+	for (int k = 0; k < m_nBus && k < (int)P.size(); k++)
+		if (m_idx[k] >= 0)
+			rhs[m_idx[k]] = P[k];
+	if (m > 0)
+		m_Chol.solve(rhs, x, work);
+	F.resize(m_nBranch);
+	for (int l = 0; l < m_nBranch; l++)
+	{
+		int f = m_idx[m_from[l]], t = m_idx[m_to[l]];
+		F[l] = m_b[l] == 0 ? 0 : m_b[l] * ((f >= 0 ? x[f] : 0) - (t >= 0 ? x[t] : 0));
+	}
+}
+
+bool CDcPowerFlow::transfer(int branch, std::vector<double>& F, std::vector<double>& x, std::vector<double>& work) const
+{
+	if (m_b.empty() || m_b[branch] == 0)
+		return false;
+	int m = 0;
+	for (int k = 0; k < m_nBus; k++)
+		m = std::max(m, m_idx[k] + 1);
+	int f = m_idx[m_from[branch]], t = m_idx[m_to[branch]];
+	x.assign(m, 0);
+	if (f >= 0)
+		x[f] = 1;
+	if (t >= 0)
+		x[t] = -1;
+	if (m > 0)
+		m_Chol.solve(x, x, work);
+	F.resize(m_nBranch);
+	for (int l = 0; l < m_nBranch; l++)
+	{
+		int lf = m_idx[m_from[l]], lt = m_idx[m_to[l]];
+		F[l] = m_b[l] == 0 ? 0 : m_b[l] * ((lf >= 0 ? x[lf] : 0) - (lt >= 0 ? x[lt] : 0));
+	}
+	return true;
+}
+
+void CDcPowerFlow::flows(const std::vector<double>& P, std::vector<double>& F) const
+{
+	if (!m_bDense)
+	{ //a solve reads far less than the matrix would be
+		solveFlows(P, F);
+		for (int l = 0; l < m_nBranch; l++)
+			F[l] += m_shift[l];
+		return;
+	}
+	std::vector<double> x(m_Blocks.size() * PTDF_BLOCK, 0.0);
+	std::copy(P.begin(), P.begin() + std::min((int)P.size(), m_nBus), x.begin());
+	F = m_shift;
+	for (size_t blk = 0; blk < m_Blocks.size(); blk++)
+	{
+		const float* v = m_Blocks[blk].values.empty() ? NULL : &m_Blocks[blk].values[0];
+		const double* xb = &x[blk * PTDF_BLOCK];
+		for (int l = 0; l < m_nBranch; l++, v += PTDF_BLOCK)
+			F[l] += dot(v, xb);
+	}
+}
+
+void CDcPowerFlow::update(const std::vector<int>& buses, const std::vector<double>& dP, std::vector<double>& F)
+{
+	std::vector<int> missing;
+	for (size_t i = 0; i < buses.size(); i++)
+	{
+		int blk = buses[i] / PTDF_BLOCK;
+		if (!m_Blocks[blk].built && std::find(missing.begin(), missing.end(), blk) == missing.end())
+			missing.push_back(blk);
+	}
+	if (!missing.empty())
+		buildBlocks(missing, 0);
+
+	for (size_t i = 0; i < buses.size(); i++)
+	{
+		const ptdf_block& block = m_Blocks[buses[i] / PTDF_BLOCK];
+		int j = buses[i] % PTDF_BLOCK;
+		double d = dP[i];
+		const float* v = block.values.empty() ? NULL : &block.values[j];
+		if (m_bDense)
+			for (int l = 0; l < m_nBranch; l++, v += PTDF_BLOCK)
+				F[l] += *v * d;
+		else
+			for (size_t r = 0; r < block.rows.size(); r++, v += PTDF_BLOCK)
+				F[block.rows[r]] += *v * d;
+	}
+}
+
+const std::vector<double>& CDcPowerFlow::inject(const std::vector<double>& P)
+{
+	if (!m_bFlows || P.size() != m_P.size())
+	{
+		flows(P, m_F);
+		m_P = P;
+		m_bFlows = true;
+		return m_F;
+	}
+	std::vector<int> changed;
+	std::vector<double> dP;
+	for (size_t k = 0; k < P.size() && (int)changed.size() * 8 <= m_nBus; k++)
+		if (P[k] != m_P[k])
+		{
+			changed.push_back((int)k);
+			dP.push_back(P[k] - m_P[k]);
+		}
+	if ((int)changed.size() * 8 > m_nBus)
+		flows(P, m_F);   //most of the matrix is read either way
+	else if (!changed.empty())
+		update(changed, dP, m_F);
+	m_P = P;
+	return m_F;
+}
@@ -0,0 +1,104 @@
+#pragma once
+//
+// DC power flow through the power transfer distribution factors: PTDF(l, k) is the MW that
+// branch l carries per MW injected at bus k and taken out at the slack. Column k is
+// Bf B^-1 e_k, one solve with the factorized bus susceptance matrix, and with the columns at
+// hand a full set of flows is one matrix-vector product and a change at a few buses is a few
+// columns added to the last flows, with no solve at all.
+//
+// Columns are kept in blocks of 16 buses, a row of a block being 16 floats that are read
+// with one vectorized dot product. A model of up to PTDF_DENSE_LIMIT factors has every block
+// built with setModel(), in parallel. A larger one would not fit in memory dense, so its
+// full flows come from a solve with the cached factorization (cheaper than reading the
+// matrix) and only the blocks of buses whose injections actually change are built, on first
+// use, without the rows whose factors are all below PTDF_DROP; the blocks in use are built
+// again in parallel when the topology changes.
+//
+// A branch switched in or out of service is a rank one change of B. The factorization takes
+// it as an update or downdate (branches out of service keep their place in B's pattern), and
+// the PTDF and the last flows follow by Sherman-Morrison from one solve, without building
+// anything again. Only a switch that changes which buses are energized builds it all.
+//
+// A caller that only needs solves (the contingency screen) sets the model without the PTDF:
+// then nothing is built beyond the factorization, and flows come from solves as when sparse.
+//
+#include "PowerModel.h"
+#include "SparseMatrix.h"
+
+#define PTDF_BLOCK			16
+#define PTDF_DENSE_LIMIT	(16 * 1024 * 1024)   // factors kept for every bus, 64 MB
+#define PTDF_DROP			1e-4                 // rows of a block below this are left out when sparse
+
+class CDcPowerFlow
+{
+public:
+	CDcPowerFlow();
+
+	// B, its factorization and the PTDF for the model's topology; nWorkers as in CParallelFor
+	bool setModel(const CPowerModel& model, int nWorkers = 0, bool bPtdf = true);
+	// a breaker of the branch moved: the factorization, the PTDF and the last flows follow
+	bool setBranch(int branch, bool bInService, int nWorkers = 0);
+	const CPowerModel& model() const { return m_Model; }
+	int buses() const { return m_nBus; }
+	int branches() const { return m_nBranch; }
+	bool dense() const { return m_bDense; }
+	size_t entries() const;                 // factors stored
+
+	double ptdf(int branch, int bus);
+	void column(int bus, std::vector<double>& out);   // PTDF(:, bus), 0 for the slack
+
+	// branch flows in MW for bus injections P in MW; the slack takes the balance
+	void flows(const std::vector<double>& P, std::vector<double>& F) const;
+	// flows of one MW in at the branch's from bus and out at its to bus, a solve with the
+	// caller's scratch so several threads can run it; false if the branch carries nothing
+	bool transfer(int branch, std::vector<double>& F, std::vector<double>& x, std::vector<double>& work) const;
+	// F += PTDF(:, bus) dP for the listed buses
+	void update(const std::vector<int>& buses, const std::vector<double>& dP, std::vector<double>& F);
+	// keeps the last injections and flows and picks update() or flows() by how many changed
+	const std::vector<double>& inject(const std::vector<double>& P);
+	const std::vector<double>& lastFlows() const { return m_F; }
+
+	// injections of the model's buses, generation less load, MW
+	static void injections(const CPowerModel& model, std::vector<double>& P);
+
+private:
+	struct ptdf_block
+	{
+		bool built;
+		std::vector<int> rows;       // branch of each stored row, empty when every row is kept
+		std::vector<float> values;   // PTDF_BLOCK per row
+	};
+	struct solve_scratch
+	{
+		std::vector<double> rhs, x, work;
+	};
+	bool build(int nWorkers);
+	bool rebuild(int nWorkers);      // build() keeping the last flows up to date
+	void shifts();
+	// the branch is the only way between its ends
+	bool bridge(int branch);
+	void buildBlock(int blk, solve_scratch& s);
+	void buildBlocks(const std::vector<int>& blocks, int nWorkers);
+	// flows for P by a solve, without the PTDF
+	void solveFlows(const std::vector<double>& P, std::vector<double>& F) const;
+
+	CPowerModel m_Model;
+	int m_nBus;
+	int m_nBranch;
+	bool m_bDense;
+	bool m_bPtdf;                    // blocks are built at all
+	int m_ref;
+	std::vector<int> m_idx;          // row of a bus in B, -1 for the reference and islands
+	std::vector<int> m_from, m_to;
+	std::vector<int> m_Adjp, m_Adjl; // branches of bus k at m_Adjl[m_Adjp[k] .. m_Adjp[k+1])
+	std::vector<double> m_y;         // branch susceptance in service
+	std::vector<double> m_b;         // the same, 0 when out of service
+	CSparseCholesky m_Chol;
+	std::vector<ptdf_block> m_Blocks;
+	std::vector<double> m_shift;     // flow of phase shifters with no injection, MW
+
+	std::vector<double> m_P;         // for inject()
+	std::vector<double> m_F;
+	bool m_bFlows;
+	std::vector<char> m_mark;        // bridge()'s, zero between calls
+};
@@ -0,0 +1,1063 @@
+#include "stdafx.h"
+#include "Historian.h"
+#include <intrin.h>
+#include <float.h>
+#include <stddef.h>
+#include <map>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+#pragma pack(push,1)
+struct hist_point_record
+{
+	unsigned short ca;
+	unsigned int address;
+};
+#pragma pack(pop)
+
+// a block of the tail file as its records build it up
+struct hist_tail_block
+{
+	int point;
+	unsigned int sealed;
+	unsigned int count;
+	std::vector<unsigned char> payload;
+};
+
+static unsigned int FloatBits(float f)
+{
+	unsigned int u;
+	memcpy(&u, &f, 4);
+	return u;
+}
+
+static float BitsFloat(unsigned int u)
+{
+	float f;
+	memcpy(&f, &u, 4);
+	return f;
+}
+
+static int LeadingZeros32(unsigned int v)
+{
+	unsigned long idx;
+	if (!_BitScanReverse(&idx, v))
+		return 32;
+	return 31 - (int)idx;
+}
+
+static int TrailingZeros32(unsigned int v)
+{
+	unsigned long idx;
+	if (!_BitScanForward(&idx, v))
+		return 32;
+	return (int)idx;
+}
+
+static unsigned int Fnv1a(const unsigned char* p, unsigned int n)
+{
+	unsigned int h = 2166136261u;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static __int64 SignExtend(unsigned __int64 v, int n)
+{
+	return (__int64)(v << (64 - n)) >> (64 - n);
+}
+
+//////////////////////////////////////////////////////////////////////
+// CHistBlockEncoder
+//
+// timestamps: first raw (64 bits), then delta of delta
+//   '0' dod=0 | '10' 8 bits | '110' 14 bits | '1110' 20 bits | '1111' 64 bits
+// values: first raw (32 bits), then xor with the previous value
+//   '0' same | '10' bits inside the previous window | '11' 5 bits lead, 5 bits len-1, bits
+// quality: '0' same as previous | '1' 8 bits
+
+CHistBlockEncoder::CHistBlockEncoder()
+{
+	reset();
+}
+
+void CHistBlockEncoder::reset()
+{
+	m_buf.clear();
+	m_acc = 0;
+	m_nacc = 0;
+	memset(&m_hdr, 0, sizeof(m_hdr));
+	m_hdr.magic = HIST_MAGIC;
+	m_hdr.flags = HIST_BLOCK_ORDERED;
+	m_prevTime = 0;
+	m_prevDelta = 0;
+	m_prevBits = 0;
+	m_prevLead = -1;
+	m_prevTrail = 0;
+	m_prevQuality = 0;
+}
+
+void CHistBlockEncoder::putBits(unsigned __int64 v, int n)
+{
+	if (n > 32)
+	{
+		putBits(v >> 32, n - 32);
+		n = 32;
+	}
+	v &= (n == 32) ? 0xFFFFFFFFull : ((1ull << n) - 1);
+	m_acc = (m_acc << n) | v;
+	m_nacc += n;
+	while (m_nacc >= 8)
+	{
+		m_nacc -= 8;
+		m_buf.push_back((unsigned char)(m_acc >> m_nacc));
+	}
+	m_acc &= (1ull << m_nacc) - 1;
+}
+
+void CHistBlockEncoder::add(__int64 time, float value, unsigned char quality)
+{
+	unsigned int bits = FloatBits(value);
+
+	if (m_hdr.count == 0)
+	{
+		putBits((unsigned __int64)time, 64);
+		putBits(bits, 32);
+		putBits(quality, 8);
+		m_hdr.tmin = m_hdr.tmax = time;
+		m_hdr.vmin = m_hdr.vmax = m_hdr.first = value;
+	}
+	else
+	{
+		__int64 delta = time - m_prevTime;
+		__int64 dod = delta - m_prevDelta;
+		if (dod == 0)
+			putBits(0, 1);
+		else if (dod >= -128 && dod < 128)
+		{
+			putBits(2, 2);
+			putBits((unsigned __int64)dod, 8);
+		}
+		else if (dod >= -8192 && dod < 8192)
+		{
+			putBits(6, 3);
+			putBits((unsigned __int64)dod, 14);
+		}
+		else if (dod >= -524288 && dod < 524288)
+		{
+			putBits(14, 4);
+			putBits((unsigned __int64)dod, 20);
+		}
+		else
+		{
+			putBits(15, 4);
+			putBits((unsigned __int64)dod, 64);
+		}
+		m_prevDelta = delta;
+
+		unsigned int x = bits ^ m_prevBits;
+		if (x == 0)
+			putBits(0, 1);
+		else
+		{
+			int lead = LeadingZeros32(x);
+			int trail = TrailingZeros32(x);
+			if (lead > 31)
+				lead = 31;
+			if (m_prevLead >= 0 && lead >= m_prevLead && trail >= m_prevTrail)
+			{
+				putBits(2, 2);
+				putBits(x >> m_prevTrail, 32 - m_prevLead - m_prevTrail);
+			}
+			else
+			{
+				int len = 32 - lead - trail;
+				putBits(3, 2);
+				putBits(lead, 5);
+				putBits(len - 1, 5);
+				putBits(x >> trail, len);
+				m_prevLead = lead;
+				m_prevTrail = trail;
+			}
+		}
+
+		if (quality == m_prevQuality)
+			putBits(0, 1);
+		else
+		{
+			putBits(1, 1);
+			putBits(quality, 8);
+		}
+
+		if (time < m_prevTime)
+			m_hdr.flags &= ~HIST_BLOCK_ORDERED;
+		if (time < m_hdr.tmin)
+			m_hdr.tmin = time;
+		if (time > m_hdr.tmax)
+			m_hdr.tmax = time;
+		if (value < m_hdr.vmin)
+			m_hdr.vmin = value;
+		if (value > m_hdr.vmax)
+			m_hdr.vmax = value;
+	}
+
+	m_hdr.last = value;
+	m_hdr.sum += value;
+	m_hdr.count++;
+	m_prevTime = time;
+	m_prevBits = bits;
+	m_prevQuality = quality;
+}
+
+bool CHistBlockEncoder::full() const
+{
+	return m_hdr.count >= HIST_BLOCK_SAMPLES || m_buf.size() >= HIST_BLOCK_BYTES;
+}
+
+const hist_block_header& CHistBlockEncoder::finish()
+{
+	if (m_nacc > 0)
+	{
+		// pad the last byte, the decoder stops after count samples
+		m_buf.push_back((unsigned char)(m_acc << (8 - m_nacc)));
+		m_acc = 0;
+		m_nacc = 0;
+	}
+	m_hdr.nbytes = (unsigned int)m_buf.size();
+	m_hdr.check = Fnv1a(m_buf.empty() ? NULL : &m_buf[0], m_hdr.nbytes);
+	return m_hdr;
+}
+
+int CHistBlockEncoder::partial(unsigned char& byte) const
+{
+	byte = m_nacc > 0 ? (unsigned char)(m_acc << (8 - m_nacc)) : 0;
+	return m_nacc;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CHistBlockDecoder
+
+CHistBlockDecoder::CHistBlockDecoder(const unsigned char* data, unsigned int nbytes, unsigned int count)
+{
+	m_data = data;
+	m_nbytes = nbytes;
+	m_count = count;
+	m_done = 0;
+	m_bitpos = 0;
+	m_prevTime = 0;
+	m_prevDelta = 0;
+	m_prevBits = 0;
+	m_prevLead = 0;
+	m_prevTrail = 0;
+	m_prevQuality = 0;
+}
+
+unsigned __int64 CHistBlockDecoder::getBits(int n)
+{
+	if (n > 32)
+	{
+		unsigned __int64 hi = getBits(n - 32);
+		return (hi << 32) | getBits(32);
+	}
+	if (n > 0 && (m_bitpos >> 3) + 8 <= m_nbytes)
+	{
+		//one unaligned big endian load covers up to 57 bits from any bit position
+		unsigned __int64 w;
+		memcpy(&w, m_data + (m_bitpos >> 3), 8);
+		w = _byteswap_uint64(w) << (m_bitpos & 7);
+		m_bitpos += n;
+		return w >> (64 - n);
+	}
+	unsigned __int64 v = 0;
+	while (n > 0)
+	{
+		unsigned int byte = m_bitpos >> 3;
+		int avail = 8 - (int)(m_bitpos & 7);
+		int take = (n < avail) ? n : avail;
+		unsigned int b = (byte < m_nbytes) ? m_data[byte] : 0;
+		v = (v << take) | ((b >> (avail - take)) & ((1u << take) - 1));
+		m_bitpos += take;
+		n -= take;
+	}
+	return v;
+}
+
+unsigned __int64 CHistBlockDecoder::peekBits()
+{
+	unsigned __int64 w;
+	if ((m_bitpos >> 3) + 8 <= m_nbytes)
+	{
+		memcpy(&w, m_data + (m_bitpos >> 3), 8);
+		return _byteswap_uint64(w) << (m_bitpos & 7);
+	}
+	//near the end of the payload
+	unsigned int pos = m_bitpos;
+	w = getBits(32) << 32;
+	w |= getBits(32);
+	m_bitpos = pos;
+	return w;
+}
+
+bool CHistBlockDecoder::next(hist_sample& s)
+{
+	if (m_done >= m_count)
+		return false;
+
+	if (m_done == 0)
+	{
+		m_prevTime = (__int64)getBits(64);
+		m_prevBits = (unsigned int)getBits(32);
+		m_prevQuality = (unsigned char)getBits(8);
+	}
+	else
+	{
+		//each field is parsed from one look ahead window, 57 bits are always valid in it
+		unsigned __int64 w = peekBits();
+		__int64 dod;
+		if ((w >> 63) == 0)
+		{
+			dod = 0;
+			m_bitpos += 1;
+		}
+		else if ((w >> 62) == 2)
+		{
+			dod = SignExtend(w >> 54, 8);
+			m_bitpos += 10;
+		}
+		else if ((w >> 61) == 6)
+		{
+			dod = SignExtend(w >> 47, 14);
+			m_bitpos += 17;
+		}
+		else if ((w >> 60) == 14)
+		{
+			dod = SignExtend(w >> 40, 20);
+			m_bitpos += 24;
+		}
+		else
+		{
+			m_bitpos += 4;
+			dod = (__int64)getBits(64);
+		}
+		m_prevDelta += dod;
+		m_prevTime += m_prevDelta;
+
+		w = peekBits();
+		if ((w >> 63) == 0)
+			m_bitpos += 1;
+		else if ((w >> 62) == 2)
+		{
+			int len = 32 - m_prevLead - m_prevTrail;
+			m_prevBits ^= (unsigned int)((w << 2) >> (64 - len)) << m_prevTrail;
+			m_bitpos += 2 + len;
+		}
+		else
+		{
+			m_prevLead = (int)((w >> 57) & 31);
+			int len = (int)((w >> 52) & 31) + 1;
+			m_prevTrail = 32 - m_prevLead - len;
+			m_prevBits ^= (unsigned int)((w << 12) >> (64 - len)) << m_prevTrail;
+			m_bitpos += 12 + len;
+		}
+
+		w = peekBits();
+		if ((w >> 63) == 0)
+			m_bitpos += 1;
+		else
+		{
+			m_prevQuality = (unsigned char)(w >> 55);
+			m_bitpos += 9;
+		}
+	}
+
+	s.time = m_prevTime;
+	s.value = BitsFloat(m_prevBits);
+	s.quality = m_prevQuality;
+	m_done++;
+	return true;
+}
+
+int CHistBlockDecoder::decodeAll(std::vector<hist_sample>& out)
+{
+	hist_sample s;
+	int n = 0;
+	out.reserve(out.size() + m_count - m_done);
+	while (next(s))
+	{
+		out.push_back(s);
+		n++;
+	}
+	return n;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CHistorian
+
+CHistorian::CHistorian()
+{
+	m_bOpen = false;
+	m_hPoints = INVALID_HANDLE_VALUE;
+	m_hTail = INVALID_HANDLE_VALUE;
+	m_nTail = 0;
+	InitializeCriticalSection(&m_cs);
+}
+
+CHistorian::~CHistorian()
+{
+	close();
+	DeleteCriticalSection(&m_cs);
+}
+
+CString CHistorian::segmentName(int n)
+{
+	CString sName;
+	sName.Format(_T("%s\\seg%05d.dat"), m_sDirectory.operator LPCTSTR(), n);
+	return sName;
+}
+
+bool CHistorian::open(LPCTSTR lpszDirectory)
+{
+	close();
+
+	m_sDirectory = lpszDirectory;
+	CreateDirectory(m_sDirectory, NULL);
+
+	//point directory: one record per point, the index is the record number
+	m_hPoints = CreateFile(m_sDirectory + _T("\\points.dat"), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hPoints == INVALID_HANDLE_VALUE)
+	{
+		TRACE(_T("CHistorian::open, Failed to open point directory, Error:%u\n"), GetLastError());
+		return false;
+	}
+	hist_point_record rec;
+	DWORD dwRead = 0;
+	while (ReadFile(m_hPoints, &rec, sizeof(rec), &dwRead, NULL) && dwRead == sizeof(rec))
+	{
+		hist_point* pPoint = new hist_point;
+		pPoint->ca = rec.ca;
+		pPoint->address = rec.address;
+		m_PointIndex[pointKey(rec.ca, rec.address)] = (int)m_Points.size();
+		m_Points.push_back(pPoint);
+	}
+	//drop a torn record at the end
+	SetFilePointer(m_hPoints, (LONG)(m_Points.size() * sizeof(rec)), NULL, FILE_BEGIN);
+	SetEndOfFile(m_hPoints);
+
+	//map existing segments and rebuild the block index
+	int n = 0;
+	while (GetFileAttributes(segmentName(n)) != INVALID_FILE_ATTRIBUTES)
+	{
+		if (!openSegment(n, false))
+			break;
+		scanSegment(n);
+		n++;
+	}
+	if (m_Segments.empty() && !openSegment(0, true))
+	{
+		close();
+		return false;
+	}
+
+	hist_segment& seg = m_Segments.back();
+	SetFilePointer(seg.hFile, seg.used, NULL, FILE_BEGIN);
+	m_WriteBuffer.reserve(HIST_WRITE_BUFFER);
+
+	//the open blocks as they were at the last flush, then a tail of just them
+	replayTail();
+	rewriteTail();
+	m_bOpen = true;
+	return true;
+}
+
+bool CHistorian::openSegment(int n, bool create)
+{
+	hist_segment seg;
+	seg.hFile = CreateFile(segmentName(n), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (seg.hFile == INVALID_HANDLE_VALUE)
+	{
+		TRACE(_T("CHistorian::openSegment, Failed to open segment %d, Error:%u\n"), n, GetLastError());
+		return false;
+	}
+
+	//segments are sized once so the mapping never has to grow, unused space reads as zero
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(seg.hFile, &liSize) || liSize.QuadPart < HIST_SEGMENT_SIZE)
+	{
+		SetFilePointer(seg.hFile, HIST_SEGMENT_SIZE, NULL, FILE_BEGIN);
+		SetEndOfFile(seg.hFile);
+		SetFilePointer(seg.hFile, 0, NULL, FILE_BEGIN);
+	}
+	seg.hMap = CreateFileMapping(seg.hFile, NULL, PAGE_READONLY, 0, HIST_SEGMENT_SIZE, NULL);
+	if (seg.hMap == NULL)
+	{
+		TRACE(_T("CHistorian::openSegment, Failed to map segment %d, Error:%u\n"), n, GetLastError());
+		CloseHandle(seg.hFile);
+		return false;
+	}
+	seg.base = static_cast<const unsigned char*>(MapViewOfFile(seg.hMap, FILE_MAP_READ, 0, 0, HIST_SEGMENT_SIZE));
+	if (seg.base == NULL)
+	{
+		CloseHandle(seg.hMap);
+		CloseHandle(seg.hFile);
+		return false;
+	}
+	seg.used = 0;
+	m_Segments.push_back(seg);
+	return true;
+}
+
+void CHistorian::scanSegment(int n)
+{
+	hist_segment& seg = m_Segments[n];
+	unsigned int offset = 0;
+	while (offset + sizeof(hist_block_header) <= HIST_SEGMENT_SIZE)
+	{
+		hist_block_header hdr;
+		memcpy(&hdr, seg.base + offset, sizeof(hdr));
+		if (hdr.magic != HIST_MAGIC || hdr.nbytes > HIST_SEGMENT_SIZE - offset - sizeof(hdr))
+			break;
+		if (hdr.check != Fnv1a(seg.base + offset + sizeof(hdr), hdr.nbytes))
+			break; //torn write, everything after it is discarded
+		if (hdr.point < m_Points.size())
+		{
+			hist_blockref ref;
+			ref.segment = n;
+			ref.offset = offset;
+			ref.hdr = hdr;
+			m_Points[hdr.point]->blocks.push_back(ref);
+		}
+		offset += sizeof(hdr) + hdr.nbytes;
+	}
+	seg.used = offset;
+}
+
+void CHistorian::close()
+{
+	if (m_bOpen)
+		flush();
+
+	EnterCriticalSection(&m_cs);
+	for (size_t i = 0; i < m_Segments.size(); i++)
+	{
+		UnmapViewOfFile(m_Segments[i].base);
+		CloseHandle(m_Segments[i].hMap);
+		CloseHandle(m_Segments[i].hFile);
+	}
+	m_Segments.clear();
+	for (size_t i = 0; i < m_Points.size(); i++)
+		delete m_Points[i];
+	m_Points.clear();
+	m_PointIndex.clear();
+	m_WriteBuffer.clear();
+	if (m_hPoints != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hPoints);
+		m_hPoints = INVALID_HANDLE_VALUE;
+	}
+	if (m_hTail != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hTail);
+		m_hTail = INVALID_HANDLE_VALUE;
+	}
+	m_nTail = 0;
+	m_bOpen = false;
+	LeaveCriticalSection(&m_cs);
+}
+
+int CHistorian::pointIndex(unsigned short ca, unsigned int address)
+{
+	EnterCriticalSection(&m_cs);
+	int nIndex;
+	std::unordered_map<unsigned __int64, int>::const_iterator it = m_PointIndex.find(pointKey(ca, address));
+	if (it != m_PointIndex.end())
+		nIndex = it->second;
+	else
+	{
+		hist_point_record rec;
+		rec.ca = ca;
+		rec.address = address & 0xFFFFFF;
+		DWORD dwWritten = 0;
+		if (m_hPoints != INVALID_HANDLE_VALUE)
+			WriteFile(m_hPoints, &rec, sizeof(rec), &dwWritten, NULL);
+
+		hist_point* pPoint = new hist_point;
+		pPoint->ca = rec.ca;
+		pPoint->address = rec.address;
+		nIndex = (int)m_Points.size();
+		m_Points.push_back(pPoint);
+		m_PointIndex[pointKey(ca, address)] = nIndex;
+	}
+	LeaveCriticalSection(&m_cs);
+	return nIndex;
+}
+
+int CHistorian::findPoint(unsigned short ca, unsigned int address)
+{
+	EnterCriticalSection(&m_cs);
+	std::unordered_map<unsigned __int64, int>::const_iterator it = m_PointIndex.find(pointKey(ca, address));
+	int nIndex = (it != m_PointIndex.end()) ? it->second : -1;
+	LeaveCriticalSection(&m_cs);
+	return nIndex;
+}
+
+int CHistorian::pointCount()
+{
+	EnterCriticalSection(&m_cs);
+	int n = (int)m_Points.size();
+	LeaveCriticalSection(&m_cs);
+	return n;
+}
+
+void CHistorian::append(int point, __int64 time, float value, unsigned char quality)
+{
+	EnterCriticalSection(&m_cs);
+	if (m_bOpen && point >= 0 && point < (int)m_Points.size())
+	{
+		CHistBlockEncoder& enc = m_Points[point]->open;
+		enc.add(time, value, quality);
+		if (enc.full())
+			seal(point);
+	}
+	LeaveCriticalSection(&m_cs);
+}
+
+void CHistorian::appendObjects(const iec_obj* obj, int numpoints, __int64 rxtime)
+{
+	for (int i = 0; i < numpoints; i++)
+	{
+		int point = pointIndex(obj[i].ca, obj[i].address);
+		__int64 t = hasTimeTag(obj[i].type) ? timeFromCP56(obj[i].timetag) : rxtime;
+		append(point, t, obj[i].value, qualityOf(&obj[i]));
+	}
+}
+
+// called with m_cs held
+void CHistorian::seal(int point)
+{
+	CHistBlockEncoder& enc = m_Points[point]->open;
+	if (enc.empty())
+		return;
+
+	hist_block_header hdr = enc.finish();
+	hdr.point = point;
+	unsigned int nSize = sizeof(hdr) + hdr.nbytes;
+
+	if (m_WriteBuffer.size() + nSize > HIST_WRITE_BUFFER)
+		writeBuffer();
+
+	//start a new segment when this block does not fit the current one
+	if (m_Segments.back().used + m_WriteBuffer.size() + nSize > HIST_SEGMENT_SIZE)
+	{
+		writeBuffer();
+		FlushFileBuffers(m_Segments.back().hFile);
+		if (!openSegment((int)m_Segments.size(), true))
+		{
+			enc.reset(); //no place to store it
+			m_Points[point]->tailBytes = m_Points[point]->tailCount = 0;
+			return;
+		}
+	}
+
+	hist_blockref ref;
+	ref.segment = (int)m_Segments.size() - 1;
+	ref.offset = m_Segments.back().used + (unsigned int)m_WriteBuffer.size();
+	ref.hdr = hdr;
+
+	const unsigned char* pHdr = reinterpret_cast<const unsigned char*>(&hdr);
+	m_WriteBuffer.insert(m_WriteBuffer.end(), pHdr, pHdr + sizeof(hdr));
+	if (hdr.nbytes)
+		m_WriteBuffer.insert(m_WriteBuffer.end(), enc.payload().begin(), enc.payload().end());
+	m_Points[point]->blocks.push_back(ref);
+	enc.reset();
+	m_Points[point]->tailBytes = m_Points[point]->tailCount = 0;
+}
+
+// called with m_cs held
+void CHistorian::writeBuffer()
+{
+	if (m_WriteBuffer.empty())
+		return;
+
+	hist_segment& seg = m_Segments.back();
+	DWORD dwWritten = 0;
+	if (!WriteFile(seg.hFile, &m_WriteBuffer[0], (DWORD)m_WriteBuffer.size(), &dwWritten, NULL) || dwWritten != m_WriteBuffer.size())
+	{
+		TRACE(_T("CHistorian::writeBuffer, Failed to write segment, Error:%u\n"), GetLastError());
+		SetFilePointer(seg.hFile, seg.used, NULL, FILE_BEGIN);
+		return; //keep the buffer, retried on the next flush
+	}
+	seg.used += dwWritten;
+	m_WriteBuffer.clear();
+}
+
+// called with m_cs held
+void CHistorian::tailRecord(int point, unsigned int offset, std::vector<unsigned char>& out)
+{
+	hist_point& pt = *m_Points[point];
+	const std::vector<unsigned char>& payload = pt.open.payload();
+	unsigned char last;
+	int nBits = pt.open.partial(last);
+
+	hist_tail_record rec;
+	rec.magic = HIST_TAIL_MAGIC;
+	rec.point = point;
+	rec.sealed = (unsigned int)pt.blocks.size();
+	rec.count = pt.open.header().count;
+	rec.offset = offset;
+	rec.nbytes = (unsigned int)payload.size() - offset + (nBits > 0 ? 1 : 0);
+	rec.check = 0;
+	size_t nPos = out.size();
+	const unsigned char* pRec = reinterpret_cast<const unsigned char*>(&rec);
+	out.insert(out.end(), pRec, pRec + sizeof(rec));
+	out.insert(out.end(), payload.begin() + offset, payload.end());
+	if (nBits > 0)
+		out.push_back(last);   //the next record of the block starts with this byte again
+	rec.check = Fnv1a(&out[nPos], (unsigned int)(out.size() - nPos));
+	memcpy(&out[nPos + offsetof(hist_tail_record, check)], &rec.check, sizeof(rec.check));
+	pt.tailBytes = (unsigned int)payload.size();
+	pt.tailCount = rec.count;
+}
+
+// called with m_cs held
+void CHistorian::writeTail()
+{
+	if (m_hTail == INVALID_HANDLE_VALUE)
+		return;
+	m_TailBuffer.clear();
+	for (int i = 0; i < (int)m_Points.size(); i++)
+	{
+		const hist_point& pt = *m_Points[i];
+		if (pt.open.header().count != pt.tailCount)
+			tailRecord(i, pt.tailBytes, m_TailBuffer);
+	}
+	if (m_TailBuffer.empty())
+		return;
+
+	DWORD dwWritten = 0;
+	if (!WriteFile(m_hTail, &m_TailBuffer[0], (DWORD)m_TailBuffer.size(), &dwWritten, NULL) || dwWritten != m_TailBuffer.size())
+	{
+		TRACE(_T("CHistorian::writeTail, Failed to write the tail, Error:%u\n"), GetLastError());
+		//whole blocks on the next flush, after the records written before
+		SetFilePointer(m_hTail, m_nTail, NULL, FILE_BEGIN);
+		for (size_t i = 0; i < m_Points.size(); i++)
+			m_Points[i]->tailBytes = m_Points[i]->tailCount = 0;
+		return;
+	}
+	m_nTail += dwWritten;
+}
+
+// called with m_cs held
+bool CHistorian::rewriteTail()
+{
+	//the records left out may be all there is of blocks sealed since the last flush
+	writeBuffer();
+	FlushFileBuffers(m_Segments.back().hFile);
+
+	CString sName = m_sDirectory + _T("\\tail.dat");
+	CString sNew = m_sDirectory + _T("\\tail.new");
+	bool bWritten = false;
+	HANDLE hNew = CreateFile(sNew, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hNew != INVALID_HANDLE_VALUE)
+	{
+		m_TailBuffer.clear();
+		for (int i = 0; i < (int)m_Points.size(); i++)
+		{
+			if (!m_Points[i]->open.empty())
+				tailRecord(i, 0, m_TailBuffer);
+		}
+		DWORD dwWritten = 0;
+		bWritten = m_TailBuffer.empty() ||
+			(WriteFile(hNew, &m_TailBuffer[0], (DWORD)m_TailBuffer.size(), &dwWritten, NULL) && dwWritten == m_TailBuffer.size());
+		if (bWritten)
+			FlushFileBuffers(hNew);
+		CloseHandle(hNew);
+	}
+	if (m_hTail != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hTail);
+		m_hTail = INVALID_HANDLE_VALUE;
+	}
+	bool bReplaced = bWritten && MoveFileEx(sNew, sName, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+	if (!bReplaced)
+	{
+		//the old tail is kept and gets whole blocks from the next flush on
+		TRACE(_T("CHistorian::rewriteTail, Failed to replace the tail, Error:%u\n"), GetLastError());
+		DeleteFile(sNew);
+		for (size_t i = 0; i < m_Points.size(); i++)
+			m_Points[i]->tailBytes = m_Points[i]->tailCount = 0;
+	}
+
+	m_nTail = 0;
+	m_hTail = CreateFile(sName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hTail == INVALID_HANDLE_VALUE)
+	{
+		TRACE(_T("CHistorian::rewriteTail, Failed to open the tail, Error:%u\n"), GetLastError());
+		return false;
+	}
+	LARGE_INTEGER liSize;
+	if (GetFileSizeEx(m_hTail, &liSize))
+		m_nTail = (unsigned int)liSize.QuadPart;
+	SetFilePointer(m_hTail, m_nTail, NULL, FILE_BEGIN);
+	return bReplaced;
+}
+
+void CHistorian::replayTail()
+{
+	std::vector<unsigned char> data;
+	HANDLE hFile = CreateFile(m_sDirectory + _T("\\tail.dat"), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER liSize;
+	if (GetFileSizeEx(hFile, &liSize) && liSize.QuadPart > 0 && liSize.QuadPart < 0x7FFFFFFF)
+	{
+		data.resize((size_t)liSize.QuadPart);
+		DWORD dwRead = 0;
+		if (!ReadFile(hFile, &data[0], (DWORD)data.size(), &dwRead, NULL))
+			dwRead = 0;
+		data.resize(dwRead);
+	}
+	CloseHandle(hFile);
+
+	//each block's payload, a record carrying on where the block's last one stopped
+	std::map<unsigned __int64, hist_tail_block> tail;   //point << 32 | sealed, in sealing order
+	size_t nPos = 0;
+	while (nPos + sizeof(hist_tail_record) <= data.size())
+	{
+		hist_tail_record rec;
+		memcpy(&rec, &data[nPos], sizeof(rec));
+		if (rec.magic != HIST_TAIL_MAGIC || rec.nbytes > data.size() - nPos - sizeof(rec))
+			break;
+		memset(&data[nPos + offsetof(hist_tail_record, check)], 0, sizeof(rec.check));
+		if (rec.check != Fnv1a(&data[nPos], (unsigned int)(sizeof(rec) + rec.nbytes)))
+			break; //torn write, everything after it is discarded
+		const unsigned char* pBytes = &data[nPos + sizeof(rec)];
+		nPos += sizeof(rec) + rec.nbytes;
+		if (rec.point >= m_Points.size())
+			continue;
+
+		unsigned __int64 key = ((unsigned __int64)rec.point << 32) | rec.sealed;
+		std::map<unsigned __int64, hist_tail_block>::iterator it = tail.find(key);
+		if (it == tail.end())
+		{
+			if (rec.offset != 0)
+				continue;
+			it = tail.insert(std::make_pair(key, hist_tail_block())).first;
+		}
+		else if (rec.offset > it->second.payload.size())
+			continue;
+		hist_tail_block& blk = it->second;
+		blk.point = (int)rec.point;
+		blk.sealed = rec.sealed;
+		blk.count = rec.count;
+		blk.payload.resize(rec.offset);
+		blk.payload.insert(blk.payload.end(), pBytes, pBytes + rec.nbytes);
+	}
+
+	//blocks the segments do not have are added again, the last of a point stays open
+	int nSamples = 0;
+	std::vector<hist_sample> samples;
+	for (std::map<unsigned __int64, hist_tail_block>::iterator it = tail.begin(); it != tail.end(); ++it)
+	{
+		hist_tail_block& blk = it->second;
+		hist_point& pt = *m_Points[blk.point];
+		if (blk.sealed < pt.blocks.size())
+			continue;
+		seal(blk.point);
+		blk.payload.push_back(0);
+		samples.clear();
+		CHistBlockDecoder dec(&blk.payload[0], (unsigned int)blk.payload.size() - 1, blk.count);
+		dec.decodeAll(samples);
+		for (size_t j = 0; j < samples.size(); j++)
+			pt.open.add(samples[j].time, samples[j].value, samples[j].quality);
+		nSamples += (int)samples.size();
+	}
+	TRACE(_T("CHistorian::replayTail, %d samples of open blocks restored\n"), nSamples);
+}
+
+void CHistorian::flush()
+{
+	HANDLE hSegment = INVALID_HANDLE_VALUE;
+	HANDLE hTail = INVALID_HANDLE_VALUE;
+	EnterCriticalSection(&m_cs);
+	if (m_bOpen)
+	{
+		writeBuffer();
+		hSegment = m_Segments.back().hFile;
+		if (m_nTail > HIST_TAIL_SIZE)
+			rewriteTail();
+		else
+			writeTail();
+		hTail = m_hTail;
+	}
+	LeaveCriticalSection(&m_cs);
+
+	//the handles stay open until close(), so appends need not wait for the disk; the segment
+	//goes first, the tail has the blocks sealed since the last flush as they were then
+	if (hSegment != INVALID_HANDLE_VALUE)
+	{
+		FlushFileBuffers(hSegment);
+		FlushFileBuffers(m_hPoints);
+		if (hTail != INVALID_HANDLE_VALUE)
+			FlushFileBuffers(hTail);
+	}
+}
+
+void CHistorian::blocks(int point, __int64 t0, __int64 t1, std::vector<hist_blockref>& out)
+{
+	EnterCriticalSection(&m_cs);
+	if (point >= 0 && point < (int)m_Points.size())
+	{
+		const std::vector<hist_blockref>& refs = m_Points[point]->blocks;
+		for (size_t i = 0; i < refs.size(); i++)
+		{
+			if (refs[i].hdr.tmax >= t0 && refs[i].hdr.tmin <= t1)
+				out.push_back(refs[i]);
+		}
+	}
+	LeaveCriticalSection(&m_cs);
+}
+
+const unsigned char* CHistorian::blockData(const hist_blockref& ref, std::vector<unsigned char>& scratch)
+{
+	const unsigned char* pData = NULL;
+	EnterCriticalSection(&m_cs);
+	if (ref.segment >= 0 && ref.segment < (int)m_Segments.size())
+	{
+		const hist_segment& seg = m_Segments[ref.segment];
+		if (ref.offset < seg.used)
+			pData = seg.base + ref.offset + sizeof(hist_block_header); //written, stable for the lifetime of the mapping
+		else if (ref.segment == (int)m_Segments.size() - 1)
+		{
+			size_t nPos = ref.offset - seg.used + sizeof(hist_block_header);
+			if (nPos + ref.hdr.nbytes <= m_WriteBuffer.size())
+			{
+				scratch.assign(m_WriteBuffer.begin() + nPos, m_WriteBuffer.begin() + nPos + ref.hdr.nbytes);
+				scratch.push_back(0);
+				pData = &scratch[0];
+			}
+		}
+	}
+	LeaveCriticalSection(&m_cs);
+	return pData;
+}
+
+bool CHistorian::openBlock(int point, hist_block_header& hdr, std::vector<unsigned char>& payload)
+{
+	bool bFound = false;
+	EnterCriticalSection(&m_cs);
+	if (point >= 0 && point < (int)m_Points.size() && !m_Points[point]->open.empty())
+	{
+		//work on a copy, the live encoder keeps its partial byte
+		CHistBlockEncoder enc(m_Points[point]->open);
+		hdr = enc.finish();
+		hdr.point = point;
+		payload = enc.payload();
+		payload.push_back(0);
+		bFound = true;
+	}
+	LeaveCriticalSection(&m_cs);
+	return bFound;
+}
+
+bool CHistorian::read(int point, __int64 t0, __int64 t1, std::vector<hist_sample>& out)
+{
+	if (point < 0 || point >= pointCount())
+		return false;
+
+	std::vector<hist_blockref> refs;
+	std::vector<unsigned char> scratch;
+	std::vector<hist_sample> samples;
+	blocks(point, t0, t1, refs);
+
+	for (size_t i = 0; i < refs.size(); i++)
+	{
+		const unsigned char* pData = blockData(refs[i], scratch);
+		if (pData == NULL)
+			continue;
+		samples.clear();
+		CHistBlockDecoder dec(pData, refs[i].hdr.nbytes, refs[i].hdr.count);
+		dec.decodeAll(samples);
+		for (size_t j = 0; j < samples.size(); j++)
+		{
+			if (samples[j].time >= t0 && samples[j].time <= t1)
+				out.push_back(samples[j]);
+		}
+	}
+
+	hist_block_header hdr;
+	if (openBlock(point, hdr, scratch) && hdr.tmax >= t0 && hdr.tmin <= t1)
+	{
+		samples.clear();
+		CHistBlockDecoder dec(&scratch[0], hdr.nbytes, hdr.count);
+		dec.decodeAll(samples);
+		for (size_t j = 0; j < samples.size(); j++)
+		{
+			if (samples[j].time >= t0 && samples[j].time <= t1)
+				out.push_back(samples[j]);
+		}
+	}
+	return true;
+}
+
+__int64 CHistorian::now()
+{
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	ULARGE_INTEGER li;
+	li.LowPart = ft.dwLowDateTime;
+	li.HighPart = ft.dwHighDateTime;
+	return (__int64)(li.QuadPart / 10000) - 11644473600000LL; //100ns since 1601 -> ms since 1970
+}
+
+__int64 CHistorian::timeFromCP56(const cp56time2a& t)
+{
+	SYSTEMTIME st;
+	memset(&st, 0, sizeof(st));
+	st.wYear = (WORD)(2000 + t.year);
+	st.wMonth = (WORD)((t.month >= 1 && t.month <= 12) ? t.month : 1);
+	st.wDay = (WORD)((t.mday >= 1) ? t.mday : 1);
+	st.wHour = t.hour;
+	st.wMinute = t.min;
+	st.wSecond = (WORD)(t.msec / 1000);
+	st.wMilliseconds = (WORD)(t.msec % 1000);
+
+	FILETIME ft;
+	if (!SystemTimeToFileTime(&st, &ft))
+		return now();
+	ULARGE_INTEGER li;
+	li.LowPart = ft.dwLowDateTime;
+	li.HighPart = ft.dwHighDateTime;
+	return (__int64)(li.QuadPart / 10000) - 11644473600000LL;
+}
+
+bool CHistorian::hasTimeTag(unsigned char type)
+{
+	return type >= iec104_class::M_SP_TB_1 && type <= iec104_class::M_IT_TB_1;
+}
+
+unsigned char CHistorian::qualityOf(const iec_obj* obj)
+{
+	//ov shares its bit with sp/dp, only measured values, step positions and bitstrings carry it
+	unsigned char ov = 0;
+	switch (obj->type)
+	{
+	case iec104_class::M_ST_NA_1:
+	case iec104_class::M_BO_NA_1:
+	case iec104_class::M_ME_NA_1:
+	case iec104_class::M_ME_NB_1:
+	case iec104_class::M_ME_NC_1:
+	case iec104_class::M_ST_TB_1:
+	case iec104_class::M_BO_TB_1:
+	case iec104_class::M_ME_TD_1:
+	case iec104_class::M_ME_TE_1:
+	case iec104_class::M_ME_TF_1:
+		ov = obj->ov;
+		break;
+	}
+	return (unsigned char)(ov | (obj->bl << 4) | (obj->sb << 5) | (obj->nt << 6) | (obj->iv << 7));
+}
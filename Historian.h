@@ -0,0 +1,214 @@
+#pragma once
+//
+// Historian: append-only compressed store for point updates received over IEC 104.
+// Every point keeps one open block in memory; timestamps are delta-of-delta coded and
+// values XOR coded against the previous value. Sealed blocks are buffered and appended
+// to pre-sized segment files with large sequential writes, and read back through a
+// mapping of each segment that stays valid until close().
+//
+// Open blocks outlive flushes and restarts: a flush appends what each open block gained
+// since the last one (its new payload bytes, the partial last byte included, and its sample
+// count) to a tail file, and open() rebuilds the open blocks from it, so a crash loses no
+// more than what arrived since the last flush while a block still fills up to its limits.
+// The tail is rewritten with only the open blocks when it grows past HIST_TAIL_SIZE.
+//
+#include "iec104_class.h"
+#include <vector>
+#include <unordered_map>
+
+#define HIST_MAGIC 0x54534948         // "HIST"
+#define HIST_BLOCK_SAMPLES 1024       // samples per block at most
+#define HIST_BLOCK_BYTES 4096         // payload bytes per block at most
+#define HIST_SEGMENT_SIZE (64 << 20)  // bytes per segment file
+#define HIST_WRITE_BUFFER (1 << 20)   // sealed blocks are written in chunks of this size
+#define HIST_TAIL_MAGIC 0x4C494154    // "TAIL"
+#define HIST_TAIL_SIZE (8 << 20)      // tail file bytes from which a flush rewrites it
+
+#define HIST_BLOCK_ORDERED 0x0001     // samples were added in time order, first/last are at tmin/tmax
+
+struct hist_sample
+{
+	__int64 time;          // ms since 1970-01-01 UTC
+	float value;
+	unsigned char quality; // quality descriptor: ov(bit0) bl(bit4) sb(bit5) nt(bit6) iv(bit7)
+};
+
+#pragma pack(push,1)
+struct hist_block_header
+{
+	unsigned int magic;
+	unsigned int point;    // point index
+	unsigned int count;    // number of samples
+	unsigned int nbytes;   // payload bytes following the header
+	unsigned int check;    // FNV-1a of the payload
+	unsigned int flags;    // HIST_BLOCK_*
+	__int64 tmin;          // block summary, used to skip blocks
+	__int64 tmax;
+	float vmin;
+	float vmax;
+	float first;
+	float last;
+	double sum;
+};
+
+// tail file record, followed by nbytes of payload
+struct hist_tail_record
+{
+	unsigned int magic;
+	unsigned int point;
+	unsigned int sealed;   // blocks of the point before this one
+	unsigned int count;    // samples of the block up to here
+	unsigned int offset;   // payload bytes of the block before the ones of this record
+	unsigned int nbytes;
+	unsigned int check;    // FNV-1a of the record with check 0 and its payload
+};
+#pragma pack(pop)
+
+// bit stream encoder for one block
+class CHistBlockEncoder
+{
+public:
+	CHistBlockEncoder();
+	void reset();
+	void add(__int64 time, float value, unsigned char quality);
+	bool full() const;
+	bool empty() const { return m_hdr.count == 0; }
+	// header with summaries and the payload, valid until the next add/reset
+	const hist_block_header& finish();
+	const std::vector<unsigned char>& payload() const { return m_buf; }
+	const hist_block_header& header() const { return m_hdr; }
+	// bits of the last byte not yet in payload(), left aligned in byte; 0 when there are none
+	int partial(unsigned char& byte) const;
+
+private:
+	void putBits(unsigned __int64 v, int n);
+	std::vector<unsigned char> m_buf;
+	unsigned __int64 m_acc;
+	int m_nacc;
+	hist_block_header m_hdr;
+	__int64 m_prevTime;
+	__int64 m_prevDelta;
+	unsigned int m_prevBits;
+	int m_prevLead;
+	int m_prevTrail;
+	unsigned char m_prevQuality;
+};
+
+// bit stream decoder for one block
+class CHistBlockDecoder
+{
+public:
+	CHistBlockDecoder(const unsigned char* data, unsigned int nbytes, unsigned int count);
+	bool next(hist_sample& s);
+	// decode everything, returns number of samples appended
+	int decodeAll(std::vector<hist_sample>& out);
+
+private:
+	unsigned __int64 getBits(int n);
+	// next 64 bits left aligned without consuming them
+	unsigned __int64 peekBits();
+	const unsigned char* m_data;
+	unsigned int m_nbytes;
+	unsigned int m_count;
+	unsigned int m_done;
+	unsigned int m_bitpos;
+	__int64 m_prevTime;
+	__int64 m_prevDelta;
+	unsigned int m_prevBits;
+	int m_prevLead;
+	int m_prevTrail;
+	unsigned char m_prevQuality;
+};
+
+struct hist_blockref
+{
+	int segment;
+	unsigned int offset;   // offset of the header in the segment
+	hist_block_header hdr;
+};
+
+class CHistorian
+{
+public:
+	CHistorian();
+	~CHistorian();
+
+	bool open(LPCTSTR lpszDirectory);
+	void close();
+	bool isOpen() const { return m_bOpen; }
+
+	// point index of (ca, address), created on first use
+	int pointIndex(unsigned short ca, unsigned int address);
+	// -1 if the point was never stored
+	int findPoint(unsigned short ca, unsigned int address);
+	int pointCount();
+
+	void append(int point, __int64 time, float value, unsigned char quality);
+	// appends a dataIndication batch, objects without time tag get rxtime
+	void appendObjects(const iec_obj* obj, int numpoints, __int64 rxtime);
+	// write the sealed blocks still in the write buffer, log the open blocks to the tail
+	// file and flush the files to disk (also done on close)
+	void flush();
+
+	// raw samples of a point in [t0, t1], in storage order
+	bool read(int point, __int64 t0, __int64 t1, std::vector<hist_sample>& out);
+
+	// sealed blocks of a point overlapping [t0, t1] (summaries only)
+	void blocks(int point, __int64 t0, __int64 t1, std::vector<hist_blockref>& out);
+	// payload of a sealed block, scratch is used when it is still in the write buffer
+	const unsigned char* blockData(const hist_blockref& ref, std::vector<unsigned char>& scratch);
+	// copy of the open block of a point, as a sealed block would look
+	bool openBlock(int point, hist_block_header& hdr, std::vector<unsigned char>& payload);
+
+	static __int64 now();
+	static __int64 timeFromCP56(const cp56time2a& t);
+	static bool hasTimeTag(unsigned char type);
+	static unsigned char qualityOf(const iec_obj* obj);
+
+private:
+	struct hist_point
+	{
+		unsigned short ca;
+		unsigned int address;
+		CHistBlockEncoder open;
+		std::vector<hist_blockref> blocks;
+		unsigned int tailBytes;   // whole payload bytes of the open block in the tail file
+		unsigned int tailCount;   // its samples there
+
+		hist_point() : tailBytes(0), tailCount(0) {}
+	};
+	struct hist_segment
+	{
+		HANDLE hFile;
+		HANDLE hMap;
+		const unsigned char* base;
+		unsigned int used;     // bytes written to the file
+	};
+
+	bool openSegment(int n, bool create);
+	void scanSegment(int n);
+	void seal(int point);
+	void writeBuffer();
+	// what the open blocks gained since the last call, into the tail file
+	void writeTail();
+	// a new tail file of the open blocks only, once the sealed blocks are on disk
+	bool rewriteTail();
+	// the open blocks of the tail file and the blocks it has that a crash kept from the segments
+	void replayTail();
+	void tailRecord(int point, unsigned int offset, std::vector<unsigned char>& out);
+	CString segmentName(int n);
+	static unsigned __int64 pointKey(unsigned short ca, unsigned int address)
+		{ return ((unsigned __int64)ca << 24) | (address & 0xFFFFFF); }
+
+	bool m_bOpen;
+	CString m_sDirectory;
+	HANDLE m_hPoints;
+	HANDLE m_hTail;
+	unsigned int m_nTail;                  // bytes in the tail file
+	std::vector<unsigned char> m_TailBuffer;
+	std::vector<hist_point*> m_Points;
+	std::unordered_map<unsigned __int64, int> m_PointIndex;
+	std::vector<hist_segment> m_Segments;
+	std::vector<unsigned char> m_WriteBuffer;
+	CRITICAL_SECTION m_cs;
+};
@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include "HistorianBench.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+static double seconds(const LARGE_INTEGER& from, const LARGE_INTEGER& to)
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return (double)(to.QuadPart - from.QuadPart) / (double)frequency.QuadPart;
+}
+
+static void removeStore(LPCTSTR lpszDirectory)
+{
+	CString sDirectory(lpszDirectory);
+	DeleteFile(sDirectory + _T("\\points.dat"));
+	DeleteFile(sDirectory + _T("\\tail.dat"));
+	for (int n = 0; ; n++)
+	{
+		CString sName;
+		sName.Format(_T("%s\\seg%05d.dat"), lpszDirectory, n);
+		if (!DeleteFile(sName))
+			break;
+	}
+	RemoveDirectory(sDirectory);
+}
+
+void HistorianBenchmark(LPCTSTR lpszDirectory, int points, int duration, hist_bench& result)
+{
+	memset(&result, 0, sizeof(result));
+	result.points = points;
+	removeStore(lpszDirectory);
+	CHistorian historian;
+	if (!historian.open(lpszDirectory))
+		return;
+
+	//a feeder's measurands: each point wanders around its own level, a few change quality, and
+	//reports at its own period as cyclic or deadband points do, spread over the period
+	static const int periods[] = { 1, 2, 5, 10, 30, 60 };
+	std::vector<iec_obj> objects(points), batch;
+	memset(&objects[0], 0, points * sizeof(iec_obj));
+	batch.reserve(points);
+	for (int i = 0; i < points; i++)
+	{
+		objects[i].ca = (unsigned short)(i / 1000 + 1);
+		objects[i].address = i % 1000 + 1;
+		objects[i].type = iec104_class::M_ME_NC_1;
+		objects[i].value = (float)(100 + i % 400);
+	}
+	unsigned int rng = 1;
+	__int64 t = 1500000000000LL;
+	LARGE_INTEGER t0, t1;
+	LONGLONG append = 0, flush = 0;
+	for (int s = 0; s < duration; s++, t += 1000)
+	{
+		batch.clear();
+		for (int i = 0; i < points; i++)
+		{
+			int period = periods[i % (sizeof(periods) / sizeof(periods[0]))];
+			if ((s + i) % period != 0)
+				continue;
+			rng = rng * 1103515245u + 12345u;
+			objects[i].value += (float)((int)((rng >> 16) % 21) - 10) * 0.01f;
+			if ((rng >> 8) % 1000 == 0)
+				objects[i].iv = !objects[i].iv;
+			batch.push_back(objects[i]);
+		}
+		result.samples += (int)batch.size();
+		QueryPerformanceCounter(&t0);
+		if (!batch.empty())
+			historian.appendObjects(&batch[0], (int)batch.size(), t);
+		QueryPerformanceCounter(&t1);
+		append += t1.QuadPart - t0.QuadPart;
+		if (s % 5 == 4)
+		{
+			historian.flush();
+			QueryPerformanceCounter(&t0);
+			flush += t0.QuadPart - t1.QuadPart;
+		}
+	}
+	QueryPerformanceCounter(&t0);
+	historian.flush();
+	QueryPerformanceCounter(&t1);
+	flush += t1.QuadPart - t0.QuadPart;
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	result.appendSeconds = (double)append / (double)frequency.QuadPart;
+	result.flushSeconds = (double)flush / (double)frequency.QuadPart;
+
+	std::vector<hist_sample> samples;
+	std::vector<hist_blockref> refs;
+	std::vector<unsigned char> payload;
+	QueryPerformanceCounter(&t0);
+	for (int i = 0; i < points; i++)
+	{
+		samples.clear();
+		historian.read(i, 0, t, samples);
+	}
+	QueryPerformanceCounter(&t1);
+	result.readSeconds = seconds(t0, t1);
+	for (int i = 0; i < points; i++)
+	{
+		refs.clear();
+		historian.blocks(i, 0, t, refs);
+		for (size_t b = 0; b < refs.size(); b++)
+			result.bytes += sizeof(hist_block_header) + refs[b].hdr.nbytes;
+		//the open block as it will be sealed
+		hist_block_header hdr;
+		if (historian.openBlock(i, hdr, payload))
+			result.bytes += sizeof(hist_block_header) + hdr.nbytes;
+	}
+
+	historian.close();
+	removeStore(lpszDirectory);
+}
+
+static void report(int duration, const hist_bench& b)
+{
+	TRACE(_T("HistorianBenchmarks, %d points over %d s: %d samples, append %.2f M/s, flushes %.1f ms in all, ")
+		_T("%.2f bytes per sample, read %.2f M/s\n"),
+		b.points, duration, b.samples, b.appendSeconds > 0 ? b.samples / b.appendSeconds / 1e6 : 0, b.flushSeconds * 1000,
+		b.samples > 0 ? (double)b.bytes / b.samples : 0, b.readSeconds > 0 ? b.samples / b.readSeconds / 1e6 : 0);
+}
+
+void HistorianBenchmarks()
+{
+	TCHAR szPath[_MAX_PATH];
+	if (GetTempPath(_MAX_PATH, szPath) == 0)
+		return;
+	CString sDirectory(szPath);
+	sDirectory += _T("OSMCtrlAppHistBench");
+
+	hist_bench b;
+	HistorianBenchmark(sDirectory, 1000, 3600, b);
+	report(3600, b);
+	HistorianBenchmark(sDirectory, 10000, 600, b);
+	report(600, b);
+}
@@ -0,0 +1,22 @@
+#pragma once
+//
+// Timing of the historian on synthetic telemetry: slowly moving analog values with the odd
+// quality change, each point reporting every 1, 2, 5, 10, 30 or 60 s, appended in batches
+// as the archive thread appends them, flushed as the flush timer does, then read back. The store goes to a directory under the temporary
+// directory that is removed afterwards. Results go to the debug output.
+//
+#include "Historian.h"
+
+struct hist_bench
+{
+	int points;
+	int samples;            // appended
+	double appendSeconds;   // appendObjects, one batch of the points due per second of data
+	double flushSeconds;    // the flushes, one per 5 s of data, logging the open blocks to the tail
+	double readSeconds;     // every point read back in full
+	__int64 bytes;          // of the blocks, open ones included, headers included
+};
+
+void HistorianBenchmark(LPCTSTR lpszDirectory, int points, int duration, hist_bench& result);
+// 1,000 points over an hour and 10,000 points over 10 minutes
+void HistorianBenchmarks();
@@ -0,0 +1,390 @@
+#include "stdafx.h"
+#include "HistorianQuery.h"
+#include "ParallelFor.h"
+#include <emmintrin.h>
+#include <float.h>
+#include <limits.h>
+#include <algorithm>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+static bool SampleBefore(const hist_sample& a, const hist_sample& b)
+{
+	return a.time < b.time;
+}
+
+// blocks are normally appended in time order, only sort when they were not
+static void SortSamples(std::vector<hist_sample>& v)
+{
+	for (size_t i = 1; i < v.size(); i++)
+	{
+		if (v[i].time < v[i - 1].time)
+		{
+			std::stable_sort(v.begin(), v.end(), SampleBefore);
+			return;
+		}
+	}
+}
+
+static void MergeRange(hist_aggregate& a, __int64& aFirstTime, __int64& aLastTime, unsigned int count,
+	float vmin, float vmax, __int64 firstTime, float first, __int64 lastTime, float last)
+{
+	if (a.count == 0)
+	{
+		a.vmin = vmin;
+		a.vmax = vmax;
+		aFirstTime = firstTime;
+		a.first = first;
+		aLastTime = lastTime;
+		a.last = last;
+	}
+	else
+	{
+		if (vmin < a.vmin)
+			a.vmin = vmin;
+		if (vmax > a.vmax)
+			a.vmax = vmax;
+		if (firstTime < aFirstTime)
+		{
+			aFirstTime = firstTime;
+			a.first = first;
+		}
+		if (lastTime >= aLastTime)
+		{
+			aLastTime = lastTime;
+			a.last = last;
+		}
+	}
+	a.count += count;
+}
+
+CHistorianQuery::CHistorianQuery(CHistorian& hist)
+	: m_hist(hist)
+{
+}
+
+void CHistorianQuery::minMaxSum(const float* v, int n, float& vmin, float& vmax, double& sum)
+{
+	int i = 0;
+	float mn = FLT_MAX;
+	float mx = -FLT_MAX;
+	double s = 0;
+
+	if (n >= 4)
+	{
+		__m128 vmn = _mm_set1_ps(FLT_MAX);
+		__m128 vmx = _mm_set1_ps(-FLT_MAX);
+		__m128d s0 = _mm_setzero_pd();
+		__m128d s1 = _mm_setzero_pd();
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 x = _mm_loadu_ps(v + i);
+			vmn = _mm_min_ps(vmn, x);
+			vmx = _mm_max_ps(vmx, x);
+			s0 = _mm_add_pd(s0, _mm_cvtps_pd(x));
+			s1 = _mm_add_pd(s1, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+		}
+		vmn = _mm_min_ps(vmn, _mm_movehl_ps(vmn, vmn));
+		vmn = _mm_min_ss(vmn, _mm_shuffle_ps(vmn, vmn, 1));
+		vmx = _mm_max_ps(vmx, _mm_movehl_ps(vmx, vmx));
+		vmx = _mm_max_ss(vmx, _mm_shuffle_ps(vmx, vmx, 1));
+		s0 = _mm_add_pd(s0, s1);
+		s0 = _mm_add_sd(s0, _mm_unpackhi_pd(s0, s0));
+		mn = _mm_cvtss_f32(vmn);
+		mx = _mm_cvtss_f32(vmx);
+		s = _mm_cvtsd_f64(s0);
+	}
+
+	for (; i < n; i++)
+	{
+		if (v[i] < mn)
+			mn = v[i];
+		if (v[i] > mx)
+			mx = v[i];
+		s += v[i];
+	}
+	vmin = mn;
+	vmax = mx;
+	sum = s;
+}
+
+double CHistorianQuery::weightedSum(const float* v, const float* w, int n)
+{
+	int i = 0;
+	double s = 0;
+
+	if (n >= 4)
+	{
+		__m128d s0 = _mm_setzero_pd();
+		__m128d s1 = _mm_setzero_pd();
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 x = _mm_loadu_ps(v + i);
+			__m128 y = _mm_loadu_ps(w + i);
+			s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_cvtps_pd(x), _mm_cvtps_pd(y)));
+			s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), _mm_cvtps_pd(_mm_movehl_ps(y, y))));
+		}
+		s0 = _mm_add_pd(s0, s1);
+		s0 = _mm_add_sd(s0, _mm_unpackhi_pd(s0, s0));
+		s = _mm_cvtsd_f64(s0);
+	}
+
+	for (; i < n; i++)
+		s += (double)v[i] * w[i];
+	return s;
+}
+
+void CHistorianQuery::decodeBlock(const hist_block_header& hdr, const unsigned char* pData,
+	__int64 t0, __int64 t1, std::vector<hist_sample>& out)
+{
+	CHistBlockDecoder dec(pData, hdr.nbytes, hdr.count);
+	hist_sample smp;
+	if (hdr.tmin >= t0 && hdr.tmax < t1)
+	{
+		while (dec.next(smp))
+			out.push_back(smp);
+	}
+	else
+	{
+		while (dec.next(smp))
+		{
+			if (smp.time >= t0 && smp.time < t1)
+				out.push_back(smp);
+		}
+	}
+}
+
+bool CHistorianQuery::lastBefore(int point, __int64 t, hist_sample& out, query_scratch& s)
+{
+	bool bFound = false;
+	hist_sample smp;
+
+	hist_block_header hdr;
+	if (m_hist.openBlock(point, hdr, s.data) && hdr.tmin < t)
+	{
+		CHistBlockDecoder dec(&s.data[0], hdr.nbytes, hdr.count);
+		while (dec.next(smp))
+		{
+			if (smp.time < t && (!bFound || smp.time >= out.time))
+			{
+				out = smp;
+				bFound = true;
+			}
+		}
+	}
+
+	//newest blocks first, stop decoding once no block can hold a later sample
+	s.refs.clear();
+	m_hist.blocks(point, LLONG_MIN, t - 1, s.refs);
+	for (size_t i = s.refs.size(); i-- > 0;)
+	{
+		const hist_block_header& h = s.refs[i].hdr;
+		__int64 tLimit = (h.tmax < t) ? h.tmax : t - 1;
+		if (bFound && tLimit <= out.time)
+			continue;
+		if ((h.flags & HIST_BLOCK_ORDERED) && h.tmax < t)
+		{
+			//the last sample of an ordered block is its newest
+			out.time = h.tmax;
+			out.value = h.last;
+			bFound = true;
+			continue;
+		}
+		const unsigned char* pData = m_hist.blockData(s.refs[i], s.data);
+		if (pData == NULL)
+			continue;
+		CHistBlockDecoder dec(pData, h.nbytes, h.count);
+		while (dec.next(smp))
+		{
+			if (smp.time < t && (!bFound || smp.time >= out.time))
+			{
+				out = smp;
+				bFound = true;
+			}
+		}
+	}
+	return bFound;
+}
+
+bool CHistorianQuery::raw(int point, __int64 t0, __int64 t1, std::vector<hist_sample>& out)
+{
+	query_scratch s;
+	return raw(point, t0, t1, out, s);
+}
+
+bool CHistorianQuery::raw(int point, __int64 t0, __int64 t1, std::vector<hist_sample>& out, query_scratch& s)
+{
+	out.clear();
+	if (point < 0 || point >= m_hist.pointCount() || t1 < t0)
+		return false;
+
+	__int64 tEnd = (t1 < LLONG_MAX) ? t1 + 1 : t1;
+	s.refs.clear();
+	m_hist.blocks(point, t0, t1, s.refs);
+	for (size_t i = 0; i < s.refs.size(); i++)
+	{
+		const unsigned char* pData = m_hist.blockData(s.refs[i], s.data);
+		if (pData != NULL)
+			decodeBlock(s.refs[i].hdr, pData, t0, tEnd, out);
+	}
+
+	hist_block_header hdr;
+	if (m_hist.openBlock(point, hdr, s.data) && hdr.tmax >= t0 && hdr.tmin <= t1)
+		decodeBlock(hdr, &s.data[0], t0, tEnd, out);
+
+	SortSamples(out);
+	return true;
+}
+
+bool CHistorianQuery::aggregate(int point, __int64 t0, __int64 t1, __int64 interval,
+	std::vector<hist_aggregate>& out, bool bTimeWeighted)
+{
+	query_scratch s;
+	return aggregate(point, t0, t1, interval, out, bTimeWeighted, s);
+}
+
+bool CHistorianQuery::aggregate(int point, __int64 t0, __int64 t1, __int64 interval,
+	std::vector<hist_aggregate>& out, bool bTimeWeighted, query_scratch& s)
+{
+	out.clear();
+	if (point < 0 || point >= m_hist.pointCount() || interval <= 0 || t1 <= t0)
+		return false;
+
+	size_t nb = (size_t)((t1 - t0 + interval - 1) / interval);
+	hist_aggregate empty;
+	memset(&empty, 0, sizeof(empty));
+	out.assign(nb, empty);
+	for (size_t k = 0; k < nb; k++)
+		out[k].time = t0 + (__int64)k * interval;
+	s.sum.assign(nb, 0.0);
+	s.firstTime.resize(nb);
+	s.lastTime.resize(nb);
+
+	//value holding at t0 for the time weighted average
+	hist_sample carry;
+	bool bCarry = bTimeWeighted && lastBefore(point, t0, carry, s);
+
+	s.samples.clear();
+	s.refs.clear();
+	m_hist.blocks(point, t0, t1 - 1, s.refs);
+	for (size_t i = 0; i < s.refs.size(); i++)
+	{
+		const hist_block_header& h = s.refs[i].hdr;
+		if (!bTimeWeighted && (h.flags & HIST_BLOCK_ORDERED) && h.tmin >= t0 && h.tmax < t1)
+		{
+			size_t k = (size_t)((h.tmin - t0) / interval);
+			if (k == (size_t)((h.tmax - t0) / interval))
+			{
+				//whole block inside one interval, the summary is enough
+				MergeRange(out[k], s.firstTime[k], s.lastTime[k], h.count, h.vmin, h.vmax, h.tmin, h.first, h.tmax, h.last);
+				s.sum[k] += h.sum;
+				continue;
+			}
+		}
+		const unsigned char* pData = m_hist.blockData(s.refs[i], s.data);
+		if (pData != NULL)
+			decodeBlock(h, pData, t0, t1, s.samples);
+	}
+
+	hist_block_header hdr;
+	if (m_hist.openBlock(point, hdr, s.data) && hdr.tmax >= t0 && hdr.tmin < t1)
+		decodeBlock(hdr, &s.data[0], t0, t1, s.samples);
+
+	SortSamples(s.samples);
+	size_t n = s.samples.size();
+	s.times.resize(n);
+	s.values.resize(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		s.times[i] = s.samples[i].time;
+		s.values[i] = s.samples[i].value;
+	}
+	if (bTimeWeighted)
+	{
+		s.dt.resize(n);
+		for (size_t i = 0; i + 1 < n; i++)
+			s.dt[i] = (float)(s.times[i + 1] - s.times[i]);
+	}
+
+	size_t lo = 0;
+	for (size_t k = 0; k < nb; k++)
+	{
+		hist_aggregate& a = out[k];
+		__int64 b = (t1 - a.time > interval) ? a.time + interval : t1;
+		size_t hi = lo;
+		while (hi < n && s.times[hi] < b)
+			hi++;
+
+		if (hi > lo)
+		{
+			float vmin, vmax;
+			double sum;
+			minMaxSum(&s.values[lo], (int)(hi - lo), vmin, vmax, sum);
+			MergeRange(a, s.firstTime[k], s.lastTime[k], (unsigned int)(hi - lo), vmin, vmax,
+				s.times[lo], s.values[lo], s.times[hi - 1], s.values[hi - 1]);
+			s.sum[k] += sum;
+		}
+
+		if (bTimeWeighted)
+		{
+			bool bPrev = (lo > 0) || bCarry;
+			double prev = (lo > 0) ? s.values[lo - 1] : (bCarry ? carry.value : 0);
+			double tw = 0;
+			__int64 covered = 0;
+			if (hi == lo)
+			{
+				if (bPrev)
+				{
+					tw = prev * (double)(b - a.time);
+					covered = b - a.time;
+				}
+			}
+			else
+			{
+				if (bPrev)
+				{
+					tw += prev * (double)(s.times[lo] - a.time);
+					covered += s.times[lo] - a.time;
+				}
+				tw += weightedSum(&s.values[lo], &s.dt[lo], (int)(hi - 1 - lo));
+				tw += (double)s.values[hi - 1] * (double)(b - s.times[hi - 1]);
+				covered += b - s.times[lo];
+			}
+			a.twa = (covered > 0) ? (float)(tw / (double)covered) : 0;
+			a.coverage = (float)((double)covered / (double)interval);
+		}
+
+		if (a.count > 0)
+			a.avg = (float)(s.sum[k] / a.count);
+		lo = hi;
+	}
+	return true;
+}
+
+void CHistorianQuery::aggregateMany(const std::vector<int>& points, __int64 t0, __int64 t1, __int64 interval,
+	std::vector< std::vector<hist_aggregate> >& out, bool bTimeWeighted, int nWorkers)
+{
+	int n = (int)points.size();
+	out.clear();
+	out.resize(n);
+	std::vector<query_scratch> scratch(CParallelFor::workerCount(n, nWorkers));
+	CParallelFor::run(n, [&](int i, int worker)
+	{
+		aggregate(points[i], t0, t1, interval, out[i], bTimeWeighted, scratch[worker]);
+	}, nWorkers);
+}
+
+void CHistorianQuery::rawMany(const std::vector<int>& points, __int64 t0, __int64 t1,
+	std::vector< std::vector<hist_sample> >& out, int nWorkers)
+{
+	int n = (int)points.size();
+	out.clear();
+	out.resize(n);
+	std::vector<query_scratch> scratch(CParallelFor::workerCount(n, nWorkers));
+	CParallelFor::run(n, [&](int i, int worker)
+	{
+		raw(points[i], t0, t1, out[i], scratch[worker]);
+	}, nWorkers);
+}
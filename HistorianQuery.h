@@ -0,0 +1,72 @@
+#pragma once
+//
+// Trend queries on the historian: raw samples, per interval min/max/avg/first/last and
+// time weighted average. Blocks that fall inside one interval are merged from their header
+// summaries without decoding; the rest are decoded once and reduced with SSE2 kernels.
+// Multi point queries are spread over worker threads.
+//
+#include "Historian.h"
+#include <vector>
+
+struct hist_aggregate
+{
+	__int64 time;          // interval start
+	unsigned int count;    // samples in the interval, the fields below are 0 when there are none
+	float vmin;
+	float vmax;
+	float avg;
+	float first;
+	float last;
+	float twa;             // time weighted average, each value holds until the next sample
+	float coverage;        // part of the interval (0..1) with a known value, 0 when twa is not valid
+};
+
+class CHistorianQuery
+{
+public:
+	CHistorianQuery(CHistorian& hist);
+
+	// raw samples of a point in [t0, t1], ordered by time
+	bool raw(int point, __int64 t0, __int64 t1, std::vector<hist_sample>& out);
+
+	// one entry per interval of [t0, t1); bTimeWeighted also fills twa/coverage, which needs
+	// every block decoded plus the last sample before t0
+	bool aggregate(int point, __int64 t0, __int64 t1, __int64 interval,
+		std::vector<hist_aggregate>& out, bool bTimeWeighted = false);
+
+	// aggregate() for several points on up to nWorkers threads (0 = one per processor)
+	void aggregateMany(const std::vector<int>& points, __int64 t0, __int64 t1, __int64 interval,
+		std::vector< std::vector<hist_aggregate> >& out, bool bTimeWeighted = false, int nWorkers = 0);
+	void rawMany(const std::vector<int>& points, __int64 t0, __int64 t1,
+		std::vector< std::vector<hist_sample> >& out, int nWorkers = 0);
+
+	// min, max and sum of v[0..n), sum accumulated in double
+	static void minMaxSum(const float* v, int n, float& vmin, float& vmax, double& sum);
+	// sum of v[i] * w[i], accumulated in double
+	static double weightedSum(const float* v, const float* w, int n);
+
+private:
+	struct query_scratch
+	{
+		std::vector<hist_blockref> refs;
+		std::vector<unsigned char> data;
+		std::vector<hist_sample> samples;
+		std::vector<__int64> times;
+		std::vector<float> values;
+		std::vector<float> dt;
+		std::vector<double> sum;          // per interval merge state
+		std::vector<__int64> firstTime;
+		std::vector<__int64> lastTime;
+	};
+
+	bool raw(int point, __int64 t0, __int64 t1, std::vector<hist_sample>& out, query_scratch& s);
+	bool aggregate(int point, __int64 t0, __int64 t1, __int64 interval,
+		std::vector<hist_aggregate>& out, bool bTimeWeighted, query_scratch& s);
+	// appends the samples of a block with t0 <= time < t1
+	static void decodeBlock(const hist_block_header& hdr, const unsigned char* pData,
+		__int64 t0, __int64 t1, std::vector<hist_sample>& out);
+	// time and value of the newest sample before t, quality is not filled in
+	bool lastBefore(int point, __int64 t, hist_sample& out, query_scratch& s);
+
+	CHistorian& m_hist;
+};
@@ -108,10 +108,17 @@ void iec104ex_class::commandActTermIndication( iec_obj *obj )
 void iec104ex_class::dataIndication( iec_obj *obj, int numpoints )
 {
 	CMainFrame* pMF = (CMainFrame*)AfxGetApp()->m_pMainWnd;   
-	pMF->SendMessage( WM_INFONOTIFY, (WPARAM )obj, (LPARAM)numpoints);
+	//subscribers get a shared copy, the receive thread only waits when the archive falls behind
+	pMF->m_bus.publish( obj, numpoints, CHistorian::now() );
 	//pMF->pIECSView-> SendMessage(WM_SHOWIECDATA, (WPARAM)obj, (LPARAM)numpoints);
 	return;
 }
+void iec104ex_class::interrogationIndication( iec_obj *obj, int numpoints )
+{
+	CMainFrame* pMF = (CMainFrame*)AfxGetApp()->m_pMainWnd;
+	//the whole station in one batch, the point database and the display never see half a GI
+	pMF->m_bus.publish( obj, numpoints, CHistorian::now() );
+}
 
 void iec104ex_class::startListening()
 {
@@ -39,6 +39,7 @@ private:
 	void commandActConfIndication( iec_obj *obj );
 	void commandActTermIndication( iec_obj *obj );
 	void dataIndication(iec_obj *obj, int numpoints);
+	void interrogationIndication(iec_obj *obj, int numpoints);
 	bool mEnding;
 	bool mAllowConnect;
 	void startListening();
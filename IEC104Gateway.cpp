@@ -0,0 +1,330 @@
+#include "stdafx.h"
+#include "IEC104Gateway.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CGatewayClient::CGatewayClient(CIEC104Gateway* pGateway, SOCKET sock, const SOCKADDR_IN& addr)
+{
+	m_pGateway = pGateway;
+	m_Socket = sock;
+	m_sPeer.Format(_T("%s:%u"), (LPCTSTR)CString(inet_ntoa(addr.sin_addr)), (unsigned)ntohs(addr.sin_port));
+	m_pThread = NULL;
+	m_bClosed = false;
+	mLog.activateLog();
+	mLog.dontLogTime();
+	mLog.setMaxMsg(200);
+
+	//Changes queue per connection, a master that does not keep up only loses its own frames
+	m_hDataEvt = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_pSub = m_pGateway->m_pBus->subscribeEvent(_T("gateway ") + m_sPeer, telemetry_filter(), m_hDataEvt);
+}
+
+CGatewayClient::~CGatewayClient()
+{
+	join();
+	m_pGateway->m_pBus->unsubscribe(m_pSub);
+	if (m_Socket != INVALID_SOCKET)
+		closesocket(m_Socket);
+	CloseHandle(m_hDataEvt);
+	mLog.deactivateLog();
+}
+
+bool CGatewayClient::start()
+{
+	m_pThread = AfxBeginThread(threadClient, this, THREAD_PRIORITY_NORMAL, 0, CREATE_SUSPENDED);
+	if (m_pThread == NULL)
+		return false;
+	m_pThread->m_bAutoDelete = FALSE;
+	m_pThread->ResumeThread();
+	return true;
+}
+
+void CGatewayClient::join()
+{
+	if (m_pThread != NULL)
+	{
+		WaitForSingleObject(m_pThread->m_hThread, INFINITE);
+		delete m_pThread;
+		m_pThread = NULL;
+	}
+}
+
+void CGatewayClient::disconnectTCP()
+{
+	if (m_Socket == INVALID_SOCKET)
+		return;
+	closesocket(m_Socket);
+	m_Socket = INVALID_SOCKET;
+	m_bClosed = true;
+	onDisconnectTCP();
+}
+
+int CGatewayClient::readTCP(char* buf, int szmax)
+{
+	return recv(m_Socket, buf, szmax, 0);
+}
+
+void CGatewayClient::sendTCP(char* data, int sz)
+{
+	while (sz > 0 && m_Socket != INVALID_SOCKET)
+	{
+		int nRet = send(m_Socket, data, sz, 0);
+		if (nRet == SOCKET_ERROR)
+		{
+			TRACE(_T("CGatewayClient::sendTCP, Failed to send to %s, Error:%d\n"), m_sPeer.operator LPCTSTR(), WSAGetLastError());
+			disconnectTCP();
+			return;
+		}
+		data += nRet;
+		sz -= nRet;
+	}
+}
+
+void CGatewayClient::interrogationPoints(unsigned short ca, std::vector<iec_obj>& points)
+{
+	//shared cut, masters interrogating together do not each copy the database
+	pdb_snapshot_ptr pCut = m_pGateway->m_pPointDB->snapshot();
+	points.reserve(pCut->points.size());
+	for (size_t i = 0; i < pCut->points.size(); i++)
+	{
+		const pdb_point& p = pCut->points[i];
+		if (ca != 0xFFFF && p.ca != ca)
+			continue;
+		iec_obj obj;
+		memset(&obj, 0, sizeof(obj));
+		obj.address = p.address;
+		obj.value = p.value;
+		obj.type = p.type;
+		obj.ca = p.ca;
+		obj.cause = 20;
+		obj.ov = p.quality & 0x01;
+		obj.bl = (p.quality >> 4) & 0x01;
+		obj.sb = (p.quality >> 5) & 0x01;
+		obj.nt = (p.quality >> 6) & 0x01;
+		obj.iv = (p.quality >> 7) & 0x01;
+		points.push_back(obj);
+	}
+}
+
+void CGatewayClient::forwardChanges()
+{
+	telemetry_ptr batch;
+	while (!m_bClosed && m_pSub->pop(batch))
+	{
+		if (!batch->obj.empty())
+			sendSpontaneous(&batch->obj[0], (int)batch->obj.size());
+	}
+}
+
+UINT CGatewayClient::threadClient(LPVOID lParam)
+{
+	CGatewayClient* pClient = (CGatewayClient*)lParam;
+	DWORD dwLastSecond = GetTickCount();
+
+	pClient->onConnectTCP();
+	while (!pClient->m_bClosed && WaitForSingleObject(pClient->m_pGateway->m_hExit, 0) == WAIT_TIMEOUT)
+	{
+		//Short select timeout so queued changes and the second timer are served without a read
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(pClient->m_Socket, &readfds);
+		timeval tv = { 0, 50000 };
+		int nRet = select(0, &readfds, NULL, NULL, &tv);
+		if (nRet == SOCKET_ERROR)
+		{
+			TRACE(_T("CGatewayClient::threadClient, select failed for %s, Error:%d\n"), pClient->m_sPeer.operator LPCTSTR(), WSAGetLastError());
+			break;
+		}
+		if (nRet > 0)
+		{
+			char c;
+			if (recv(pClient->m_Socket, &c, 1, MSG_PEEK) <= 0)
+				break;
+			pClient->packetReadyTCP();
+		}
+		pClient->forwardChanges();
+		if (GetTickCount() - dwLastSecond >= 1000)
+		{
+			dwLastSecond += 1000;
+			pClient->onTimerSecond();
+		}
+	}
+	pClient->disconnectTCP();
+	return 0;
+}
+
+
+CIEC104Gateway::CIEC104Gateway()
+{
+	m_pPointDB = NULL;
+	m_pBus = NULL;
+	m_ListenSocket = INVALID_SOCKET;
+	m_nMaxClients = GATEWAY_MAXCLIENTS;
+	m_hExit = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_pListenThread = NULL;
+	InitializeCriticalSection(&m_cs);
+}
+
+CIEC104Gateway::~CIEC104Gateway()
+{
+	stop();
+	CloseHandle(m_hExit);
+	DeleteCriticalSection(&m_cs);
+}
+
+bool CIEC104Gateway::start(CPointDatabase* pPointDB, CTelemetryBus* pBus, unsigned short nPort, int nMaxClients)
+{
+	if (m_pListenThread != NULL)
+		return true;
+
+	m_pPointDB = pPointDB;
+	m_pBus = pBus;
+	m_nMaxClients = nMaxClients;
+
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(1, 1), &wsaData);
+	m_ListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (m_ListenSocket == INVALID_SOCKET)
+	{
+		TRACE(_T("CIEC104Gateway::start, Failed to create the socket, Error:%d\n"), WSAGetLastError());
+		WSACleanup();
+		return false;
+	}
+
+	SOCKADDR_IN addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(nPort);
+	addr.sin_addr.S_un.S_addr = htonl(INADDR_ANY);
+	if (bind(m_ListenSocket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(m_ListenSocket, SOMAXCONN) == SOCKET_ERROR)
+	{
+		TRACE(_T("CIEC104Gateway::start, Failed to listen on port %u, Error:%d\n"), (unsigned)nPort, WSAGetLastError());
+		closesocket(m_ListenSocket);
+		m_ListenSocket = INVALID_SOCKET;
+		WSACleanup();
+		return false;
+	}
+
+	ResetEvent(m_hExit);
+	m_pListenThread = AfxBeginThread(threadListen, this, THREAD_PRIORITY_NORMAL, 0, CREATE_SUSPENDED);
+	if (m_pListenThread == NULL)
+	{
+		closesocket(m_ListenSocket);
+		m_ListenSocket = INVALID_SOCKET;
+		WSACleanup();
+		return false;
+	}
+	m_pListenThread->m_bAutoDelete = FALSE;
+	m_pListenThread->ResumeThread();
+	return true;
+}
+
+void CIEC104Gateway::stop()
+{
+	if (m_pListenThread == NULL)
+		return;
+
+	SetEvent(m_hExit);
+	WaitForSingleObject(m_pListenThread->m_hThread, INFINITE);
+	delete m_pListenThread;
+	m_pListenThread = NULL;
+	closesocket(m_ListenSocket);
+	m_ListenSocket = INVALID_SOCKET;
+
+	//The client threads see the exit event within one select timeout
+	EnterCriticalSection(&m_cs);
+	for (size_t i = 0; i < m_Clients.size(); i++)
+		delete m_Clients[i];
+	m_Clients.clear();
+	LeaveCriticalSection(&m_cs);
+	WSACleanup();
+}
+
+int CIEC104Gateway::clients()
+{
+	EnterCriticalSection(&m_cs);
+	int nClients = 0;
+	for (size_t i = 0; i < m_Clients.size(); i++)
+		if (!m_Clients[i]->isClosed())
+			nClients++;
+	LeaveCriticalSection(&m_cs);
+	return nClients;
+}
+
+void CIEC104Gateway::getStats(std::vector<iec104_slave_stats>& stats)
+{
+	EnterCriticalSection(&m_cs);
+	stats.clear();
+	for (size_t i = 0; i < m_Clients.size(); i++)
+		stats.push_back(m_Clients[i]->getStats());
+	LeaveCriticalSection(&m_cs);
+}
+
+void CIEC104Gateway::reap()
+{
+	EnterCriticalSection(&m_cs);
+	for (size_t i = 0; i < m_Clients.size();)
+	{
+		if (m_Clients[i]->isClosed())
+		{
+			delete m_Clients[i];
+			m_Clients.erase(m_Clients.begin() + i);
+		}
+		else
+			i++;
+	}
+	LeaveCriticalSection(&m_cs);
+}
+
+void CIEC104Gateway::accepted(SOCKET sock, const SOCKADDR_IN& addr)
+{
+	reap();
+	EnterCriticalSection(&m_cs);
+	if ((int)m_Clients.size() >= m_nMaxClients)
+	{
+		LeaveCriticalSection(&m_cs);
+		TRACE(_T("CIEC104Gateway::accepted, Refused a connection, %d masters connected\n"), m_nMaxClients);
+		closesocket(sock);
+		return;
+	}
+	CGatewayClient* pClient = new CGatewayClient(this, sock, addr);
+	if (!pClient->start())
+	{
+		LeaveCriticalSection(&m_cs);
+		delete pClient;
+		return;
+	}
+	m_Clients.push_back(pClient);
+	LeaveCriticalSection(&m_cs);
+}
+
+UINT CIEC104Gateway::threadListen(LPVOID lParam)
+{
+	CIEC104Gateway* pGateway = (CIEC104Gateway*)lParam;
+
+	while (WaitForSingleObject(pGateway->m_hExit, 0) == WAIT_TIMEOUT)
+	{
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(pGateway->m_ListenSocket, &readfds);
+		timeval tv = { 0, 200000 };
+		int nRet = select(0, &readfds, NULL, NULL, &tv);
+		if (nRet == SOCKET_ERROR)
+		{
+			TRACE(_T("CIEC104Gateway::threadListen, select failed, Error:%d\n"), WSAGetLastError());
+			break;
+		}
+		if (nRet == 0)
+		{
+			pGateway->reap();
+			continue;
+		}
+		SOCKADDR_IN addr = { 0 };
+		int nLen = sizeof(addr);
+		SOCKET sock = accept(pGateway->m_ListenSocket, (sockaddr*)&addr, &nLen);
+		if (sock != INVALID_SOCKET)
+			pGateway->accepted(sock, addr);
+	}
+	return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+//
+// IEC 104 gateway: serves the point database to upstream masters as an outstation.
+// Each accepted connection gets an iec104_slave on its own thread and its own telemetry
+// bus subscription, so a slow master only fills (and eventually drops from) its own queue.
+// GI is answered from a copy of the point database. Commands are not forwarded to the RTUs,
+// they get a negative confirmation.
+//
+#include "iec104_slave.h"
+#include "PointDatabase.h"
+#include "TelemetryBus.h"
+#include <vector>
+
+#define GATEWAY_PORT 2404
+#define GATEWAY_MAXCLIENTS 8
+
+class CIEC104Gateway;
+
+class CGatewayClient : public iec104_slave
+{
+public:
+	CGatewayClient(CIEC104Gateway* pGateway, SOCKET sock, const SOCKADDR_IN& addr);
+	~CGatewayClient();
+
+	bool start();
+	bool isClosed() const { return m_bClosed; }
+	void join();               // waits for the thread, after the gateway exit event is set
+	const CString& peer() const { return m_sPeer; }
+
+private:
+	// redefine for iec104_slave
+	void disconnectTCP();
+	int readTCP(char* buf, int szmax);
+	void sendTCP(char* data, int sz);
+	void interrogationPoints(unsigned short ca, std::vector<iec_obj>& points);
+
+	void forwardChanges();
+	static UINT threadClient(LPVOID lParam);
+
+	CIEC104Gateway* m_pGateway;
+	SOCKET m_Socket;
+	CString m_sPeer;
+	telemetry_sub m_pSub;
+	HANDLE m_hDataEvt;
+	CWinThread* m_pThread;
+	volatile bool m_bClosed;
+	std::vector<iec_obj> m_Changes;
+};
+
+class CIEC104Gateway
+{
+public:
+	CIEC104Gateway();
+	~CIEC104Gateway();
+
+	bool start(CPointDatabase* pPointDB, CTelemetryBus* pBus, unsigned short nPort = GATEWAY_PORT, int nMaxClients = GATEWAY_MAXCLIENTS);
+	void stop();
+	bool isRunning() const { return m_pListenThread != NULL; }
+	int clients();
+	void getStats(std::vector<iec104_slave_stats>& stats);
+
+private:
+	friend class CGatewayClient;
+	static UINT threadListen(LPVOID lParam);
+	void accepted(SOCKET sock, const SOCKADDR_IN& addr);
+	void reap();               // deletes the clients whose connection closed
+
+	CPointDatabase* m_pPointDB;
+	CTelemetryBus* m_pBus;
+	SOCKET m_ListenSocket;
+	int m_nMaxClients;
+	HANDLE m_hExit;
+	CWinThread* m_pListenThread;
+	std::vector<CGatewayClient*> m_Clients;
+	CRITICAL_SECTION m_cs;
+};
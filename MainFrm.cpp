@@ -16,6 +16,7 @@ BEGIN_MESSAGE_MAP(CMainFrame, CFrameWnd)
   ON_WM_CREATE()
   ON_UPDATE_COMMAND_UI(ID_INDICATOR_POSITION, OnUpdatePosition)
   ON_UPDATE_COMMAND_UI(ID_INDICATOR_LENGTH, OnUpdateLength)
+  ON_UPDATE_COMMAND_UI(ID_INDICATOR_TELEMETRY, OnUpdateTelemetry)
   ON_MESSAGE(WM_INFONOTIFY, &CMainFrame::OnInfonotify)
   ON_WM_TIMER()
 END_MESSAGE_MAP()
@@ -24,7 +25,8 @@ static UINT indicators[] =
 {
   ID_SEPARATOR,       //status line indicator
   ID_INDICATOR_POSITION,
-  ID_INDICATOR_LENGTH
+  ID_INDICATOR_LENGTH,
+  ID_INDICATOR_TELEMETRY
 };
 
 CMainFrame::CMainFrame()
@@ -33,10 +35,39 @@ CMainFrame::CMainFrame()
 	v_powerflow.resize(M_BRANCHNUM*2);
 	v.resize(M_BRANCHNUM * 2);
 	v_powerdata.resize(M_BRANCHNUM * 2);
+	m_hArchiveEvt = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hArchiveExit = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_pArchiveThread = NULL;
+	m_pEstimator = NULL;
+	m_hEstimateEvt = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hEstimateExit = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_pEstimateThread = NULL;
+	m_nFlowEstimate = 0;
+	m_sTelemetry = _T("Telemetry: 0 lost, 0 waits");
 }
 
 CMainFrame::~CMainFrame()
 {
+	m_gateway.stop();
+	m_bus.unsubscribe(m_pDisplaySub);
+	m_bus.unsubscribe(m_pArchiveSub);
+	if (m_pArchiveThread != NULL)
+	{
+		SetEvent(m_hArchiveExit);
+		WaitForSingleObject(m_pArchiveThread->m_hThread, INFINITE);
+		delete m_pArchiveThread;
+	}
+	if (m_pEstimateThread != NULL)
+	{
+		SetEvent(m_hEstimateExit);
+		WaitForSingleObject(m_pEstimateThread->m_hThread, INFINITE);
+		delete m_pEstimateThread;
+	}
+	CloseHandle(m_hArchiveEvt);
+	CloseHandle(m_hArchiveExit);
+	CloseHandle(m_hEstimateEvt);
+	CloseHandle(m_hEstimateExit);
+	m_pointdb.save();
 }
 
 int CMainFrame::OnCreate(LPCREATESTRUCT lpCreateStruct)
@@ -64,6 +95,51 @@ int CMainFrame::OnCreate(LPCREATESTRUCT lpCreateStruct)
   EnableDocking(CBRS_ALIGN_ANY);
   DockControlBar(&m_wndToolBar);
 
+  //Keep the received telemetry in CSIDL_LOCAL_APPDATA\OSMCtrlApp\History
+  TCHAR szPath[_MAX_PATH];
+  if (SHGetSpecialFolderPath(NULL, szPath, CSIDL_LOCAL_APPDATA, TRUE))
+  {
+    CString sAppDirectory(szPath);
+    sAppDirectory += _T("\\OSMCtrlApp");
+    CreateDirectory(sAppDirectory, NULL);
+    if (!m_historian.open(sAppDirectory + _T("\\History")))
+      TRACE(_T("CMainFrame::OnCreate, Failed to open the historian\n"));
+
+    //Show the last snapshot of the point database until every RTU has answered a GI
+    int nRestored = m_pointdb.open(sAppDirectory + _T("\\points.snp"));
+    if (nRestored < 0)
+      TRACE(_T("CMainFrame::OnCreate, Failed to open the point database snapshot\n"));
+    else if (nRestored > 0)
+      ShowSnapshot();
+  }
+  SetTimer(M_HISTFLUSHTIMER, M_HISTFLUSHELAPSE, NULL);
+  SetTimer(M_SNAPSHOTTIMER, M_SNAPSHOTELAPSE, NULL);
+  SetTimer(M_FLOWTIMER, M_FLOWELAPSE, NULL);
+
+  //The map is fed on this thread, the historian and point database on the archive thread;
+  //the display only needs the latest values, the archive every sample, so it holds up the receive thread when full
+  m_pDisplaySub = m_bus.subscribeWindow(_T("display"), telemetry_filter(), m_hWnd, WM_INFONOTIFY);
+  m_pArchiveSub = m_bus.subscribeEvent(_T("archive"), telemetry_filter(), m_hArchiveEvt, 65536, TELEMETRY_BLOCK);
+  m_pArchiveThread = AfxBeginThread(threadArchive, this, THREAD_PRIORITY_NORMAL, 0, CREATE_SUSPENDED);
+  if (m_pArchiveThread != NULL)
+  {
+    m_pArchiveThread->m_bAutoDelete = FALSE;
+    m_pArchiveThread->ResumeThread();
+  }
+
+  //The state estimate follows the point database on a thread of its own
+  m_pEstimator = &pOSMVIew->GetDocument()->m_Estimator;
+  m_pEstimateThread = AfxBeginThread(threadEstimate, this, THREAD_PRIORITY_BELOW_NORMAL, 0, CREATE_SUSPENDED);
+  if (m_pEstimateThread != NULL)
+  {
+    m_pEstimateThread->m_bAutoDelete = FALSE;
+    m_pEstimateThread->ResumeThread();
+  }
+
+  //Upstream masters get the point database from here, as an outstation
+  if (!m_gateway.start(&m_pointdb, &m_bus))
+    TRACE(_T("CMainFrame::OnCreate, Failed to start the IEC 104 gateway\n"));
+
   return 0;
 }
 
@@ -252,6 +328,12 @@ void CMainFrame::OnUpdateLength(CCmdUI* pCmdUI)
   pCmdUI->Enable(TRUE);
 }
 
+void CMainFrame::OnUpdateTelemetry(CCmdUI* pCmdUI)
+{
+  pCmdUI->SetText(m_sTelemetry);
+  pCmdUI->Enable(TRUE);
+}
+
 
 BOOL CMainFrame::OnCreateClient(LPCREATESTRUCT lpcs, CCreateContext* pContext)
 {
@@ -284,15 +366,31 @@ BOOL CMainFrame::OnCreateClient(LPCREATESTRUCT lpcs, CCreateContext* pContext)
 
 afx_msg LRESULT CMainFrame::OnInfonotify(WPARAM wParam, LPARAM lParam)
 {
-	CMainFrame* pMF = (CMainFrame*)AfxGetApp()->m_pMainWnd;
-	COSMCtrlAppDoc* pDoc;
-	//iec_obj iec;
-
+	//posted by the display subscription once per drain, take everything queued since
+	telemetry_ptr batch;
+	while (m_pDisplaySub && m_pDisplaySub->pop(batch))
+		DisplayObjects(&batch->obj[0], (int)batch->obj.size());
 	
-	for (int i = 0; i < lParam; i++)
+	return 0;
+}
+
+
+void CMainFrame::DisplayObjects(const iec_obj* obj, int numpoints)
+{
+	bool bSwitched = false;
+	for (int i = 0; i < numpoints; i++)
 	{
-		//iec = ((iec_obj*)wParam + i);
-		unsigned int address = ((iec_obj*)wParam + i)->address;
+		if (!m_pDisplaySub->matches(obj[i]))
+			continue;
+		//a breaker point switches its branch or bus rather than showing a value
+		COSMCtrlAppDoc* pDoc = pOSMVIew->GetDocument();
+		if (pDoc->IsSwitchPoint(obj[i].ca, obj[i].address))
+		{
+			if (pDoc->SwitchBreaker(obj[i]))
+				bSwitched = true;
+			continue;
+		}
+		unsigned int address = (obj + i)->address;
 		int num;
 		/*if ((address >= 6000) && (address<=6031))
 		{
@@ -302,7 +400,7 @@ afx_msg LRESULT CMainFrame::OnInfonotify(WPARAM wParam, LPARAM lParam)
 		{
 			break;
 		}*///ʽʱʹ
-		float m = ((iec_obj*)wParam + i)->value;
+		float m = (obj + i)->value;
 		
 		/*v_powerflow[num].Format(_T("%f"), m);
 		v_powerdata[num] = m;
@@ -315,27 +413,85 @@ afx_msg LRESULT CMainFrame::OnInfonotify(WPARAM wParam, LPARAM lParam)
 		
 		if (Checked())
 		{
-			pOSMVIew->KillTimer(1);
-			//pOSMVIew->Refresh_fake(-M_REFRESNLEVEL);
-			pMF->pIECSView->SendMessage(WM_SHOWIECDATA,(WPARAM)&v_powerflow,M_BRANCHNUM);
-			pMF->pOSMVIew->m_ctrlOSM.m_Polygons.clear();
-			pOSMVIew->PowerFlowArrow(v_powerdata);
-			v_powerdata1.swap(v_powerdata);
-			pOSMVIew->m_offsetlevel = 0;
-			pOSMVIew->SetTimer (1,500,0);
-			//pOSMVIew->m_ctrlOSM.Refresh();
-			pOSMVIew->Refresh_fake(M_REFRESNLEVEL);
-			v_powerflow.clear();
-			v_powerflow.resize(M_BRANCHNUM * 2);
-			v_powerdata.clear();
-			v_powerdata.resize(M_BRANCHNUM * 2);
-			v.clear();
-			v.resize(M_BRANCHNUM * 2);
-			n_station = 0;
+			ShowPowerFlow();
+			if (m_bSnapshotShown)
+			{
+				SetMessageText(AFX_IDS_IDLEMESSAGE);
+				m_bSnapshotShown = false;
+			}
 		}
 	}
-	
-	return 0;
+
+	//the flows follow the breakers of the whole batch at once, a GI's included, in one solve
+	if (bSwitched)
+	{
+		COSMCtrlAppDoc* pDoc = pOSMVIew->GetDocument();
+		m_dcFlowSnapshot.publish(pDoc->DcFlows());
+		if (pDoc->SolvePowerFlow())
+			m_powerFlowSnapshot.publish(pDoc->m_FlowResult);
+	}
+}
+
+
+void CMainFrame::ShowPowerFlow()
+{
+	pOSMVIew->KillTimer(1);
+	//pOSMVIew->Refresh_fake(-M_REFRESNLEVEL);
+	pIECSView->SendMessage(WM_SHOWIECDATA,(WPARAM)&v_powerflow,M_BRANCHNUM);
+	pOSMVIew->m_ctrlOSM.m_Polygons.clear();
+	pOSMVIew->PowerFlowArrow(v_powerdata);
+	m_flowSnapshot.publish(v_powerdata);
+	pOSMVIew->m_offsetlevel = 0;
+	pOSMVIew->SetTimer (1,500,0);
+	//pOSMVIew->m_ctrlOSM.Refresh();
+	pOSMVIew->Refresh_fake(M_REFRESNLEVEL);
+	v_powerflow.clear();
+	v_powerflow.resize(M_BRANCHNUM * 2);
+	v_powerdata.clear();
+	v_powerdata.resize(M_BRANCHNUM * 2);
+	v.clear();
+	v.resize(M_BRANCHNUM * 2);
+	n_station = 0;
+}
+
+
+void CMainFrame::ShowSnapshot()
+{
+	//restored points fill the slots in the order they were first received, like OnInfonotify does
+	pdb_snapshot_ptr pCut = m_pointdb.snapshot();
+	const std::vector<pdb_point>& points = pCut->points;
+	COSMCtrlAppDoc* pDoc = pOSMVIew->GetDocument();
+	for (size_t i = 0; i < points.size() && n_station < M_BRANCHNUM * 2; i++)
+	{
+		//breaker points are not shown, as in DisplayObjects
+		if (pDoc->IsSwitchPoint(points[i].ca, points[i].address))
+			continue;
+		v_powerflow[n_station].Format(_T("%f NT"), points[i].value);
+		v_powerdata[n_station] = points[i].value;
+		v[n_station] = 1;
+		n_station++;
+	}
+
+	if (Checked())
+	{
+		ShowPowerFlow();
+		CString sMessage;
+		sMessage.Format(_T("Restored snapshot of %s, values are not topical until refreshed"),
+			CTime((time_t)(m_pointdb.snapshotTime() / 1000)).Format(_T("%Y-%m-%d %H:%M:%S")).operator LPCTSTR());
+		SetMessageText(sMessage);
+		m_bSnapshotShown = true;
+	}
+	else
+	{
+		//an incomplete picture is not drawn, wait for live data
+		v_powerflow.clear();
+		v_powerflow.resize(M_BRANCHNUM * 2);
+		v_powerdata.clear();
+		v_powerdata.resize(M_BRANCHNUM * 2);
+		v.clear();
+		v.resize(M_BRANCHNUM * 2);
+		n_station = 0;
+	}
 }
 
 
@@ -346,11 +502,139 @@ void CMainFrame::OnTimer(UINT_PTR nIDEvent)
 	{
 		
 	}
+	else if (nIDEvent == M_HISTFLUSHTIMER)
+	{
+		m_historian.flush();
+		ReportTelemetry();
+	}
+	else if (nIDEvent == M_SNAPSHOTTIMER)
+	{
+		m_pointdb.save();
+	}
+	else if (nIDEvent == M_FLOWTIMER)
+	{
+		//the AC flow follows the estimate's injections and the breakers, each solve starting
+		//from the last solution; the model is only touched on this thread
+		COSMCtrlAppDoc* pDoc = pOSMVIew->GetDocument();
+		unsigned __int64 nEstimate = m_estimateSnapshot.version();
+		if (nEstimate != m_nFlowEstimate)
+		{
+			CSnapshot<se_result>::ptr pEstimate = m_estimateSnapshot.get();
+			if (pEstimate && pDoc->SetInjections(*pEstimate))
+				m_dcFlowSnapshot.publish(pDoc->DcFlows());
+			m_nFlowEstimate = nEstimate;
+		}
+		if (pDoc->m_bSwitched || pDoc->m_bInjected)
+		{
+			if (pDoc->SolvePowerFlow())
+				m_powerFlowSnapshot.publish(pDoc->m_FlowResult);
+		}
+		else if (!m_powerFlowSnapshot.get() && pDoc->m_FlowResult.converged)
+			m_powerFlowSnapshot.publish(pDoc->m_FlowResult);   //BuildModel's solve
+	}
 	
 
 }
 
 
+void CMainFrame::ReportTelemetry()
+{
+	//losses and waits of every bus subscriber, logged when they grow
+	std::vector<telemetry_sub> subs;
+	m_bus.subscriptions(subs);
+	unsigned __int64 nDropped = 0, nBlocked = 0;
+	for (size_t i = 0; i < subs.size(); i++)
+	{
+		telemetry_stats stats;
+		subs[i]->getStats(stats);
+		telemetry_stats& last = m_TelemetryReported[subs[i]->name()];
+		if (stats.dropped != last.dropped || stats.blocked != last.blocked)
+			TRACE(_T("CMainFrame::ReportTelemetry, %s: %I64u batches dropped, %I64u pushes waited, depth %u of high water %u\n"),
+				(LPCTSTR)subs[i]->name(), stats.dropped - last.dropped, stats.blocked - last.blocked, stats.depth, stats.highWater);
+		last = stats;
+		nDropped += stats.dropped;
+		nBlocked += stats.blocked;
+	}
+	m_sTelemetry.Format(_T("Telemetry: %I64u lost, %I64u waits"), nDropped, nBlocked);
+}
+
+
+UINT CMainFrame::threadArchive(LPVOID lParam)
+{
+	CMainFrame* pMF = (CMainFrame*)lParam;
+	HANDLE hWaitObjects[2] = { pMF->m_hArchiveExit, pMF->m_hArchiveEvt };
+
+	while (true)
+	{
+		DWORD dwReturn = WaitForMultipleObjects(2, hWaitObjects, FALSE, INFINITE);
+		if (dwReturn != WAIT_OBJECT_0 + 1)
+			break;
+		telemetry_ptr batch;
+		while (pMF->m_pArchiveSub->pop(batch))
+		{
+			pMF->m_historian.appendObjects(&batch->obj[0], (int)batch->obj.size(), batch->rxtime);
+			pMF->m_pointdb.update(&batch->obj[0], (int)batch->obj.size(), batch->rxtime);
+		}
+		SetEvent(pMF->m_hEstimateEvt);
+	}
+	return 0;
+}
+
+
+UINT CMainFrame::threadEstimate(LPVOID lParam)
+{
+	CMainFrame* pMF = (CMainFrame*)lParam;
+	HANDLE hWaitObjects[2] = { pMF->m_hEstimateExit, pMF->m_hEstimateEvt };
+	unsigned __int64 cursor = 0;
+	std::vector<pdb_point> changed;
+	std::vector<char> flagged;    //points marked suspect in the point database
+	std::vector< std::pair<unsigned short, unsigned int> > set, clear;
+	se_result res;
+	se_options opt;
+	opt.tracking = true;    //each cycle from the last, with the gain factor as long as it serves
+	pf_result base;
+	ct_result cases;
+
+	while (true)
+	{
+		DWORD dwReturn = WaitForMultipleObjects(2, hWaitObjects, FALSE, INFINITE);
+		if (dwReturn != WAIT_OBJECT_0 + 1)
+			break;
+		//everything that arrived during the last estimate is taken in one go, so the estimate
+		//runs at the telemetry rate or as fast as it can, whichever is slower
+		bool bFull;
+		cursor = pMF->m_pointdb.changes(cursor, changed, bFull);
+		if (pMF->m_pEstimator->measure(changed) == 0)
+			continue;
+		if (pMF->m_pEstimator->estimate(res, opt))
+		{
+			pMF->m_estimateSnapshot.publish(res);
+			//every new state is screened for the branch outages it would not ride through
+			base.vm = res.vm;
+			base.va = res.va;
+			base.flows = res.flows;
+			if (pMF->m_Contingency.run(pMF->m_pEstimator->model(), base, cases))
+				pMF->m_contingencySnapshot.publish(cases);
+		}
+
+		//bad data goes back to the point database as a quality flag
+		const std::vector<se_measurement>& meas = pMF->m_pEstimator->measurements();
+		flagged.resize(meas.size(), 0);
+		set.clear();
+		clear.clear();
+		for (size_t m = 0; m < meas.size(); m++)
+			if (meas[m].suspect != (flagged[m] != 0))
+			{
+				(meas[m].suspect ? set : clear).push_back(std::make_pair(meas[m].ca, meas[m].address));
+				flagged[m] = meas[m].suspect;
+			}
+		pMF->m_pointdb.flag(set, PDB_QUALITY_SUSPECT, true);
+		pMF->m_pointdb.flag(clear, PDB_QUALITY_SUSPECT, false);
+	}
+	return 0;
+}
+
+
 int CMainFrame::Checked()
 {
 	for (int i = 0; i < v.size(); i++)
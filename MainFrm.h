@@ -3,6 +3,12 @@
 #define WM_SHOWIECDATA WM_USER + 413
 #define M_BRANCHNUM 16
 #define M_REFRESNLEVEL 0.000000001
+#define M_HISTFLUSHTIMER 2
+#define M_HISTFLUSHELAPSE 5000
+#define M_SNAPSHOTTIMER 3
+#define M_SNAPSHOTELAPSE 10000
+#define M_FLOWTIMER 4
+#define M_FLOWELAPSE 2000
 
 
 #include "OSMCtrlAppView.h"
@@ -10,7 +16,13 @@
 #include "PowerDataView.h"
 #include "IEC104Extention.h"
 #include "IECShowView.h"
+#include "Historian.h"
+#include "PointDatabase.h"
+#include "TelemetryBus.h"
+#include "IEC104Gateway.h"
+#include "Contingency.h"
 #include <vector>
+#include <map>
 
 
 class CMainFrame : public CFrameWnd
@@ -36,7 +48,11 @@ public:
 	CPowerDataView* pPowerDView;
 	COSMCtrlAppView* pOSMVIew;
 	CIECShowView* pIECSView;
+	CTelemetryBus m_bus;
 	iec104ex_class ie;
+	CHistorian m_historian;
+	CPointDatabase m_pointdb;
+	CIEC104Gateway m_gateway;
 
 protected:  // control bar embedded members
   CStatusBar  m_wndStatusBar;
@@ -49,6 +65,7 @@ protected:
   afx_msg int OnCreate(LPCREATESTRUCT lpCreateStruct);
   afx_msg void OnUpdatePosition(CCmdUI* pCmdUI);
   afx_msg void OnUpdateLength(CCmdUI* pCmdUI);
+  afx_msg void OnUpdateTelemetry(CCmdUI* pCmdUI);
   DECLARE_MESSAGE_MAP()
   afx_msg LRESULT OnInfonotify(WPARAM wParam, LPARAM lParam);
  // void CMainFrame::ReceiveIEC(UINT_PTR nIDEvent);
@@ -57,10 +74,35 @@ public:
 	std::vector<int> v;
 	std::vector<CString> v_powerflow;
 	std::vector<float> v_powerdata;
-	std::vector<float> v_powerdata1;
+	CSnapshot<std::vector<float> > m_flowSnapshot; //last drawn flows, read by the view's animation timer
+	CSnapshot<se_result> m_estimateSnapshot;       //last converged state estimate
+	CSnapshot<ct_result> m_contingencySnapshot;    //N-1 cases of that estimate, most severe first
+	CSnapshot<pf_result> m_powerFlowSnapshot;      //last AC solution of the document's model
+	CSnapshot<std::vector<double> > m_dcFlowSnapshot;   //its DC branch MW, ahead of the AC solve after a switch or new injections
+	unsigned __int64 m_nFlowEstimate;              //version of m_estimateSnapshot that solution has the injections of
 	int n_pq = 0;
 	int n_station = 0;
 	int Checked();
+	void ShowPowerFlow();
+	void ShowSnapshot();
+	bool m_bSnapshotShown = false;
+
+	telemetry_sub m_pDisplaySub;
+	telemetry_sub m_pArchiveSub;   //blocks the receive thread when full, samples are never dropped
+	CString m_sTelemetry;          //status bar: batches the bus subscribers lost or waited for
+	std::map<CString, telemetry_stats> m_TelemetryReported;   //per subscriber, at the last report
+	void ReportTelemetry();
+	HANDLE m_hArchiveEvt;
+	HANDLE m_hArchiveExit;
+	CWinThread* m_pArchiveThread;
+	static UINT threadArchive(LPVOID lParam);
+	CStateEstimator* m_pEstimator; //the document's
+	CContingency m_Contingency;    //used by the estimator thread only
+	HANDLE m_hEstimateEvt;
+	HANDLE m_hEstimateExit;
+	CWinThread* m_pEstimateThread;
+	static UINT threadEstimate(LPVOID lParam);
+	void DisplayObjects(const iec_obj* obj, int numpoints);
 	int maplist(unsigned int address);
 };
 
@@ -3,6 +3,10 @@
 #include "MainFrm.h"
 #include "OSMCtrlAppDoc.h"
 #include "OSMCtrlAppView.h"
+#include "iec104_sim.h"
+#include "iec104_decodepool.h"
+#include "HistorianBench.h"
+#include "PowerBench.h"
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -27,6 +31,71 @@ ATL::CComModule _Module;
 COSMCtrlAppApp theApp;
 
 
+//Recognises /benchmark besides the standard shell commands
+class CAppCommandLineInfo : public CCommandLineInfo
+{
+public:
+  CAppCommandLineInfo() : m_bBenchmark(FALSE)
+  {
+  }
+
+  virtual void ParseParam(const TCHAR* pszParam, BOOL bFlag, BOOL bLast)
+  {
+    if (bFlag && _tcsicmp(pszParam, _T("benchmark")) == 0)
+      m_bBenchmark = TRUE;
+    else
+      CCommandLineInfo::ParseParam(pszParam, bFlag, bLast);
+  }
+
+  BOOL m_bBenchmark;
+};
+
+//Times the decoders, the historian and the power flow solvers, the results going to the debug output
+static void RunBenchmarks()
+{
+  iec104_sim_config cfg;
+  cfg.sessions = 50;
+  cfg.points = 2000;
+  iec104_sim_load load;
+  iec104_sim_decodeLoad(cfg, 20, NULL, load);
+  TRACE(_T("RunBenchmarks, decode load: %I64u frames, %I64u objects in %.3f s\n"), load.frames, load.objects, load.seconds);
+
+  //a front end with 1,000 RTUs, decoded on the receive thread and then on the decode pool by worker count
+  iec104_sim_config many;
+  many.sessions = 1000;
+  many.points = 200;
+  iec104_sim_decodeLoad(many, 20, NULL, load);
+  TRACE(_T("RunBenchmarks, decode load %d sessions, receive thread: %.1f M objects/s\n"), many.sessions, load.objects / load.seconds / 1e6);
+  static const int workers[] = { 1, 2, 4, 8 };
+  for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); i++)
+  {
+    iec104_decodepool pool;
+    pool.start(workers[i]);
+    iec104_sim_decodeLoad(many, 20, &pool, load);
+    iec104_decodepool_stats st = pool.getStats();
+    TRACE(_T("RunBenchmarks, decode load %d sessions, %d workers: %.1f M objects/s, %I64u steals\n"), many.sessions, pool.workers(), load.objects / load.seconds / 1e6, st.steals);
+  }
+
+  static const TCHAR* levels[] = { _T("scalar"), _T("SSSE3"), _T("AVX2") };
+  iec104_sim_seqload seq;
+  iec104_sim_seqDecodeLoad(cfg, 200, seq);
+  for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+  {
+    if (seq.seconds[i] > 0)
+      TRACE(_T("RunBenchmarks, SQ=1 decode %s: %I64u frames, %.1f M objects/s\n"), levels[i], seq.frames, seq.objects / seq.seconds[i] / 1e6);
+    else
+      TRACE(_T("RunBenchmarks, SQ=1 decode %s: not supported\n"), levels[i]);
+  }
+  if (!seq.agree)
+    TRACE(_T("RunBenchmarks, SQ=1 decode paths disagree with the scalar path\n"));
+
+  HistorianBenchmarks();
+
+  //the IEEE 14 bus case is read from the cases directory under the working directory
+  PowerFlowBenchmarks("cases");
+}
+
+
 BOOL COSMCtrlAppApp::InitInstance()
 {
   //Initialize OLE
@@ -135,9 +204,16 @@ BOOL COSMCtrlAppApp::InitInstance()
   AddDocTemplate(pDocTemplate);
 
   //Parse command line for standard shell commands, DDE, file open
-  CCommandLineInfo cmdInfo;
+  CAppCommandLineInfo cmdInfo;
   ParseCommandLine(cmdInfo);
 
+  //OSMCtrlApp /benchmark only runs the benchmarks
+  if (cmdInfo.m_bBenchmark)
+  {
+    RunBenchmarks();
+    return FALSE;
+  }
+
   //Dispatch commands specified on the command line.  Will return FALSE if
   //app was launched with /RegServer, /Register, /Unregserver or /Unregister.
   if (!ProcessShellCommand(cmdInfo))
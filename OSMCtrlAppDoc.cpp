@@ -14,6 +14,12 @@ END_MESSAGE_MAP()
 
 COSMCtrlAppDoc::COSMCtrlAppDoc()
 {
+	m_FlowOptions.method = PF_FDXB;
+	m_FlowOptions.warmStart = true;
+	m_bSwitched = FALSE;
+	m_bRebuild = FALSE;
+	m_bInjected = FALSE;
+	m_bNodeBreaker = FALSE;
 }
 
 COSMCtrlAppDoc::~COSMCtrlAppDoc()
@@ -28,6 +34,197 @@ BOOL COSMCtrlAppDoc::OnNewDocument()
 	return TRUE;
 }
 
+BOOL COSMCtrlAppDoc::BuildModel()
+{
+	std::vector<tp_node> nodes;
+	std::vector<tp_switch> switches;
+	std::vector<pf_branch> branches;
+	m_bNodeBreaker = CTopologyProcessor::readCsv("nodedata.csv", "switchdata.csv", "nodebranchdata.csv", nodes, switches, branches);
+	if (m_bNodeBreaker)
+	{
+		m_Topology.setModel(nodes, switches, branches);
+		TopologyModel();
+	}
+	else
+		m_Model.fromDocument(m_Stations, m_Branchs);
+	m_PowerFlow.setModel(m_Model);
+	if (!m_DcFlow.setModel(m_Model))
+		TRACE(_T("COSMCtrlAppDoc::BuildModel, No DC model\n"));
+	m_bSwitched = FALSE;
+	m_bRebuild = FALSE;
+	m_bInjected = FALSE;
+	std::vector<se_measurement> meas;
+	m_Breakers.clear();
+	if (CStateEstimator::readCsv("measdata.csv", m_Model, meas))
+	{
+		//the buses of a node-breaker model follow its switches and the points' buses do not, so
+		//there the file only gives the breakers, and neither the estimate nor the N-1 screen runs
+		if (!m_bNodeBreaker)
+			m_Estimator.setModel(m_Model, meas);
+		for (size_t m = 0; m < meas.size(); m++)
+			if (meas[m].type == SE_BREAKER)
+				m_Breakers[((unsigned __int64)meas[m].ca << 32) | meas[m].address] = meas[m].element;
+	}
+	return SolvePowerFlow();
+}
+
+int COSMCtrlAppDoc::TopologyModel()
+{
+	//an island without a generator is dead: nothing is scheduled on its buses and its
+	//branches are out of the solves
+	m_Model = m_Topology.model();
+	int nDead = 0;
+	for (size_t k = 0; k < m_Model.buses.size(); k++)
+	{
+		if (m_Topology.energized((int)k))
+			continue;
+		pf_bus& b = m_Model.buses[k];
+		b.pd = b.qd = b.gs = b.bs = b.pg = b.qg = 0;
+		nDead++;
+	}
+	for (size_t l = 0; l < m_Model.branches.size(); l++)
+	{
+		pf_branch& br = m_Model.branches[l];
+		if (!m_Topology.energized(br.from) || !m_Topology.energized(br.to))
+			br.status = false;
+	}
+	return nDead;
+}
+
+void COSMCtrlAppDoc::TopologyChanged()
+{
+	//bus indices moved or buses died or came alive, so the DC model starts over and the AC one
+	//before its next solve
+	int nDead = TopologyModel();
+	if (!m_DcFlow.setModel(m_Model))
+		TRACE(_T("COSMCtrlAppDoc::TopologyChanged, No DC model\n"));
+	m_bSwitched = TRUE;
+	m_bRebuild = TRUE;
+	TRACE(_T("COSMCtrlAppDoc::TopologyChanged, %d buses in %d islands, %d buses dead\n"), (int)m_Model.buses.size(),
+		m_Topology.islands(), nDead);
+}
+
+BOOL COSMCtrlAppDoc::SolvePowerFlow()
+{
+	if (m_Model.buses.empty())
+		return FALSE;
+	if (m_bRebuild)
+	{
+		m_PowerFlow.setModel(m_Model);
+		m_bRebuild = FALSE;
+	}
+	m_bSwitched = FALSE;
+	m_bInjected = FALSE;
+	if (!m_PowerFlow.solve(m_FlowResult, m_FlowOptions))
+	{
+		TRACE(_T("COSMCtrlAppDoc::SolvePowerFlow, No convergence after %d iterations, mismatch %g pu\n"), m_FlowResult.iterations, m_FlowResult.mismatch);
+		return FALSE;
+	}
+	TRACE(_T("COSMCtrlAppDoc::SolvePowerFlow, %d buses in %d iterations, losses %.3f MW\n"), (int)m_Model.buses.size(), m_FlowResult.iterations, m_FlowResult.lossP);
+	return TRUE;
+}
+
+BOOL COSMCtrlAppDoc::SetInjections(const se_result& est)
+{
+	//what the estimated flows and shunts take out of each bus is its injection; the loads stay
+	//and the generation makes up the rest, buses outside the estimate keep what they had
+	int n = (int)m_Model.buses.size();
+	if (!est.converged || (int)est.vm.size() != n || est.flows.size() != m_Model.branches.size())
+		return FALSE;
+	std::vector<double> P(n, 0), Q(n, 0);
+	for (size_t l = 0; l < m_Model.branches.size(); l++)
+	{
+		const pf_branch& br = m_Model.branches[l];
+		if (!br.status)
+			continue;
+		P[br.from] += est.flows[l].pf;
+		Q[br.from] += est.flows[l].qf;
+		P[br.to] += est.flows[l].pt;
+		Q[br.to] += est.flows[l].qt;
+	}
+	for (int k = 0; k < n; k++)
+	{
+		double vm = est.vm[k];
+		if (vm <= 0)
+			continue;
+		pf_bus& b = m_Model.buses[k];
+		b.pg = P[k] + b.gs * vm * vm + b.pd;
+		b.qg = Q[k] - b.bs * vm * vm + b.qd;
+	}
+	m_PowerFlow.setInjections(m_Model.buses);
+	m_bInjected = TRUE;
+	return TRUE;
+}
+
+const std::vector<double>& COSMCtrlAppDoc::DcFlows()
+{
+	std::vector<double> P;
+	CDcPowerFlow::injections(m_Model, P);
+	return m_DcFlow.inject(P);
+}
+
+BOOL COSMCtrlAppDoc::IsSwitchPoint(unsigned short ca, unsigned int address) const
+{
+	if (m_bNodeBreaker && m_Topology.findSwitch(ca, address) >= 0)
+		return TRUE;
+	return m_Breakers.count(((unsigned __int64)ca << 32) | address) > 0;
+}
+
+BOOL COSMCtrlAppDoc::SwitchBreaker(const iec_obj& obj)
+{
+	int sw = m_bNodeBreaker ? m_Topology.findSwitch(obj.ca, obj.address) : -1;
+	std::unordered_map<unsigned __int64, int>::const_iterator it = m_Breakers.find(((unsigned __int64)obj.ca << 32) | obj.address);
+	if ((sw < 0 && it == m_Breakers.end()) || obj.iv || obj.nt)
+		return FALSE;
+	bool bClosed;
+	if (obj.type == iec104_class::M_DP_NA_1 || obj.type == iec104_class::M_DP_TB_1)
+	{ //closed at 2, open at 1, anything else is between positions and changes nothing
+		if (obj.value != 1 && obj.value != 2)
+			return FALSE;
+		bClosed = obj.value == 2;
+	}
+	else
+		bClosed = obj.value != 0;
+	if (sw >= 0)
+	{
+		//only the switch's own bus is merged or split
+		if (!m_Topology.setSwitch(sw, bClosed))
+			return FALSE;
+		TRACE(_T("COSMCtrlAppDoc::SwitchBreaker, Switch %d %s\n"), sw, bClosed ? _T("closed") : _T("opened"));
+		TopologyChanged();
+		return TRUE;
+	}
+	if (m_bNodeBreaker)
+	{
+		//the topology's islands follow the branch too; one that energizes or kills part of the
+		//network changes the buses of the solves as a switch does, within a dead island nothing
+		const pf_branch& net = m_Topology.model().branches[it->second];
+		bool bLive = m_Topology.energized(net.from) && m_Topology.energized(net.to);
+		if (!m_Topology.setBranch(it->second, bClosed))
+			return FALSE;
+		if (bLive != (m_Topology.energized(net.from) && m_Topology.energized(net.to)))
+		{
+			TRACE(_T("COSMCtrlAppDoc::SwitchBreaker, Branch %d %s\n"), it->second, bClosed ? _T("closed") : _T("opened"));
+			TopologyChanged();
+			return TRUE;
+		}
+		if (!bLive)
+			return FALSE;
+	}
+	pf_branch& br = m_Model.branches[it->second];
+	if (br.status == bClosed)
+		return FALSE;
+	br.status = bClosed;
+	if (br.line >= 0 && !m_bNodeBreaker)
+		m_Branchs[br.line].status = bClosed;
+	m_DcFlow.setBranch(it->second, bClosed);   //flows of the last injections follow at once
+	if (!m_bRebuild)
+		m_PowerFlow.setBranch(it->second, bClosed);   //Ybus and the factors patched, not rebuilt
+	m_bSwitched = TRUE;
+	TRACE(_T("COSMCtrlAppDoc::SwitchBreaker, Branch %d %s\n"), it->second, bClosed ? _T("closed") : _T("opened"));
+	return TRUE;
+}
+
 void COSMCtrlAppDoc::Serialize(CArchive& ar)
 {
 	if (ar.IsStoring())
@@ -1,5 +1,9 @@
 #pragma once
 #include "OSMMyStruct.h"
+#include "PowerFlow.h"
+#include "DcPowerFlow.h"
+#include "StateEstimator.h"
+#include "TopologyProcessor.h"
 
 class COSMCtrlAppDoc : public CDocument
 {
@@ -11,9 +15,31 @@ protected: // create from serialization only
 public:
 	std::vector<StationStruct> m_Stations;
 	std::vector<BranchStruct> m_Branchs;
+	CPowerModel m_Model;        //electrical model of the stations and branches
+	CPowerFlow m_PowerFlow;
+	pf_options m_FlowOptions;   //fast decoupled from the last solution, Newton if that fails
+	pf_result m_FlowResult;     //last solve of m_Model
+	CDcPowerFlow m_DcFlow;      //PTDF of m_Model, flows follow injection changes without a solve
+	CStateEstimator m_Estimator;   //m_Model with the points of measdata.csv, run on the frame's estimator thread; none for a node-breaker model
+	std::unordered_map<unsigned __int64, int> m_Breakers;   //ca << 32 | address -> branch of m_Model, the CB rows of measdata.csv
+	BOOL m_bSwitched;           //a breaker moved since m_FlowResult was solved
+	BOOL m_bRebuild;            //m_Model's buses changed since m_PowerFlow was given it
+	BOOL m_bInjected;           //m_PowerFlow has loads and generation m_FlowResult was not solved with
+	CTopologyProcessor m_Topology;   //node-breaker model of nodedata.csv, switchdata.csv and nodebranchdata.csv
+	BOOL m_bNodeBreaker;        //m_Model is m_Topology's buses, dead islands dropped, rather than the stations
 
 // Operations
 public:
+	BOOL BuildModel();          //m_Model from the node-breaker files or else m_Stations and m_Branchs, then SolvePowerFlow
+	BOOL SolvePowerFlow();      //from the last solution, after any breaker or injection change
+	BOOL SetInjections(const se_result& est);   //the estimate's bus injections into m_Model and m_PowerFlow
+	const std::vector<double>& DcFlows();   //branch MW for the injections of m_Model
+	BOOL SwitchBreaker(const iec_obj& obj);   //a breaker point into m_Topology, m_Model, m_DcFlow and m_PowerFlow; TRUE if the solves' network changed
+	BOOL IsSwitchPoint(unsigned short ca, unsigned int address) const;   //a switch of m_Topology or a CB row of measdata.csv
+
+protected:
+	int TopologyModel();        //m_Model from m_Topology with the buses and branches of dead islands out; returns the dead buses
+	void TopologyChanged();     //TopologyModel after a merge, split or island change, m_DcFlow and m_PowerFlow to start over
 
 // Overrides
 public:
@@ -383,106 +383,10 @@ int COSMCtrlAppView::OnCreate(LPCREATESTRUCT lpCreateStruct)
   double dLatitude = _tstof(sValue);
 
   //վϢ
-
-  using namespace std;
-
-  ifstream in("busdata.csv");
-  string line, field;
-  vector< vector<string> > busdataArray;  // the 2D array
-  vector<string> v;                // array of values for one line only
-
-  while (getline(in, line)) {  // get next line in file
-	  v.clear();
-	  stringstream ss(line);
-
-	  while (getline(ss, field, ',')) { // break line into comma delimitted fields
-		  v.push_back(field);  // add each field to the 1D array
-	  }
-
-	  busdataArray.push_back(v);  // add the 1D array to the 2D array
-  }
-  in.close();
-
-  ifstream in1("branchdata.csv");
-  vector< vector<string> > branchdataArray;  // the 2D array
-  //vector<string> v;                // array of values for one line only
-
-  while (getline(in1, line)) {  // get next line in file
-	  v.clear();
-	  stringstream ss(line);
-
-	  while (getline(ss, field, ',')) { // break line into comma delimitted fields
-		  v.push_back(field);  // add each field to the 1D array
-	  }
-
-	  branchdataArray.push_back(v);  // add the 1D array to the 2D array
-  }
-  in1.close();
-  //ifstream in2("load_profile.csv");
-  //vector< vector<string> > loadArray;  // the 2D array
-  ////vector<string> v;                // array of values for one line only
-
-  //while (getline(in2, line)) {  // get next line in file
-	 // v.clear();
-	 // stringstream ss(line);
-
-	 // while (getline(ss, field, ',')) { // break line into comma delimitted fields
-		//  v.push_back(field);  // add each field to the 1D array
-	 // }
-	 // loadArray.push_back(v);  // add the 1D array to the 2D array
-  //}
-  //in2.close();
- /* for (int i = 0; i < 24; i++)
-  {
-	  m_allload[i] = 0;
-	  for (int j = 1; j < loadArray.size(); ++j)
-		  m_allload[i] += atof(loadArray[j][i + 1].c_str());
-  }*/
-
   COSMCtrlAppDoc *pDoc = GetDocument();
-  /*put bus data*/
-  StationStruct station;
-  int bussize = busdataArray.size();
-  for (int i = 1; i < bussize; i++)
-  {
-
-	  station.busName = busdataArray[i][0].c_str();
-	  station.bus_i = atof(busdataArray[i][3].c_str());
-	  station.longitude = atof(busdataArray[i][1].c_str());
-	  station.latitude = atof(busdataArray[i][2].c_str());
-	  station.volGrade = atof(busdataArray[i][5].c_str());
-	  station.father = atof(busdataArray[i][6].c_str());
-	  station.pd_max = atof(busdataArray[i][4].c_str());
-	  /*int mm;
-	  mm = -1;
-	  for (int k = 1; k < loadArray.size(); ++k)
-		  if (station.bus_i == atof(loadArray[k][0].c_str()))
-		  {
-			  mm = k;
-			  break;
-		  }
-	  for (int k = 0; k < 24; ++k)
-		  if (mm != -1)
-			  station.load[k] = station.pd_max*atof(loadArray[mm][k + 1].c_str());
-		  else station.load[k] = 0;*/
-		  pDoc->m_Stations.push_back(station);
-	
-  }
-
-  BranchStruct branch;
-  for (int i = 1; i < branchdataArray.size(); i++)
-  {
-	  branch.fbus = atof(branchdataArray[i][0].c_str());
-	  branch.tbus = atof(branchdataArray[i][1].c_str());
-	  branch.startBus = FindBusNumByI(branch.fbus, pDoc->m_Stations);
-	  branch.endBus = FindBusNumByI(branch.tbus, pDoc->m_Stations);
-	  if (pDoc->m_Stations[branch.startBus].volGrade > pDoc->m_Stations[branch.endBus].volGrade)
-		  branch.volGrade = pDoc->m_Stations[branch.endBus].volGrade;
-	  else
-		  branch.volGrade = pDoc->m_Stations[branch.startBus].volGrade;
-	  branch.carbonAddTest = FALSE;
-	  pDoc->m_Branchs.push_back(branch);
-  }
+  if (!CPowerModel::readCsv("busdata.csv", "branchdata.csv", pDoc->m_Stations, pDoc->m_Branchs))
+    TRACE(_T("COSMCtrlAppView::OnCreate, Failed to load the stations\n"));
+  pDoc->BuildModel();
   UpdateStations(40);
 
 #ifndef COSMCTRL_NOD2D
@@ -2570,7 +2474,7 @@ void COSMCtrlAppView::UpdateStations(int timeNumber)
 }
 
 
-void COSMCtrlAppView::PowerFlowArrow(std::vector<float> v)
+void COSMCtrlAppView::PowerFlowArrow(const std::vector<float>& v)
 {
 	int size = m_ctrlOSM.m_Polylines.size();
 	float fLon, fLat, tLon, tLat;
@@ -2739,7 +2643,10 @@ void COSMCtrlAppView::OnTimer(UINT_PTR nIDEvent)
 		m_ctrlOSM.m_Polygons.clear();
 		CMainFrame* pMF = (CMainFrame*)AfxGetApp()->m_pMainWnd;
 		m_offsetlevel += 0.05;
-		PowerFlowArrow(pMF->v_powerdata1);
+		//the version being drawn stays valid even if ShowPowerFlow publishes a new one meanwhile
+		CSnapshot<std::vector<float> >::ptr pFlow = pMF->m_flowSnapshot.get();
+		if (pFlow)
+			PowerFlowArrow(*pFlow);
 		Refresh_fake(0.000000001);
 	}
 
@@ -41,7 +41,7 @@ public:
 
 // Operations
 public:
-	void PowerFlowArrow(std::vector<float> v);
+	void PowerFlowArrow(const std::vector<float>& v);
 
 // Overrides
 public:
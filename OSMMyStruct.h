@@ -15,6 +15,9 @@ struct StationStruct
 	double father;
 	double pd_max;
 	double load[24];
+	//electrical data for the power flow, see PowerModel.h
+	int type;     //0 when not given
+	double pd, qd, gs, bs, pg, qg, vm, va;
 
 };
 struct BranchStruct
@@ -24,4 +27,6 @@ struct BranchStruct
 	//double startLongitude, startLatitude, endLongitude, endLatitude;
 	double volGrade;
 	BOOL carbonAddTest;
+	double r, x, b, ratio, angle, rate; //r = x = 0 when not given
+	BOOL status;
 };
\ No newline at end of file
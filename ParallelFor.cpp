@@ -0,0 +1,85 @@
+#include "stdafx.h"
+#include "ParallelFor.h"
+#include <vector>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+int CParallelFor::processorCount()
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0) ? (int)si.dwNumberOfProcessors : 1;
+}
+
+int CParallelFor::workerCount(int n, int nWorkers)
+{
+	if (nWorkers <= 0)
+		nWorkers = processorCount();
+	if (nWorkers > MAXIMUM_WAIT_OBJECTS)
+		nWorkers = MAXIMUM_WAIT_OBJECTS;
+	if (nWorkers > n)
+		nWorkers = n;
+	return (nWorkers > 0) ? nWorkers : 1;
+}
+
+void CParallelFor::work(job* pJob, int worker)
+{
+	while (true)
+	{
+		LONG i = InterlockedIncrement(&pJob->next) - 1;
+		if (i >= pJob->n)
+			break;
+		(*pJob->fn)((int)i, worker);
+	}
+}
+
+UINT CParallelFor::threadFunc(LPVOID lParam)
+{
+	worker_arg* pArg = (worker_arg*)lParam;
+	work(pArg->pJob, pArg->worker);
+	return 0;
+}
+
+void CParallelFor::run(int n, const std::function<void(int, int)>& fn, int nWorkers)
+{
+	if (n <= 0)
+		return;
+
+	nWorkers = workerCount(n, nWorkers);
+	if (nWorkers == 1)
+	{
+		for (int i = 0; i < n; i++)
+			fn(i, 0);
+		return;
+	}
+
+	job j;
+	j.fn = &fn;
+	j.next = 0;
+	j.n = n;
+
+	std::vector<worker_arg> args(nWorkers);
+	std::vector<CWinThread*> threads;
+	std::vector<HANDLE> handles;
+	for (int w = 1; w < nWorkers; w++)
+	{
+		args[w].pJob = &j;
+		args[w].worker = w;
+		CWinThread* pThread = AfxBeginThread(threadFunc, &args[w], THREAD_PRIORITY_NORMAL, 0, CREATE_SUSPENDED);
+		if (pThread == NULL)
+			break; //the remaining workers pick up the slack
+		pThread->m_bAutoDelete = FALSE;
+		threads.push_back(pThread);
+		handles.push_back(pThread->m_hThread);
+		pThread->ResumeThread();
+	}
+
+	work(&j, 0);
+
+	if (!handles.empty())
+		WaitForMultipleObjects((DWORD)handles.size(), &handles[0], TRUE, INFINITE);
+	for (size_t t = 0; t < threads.size(); t++)
+		delete threads[t];
+}
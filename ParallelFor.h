@@ -0,0 +1,35 @@
+#pragma once
+//
+// Runs a loop body over [0, n) on the calling thread plus worker threads started with
+// AfxBeginThread. Indices are handed out one at a time, so uneven items balance out.
+//
+#include <functional>
+
+class CParallelFor
+{
+public:
+	// number of processors, at least 1
+	static int processorCount();
+
+	// number of workers run() will use for n items
+	static int workerCount(int n, int nWorkers = 0);
+
+	// fn(index, worker) is called once per index; worker is in [0, workerCount(n, nWorkers))
+	// and can be used to select per thread scratch space. nWorkers <= 0 uses processorCount().
+	static void run(int n, const std::function<void(int, int)>& fn, int nWorkers = 0);
+
+private:
+	struct job
+	{
+		const std::function<void(int, int)>* fn;
+		volatile LONG next;
+		LONG n;
+	};
+	struct worker_arg
+	{
+		job* pJob;
+		int worker;
+	};
+	static UINT threadFunc(LPVOID lParam);
+	static void work(job* pJob, int worker);
+};
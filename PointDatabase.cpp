@@ -0,0 +1,430 @@
+#include "stdafx.h"
+#include "PointDatabase.h"
+#include "Historian.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+#define PDB_INITIAL_CAPACITY 1024     // records per slot in a new file
+
+static unsigned int Fnv1a(const unsigned char* p, unsigned __int64 n)
+{
+	unsigned int h = 2166136261u;
+	for (unsigned __int64 i = 0; i < n; i++)
+	{
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+CPointDatabase::CPointDatabase()
+{
+	m_generation = 0;
+	m_savedGeneration = 0;
+	m_bStale = true;
+	m_sequence = 0;
+	m_journalBase = 0;
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMap = NULL;
+	m_pView = NULL;
+	m_fileSize = 0;
+	m_snapshotTime = 0;
+	InitializeCriticalSection(&m_cs);
+}
+
+CPointDatabase::~CPointDatabase()
+{
+	close();
+	DeleteCriticalSection(&m_cs);
+}
+
+void CPointDatabase::update(const iec_obj* obj, int numpoints, __int64 rxtime)
+{
+	if (numpoints <= 0)
+		return;
+
+	EnterCriticalSection(&m_cs);
+	//a batch is mostly one station, the partition is only looked up when the CA changes
+	pdb_partition* pPart = &partition(obj[0].ca);
+	for (int i = 0; i < numpoints; i++)
+	{
+		if (obj[i].ca != pPart->ca)
+			pPart = &partition(obj[i].ca);
+		std::unordered_map<unsigned int, int>::iterator it = pPart->index.find(obj[i].address);
+		int n = (it == pPart->index.end()) ? add(obj[i].ca, obj[i].address, *pPart) : it->second;
+
+		pdb_point& p = m_Points[n];
+		unsigned char kept = p.value == obj[i].value ? (p.quality & PDB_QUALITY_SUSPECT) : 0;
+		p.type = obj[i].type;
+		p.value = obj[i].value;
+		p.quality = CHistorian::qualityOf(&obj[i]) | kept;
+		p.time = CHistorian::hasTimeTag(obj[i].type) ? CHistorian::timeFromCP56(obj[i].timetag) : rxtime;
+		journal(n);
+	}
+	m_generation++;
+	m_bStale = true;
+	LeaveCriticalSection(&m_cs);
+}
+
+CPointDatabase::pdb_partition& CPointDatabase::partition(unsigned short ca)
+{
+	int n = m_CATable.find(ca);
+	if (n < 0)
+	{
+		n = (int)m_Partitions.size();
+		m_Partitions.push_back(pdb_partition());
+		m_Partitions[n].ca = ca;
+		m_CATable.set(ca, n);
+	}
+	return m_Partitions[n];
+}
+
+int CPointDatabase::find(unsigned short ca, unsigned int address)
+{
+	int n = m_CATable.find(ca);
+	if (n < 0)
+		return -1;
+	std::unordered_map<unsigned int, int>::const_iterator it = m_Partitions[n].index.find(address);
+	return it == m_Partitions[n].index.end() ? -1 : it->second;
+}
+
+int CPointDatabase::add(unsigned short ca, unsigned int address, pdb_partition& part)
+{
+	int n = (int)m_Points.size();
+	part.index[address] = n;
+	pdb_point p;
+	memset(&p, 0, sizeof(p));
+	p.ca = ca;
+	p.address = address;
+	m_Points.push_back(p);
+	m_LastChange.push_back(0);
+	return n;
+}
+
+void CPointDatabase::journal(int n)
+{
+	if (m_Journal.empty())
+		m_Journal.resize(PDB_JOURNAL_SIZE);
+	m_sequence++;
+	m_Journal[(size_t)(m_sequence % PDB_JOURNAL_SIZE)] = n;
+	m_LastChange[n] = m_sequence;
+}
+
+unsigned __int64 CPointDatabase::changes(unsigned __int64 since, std::vector<pdb_point>& out, bool& bFull)
+{
+	out.clear();
+	EnterCriticalSection(&m_cs);
+	unsigned __int64 oldest = m_sequence > PDB_JOURNAL_SIZE ? m_sequence - PDB_JOURNAL_SIZE : 0;
+	bFull = since < oldest || since < m_journalBase || since > m_sequence;
+	if (bFull)
+		out.assign(m_Points.begin(), m_Points.end());
+	else
+	{
+		//a point changed several times is returned at its last change only
+		for (unsigned __int64 s = since + 1; s <= m_sequence; s++)
+		{
+			int n = m_Journal[(size_t)(s % PDB_JOURNAL_SIZE)];
+			if (m_LastChange[n] == s)
+				out.push_back(m_Points[n]);
+		}
+	}
+	unsigned __int64 next = m_sequence;
+	LeaveCriticalSection(&m_cs);
+	return next;
+}
+
+int CPointDatabase::flag(const std::vector< std::pair<unsigned short, unsigned int> >& points, unsigned char bits, bool bSet)
+{
+	int changed = 0;
+	EnterCriticalSection(&m_cs);
+	for (size_t i = 0; i < points.size(); i++)
+	{
+		int n = find(points[i].first, points[i].second);
+		if (n < 0)
+			continue;
+		unsigned char quality = bSet ? (m_Points[n].quality | bits) : (m_Points[n].quality & ~bits);
+		if (quality == m_Points[n].quality)
+			continue;
+		m_Points[n].quality = quality;
+		journal(n);
+		changed++;
+	}
+	if (changed > 0)
+	{
+		m_generation++;
+		m_bStale = true;
+	}
+	LeaveCriticalSection(&m_cs);
+	return changed;
+}
+
+unsigned __int64 CPointDatabase::sequence()
+{
+	EnterCriticalSection(&m_cs);
+	unsigned __int64 seq = m_sequence;
+	LeaveCriticalSection(&m_cs);
+	return seq;
+}
+
+void CPointDatabase::reindex()
+{
+	m_Partitions.clear();
+	m_CATable.clear();
+	pdb_partition* pPart = NULL;
+	for (size_t i = 0; i < m_Points.size(); i++)
+	{
+		if (pPart == NULL || m_Points[i].ca != pPart->ca)
+			pPart = &partition(m_Points[i].ca);
+		pPart->index[m_Points[i].address] = (int)i;
+	}
+}
+
+bool CPointDatabase::get(unsigned short ca, unsigned int address, pdb_point& point)
+{
+	bool bFound = false;
+	EnterCriticalSection(&m_cs);
+	int n = find(ca, address);
+	if (n >= 0)
+	{
+		point = m_Points[n];
+		bFound = true;
+	}
+	LeaveCriticalSection(&m_cs);
+	return bFound;
+}
+
+int CPointDatabase::count()
+{
+	EnterCriticalSection(&m_cs);
+	int n = (int)m_Points.size();
+	LeaveCriticalSection(&m_cs);
+	return n;
+}
+
+unsigned __int64 CPointDatabase::copy(std::vector<pdb_point>& out)
+{
+	EnterCriticalSection(&m_cs);
+	out.assign(m_Points.begin(), m_Points.end());
+	unsigned __int64 gen = m_generation;
+	LeaveCriticalSection(&m_cs);
+	return gen;
+}
+
+pdb_snapshot_ptr CPointDatabase::snapshot()
+{
+	if (!m_bStale)
+	{
+		pdb_snapshot_ptr pCut = m_Snapshot.get();
+		if (pCut)
+			return pCut;
+	}
+
+	EnterCriticalSection(&m_cs);
+	if (m_bStale || !m_Snapshot.get())
+	{
+		std::shared_ptr<pdb_snapshot> pNew(new pdb_snapshot);
+		pNew->generation = m_generation;
+		pNew->sequence = m_sequence;
+		pNew->points = m_Points;
+		m_Snapshot.publish(pNew);
+		m_bStale = false;
+	}
+	pdb_snapshot_ptr pCut = m_Snapshot.get();
+	LeaveCriticalSection(&m_cs);
+	return pCut;
+}
+
+unsigned __int64 CPointDatabase::generation()
+{
+	EnterCriticalSection(&m_cs);
+	unsigned __int64 gen = m_generation;
+	LeaveCriticalSection(&m_cs);
+	return gen;
+}
+
+bool CPointDatabase::mapFile(unsigned __int64 size)
+{
+	LARGE_INTEGER li;
+	li.QuadPart = (LONGLONG)size;
+	if (!SetFilePointerEx(m_hFile, li, NULL, FILE_BEGIN) || !SetEndOfFile(m_hFile))
+	{
+		TRACE(_T("CPointDatabase::mapFile, Failed to size snapshot file, Error:%u\n"), GetLastError());
+		return false;
+	}
+	m_hMap = CreateFileMapping(m_hFile, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+	if (m_hMap == NULL)
+	{
+		TRACE(_T("CPointDatabase::mapFile, Failed to map snapshot file, Error:%u\n"), GetLastError());
+		return false;
+	}
+	m_pView = static_cast<unsigned char*>(MapViewOfFile(m_hMap, FILE_MAP_WRITE, 0, 0, (SIZE_T)size));
+	if (m_pView == NULL)
+	{
+		CloseHandle(m_hMap);
+		m_hMap = NULL;
+		return false;
+	}
+	m_fileSize = size;
+	return true;
+}
+
+void CPointDatabase::unmapFile()
+{
+	if (m_pView != NULL)
+	{
+		UnmapViewOfFile(m_pView);
+		m_pView = NULL;
+	}
+	if (m_hMap != NULL)
+	{
+		CloseHandle(m_hMap);
+		m_hMap = NULL;
+	}
+	m_fileSize = 0;
+}
+
+bool CPointDatabase::validSlot(const unsigned char* base, unsigned __int64 size, const pdb_slot& slot)
+{
+	if (slot.count == 0 || slot.count > slot.capacity)
+		return false;
+	unsigned __int64 nbytes = (unsigned __int64)slot.count * sizeof(pdb_point);
+	if (slot.offset < sizeof(pdb_file_header) || slot.offset + nbytes > size)
+		return false;
+	return Fnv1a(base + slot.offset, nbytes) == slot.check;
+}
+
+int CPointDatabase::open(LPCTSTR lpszFile)
+{
+	close();
+
+	m_hFile = CreateFile(lpszFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+	{
+		TRACE(_T("CPointDatabase::open, Failed to open snapshot file, Error:%u\n"), GetLastError());
+		return -1;
+	}
+
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(m_hFile, &liSize))
+		liSize.QuadPart = 0;
+
+	//restore from the newest slot that checks out, the other one is the fallback
+	int nRestored = 0;
+	bool bValid = false;
+	if (liSize.QuadPart >= (LONGLONG)sizeof(pdb_file_header) && mapFile((unsigned __int64)liSize.QuadPart))
+	{
+		const pdb_file_header* pHdr = (const pdb_file_header*)m_pView;
+		if (pHdr->magic == PDB_MAGIC && pHdr->version == PDB_VERSION && pHdr->recordSize == sizeof(pdb_point) && pHdr->active < 2)
+		{
+			bValid = true;
+			const pdb_slot* pSlot = NULL;
+			if (validSlot(m_pView, m_fileSize, pHdr->slot[pHdr->active]))
+				pSlot = &pHdr->slot[pHdr->active];
+			else if (validSlot(m_pView, m_fileSize, pHdr->slot[1 - pHdr->active]))
+				pSlot = &pHdr->slot[1 - pHdr->active];
+
+			if (pSlot != NULL)
+			{
+				const pdb_point* pRec = (const pdb_point*)(m_pView + pSlot->offset);
+				EnterCriticalSection(&m_cs);
+				m_Points.assign(pRec, pRec + pSlot->count);
+				for (size_t i = 0; i < m_Points.size(); i++)
+					m_Points[i].quality |= PDB_QUALITY_NT; //until the outstation refreshes it
+				reindex();
+				//the restore is one change of everything, older cursors get a full copy
+				m_LastChange.assign(m_Points.size(), 0);
+				m_journalBase = ++m_sequence;
+				m_generation = m_savedGeneration = pSlot->generation;
+				m_bStale = true;
+				LeaveCriticalSection(&m_cs);
+				m_snapshotTime = pSlot->time;
+				nRestored = (int)pSlot->count;
+			}
+		}
+		else
+			unmapFile();
+	}
+
+	if (!bValid)
+	{
+		//new or foreign file, start over with two empty slots
+		unmapFile();
+		unsigned __int64 nSlot = (unsigned __int64)PDB_INITIAL_CAPACITY * sizeof(pdb_point);
+		if (!mapFile(sizeof(pdb_file_header) + 2 * nSlot))
+		{
+			close();
+			return -1;
+		}
+		pdb_file_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = PDB_MAGIC;
+		hdr.version = PDB_VERSION;
+		hdr.recordSize = sizeof(pdb_point);
+		for (int i = 0; i < 2; i++)
+		{
+			hdr.slot[i].offset = sizeof(pdb_file_header) + i * nSlot;
+			hdr.slot[i].capacity = PDB_INITIAL_CAPACITY;
+		}
+		memcpy(m_pView, &hdr, sizeof(hdr));
+		FlushViewOfFile(m_pView, sizeof(hdr));
+	}
+	return nRestored;
+}
+
+bool CPointDatabase::save()
+{
+	if (m_pView == NULL)
+		return false;
+
+	unsigned __int64 gen = copy(m_SaveBuffer);
+	if (gen == m_savedGeneration || m_SaveBuffer.empty())
+		return true;
+
+	pdb_file_header* pHdr = (pdb_file_header*)m_pView;
+	unsigned int j = 1 - pHdr->active;
+	pdb_slot slot = pHdr->slot[j];
+	unsigned int n = (unsigned int)m_SaveBuffer.size();
+	unsigned __int64 nbytes = (unsigned __int64)n * sizeof(pdb_point);
+
+	if (n > slot.capacity)
+	{
+		//the inactive slot moves to the end of the file, the active one stays where it is
+		slot.capacity = n * 2;
+		slot.offset = m_fileSize;
+		unmapFile();
+		if (!mapFile(slot.offset + (unsigned __int64)slot.capacity * sizeof(pdb_point)))
+			return false;
+		pHdr = (pdb_file_header*)m_pView;
+	}
+
+	memcpy(m_pView + slot.offset, &m_SaveBuffer[0], (size_t)nbytes);
+	slot.count = n;
+	slot.check = Fnv1a(m_pView + slot.offset, nbytes);
+	slot.generation = gen;
+	slot.time = CHistorian::now();
+	FlushViewOfFile(m_pView + slot.offset, (SIZE_T)nbytes);
+	FlushFileBuffers(m_hFile);
+
+	//the records are on disk, now switch the header over to them
+	pHdr->slot[j] = slot;
+	FlushViewOfFile(pHdr, sizeof(pdb_file_header));
+	FlushFileBuffers(m_hFile);
+	pHdr->active = j;
+	FlushViewOfFile(pHdr, sizeof(pdb_file_header));
+
+	m_savedGeneration = gen;
+	m_snapshotTime = slot.time;
+	return true;
+}
+
+void CPointDatabase::close()
+{
+	unmapFile();
+	if (m_hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+}
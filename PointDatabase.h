@@ -0,0 +1,133 @@
+#pragma once
+//
+// Point database: latest value, quality and time of every (ca, address) received over
+// IEC 104. Updates of one dataIndication batch are applied under one lock, so a snapshot
+// never splits a batch. Points are partitioned by station: the CA selects the partition
+// through a table indexed by CA, and only the partition's own index is searched.
+// Every point change gets a sequence number and goes to a bounded journal, so a reader that
+// keeps a cursor catches up with changes(), in time proportional to what changed.
+// Snapshots go to a memory-mapped file with two slots: the new cut is written to the
+// inactive slot and flushed before the header switches to it, so a crash during a save
+// leaves the previous snapshot intact.
+//
+#include "iec104_class.h"
+#include "Snapshot.h"
+#include "iec104_stations.h"
+#include <vector>
+#include <unordered_map>
+
+#define PDB_MAGIC 0x53424450          // "PDBS"
+#define PDB_VERSION 1
+#define PDB_QUALITY_NT 0x40           // not topical, same bit as the quality descriptor
+#define PDB_QUALITY_IV 0x80           // invalid
+#define PDB_QUALITY_SUSPECT 0x02      // bad data by the state estimator, a reserved bit of the descriptor
+#define PDB_JOURNAL_SIZE 65536        // point changes kept for changes()
+
+struct pdb_point
+{
+	unsigned short ca;
+	unsigned char type;
+	unsigned char quality;   // ov(bit0) suspect(bit1) bl(bit4) sb(bit5) nt(bit6) iv(bit7)
+	unsigned int address;
+	float value;
+	unsigned int reserved;
+	__int64 time;            // ms since 1970-01-01 UTC
+};
+
+// a consistent cut of the database, shared by every reader until something changes
+struct pdb_snapshot
+{
+	unsigned __int64 generation;
+	unsigned __int64 sequence;     // last change in the cut, a cursor for changes()
+	std::vector<pdb_point> points;
+};
+typedef CSnapshot<pdb_snapshot>::ptr pdb_snapshot_ptr;
+
+#pragma pack(push,1)
+struct pdb_slot
+{
+	unsigned __int64 offset;       // of the first record in the file
+	unsigned int capacity;         // records the slot can hold
+	unsigned int count;
+	unsigned int check;            // FNV-1a of the records
+	unsigned __int64 generation;
+	__int64 time;                  // when the cut was taken
+};
+
+struct pdb_file_header
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int recordSize;
+	unsigned int active;           // slot holding the newest complete snapshot
+	pdb_slot slot[2];
+};
+#pragma pack(pop)
+
+class CPointDatabase
+{
+public:
+	CPointDatabase();
+	~CPointDatabase();
+
+	// applies a dataIndication batch, objects without time tag get rxtime
+	void update(const iec_obj* obj, int numpoints, __int64 rxtime);
+	bool get(unsigned short ca, unsigned int address, pdb_point& point);
+	int count();
+	// copy of every point, consistent with respect to update(); returns the generation
+	unsigned __int64 copy(std::vector<pdb_point>& out);
+	// same cut without a copy per reader: rebuilt once after a change, then shared
+	pdb_snapshot_ptr snapshot();
+	// points changed after the cursor since, each once with its latest value; returns the cursor
+	// for the next call. If since is older than the journal every point is returned and bFull
+	// is set, so a reader that falls too far behind costs one full copy
+	unsigned __int64 changes(unsigned __int64 since, std::vector<pdb_point>& out, bool& bFull);
+	unsigned __int64 sequence();   // last change
+	// sets or clears bits the application keeps itself (PDB_QUALITY_SUSPECT) on existing points
+	// as one batch; they survive updates that repeat the value. Returns the points changed
+	int flag(const std::vector< std::pair<unsigned short, unsigned int> >& points, unsigned char bits, bool bSet);
+	unsigned __int64 generation();
+
+	// maps the snapshot file, creating it if needed, and restores the newest valid cut with
+	// nt set on every point; returns the number of points restored or -1 on error
+	int open(LPCTSTR lpszFile);
+	// writes a new cut if anything changed since the last one
+	bool save();
+	void close();
+	__int64 snapshotTime() const { return m_snapshotTime; }
+
+private:
+	bool mapFile(unsigned __int64 size);
+	void unmapFile();
+	static bool validSlot(const unsigned char* base, unsigned __int64 size, const pdb_slot& slot);
+	struct pdb_partition
+	{
+		unsigned short ca;
+		std::unordered_map<unsigned int, int> index;   // address -> m_Points
+	};
+	pdb_partition& partition(unsigned short ca);      // added if new
+	int find(unsigned short ca, unsigned int address);
+	int add(unsigned short ca, unsigned int address, pdb_partition& part);
+	void reindex();
+	void journal(int n);
+
+	std::vector<pdb_point> m_Points;
+	std::vector<pdb_partition> m_Partitions;
+	iec104_ca_table m_CATable;                       // ca -> m_Partitions
+	std::vector<int> m_Journal;                      // point of change s at s % PDB_JOURNAL_SIZE
+	std::vector<unsigned __int64> m_LastChange;      // per point, its latest change
+	unsigned __int64 m_sequence;
+	unsigned __int64 m_journalBase;                  // changes up to this one are not in the journal
+	unsigned __int64 m_generation;
+	unsigned __int64 m_savedGeneration;
+	CRITICAL_SECTION m_cs;
+	CSnapshot<pdb_snapshot> m_Snapshot;
+	volatile bool m_bStale;        // m_Snapshot is older than m_Points
+
+	HANDLE m_hFile;
+	HANDLE m_hMap;
+	unsigned char* m_pView;
+	unsigned __int64 m_fileSize;
+	__int64 m_snapshotTime;
+	std::vector<pdb_point> m_SaveBuffer;
+};
@@ -0,0 +1,115 @@
+#include "stdafx.h"
+#include "PowerBench.h"
+#include <string>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+static double seconds(const LARGE_INTEGER& from, const LARGE_INTEGER& to)
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return (double)(to.QuadPart - from.QuadPart) / (double)frequency.QuadPart;
+}
+
+void PowerFlowBenchmark(const CPowerModel& model, int runs, const pf_options& opt, pf_bench& result)
+{
+	CPowerFlow flow;
+	pf_result res;
+	LARGE_INTEGER t0, t1, t2, t3, t4;
+	QueryPerformanceCounter(&t0);
+	flow.setModel(model);
+	flow.prepare(opt.method);
+	QueryPerformanceCounter(&t1);
+	for (int r = 0; r < runs; r++)
+		flow.solve(res, opt);
+	QueryPerformanceCounter(&t2);
+
+	result.buses = (int)model.buses.size();
+	result.branches = (int)model.branches.size();
+	result.unknowns = flow.unknowns();
+	result.fill = flow.factorFill();
+	result.iterations = res.iterations;
+	result.converged = res.converged;
+	result.lossP = res.lossP;
+
+	//telemetry cycles: loads and the generation following them move a little, and the solve
+	//starts from the last solution
+	pf_options refresh(opt);
+	refresh.warmStart = true;
+	std::vector<pf_bus> buses(model.buses);
+	result.refreshIterations = 0;
+	QueryPerformanceCounter(&t3);
+	for (int r = 0; r < runs; r++)
+	{
+		double scale = (r & 1) ? 1.0 / 1.01 : 1.01;
+		for (size_t k = 0; k < buses.size(); k++)
+		{
+			buses[k].pd *= scale;
+			buses[k].qd *= scale;
+			buses[k].pg *= scale;
+		}
+		flow.setInjections(buses);
+		flow.solve(res, refresh);
+		result.refreshIterations += res.iterations;
+		result.converged = result.converged && res.converged;
+	}
+	QueryPerformanceCounter(&t4);
+
+	result.setupSeconds = seconds(t0, t1);
+	result.solveSeconds = runs > 0 ? seconds(t1, t2) / runs : 0;
+	result.refreshSeconds = runs > 0 ? seconds(t3, t4) / runs : 0;
+	result.refreshIterations = runs > 0 ? result.refreshIterations / runs : 0;
+}
+
+//the separator only where the directory does not end in one; Windows takes '/' as well
+static std::string join(const std::string& directory, const char* name)
+{
+	if (directory.empty())
+		return name;
+	char last = directory[directory.size() - 1];
+	return (last == '/' || last == '\\') ? directory + name : directory + "/" + name;
+}
+
+static void report(const char* name, int method, const pf_bench& b)
+{
+	static const TCHAR* methods[] = { _T("Newton"), _T("FDXB"), _T("FDBX") };
+	TRACE(_T("PowerFlowBenchmarks, %S %s: %d buses, %d branches, %d unknowns, LU fill %d, %s in %d iterations, ")
+		_T("setup %.2f ms, solve %.2f ms, refresh %.2f ms in %d iterations, losses %.3f MW\n"),
+		name, methods[method], b.buses, b.branches, b.unknowns, b.fill, b.converged ? _T("converged") : _T("NOT converged"),
+		b.iterations, b.setupSeconds * 1000, b.solveSeconds * 1000, b.refreshSeconds * 1000, b.refreshIterations, b.lossP);
+}
+
+void PowerFlowBenchmarks(const char* caseDirectory)
+{
+	pf_options opt;
+	pf_bench b;
+
+	std::string dir(caseDirectory);
+	std::vector<StationStruct> stations;
+	std::vector<BranchStruct> lines;
+	if (CPowerModel::readCsv(join(dir, "case14_bus.csv").c_str(), join(dir, "case14_branch.csv").c_str(), stations, lines))
+	{
+		CPowerModel ieee14;
+		ieee14.fromDocument(stations, lines);
+		opt.flatStart = true;
+		for (opt.method = PF_NEWTON; opt.method <= PF_FDBX; opt.method++)
+		{
+			PowerFlowBenchmark(ieee14, 100, opt, b);
+			report("case14", opt.method, b);
+		}
+	}
+
+	static const int sizes[] = { 1000, 10000 };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		CPowerModel grid;
+		grid.synthetic(sizes[s], 1);
+		for (opt.method = PF_NEWTON; opt.method <= PF_FDBX; opt.method++)
+		{
+			PowerFlowBenchmark(grid, 10, opt, b);
+			report(sizes[s] == 1000 ? "synthetic 1000" : "synthetic 10000", opt.method, b);
+		}
+	}
+}
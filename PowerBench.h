@@ -0,0 +1,27 @@
+#pragma once
+//
+// Timing of the power flow solvers on a model: cases/case14_*.csv for correctness against the
+// published IEEE 14 bus solution, CPowerModel::synthetic() for the 1,000 and 10,000 bus sizes
+// the real-time display has to keep up with, each solved with Newton and both fast decoupled
+// variants. Results go to the debug output; OSMCtrlApp /benchmark runs them.
+//
+#include "PowerFlow.h"
+
+struct pf_bench
+{
+	int buses;
+	int branches;
+	int unknowns;
+	int fill;               // nonzeros of the LU factors
+	int iterations;
+	bool converged;
+	double setupSeconds;    // CPowerFlow::setModel, and prepare for the decoupled methods
+	double solveSeconds;    // mean of one solve from the model's voltages
+	double refreshSeconds;  // mean of one solve after a 1% load and generation change, from the last solution
+	int refreshIterations;
+	double lossP;           // MW
+};
+
+void PowerFlowBenchmark(const CPowerModel& model, int runs, const pf_options& opt, pf_bench& result);
+// the IEEE 14 bus case from the case files and synthetic 1,000 and 10,000 bus grids, by method
+void PowerFlowBenchmarks(const char* caseDirectory);
@@ -0,0 +1,504 @@
+#include "stdafx.h"
+#include "PowerFlow.h"
+#include <math.h>
+#include <algorithm>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+static const double PI = 3.14159265358979323846;
+
+CPowerFlow::CPowerFlow()
+{
+	m_nVars = 0;
+	m_bPivots = false;
+	m_nP = m_nQ = 0;
+	m_fdMethod = -1;
+}
+
+//position of (row, col) in a compressed column matrix, -1 if it is not in the pattern
+static int position(const sp_matrix& A, int row, int col)
+{
+	if (row < 0 || col < 0)
+		return -1;
+	std::vector<int>::const_iterator first = A.i.begin() + A.p[col], last = A.i.begin() + A.p[col + 1];
+	std::vector<int>::const_iterator it = std::lower_bound(first, last, row);
+	return (it != last && *it == row) ? (int)(it - A.i.begin()) : -1;
+}
+
+void CPowerFlow::setModel(const CPowerModel& model)
+{
+	m_Model = model;
+	m_Model.makeYbus(m_Y, true);
+	int n = m_Y.n;
+	int nbr = (int)m_Model.branches.size();
+	m_Adjp.assign(n + 1, 0);
+	for (int l = 0; l < nbr; l++)
+	{
+		m_Adjp[m_Model.branches[l].from + 1]++;
+		m_Adjp[m_Model.branches[l].to + 1]++;
+	}
+	for (int k = 0; k < n; k++)
+		m_Adjp[k + 1] += m_Adjp[k];
+	m_Adjl.resize(m_Adjp[n]);
+	std::vector<int> next(m_Adjp.begin(), m_Adjp.end() - 1);
+	for (int l = 0; l < nbr; l++)
+	{
+		m_Adjl[next[m_Model.branches[l].from]++] = l;
+		m_Adjl[next[m_Model.branches[l].to]++] = l;
+	}
+	m_mark.assign(n, 0);
+
+	//buses that reach a slack bus through branches in service
+	m_active.assign(n, 0);
+	std::vector<int> queue;
+	for (int k = 0; k < n; k++)
+		if (m_Model.buses[k].type == PF_SLACK)
+		{
+			m_active[k] = 1;
+			queue.push_back(k);
+		}
+	for (size_t head = 0; head < queue.size(); head++)
+	{
+		int k = queue[head];
+		for (int p = m_Y.p[k]; p < m_Y.p[k + 1]; p++)
+			if (!m_active[m_Y.j[p]] && (m_Y.g[p] != 0 || m_Y.b[p] != 0))
+			{
+				m_active[m_Y.j[p]] = 1;
+				queue.push_back(m_Y.j[p]);
+			}
+	}
+
+	//number the unknowns bus by bus in minimum degree order
+	std::vector< std::vector<int> > adj(n);
+	for (int k = 0; k < n; k++)
+		for (int p = m_Y.p[k]; p < m_Y.p[k + 1]; p++)
+			if (m_Y.j[p] != k)
+				adj[k].push_back(m_Y.j[p]);
+	std::vector<int> order;
+	CSparseOrdering::minimumDegree(adj, order);
+	m_thVar.assign(n, -1);
+	m_vVar.assign(n, -1);
+	m_pIdx.assign(n, -1);
+	m_qIdx.assign(n, -1);
+	m_nVars = m_nP = m_nQ = 0;
+	for (int t = 0; t < n; t++)
+	{
+		int k = order[t];
+		if (!m_active[k])
+			continue;
+		int type = m_Model.buses[k].type;
+		if (type != PF_SLACK)
+		{
+			m_thVar[k] = m_nVars++;
+			m_pIdx[k] = m_nP++;
+		}
+		if (type == PF_PQ)
+		{
+			m_vVar[k] = m_nVars++;
+			m_qIdx[k] = m_nQ++;
+		}
+	}
+
+	//the P equation of a bus goes with its angle, the Q equation with its magnitude
+	CSparseBuilder J(m_nVars, m_nVars);
+	for (int i = 0; i < n; i++)
+	{
+		if (m_thVar[i] < 0 && m_vVar[i] < 0)
+			continue;
+		for (int p = m_Y.p[i]; p < m_Y.p[i + 1]; p++)
+		{
+			int j = m_Y.j[p];
+			int eqs[2] = { m_thVar[i], m_vVar[i] }, vars[2] = { m_thVar[j], m_vVar[j] };
+			for (int e = 0; e < 2; e++)
+				for (int v = 0; v < 2; v++)
+					if (eqs[e] >= 0 && vars[v] >= 0)
+						J.add(eqs[e], vars[v], 0);
+		}
+	}
+	J.compress(m_J);
+	size_t nz = m_Y.j.size();
+	m_pPth.resize(nz);
+	m_pPv.resize(nz);
+	m_pQth.resize(nz);
+	m_pQv.resize(nz);
+	for (int i = 0; i < n; i++)
+		for (int p = m_Y.p[i]; p < m_Y.p[i + 1]; p++)
+		{
+			int j = m_Y.j[p];
+			m_pPth[p] = position(m_J, m_thVar[i], m_thVar[j]);
+			m_pPv[p] = position(m_J, m_thVar[i], m_vVar[j]);
+			m_pQth[p] = position(m_J, m_vVar[i], m_thVar[j]);
+			m_pQv[p] = position(m_J, m_vVar[i], m_vVar[j]);
+		}
+	m_bPivots = false;
+	m_fdMethod = -1;
+	m_vm.clear();
+	m_va.clear();
+	schedule();
+}
+
+//-imag(Y) of a model over the buses that have a row in idx
+static void susceptance(const CPowerModel& model, const std::vector<int>& idx, int n, sp_matrix& B)
+{
+	pf_ybus Y;
+	model.makeYbus(Y);
+	CSparseBuilder builder(n, n);
+	for (int i = 0; i < Y.n; i++)
+	{
+		if (idx[i] < 0)
+			continue;
+		for (int p = Y.p[i]; p < Y.p[i + 1]; p++)
+			if (idx[Y.j[p]] >= 0)
+				builder.add(idx[i], idx[Y.j[p]], -Y.b[p]);
+	}
+	builder.compress(B);
+}
+
+void CPowerFlow::prepare(int method)
+{
+	if (method == m_fdMethod || (method != PF_FDXB && method != PF_FDBX))
+		return;
+
+	//B': no shunts, no line charging, nominal taps, and no resistance for XB
+	CPowerModel model(m_Model);
+	for (size_t k = 0; k < model.buses.size(); k++)
+		model.buses[k].bs = 0;
+	for (size_t l = 0; l < model.branches.size(); l++)
+	{
+		pf_branch& br = model.branches[l];
+		br.b = 0;
+		br.ratio = 1;
+		if (method == PF_FDXB)
+			br.r = 0;
+	}
+	sp_matrix Bp, Bpp;
+	susceptance(model, m_pIdx, m_nP, Bp);
+
+	//B'': the network without phase shifts, and no resistance for BX
+	model = m_Model;
+	for (size_t l = 0; l < model.branches.size(); l++)
+	{
+		pf_branch& br = model.branches[l];
+		br.angle = 0;
+		if (method == PF_FDBX)
+			br.r = 0;
+	}
+	susceptance(model, m_qIdx, m_nQ, Bpp);
+
+	//both are numbered in the minimum degree order already
+	std::vector<int> q;
+	m_fdMethod = -1;
+	if ((m_nP > 0 && !m_LUp.factor(Bp, q)) || (m_nQ > 0 && !m_LUpp.factor(Bpp, q)))
+	{
+		TRACE(_T("CPowerFlow::prepare, Singular B' or B''\n"));
+		return;
+	}
+	m_fdMethod = method;
+}
+
+void CPowerFlow::setInjections(const std::vector<pf_bus>& buses)
+{
+	for (size_t k = 0; k < buses.size() && k < m_Model.buses.size(); k++)
+	{
+		pf_bus& b = m_Model.buses[k];
+		b.pd = buses[k].pd;
+		b.qd = buses[k].qd;
+		b.pg = buses[k].pg;
+		b.qg = buses[k].qg;
+		b.vm = buses[k].vm;
+	}
+	schedule();
+}
+
+bool CPowerFlow::setBranch(int branch, bool bInService)
+{
+	pf_branch& br = m_Model.branches[branch];
+	if (br.status == bInService)
+		return true;
+	br.status = bInService;
+	//energizing a dead part or opening the last way to one changes the unknowns
+	if (m_active[br.from] != m_active[br.to] || (!bInService && m_active[br.from] && !joined(br.from, br.to)))
+	{
+		CPowerModel model(m_Model);
+		setModel(model);
+		return false;
+	}
+	m_Model.stampBranch(m_Y, branch, bInService ? 1 : -1);
+	m_fdMethod = -1;   //B' and B'' hold the branch as it was
+	return true;
+}
+
+bool CPowerFlow::joined(int a, int b)
+{
+	std::vector<int> queue(1, a);
+	m_mark[a] = 1;
+	for (size_t head = 0; head < queue.size() && !m_mark[b]; head++)
+		for (int p = m_Adjp[queue[head]]; p < m_Adjp[queue[head] + 1]; p++)
+		{
+			const pf_branch& br = m_Model.branches[m_Adjl[p]];
+			int k = br.from == queue[head] ? br.to : br.from;
+			if (br.status && !m_mark[k])
+			{
+				m_mark[k] = 1;
+				queue.push_back(k);
+			}
+		}
+	bool bJoined = m_mark[b] != 0;
+	for (size_t i = 0; i < queue.size(); i++)
+		m_mark[queue[i]] = 0;
+	return bJoined;
+}
+
+void CPowerFlow::setStart(const std::vector<double>& vm, const std::vector<double>& va)
+{
+	m_vm = vm;
+	m_va.resize(va.size());
+	for (size_t k = 0; k < va.size(); k++)
+		m_va[k] = va[k] * PI / 180;
+}
+
+void CPowerFlow::schedule()
+{
+	size_t n = m_Model.buses.size();
+	m_Psch.resize(n);
+	m_Qsch.resize(n);
+	for (size_t k = 0; k < n; k++)
+	{
+		const pf_bus& b = m_Model.buses[k];
+		m_Psch[k] = (b.pg - b.pd) / m_Model.baseMVA;
+		m_Qsch[k] = (b.qg - b.qd) / m_Model.baseMVA;
+	}
+}
+
+double CPowerFlow::evaluate(const std::vector<double>& vm, const std::vector<double>& va, std::vector<double>& F, bool bJacobian)
+{
+	double worst = 0;
+	double* Jx = m_J.x.empty() ? NULL : &m_J.x[0];
+	for (int i = 0; i < m_Y.n; i++)
+	{
+		if (m_thVar[i] < 0 && m_vVar[i] < 0)
+			continue;
+		double vi = vm[i], P = 0, Q = 0;
+		for (int p = m_Y.p[i]; p < m_Y.p[i + 1]; p++)
+		{
+			int j = m_Y.j[p];
+			double G = m_Y.g[p], B = m_Y.b[p];
+			double c = 1, s = 0;
+			if (j != i)
+			{
+				double th = va[i] - va[j];
+				c = cos(th);
+				s = sin(th);
+			}
+			double a = G * c + B * s, b = G * s - B * c;
+			double vj = vm[j];
+			P += vi * vj * a;
+			Q += vi * vj * b;
+			if (bJacobian && j != i)
+			{
+				if (m_pPth[p] >= 0) Jx[m_pPth[p]] = vi * vj * b;
+				if (m_pPv[p] >= 0) Jx[m_pPv[p]] = vi * a;
+				if (m_pQth[p] >= 0) Jx[m_pQth[p]] = -vi * vj * a;
+				if (m_pQv[p] >= 0) Jx[m_pQv[p]] = vi * b;
+			}
+		}
+		if (bJacobian)
+		{
+			int d = m_Y.diag[i];
+			double G = m_Y.g[d], B = m_Y.b[d];
+			if (m_pPth[d] >= 0) Jx[m_pPth[d]] = -Q - B * vi * vi;
+			if (m_pPv[d] >= 0) Jx[m_pPv[d]] = P / vi + G * vi;
+			if (m_pQth[d] >= 0) Jx[m_pQth[d]] = P - G * vi * vi;
+			if (m_pQv[d] >= 0) Jx[m_pQv[d]] = Q / vi - B * vi;
+		}
+		if (m_thVar[i] >= 0)
+		{
+			double f = m_Psch[i] - P;
+			F[m_thVar[i]] = f;
+			worst = std::max(worst, fabs(f));
+		}
+		if (m_vVar[i] >= 0)
+		{
+			double f = m_Qsch[i] - Q;
+			F[m_vVar[i]] = f;
+			worst = std::max(worst, fabs(f));
+		}
+	}
+	return worst;
+}
+
+bool CPowerFlow::newton(std::vector<double>& vm, std::vector<double>& va, const pf_options& opt, int& iterations, double& mismatch)
+{
+	std::vector<double> F(m_nVars), dx(m_nVars);
+	for (iterations = 0;; iterations++)
+	{
+		mismatch = evaluate(vm, va, F, iterations < opt.maxIterations);
+		if (mismatch < opt.tolerance)
+			return true;
+		if (iterations >= opt.maxIterations || !(mismatch < 1e10))
+			return false;
+
+		bool bOk = m_bPivots && m_LU.refactor(m_J);
+		if (!bOk)
+		{
+			m_bPivots = m_LU.factor(m_J, std::vector<int>());
+			if (!m_bPivots)
+			{
+				TRACE(_T("CPowerFlow::newton, Singular Jacobian at iteration %d\n"), iterations);
+				return false;
+			}
+		}
+		m_LU.solve(F, dx);
+		for (int i = 0; i < m_Y.n; i++)
+		{
+			if (m_thVar[i] >= 0)
+				va[i] += dx[m_thVar[i]];
+			if (m_vVar[i] >= 0)
+				vm[i] += dx[m_vVar[i]];
+		}
+	}
+}
+
+bool CPowerFlow::decoupled(std::vector<double>& vm, std::vector<double>& va, const pf_options& opt, int& iterations, double& mismatch)
+{
+	prepare(opt.method);
+	if (m_fdMethod != opt.method)
+		return false;
+	std::vector<double> F(m_nVars), dp(m_nP), dq(m_nQ);
+	mismatch = evaluate(vm, va, F, false);
+	for (iterations = 0; iterations < 2 * opt.maxIterations; iterations++)
+	{
+		if (mismatch < opt.tolerance)
+			return true;
+		if (!(mismatch < 1e10))
+			return false;
+
+		//angles from the P mismatches
+		for (int i = 0; i < m_Y.n; i++)
+			if (m_pIdx[i] >= 0)
+				dp[m_pIdx[i]] = F[m_thVar[i]] / vm[i];
+		m_LUp.solve(dp, dp);
+		for (int i = 0; i < m_Y.n; i++)
+			if (m_pIdx[i] >= 0)
+				va[i] += dp[m_pIdx[i]];
+		mismatch = evaluate(vm, va, F, false);
+		if (mismatch < opt.tolerance || m_nQ == 0)
+			continue;
+
+		//magnitudes from the Q mismatches
+		for (int i = 0; i < m_Y.n; i++)
+			if (m_qIdx[i] >= 0)
+				dq[m_qIdx[i]] = F[m_vVar[i]] / vm[i];
+		m_LUpp.solve(dq, dq);
+		for (int i = 0; i < m_Y.n; i++)
+			if (m_qIdx[i] >= 0)
+				vm[i] += dq[m_qIdx[i]];
+		mismatch = evaluate(vm, va, F, false);
+	}
+	return mismatch < opt.tolerance;
+}
+
+bool CPowerFlow::solve(pf_result& res, const pf_options& opt)
+{
+	int n = m_Y.n;
+	std::vector<double> vm(n), va(n);
+	bool bWarm = opt.warmStart && (int)m_vm.size() == n;
+	for (int k = 0; k < n; k++)
+	{
+		const pf_bus& b = m_Model.buses[k];
+		bool bHeld = b.type != PF_PQ;
+		if (bWarm)
+		{ //setpoints may have moved since
+			vm[k] = bHeld ? b.vm : m_vm[k];
+			va[k] = b.type == PF_SLACK ? b.va * PI / 180 : m_va[k];
+		}
+		else
+		{
+			vm[k] = (opt.flatStart && !bHeld) ? 1.0 : b.vm;
+			va[k] = (opt.flatStart && b.type != PF_SLACK) ? 0.0 : b.va * PI / 180;
+		}
+		if (!m_active[k])
+			vm[k] = va[k] = 0;
+	}
+
+	res.method = opt.method;
+	if (opt.method == PF_FDXB || opt.method == PF_FDBX)
+	{
+		std::vector<double> vm0(vm), va0(va);
+		res.converged = decoupled(vm, va, opt, res.iterations, res.mismatch);
+		if (!res.converged)
+		{
+			TRACE(_T("CPowerFlow::solve, Fast decoupled did not converge, mismatch %g pu, trying Newton\n"), res.mismatch);
+			vm.swap(vm0);
+			va.swap(va0);
+			res.method = PF_NEWTON;
+		}
+	}
+	if (res.method == PF_NEWTON)
+		res.converged = newton(vm, va, opt, res.iterations, res.mismatch);
+
+	if (res.converged)
+	{
+		m_vm = vm;
+		m_va = va;
+	}
+	finish(vm, va, res);
+	return res.converged;
+}
+
+void CPowerFlow::finish(const std::vector<double>& vm, const std::vector<double>& va, pf_result& res) const
+{
+	int n = m_Y.n;
+	double base = m_Model.baseMVA;
+	std::vector< std::complex<double> > V(n);
+	res.vm = vm;
+	res.va.resize(n);
+	for (int k = 0; k < n; k++)
+	{
+		res.va[k] = va[k] * 180 / PI;
+		V[k] = std::polar(vm[k], va[k]);
+	}
+
+	//generation is what the network takes out of a bus plus its load
+	res.pg.resize(n);
+	res.qg.resize(n);
+	for (int i = 0; i < n; i++)
+	{
+		const pf_bus& b = m_Model.buses[i];
+		res.pg[i] = b.pg;
+		res.qg[i] = b.qg;
+		if (!m_active[i] || b.type == PF_PQ)
+			continue;
+		std::complex<double> I = 0;
+		for (int p = m_Y.p[i]; p < m_Y.p[i + 1]; p++)
+			I += std::complex<double>(m_Y.g[p], m_Y.b[p]) * V[m_Y.j[p]];
+		std::complex<double> S = V[i] * std::conj(I) * base;
+		if (b.type == PF_SLACK)
+			res.pg[i] = S.real() + b.pd;
+		res.qg[i] = S.imag() + b.qd;
+	}
+
+	res.flows.resize(m_Model.branches.size());
+	res.lossP = res.lossQ = 0;
+	for (size_t l = 0; l < m_Model.branches.size(); l++)
+	{
+		const pf_branch& br = m_Model.branches[l];
+		pf_flow& f = res.flows[l];
+		f.pf = f.qf = f.pt = f.qt = 0;
+		if (!br.status || !m_active[br.from])
+			continue;
+		std::complex<double> yff, yft, ytf, ytt;
+		CPowerModel::branchAdmittance(br, yff, yft, ytf, ytt);
+		std::complex<double> Vf = V[br.from], Vt = V[br.to];
+		std::complex<double> Sf = Vf * std::conj(yff * Vf + yft * Vt) * base;
+		std::complex<double> St = Vt * std::conj(ytf * Vf + ytt * Vt) * base;
+		f.pf = Sf.real();
+		f.qf = Sf.imag();
+		f.pt = St.real();
+		f.qt = St.imag();
+		res.lossP += f.pf + f.pt;
+		res.lossQ += f.qf + f.qt;
+	}
+}
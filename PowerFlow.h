@@ -0,0 +1,115 @@
+#pragma once
+//
+// AC power flow on a CPowerModel. Newton-Raphson in polar coordinates: the unknowns are the
+// angles of all buses but the slack and the magnitudes of the PQ buses, the Jacobian is kept
+// sparse with its pattern and the position of every term worked out once in setModel(), and
+// the unknowns are numbered in minimum degree order of the bus graph so the LU factors stay
+// close to the Jacobian's own size. The first iteration finds the pivots, the others only
+// redo the numbers. Buses that are not connected to a slack bus are left out of the solve.
+//
+// The fast decoupled methods (Stott and Alsac, in the XB and BX variants of van Amerongen)
+// solve the angles with B' and the magnitudes with B'', two constant matrices that are
+// factorized once per topology, so an iteration is an injection evaluation and two forward
+// and back substitutions. They take more iterations than Newton but each is far cheaper,
+// which suits a display that re-solves every telemetry cycle from the last solution. When
+// they do not converge the solve starts again with Newton.
+//
+// Ybus keeps a place for every branch, in service or not, so a branch switched without
+// changing which buses reach a slack is a change of its admittances in place: the ordering,
+// the Jacobian pattern and the pivots stay, which is what a contingency solve needs.
+//
+#include "PowerModel.h"
+#include "SparseMatrix.h"
+
+#define PF_NEWTON	0
+#define PF_FDXB		1   // fast decoupled, resistance left out of B'
+#define PF_FDBX		2   // fast decoupled, resistance left out of B''
+
+struct pf_options
+{
+	int method;          // PF_NEWTON, PF_FDXB or PF_FDBX
+	int maxIterations;   // Newton iterations; the decoupled methods are allowed twice as many
+	double tolerance;    // largest P or Q mismatch, pu
+	bool flatStart;      // 1 pu and 0 degrees instead of the model's voltages
+	bool warmStart;      // from the last converged solution, if the topology has not changed since
+
+	pf_options() : method(PF_NEWTON), maxIterations(20), tolerance(1e-8), flatStart(false), warmStart(false) {}
+};
+
+// MW / MVAr flowing into the branch at its from and to ends
+struct pf_flow
+{
+	double pf, qf;
+	double pt, qt;
+};
+
+struct pf_result
+{
+	bool converged;
+	int method;                   // the method that gave the result, PF_NEWTON after a fallback
+	int iterations;
+	double mismatch;              // pu
+	std::vector<double> vm, va;   // pu / degrees, 0 on buses without a slack
+	std::vector<double> pg, qg;   // generation after the solve, MW / MVAr
+	std::vector<pf_flow> flows;   // per model branch, 0 when out of service
+	double lossP, lossQ;          // MW / MVAr
+
+	pf_result() : converged(false), method(PF_NEWTON), iterations(0), mismatch(0), lossP(0), lossQ(0) {}
+};
+
+class CPowerFlow
+{
+public:
+	CPowerFlow();
+
+	// copies the model and prepares the admittance matrix, the ordering and the Jacobian
+	// pattern; needed again whenever the topology or an impedance changes, not for new
+	// loads or setpoints (setInjections)
+	void setModel(const CPowerModel& model);
+	// new bus loads and generation without touching the network
+	void setInjections(const std::vector<pf_bus>& buses);
+	// the branch in or out of service; false when that changes which buses reach a slack, in
+	// which case setModel() has been done again
+	bool setBranch(int branch, bool bInService);
+	// the solution the next warm start begins from, pu / degrees
+	void setStart(const std::vector<double>& vm, const std::vector<double>& va);
+	const CPowerModel& model() const { return m_Model; }
+	int unknowns() const { return m_nVars; }
+	int factorFill() const { return m_LU.fill(); }
+	// factorizes B' and B'' for PF_FDXB or PF_FDBX now rather than in the first solve
+	void prepare(int method);
+
+	bool solve(pf_result& res, const pf_options& opt = pf_options());
+
+private:
+	void schedule();
+	bool joined(int a, int b);   // a path of branches in service between the buses
+	// mismatches of the scheduled injections at vm/va (radians) into F, and the Jacobian
+	// into m_J when bJacobian; returns the largest mismatch
+	double evaluate(const std::vector<double>& vm, const std::vector<double>& va, std::vector<double>& F, bool bJacobian);
+	bool newton(std::vector<double>& vm, std::vector<double>& va, const pf_options& opt, int& iterations, double& mismatch);
+	bool decoupled(std::vector<double>& vm, std::vector<double>& va, const pf_options& opt, int& iterations, double& mismatch);
+	void finish(const std::vector<double>& vm, const std::vector<double>& va, pf_result& res) const;
+
+	CPowerModel m_Model;
+	pf_ybus m_Y;
+	std::vector<char> m_active;             // bus reaches a slack bus
+	std::vector<int> m_Adjp, m_Adjl;        // branches of bus k at m_Adjl[m_Adjp[k] .. m_Adjp[k+1])
+	std::vector<char> m_mark;               // joined()'s, zero between calls
+	std::vector<double> m_Psch, m_Qsch;     // pu
+	std::vector<int> m_thVar, m_vVar;       // unknown of a bus's angle and magnitude, -1 if held
+	int m_nVars;
+
+	sp_matrix m_J;
+	std::vector<int> m_pPth, m_pPv;         // per entry of Y: where dP(i)/dth(j), dP(i)/dV(j) go in m_J
+	std::vector<int> m_pQth, m_pQv;
+	CSparseLU m_LU;
+	bool m_bPivots;                         // m_LU holds pivots for this pattern
+
+	std::vector<int> m_pIdx, m_qIdx;        // row of a bus in B' and B'', -1 if held
+	int m_nP, m_nQ;
+	int m_fdMethod;                         // variant m_LUp and m_LUpp were built for, -1 for none
+	CSparseLU m_LUp, m_LUpp;
+
+	std::vector<double> m_vm, m_va;         // last converged solution, radians
+};
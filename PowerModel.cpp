@@ -0,0 +1,474 @@
+#include "stdafx.h"
+#include "PowerModel.h"
+#include "SparseMatrix.h"
+#include <math.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+static const double PI = 3.14159265358979323846;
+
+bool csvRows(const char* file, std::vector< std::vector<std::string> >& rows)
+{
+	std::ifstream in(file);
+	if (!in)
+		return false;
+	std::string line, field;
+	std::vector<std::string> v;
+	while (std::getline(in, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		v.clear();
+		std::stringstream ss(line);
+		while (std::getline(ss, field, ','))
+			v.push_back(field);
+		rows.push_back(v);
+	}
+	return !rows.empty();
+}
+
+int csvColumn(const std::vector<std::string>& header, const char* name, int legacy)
+{
+	for (size_t c = 0; c < header.size(); c++)
+	{
+		const std::string& h = header[c];
+		size_t k = 0;
+		while (k < h.size() && name[k] && tolower((unsigned char)h[k]) == tolower((unsigned char)name[k]))
+			k++;
+		if (k == h.size() && name[k] == 0)
+			return (int)c;
+	}
+	return legacy;
+}
+
+double csvValue(const std::vector<std::string>& row, int col, double def)
+{
+	if (col < 0 || col >= (int)row.size() || row[col].empty())
+		return def;
+	return atof(row[col].c_str());
+}
+
+CPowerModel::CPowerModel()
+{
+	baseMVA = 100;
+}
+
+bool CPowerModel::readCsv(const char* busFile, const char* branchFile, std::vector<StationStruct>& stations, std::vector<BranchStruct>& lines)
+{
+	std::vector< std::vector<std::string> > busRows, branchRows;
+	if (!csvRows(busFile, busRows) || !csvRows(branchFile, branchRows))
+	{
+		TRACE(_T("CPowerModel::readCsv, Failed to read the bus or branch file\n"));
+		return false;
+	}
+
+	const std::vector<std::string>& bh = busRows[0];
+	int cName = csvColumn(bh, "name", 0), cLon = csvColumn(bh, "Longitude", 1), cLat = csvColumn(bh, "Latitude", 2);
+	int cBus = csvColumn(bh, "bus_i", 3), cPdMax = csvColumn(bh, "pd_max", 4), cGrade = csvColumn(bh, "voltagegra", 5);
+	int cFather = csvColumn(bh, "father", 6);
+	int cType = csvColumn(bh, "type"), cPd = csvColumn(bh, "pd"), cQd = csvColumn(bh, "qd"), cGs = csvColumn(bh, "gs"), cBs = csvColumn(bh, "bs");
+	int cPg = csvColumn(bh, "pg"), cQg = csvColumn(bh, "qg"), cVm = csvColumn(bh, "vm"), cVa = csvColumn(bh, "va");
+	int cLoad[24];
+	for (int h = 0; h < 24; h++)
+	{
+		char name[8];
+		sprintf_s(name, "load%d", h);
+		cLoad[h] = csvColumn(bh, name);
+	}
+
+	size_t first = stations.size();
+	StationStruct station;
+	memset(station.load, 0, sizeof(station.load));
+	for (size_t i = 1; i < busRows.size(); i++)
+	{
+		const std::vector<std::string>& v = busRows[i];
+		if (v.empty())
+			continue;
+		station.busName = cName < (int)v.size() ? v[cName].c_str() : "";
+		station.longitude = csvValue(v, cLon, 0);
+		station.latitude = csvValue(v, cLat, 0);
+		station.bus_i = csvValue(v, cBus, 0);
+		station.pd_max = csvValue(v, cPdMax, 0);
+		station.volGrade = csvValue(v, cGrade, 0);
+		station.father = csvValue(v, cFather, station.bus_i);
+		station.type = (int)csvValue(v, cType, 0);
+		station.pd = csvValue(v, cPd, station.pd_max > 0 ? station.pd_max : 0);
+		station.qd = csvValue(v, cQd, 0);
+		station.gs = csvValue(v, cGs, 0);
+		station.bs = csvValue(v, cBs, 0);
+		station.pg = csvValue(v, cPg, 0);
+		station.qg = csvValue(v, cQg, 0);
+		station.vm = csvValue(v, cVm, 1.0);
+		station.va = csvValue(v, cVa, 0);
+		for (int h = 0; h < 24; h++)
+			station.load[h] = csvValue(v, cLoad[h], 0);
+		stations.push_back(station);
+	}
+
+	//bus_i -> station, then each station's father
+	std::map<double, int> index;
+	for (size_t i = first; i < stations.size(); i++)
+		index.insert(std::make_pair(stations[i].bus_i, (int)i));
+
+	const std::vector<std::string>& lh = branchRows[0];
+	int cF = csvColumn(lh, "fbus", 0), cT = csvColumn(lh, "tbus", 1);
+	int cR = csvColumn(lh, "r"), cX = csvColumn(lh, "x"), cB = csvColumn(lh, "b"), cRatio = csvColumn(lh, "ratio");
+	int cAngle = csvColumn(lh, "angle"), cRate = csvColumn(lh, "rate"), cStatus = csvColumn(lh, "status");
+
+	BranchStruct branch;
+	for (size_t i = 1; i < branchRows.size(); i++)
+	{
+		const std::vector<std::string>& v = branchRows[i];
+		if (v.empty())
+			continue;
+		branch.fbus = csvValue(v, cF, 0);
+		branch.tbus = csvValue(v, cT, 0);
+		int ends[2] = { -2, -2 };
+		double bus[2] = { branch.fbus, branch.tbus };
+		for (int e = 0; e < 2; e++)
+		{
+			std::map<double, int>::const_iterator it = index.find(bus[e]);
+			if (it == index.end())
+				continue;
+			std::map<double, int>::const_iterator father = index.find(stations[it->second].father);
+			if (father != index.end())
+				ends[e] = father->second;
+		}
+		if (ends[0] < 0 || ends[1] < 0)
+		{
+			TRACE(_T("CPowerModel::readCsv, Branch %d has an unknown bus\n"), (int)i);
+			continue;
+		}
+		branch.startBus = ends[0];
+		branch.endBus = ends[1];
+		branch.volGrade = std::min(stations[ends[0]].volGrade, stations[ends[1]].volGrade);
+		branch.carbonAddTest = FALSE;
+		branch.r = csvValue(v, cR, 0);
+		branch.x = csvValue(v, cX, 0);
+		branch.b = csvValue(v, cB, 0);
+		branch.ratio = csvValue(v, cRatio, 0);
+		branch.angle = csvValue(v, cAngle, 0);
+		branch.rate = csvValue(v, cRate, 0);
+		branch.status = csvValue(v, cStatus, 1) != 0;
+		lines.push_back(branch);
+	}
+	return true;
+}
+
+//line constants per km (ohm, ohm, siemens) for a voltage grade, overhead lines
+static void lineConstants(double kV, double& r, double& x, double& b)
+{
+	if (kV >= 500)
+	{
+		r = 0.02; x = 0.28; b = 4.0e-6;
+	}
+	else if (kV >= 220)
+	{
+		r = 0.05; x = 0.40; b = 2.8e-6;
+	}
+	else if (kV >= 110)
+	{
+		r = 0.12; x = 0.40; b = 2.8e-6;
+	}
+	else
+	{
+		r = 0.20; x = 0.38; b = 2.9e-6;
+	}
+}
+
+static double distanceKm(const StationStruct& a, const StationStruct& b)
+{
+	double lat1 = a.latitude * PI / 180, lat2 = b.latitude * PI / 180;
+	double dLat = lat2 - lat1, dLon = (b.longitude - a.longitude) * PI / 180;
+	double h = sin(dLat / 2) * sin(dLat / 2) + cos(lat1) * cos(lat2) * sin(dLon / 2) * sin(dLon / 2);
+	return 2 * 6371.0 * asin(std::min(1.0, sqrt(h)));
+}
+
+void CPowerModel::fromDocument(const std::vector<StationStruct>& stations, const std::vector<BranchStruct>& lines)
+{
+	buses.clear();
+	branches.clear();
+
+	std::map<double, int> index;
+	for (size_t i = 0; i < stations.size(); i++)
+		index.insert(std::make_pair(stations[i].bus_i, (int)i));
+
+	std::vector<int> busOf(stations.size(), -1);
+	bool bSlack = false, bProfile = false;
+	for (size_t i = 0; i < stations.size(); i++)
+	{
+		const StationStruct& s = stations[i];
+		if (s.father != s.bus_i)
+			continue;
+		pf_bus bus;
+		bus.number = (int)s.bus_i;
+		bus.station = (int)i;
+		bus.type = s.type != 0 ? s.type : (s.pd_max < 0 ? PF_PV : PF_PQ);
+		bus.pd = s.pd;
+		bus.qd = s.qd;
+		bus.gs = s.gs;
+		bus.bs = s.bs;
+		bus.pg = s.pg;
+		bus.qg = s.qg;
+		bus.vm = s.vm > 0 ? s.vm : 1.0;
+		bus.va = s.va;
+		bus.baseKV = s.volGrade;
+		bSlack = bSlack || bus.type == PF_SLACK;
+		busOf[i] = (int)buses.size();
+		buses.push_back(bus);
+	}
+	for (size_t i = 0; i < stations.size() && !bProfile; i++)
+		for (int h = 0; h < 24; h++)
+			bProfile = bProfile || stations[i].load[h] != 0;
+	for (size_t i = 0; i < stations.size(); i++)
+	{
+		if (busOf[i] >= 0)
+			continue;
+		std::map<double, int>::const_iterator father = index.find(stations[i].father);
+		if (father == index.end() || busOf[father->second] < 0)
+			continue;
+		busOf[i] = busOf[father->second];
+		buses[busOf[i]].pd += stations[i].pd;
+		buses[busOf[i]].qd += stations[i].qd;
+	}
+	profile.assign(bProfile ? 24 * buses.size() : 0, 0.0);
+	for (size_t i = 0; i < stations.size() && bProfile; i++)
+		if (busOf[i] >= 0)
+			for (int h = 0; h < 24; h++)
+				profile[24 * busOf[i] + h] += stations[i].load[h];
+	if (!bSlack && !buses.empty())
+	{ //the first bus of the highest grade holds the angle reference
+		size_t slack = 0;
+		for (size_t k = 1; k < buses.size(); k++)
+			if (buses[k].baseKV > buses[slack].baseKV)
+				slack = k;
+		buses[slack].type = PF_SLACK;
+	}
+
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		const BranchStruct& l = lines[i];
+		int s0 = (int)l.startBus, s1 = (int)l.endBus;
+		if (s0 < 0 || s1 < 0 || s0 >= (int)stations.size() || s1 >= (int)stations.size())
+			continue;
+		pf_branch br;
+		br.from = busOf[s0];
+		br.to = busOf[s1];
+		br.line = (int)i;
+		if (br.from < 0 || br.to < 0 || br.from == br.to)
+			continue;
+		br.r = l.r;
+		br.x = l.x;
+		br.b = l.b;
+		br.ratio = l.ratio;
+		br.angle = l.angle;
+		br.rate = l.rate;
+		br.status = l.status != FALSE;
+		if (br.r == 0 && br.x == 0)
+		{
+			double kVf = buses[br.from].baseKV, kVt = buses[br.to].baseKV;
+			if (kVf != kVt)
+			{ //a transformer between grades
+				br.r = 0.002;
+				br.x = 0.08;
+				br.b = 0;
+				if (br.ratio == 0)
+					br.ratio = 1.0;
+			}
+			else
+			{
+				double kV = kVf > 0 ? kVf : 110;
+				double zbase = kV * kV / baseMVA;
+				double km = std::max(1.0, distanceKm(stations[s0], stations[s1]));
+				double r, x, b;
+				lineConstants(kV, r, x, b);
+				br.r = r * km / zbase;
+				br.x = x * km / zbase;
+				br.b = b * km * zbase;
+			}
+		}
+		branches.push_back(br);
+	}
+}
+
+//a small generator of its own so a seed gives the same case everywhere
+static double uniform(unsigned int& state)
+{
+	state = state * 1103515245u + 12345u;
+	return ((state >> 8) & 0xFFFFFF) / 16777216.0;
+}
+
+void CPowerModel::synthetic(int nBuses, unsigned int seed)
+{
+	buses.clear();
+	branches.clear();
+	profile.clear();
+	int cols = (int)ceil(sqrt((double)nBuses));
+	unsigned int state = seed;
+
+	double load = 0;
+	int nGen = 0;
+	for (int k = 0; k < nBuses; k++)
+	{
+		pf_bus bus;
+		bus.number = k + 1;
+		bus.station = -1;
+		bus.type = (k % 10 == 3) ? PF_PV : PF_PQ;
+		bus.pd = 5 + 20 * uniform(state);
+		bus.qd = bus.pd * (0.2 + 0.2 * uniform(state));
+		bus.gs = 0;
+		bus.bs = (k % 25 == 7) ? 10.0 : 0;
+		bus.pg = bus.qg = 0;
+		bus.vm = bus.type == PF_PV ? 1.02 : 1.0;
+		bus.va = 0;
+		bus.baseKV = 220;
+		load += bus.pd;
+		nGen += bus.type == PF_PV;
+		buses.push_back(bus);
+	}
+	int slack = (nBuses / cols / 2) * cols + cols / 2;
+	if (slack >= nBuses)
+		slack = 0;
+	nGen -= buses[slack].type == PF_PV;
+	buses[slack].type = PF_SLACK;
+	buses[slack].vm = 1.03;
+	for (int k = 0; k < nBuses; k++)
+		if (buses[k].type == PF_PV)
+			buses[k].pg = 1.01 * load / nGen;   //the slack is left with about the losses
+
+	//lattice edges in random order: those that join two parts make a spanning tree, a share
+	//of the others closes loops, about 1.4 branches a bus like a transmission grid
+	std::vector< std::pair<int, int> > edges;
+	for (int k = 0; k < nBuses; k++)
+	{
+		if (k % cols + 1 < cols && k + 1 < nBuses)
+			edges.push_back(std::make_pair(k, k + 1));
+		if (k + cols < nBuses)
+			edges.push_back(std::make_pair(k, k + cols));
+	}
+	for (size_t k = edges.size(); k > 1; k--)
+		std::swap(edges[k - 1], edges[(size_t)(uniform(state) * k)]);
+	std::vector<int> part(nBuses);
+	for (int k = 0; k < nBuses; k++)
+		part[k] = k;
+
+	pf_branch br;
+	br.line = -1;
+	br.angle = 0;
+	br.rate = 0;
+	br.status = true;
+	for (size_t e = 0; e < edges.size(); e++)
+	{
+		int a = edges[e].first, b = edges[e].second;
+		while (part[a] != a)
+			a = part[a] = part[part[a]];
+		while (part[b] != b)
+			b = part[b] = part[part[b]];
+		if (a == b && uniform(state) >= 0.4)
+			continue;
+		part[a] = b;
+		br.from = edges[e].first;
+		br.to = edges[e].second;
+		if (branches.size() % 8 == 5)
+		{ //a transformer with its tap off nominal
+			br.x = 0.05;
+			br.r = 0.002;
+			br.b = 0;
+			br.ratio = 0.975 + 0.05 * uniform(state);
+		}
+		else
+		{
+			br.x = 0.01 + 0.03 * uniform(state);
+			br.r = 0.2 * br.x;
+			br.b = 0.02 + 0.02 * uniform(state);
+			br.ratio = 0;
+		}
+		branches.push_back(br);
+	}
+}
+
+int CPowerModel::busIndex(int number) const
+{
+	for (size_t k = 0; k < buses.size(); k++)
+		if (buses[k].number == number)
+			return (int)k;
+	return -1;
+}
+
+void CPowerModel::branchAdmittance(const pf_branch& br, std::complex<double>& yff, std::complex<double>& yft,
+	std::complex<double>& ytf, std::complex<double>& ytt)
+{
+	std::complex<double> ys = 1.0 / std::complex<double>(br.r, br.x);
+	double ratio = br.ratio != 0 ? br.ratio : 1.0;
+	std::complex<double> tap = std::polar(ratio, br.angle * PI / 180);
+	ytt = ys + std::complex<double>(0, br.b / 2);
+	yff = ytt / (ratio * ratio);
+	yft = -ys / std::conj(tap);
+	ytf = -ys / tap;
+}
+
+void CPowerModel::makeYbus(pf_ybus& Y, bool bAllBranches) const
+{
+	int n = (int)buses.size();
+	//rows of Y are built as the columns of its transpose
+	CSparseBuilder G(n, n), B(n, n);
+	for (int k = 0; k < n; k++)
+	{
+		G.add(k, k, buses[k].gs / baseMVA);
+		B.add(k, k, buses[k].bs / baseMVA);
+	}
+	for (size_t l = 0; l < branches.size(); l++)
+	{
+		const pf_branch& br = branches[l];
+		if (!br.status && !bAllBranches)
+			continue;
+		std::complex<double> yff, yft, ytf, ytt;
+		branchAdmittance(br, yff, yft, ytf, ytt);
+		if (!br.status)
+			yff = yft = ytf = ytt = 0;
+		G.add(br.from, br.from, yff.real()); B.add(br.from, br.from, yff.imag());
+		G.add(br.to, br.from, yft.real());   B.add(br.to, br.from, yft.imag());
+		G.add(br.from, br.to, ytf.real());   B.add(br.from, br.to, ytf.imag());
+		G.add(br.to, br.to, ytt.real());     B.add(br.to, br.to, ytt.imag());
+	}
+	sp_matrix g, b;
+	G.compress(g);
+	B.compress(b);
+	Y.n = n;
+	Y.p.swap(g.p);
+	Y.j.swap(g.i);
+	Y.g.swap(g.x);
+	Y.b.swap(b.x);
+	Y.diag.assign(n, -1);
+	for (int k = 0; k < n; k++)
+		for (int p = Y.p[k]; p < Y.p[k + 1]; p++)
+			if (Y.j[p] == k)
+				Y.diag[k] = p;
+}
+
+void CPowerModel::stampBranch(pf_ybus& Y, int branch, double sign) const
+{
+	const pf_branch& br = branches[branch];
+	std::complex<double> y[2][2];
+	branchAdmittance(br, y[0][0], y[0][1], y[1][0], y[1][1]);
+	int ends[2] = { br.from, br.to };
+	for (int r = 0; r < 2; r++)
+		for (int c = 0; c < 2; c++)
+		{
+			std::vector<int>::const_iterator first = Y.j.begin() + Y.p[ends[r]], last = Y.j.begin() + Y.p[ends[r] + 1];
+			std::vector<int>::const_iterator it = std::lower_bound(first, last, ends[c]);
+			if (it == last || *it != ends[c])
+				continue;
+			Y.g[it - Y.j.begin()] += sign * y[r][c].real();
+			Y.b[it - Y.j.begin()] += sign * y[r][c].imag();
+		}
+}
@@ -0,0 +1,89 @@
+#pragma once
+//
+// Bus/branch network model for the power flow solvers, in the per unit conventions of
+// MATPOWER: loads and generation in MW/MVAr, shunts in MW/MVAr at 1 pu voltage, branch
+// impedances in pu on the system base, a transformer's off nominal ratio and phase shift at
+// its from end. busdata.csv and branchdata.csv may carry the electrical columns by name
+// (type,pd,qd,gs,bs,pg,qg,vm,va on buses; r,x,b,ratio,angle,rate,status on branches); a
+// file that only has the topology gets typical values from the voltage grade and the length
+// of the line between the stations' coordinates, so the map's own grid can be solved.
+// Columns load0 .. load23 give a station's daily load profile, MW by hour.
+//
+#include <vector>
+#include <complex>
+#include <string>
+#include "OSMMyStruct.h"
+
+#define PF_PQ		1
+#define PF_PV		2
+#define PF_SLACK	3
+
+struct pf_bus
+{
+	int number;        // bus_i of the station
+	int station;       // index into the document's stations
+	int type;          // PF_PQ, PF_PV or PF_SLACK
+	double pd, qd;     // load, MW / MVAr
+	double gs, bs;     // shunt, MW / MVAr at 1 pu
+	double pg, qg;     // generation, MW / MVAr (qg is only held on PQ buses)
+	double vm, va;     // voltage magnitude (setpoint on PV and slack buses) and angle, pu / degrees
+	double baseKV;
+};
+
+struct pf_branch
+{
+	int from, to;      // bus indices
+	int line;          // index into the document's branches, -1 if it has none
+	double r, x, b;    // pu, b is the total line charging
+	double ratio;      // off nominal turns ratio at the from end, 0 for a line
+	double angle;      // phase shift, degrees
+	double rate;       // MVA, 0 when unlimited
+	bool status;
+};
+
+// bus admittance matrix by rows: row k holds columns j[p[k] .. p[k+1]) with Y = g + jb
+struct pf_ybus
+{
+	int n;
+	std::vector<int> p;
+	std::vector<int> j;
+	std::vector<double> g;
+	std::vector<double> b;
+	std::vector<int> diag;  // position of Y(k,k) in row k
+};
+
+class CPowerModel
+{
+public:
+	CPowerModel();
+
+	double baseMVA;
+	std::vector<pf_bus> buses;
+	std::vector<pf_branch> branches;
+	std::vector<double> profile;      // load of bus k at hour h in profile[24 * k + h], MW; empty without one
+
+	// reads the station and branch files into the document's structures; startBus/endBus are
+	// resolved to the father station as the map has always drawn them
+	static bool readCsv(const char* busFile, const char* branchFile, std::vector<StationStruct>& stations, std::vector<BranchStruct>& lines);
+	// one bus per station that is its own father, children's loads added to their father
+	void fromDocument(const std::vector<StationStruct>& stations, const std::vector<BranchStruct>& lines);
+	// an n bus meshed grid with random lines, loads and generators, the same for the same seed
+	void synthetic(int nBuses, unsigned int seed);
+
+	int busIndex(int number) const;   // -1 if there is no bus with this number
+	// with bAllBranches a branch out of service keeps its place with zeros, so switching it is
+	// stampBranch() on the values
+	void makeYbus(pf_ybus& Y, bool bAllBranches = false) const;
+	// adds the branch's admittances to Y (sign 1) or takes them out (-1)
+	void stampBranch(pf_ybus& Y, int branch, double sign) const;
+	// the branch's two port admittances: If = yff Vf + yft Vt, It = ytf Vf + ytt Vt
+	static void branchAdmittance(const pf_branch& br, std::complex<double>& yff, std::complex<double>& yft,
+		std::complex<double>& ytf, std::complex<double>& ytt);
+};
+
+// the case files' CSV reading, shared with the other readers of per element tables:
+// lines split at commas, a named column or the column the old fixed layout used for it,
+// and a number or def when the field is missing or empty
+bool csvRows(const char* file, std::vector< std::vector<std::string> >& rows);
+int csvColumn(const std::vector<std::string>& header, const char* name, int legacy = -1);
+double csvValue(const std::vector<std::string>& row, int col, double def);
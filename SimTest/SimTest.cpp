@@ -0,0 +1,292 @@
+// IEC 104 simulator scenarios: the master session's timers, reconnection, GI retry, the
+// outstation faults and the gateway loopback, each run in virtual time with its counters
+// checked against what the protocol parameters (t1 = 6 s, t2 = 4 s, t3 = 10 s, reconnect
+// every 5 s, GI 10 s after STARTDT) dictate. The exit code is the number of failed checks.
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <string.h>
+#include <map>
+
+#include "iec104_sim.h"
+
+static int failures = 0;
+
+#define CHECK( cond ) check( ( cond ), #cond, __FILE__, __LINE__ )
+
+static void check( bool ok, const char * what, const char * file, int line )
+{
+    if ( !ok )
+    {
+        printf( "  FAILED %s(%d): %s\n", file, line, what );
+        failures++;
+    }
+}
+
+static iec104_sim_stats stats( const iec104_simulator & sim )
+{
+    iec104_sim_stats s;
+    sim.getStats( s );
+    return s;
+}
+
+// messages of a master's log containing text, the log emptied
+static int logged( iec104_sim_master * m, const char * text )
+{
+    int n = 0;
+    while ( m->mLog.haveMsg() )
+        if ( m->mLog.pullMsg().find( text ) != std::string::npos )
+            n++;
+    return n;
+}
+
+// connect within 5 s, STARTDT, GI 10 s later, then one spontaneous frame a second
+static void normal()
+{
+    printf( "normal start\n" );
+    iec104_sim_config cfg;
+    iec104_simulator sim( cfg );
+    sim.run( 14000 );
+    CHECK( stats( sim ).connects == 1 );
+    CHECK( stats( sim ).gis == 0 );
+    sim.run( 6000 );
+    iec104_sim_stats s = stats( sim );
+    CHECK( s.gis == 1 );
+    CHECK( s.giCommits == 1 );
+    CHECK( s.objects >= (unsigned __int64)cfg.points );
+    CHECK( s.transferring == 1 );
+    CHECK( s.disconnects == 0 );
+}
+
+// t2: an I frame every 5 s, never w of them within t2, so each is acknowledged by an S frame
+// t2 after it arrives
+static void supervisoryT2()
+{
+    printf( "t2 acknowledgement\n" );
+    iec104_sim_config cfg;
+    cfg.period = 5000;
+    iec104_simulator sim( cfg );
+    sim.run( 20000 );
+    unsigned __int64 s0 = stats( sim ).supervisory;
+    sim.run( 60000 );
+    iec104_sim_stats s = stats( sim );
+    CHECK( s.supervisory - s0 >= 11 && s.supervisory - s0 <= 13 );
+    CHECK( s.suppressed == 0 );
+    CHECK( s.disconnects == 0 );
+}
+
+// t3: a quiet link is tested t3 after the last frame, TESTFRCON keeps it up
+static void idleT3()
+{
+    printf( "t3 test frames\n" );
+    iec104_sim_config cfg;
+    cfg.changes = 0;
+    iec104_simulator sim( cfg );
+    sim.run( 20000 );
+    unsigned __int64 t0 = stats( sim ).testfr;
+    sim.run( 100000 );
+    iec104_sim_stats s = stats( sim );
+    // one TESTFR every t3 plus a round trip
+    CHECK( s.testfr - t0 >= 9 && s.testfr - t0 <= 10 );
+    CHECK( s.disconnects == 0 );
+    CHECK( s.transferring == 1 );
+}
+
+// t1: the outstation goes silent at 30 s, the unanswered TESTFR drops the connection t1 later,
+// STARTDT is repeated every t1 until it answers again at 60 s
+static void silentT1()
+{
+    printf( "t1 expiry\n" );
+    iec104_sim_config cfg;
+    cfg.changes = 0;
+    cfg.log = true;
+    cfg.faultySessions = 1;
+    cfg.faults.silentFrom = 30000;
+    cfg.faults.silentUntil = 60000;
+    iec104_simulator sim( cfg );
+    iec104_sim_master * m = sim.master( 0 );
+    sim.run( 35000 );
+    CHECK( stats( sim ).disconnects == 0 );
+    sim.run( 12000 );   // TESTFR by 40 s, t1 expired by 46 s
+    CHECK( stats( sim ).disconnects == 1 );
+    CHECK( logged( m, "NO TESTFRCON" ) == 1 );
+    sim.run( 13000 );
+    CHECK( stats( sim ).transferring == 0 );
+    sim.run( 30000 );
+    iec104_sim_stats s = stats( sim );
+    CHECK( s.disconnects == 1 );
+    CHECK( s.connects == 2 );
+    CHECK( s.gis == 2 );
+    CHECK( s.transferring == 1 );
+}
+
+// reconnection: refused until 30 s, one attempt every reconnect delay
+static void reconnect()
+{
+    printf( "reconnect\n" );
+    iec104_sim_config cfg;
+    cfg.faultySessions = 1;
+    cfg.faults.refuseFrom = 0;
+    cfg.faults.refuseUntil = 30000;
+    iec104_simulator sim( cfg );
+    sim.run( 30000 );
+    iec104_sim_stats s = stats( sim );
+    CHECK( s.refused == 6 );     // the session ticks from its start, 5 s apart
+    CHECK( s.connects == 0 );
+    sim.run( 20000 );
+    s = stats( sim );
+    CHECK( s.refused == 6 );
+    CHECK( s.connects == 1 );
+    CHECK( s.gis == 1 );
+    CHECK( s.transferring == 1 );
+
+    // a dropped link is taken up again after the reconnect delay, with a new GI
+    iec104_sim_config drop;
+    drop.faultySessions = 1;
+    drop.faults.dropEvery = 60000;
+    iec104_simulator sim2( drop );
+    sim2.run( 290000 );
+    s = stats( sim2 );
+    CHECK( s.disconnects == 4 );
+    CHECK( s.connects == 5 );
+    CHECK( s.gis == 5 );
+    CHECK( s.transferring == 1 );
+}
+
+// GI retry: GI is never confirmed, so it is repeated every t1 and the session stays interrogating
+static void giRetry()
+{
+    printf( "GI retry\n" );
+    iec104_sim_config cfg;
+    cfg.log = true;
+    cfg.faultySessions = 1;
+    cfg.faults.ignoreGI = true;
+    iec104_simulator sim( cfg );
+    iec104_sim_master * m = sim.master( 0 );
+    sim.run( 60000 );
+    iec104_sim_stats s = stats( sim );
+    // first GI at 15 s, repeated at 21, 27 ... 57 s
+    CHECK( logged( m, "NO INTERROGATION ACT CON" ) == 7 );
+    CHECK( s.gis == 0 );
+    CHECK( s.giCommits == 0 );
+    CHECK( m->getSession().state() == iec104_session::INTERROGATING );
+    CHECK( s.disconnects == 0 );
+}
+
+// noGITerm: GI is confirmed and answered but never terminated; the answer is committed when
+// ACTTERM is given up on and the session goes on to transfer
+static void noGITerm()
+{
+    printf( "GI without termination\n" );
+    iec104_sim_config cfg;
+    cfg.log = true;
+    cfg.faultySessions = 1;
+    cfg.faults.noGITerm = true;
+    iec104_simulator sim( cfg );
+    iec104_sim_master * m = sim.master( 0 );
+    sim.run( 60000 );
+    iec104_sim_stats s = stats( sim );
+    CHECK( logged( m, "NO INTERROGATION ACT TERM" ) == 1 );
+    CHECK( s.gis == 0 );
+    CHECK( s.giCommits == 1 );
+    CHECK( s.objects >= (unsigned __int64)cfg.points );
+    CHECK( m->getSession().state() == iec104_session::TRANSFER );
+    CHECK( s.disconnects == 0 );
+}
+
+// changeInGI: values change between the GI answer and ACTTERM; the changes are held with the
+// answer and delivered after it, so the last value given for every point is the newest
+static void changeInGI()
+{
+    printf( "changes during GI\n" );
+    iec104_sim_config cfg;
+    cfg.period = 600000;
+    cfg.faultySessions = 1;
+    cfg.faults.changeInGI = true;
+    iec104_simulator sim( cfg );
+    std::map<unsigned int, float> last, changed;
+    sim.master( 0 )->onData = [&last, &changed]( iec_obj * obj, int n ) {
+        for ( int j = 0; j < n; j++ )
+        {
+            last[obj[j].address] = obj[j].value;
+            if ( obj[j].cause == 3 )
+                changed[obj[j].address] = obj[j].value;
+        }
+    };
+    sim.run( 30000 );
+    iec104_sim_stats s = stats( sim );
+    CHECK( s.gis == 1 );
+    CHECK( s.giCommits == 1 );
+    CHECK( !changed.empty() );
+    CHECK( last.size() == (size_t)cfg.points );
+    for ( std::map<unsigned int, float>::const_iterator it = changed.begin(); it != changed.end(); ++it )
+        CHECK( last[it->first] == it->second );
+}
+
+// loopback: points received from the outstations are served again by the gateways, each upstream
+// master sees every point with the value the downstream masters last received
+static void loopback()
+{
+    printf( "gateway loopback\n" );
+    iec104_sim_config cfg;
+    cfg.sessions = 5;
+    cfg.points = 300;
+    cfg.upstream = 2;
+    iec104_simulator sim( cfg );
+    std::map<unsigned __int64, float> down;
+    std::vector< std::map<unsigned __int64, float> > up( cfg.upstream );
+    for ( int i = 0; i < sim.sessions(); i++ )
+    {
+        // the simulator's own handler forwards to the gateways
+        std::map<unsigned __int64, float> * seen = &down;
+        std::function<void( iec_obj *, int )> forward = sim.master( i )->onData;
+        sim.master( i )->onData = [seen, forward]( iec_obj * obj, int n ) {
+            for ( int j = 0; j < n; j++ )
+                ( *seen )[ ( (unsigned __int64)obj[j].ca << 24 ) | obj[j].address ] = obj[j].value;
+            forward( obj, n );
+        };
+    }
+    for ( int i = 0; i < sim.upstreamSessions(); i++ )
+    {
+        std::map<unsigned __int64, float> * seen = &up[i];
+        sim.upstreamMaster( i )->onData = [seen]( iec_obj * obj, int n ) {
+            for ( int j = 0; j < n; j++ )
+                ( *seen )[ ( (unsigned __int64)obj[j].ca << 24 ) | obj[j].address ] = obj[j].value;
+        };
+    }
+    sim.run( 120000 );
+    iec104_sim_stats s = stats( sim );
+    CHECK( s.gis == (unsigned __int64)cfg.sessions );
+    CHECK( s.upstreamGis >= (unsigned __int64)cfg.upstream );
+    CHECK( s.upstreamTransferring == cfg.upstream );
+    CHECK( s.upstreamDropped == 0 );
+    CHECK( down.size() == (size_t)( cfg.sessions * cfg.points ) );
+    for ( int i = 0; i < cfg.upstream; i++ )
+    {
+        CHECK( up[i].size() == down.size() );
+        // changes still in flight to the gateway or upstream are the only differences
+        int differ = 0;
+        for ( std::map<unsigned __int64, float>::const_iterator it = down.begin(); it != down.end(); ++it )
+        {
+            std::map<unsigned __int64, float>::const_iterator u = up[i].find( it->first );
+            if ( u == up[i].end() || u->second != it->second )
+                differ++;
+        }
+        CHECK( differ <= 2 * cfg.sessions * cfg.changes );
+    }
+}
+
+int main()
+{
+    normal();
+    supervisoryT2();
+    idleT3();
+    silentT1();
+    reconnect();
+    giRetry();
+    noGITerm();
+    changeInGI();
+    loopback();
+    printf( failures ? "%d checks FAILED\n" : "all checks passed\n", failures );
+    return failures;
+}
@@ -0,0 +1,61 @@
+#pragma once
+//
+// Read-copy-update holder for data many threads read and few write (point database cuts,
+// solver results). A writer builds a new version and publishes it; readers take a pointer
+// to the current version and keep using it for as long as they like. Versions are never
+// modified after publish(), so a reader never sees a half-written value, and a version is
+// freed when the last pointer to it goes away, so old versions are reclaimed without the
+// writer waiting for readers. get() only swaps a reference count, it never copies the data
+// and never waits for a writer that is building the next version.
+//
+#include <memory>
+
+template <class T>
+class CSnapshot
+{
+public:
+	typedef std::shared_ptr<const T> ptr;
+
+	CSnapshot() : m_version(0) { InitializeCriticalSection(&m_cs); }
+	~CSnapshot() { DeleteCriticalSection(&m_cs); }
+
+	// current version, empty until the first publish
+	ptr get() const { return std::atomic_load(&m_pCurrent); }
+	// number of versions published
+	unsigned __int64 version() const
+	{
+		EnterCriticalSection(&m_cs);
+		unsigned __int64 n = m_version;
+		LeaveCriticalSection(&m_cs);
+		return n;
+	}
+
+	void publish(const ptr& pNew)
+	{
+		EnterCriticalSection(&m_cs);
+		std::atomic_store(&m_pCurrent, pNew);
+		m_version++;
+		LeaveCriticalSection(&m_cs);
+	}
+	void publish(const T& value) { publish(ptr(new T(value))); }
+	// copies the current version (or a default T), lets fn change the copy and publishes it;
+	// writers are serialised, so two updates never lose each other's changes
+	template <class F> void update(F fn)
+	{
+		EnterCriticalSection(&m_cs);
+		ptr pOld = std::atomic_load(&m_pCurrent);
+		std::shared_ptr<T> pNew(pOld ? new T(*pOld) : new T());
+		fn(*pNew);
+		std::atomic_store(&m_pCurrent, ptr(pNew));
+		m_version++;
+		LeaveCriticalSection(&m_cs);
+	}
+
+private:
+	CSnapshot(const CSnapshot&);
+	CSnapshot& operator=(const CSnapshot&);
+
+	ptr m_pCurrent;
+	unsigned __int64 m_version;
+	mutable CRITICAL_SECTION m_cs; // publishers and version(), never get()
+};
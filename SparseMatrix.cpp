@@ -0,0 +1,606 @@
+#include "stdafx.h"
+#include "SparseMatrix.h"
+#include <math.h>
+#include <algorithm>
+#include <set>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+void CSparseBuilder::add(int row, int col, double value)
+{
+	entry e = { row, col, value };
+	m_Entries.push_back(e);
+}
+
+void CSparseBuilder::compress(sp_matrix& out) const
+{
+	out.m = m_m;
+	out.n = m_n;
+	out.p.assign(m_n + 1, 0);
+	for (size_t k = 0; k < m_Entries.size(); k++)
+		out.p[m_Entries[k].col + 1]++;
+	for (int j = 0; j < m_n; j++)
+		out.p[j + 1] += out.p[j];
+
+	std::vector<int> next(out.p.begin(), out.p.end() - 1);
+	std::vector<int> rows(m_Entries.size());
+	std::vector<double> values(m_Entries.size());
+	for (size_t k = 0; k < m_Entries.size(); k++)
+	{
+		int at = next[m_Entries[k].col]++;
+		rows[at] = m_Entries[k].row;
+		values[at] = m_Entries[k].value;
+	}
+
+	//sort each column by row and sum duplicates
+	out.i.clear();
+	out.x.clear();
+	out.i.reserve(rows.size());
+	out.x.reserve(rows.size());
+	std::vector<std::pair<int, double> > col;
+	int nz = 0;
+	for (int j = 0; j < m_n; j++)
+	{
+		col.clear();
+		for (int p = out.p[j]; p < out.p[j + 1]; p++)
+			col.push_back(std::make_pair(rows[p], values[p]));
+		std::sort(col.begin(), col.end(),
+			[](const std::pair<int, double>& a, const std::pair<int, double>& b) { return a.first < b.first; });
+		out.p[j] = nz;
+		for (size_t k = 0; k < col.size(); k++)
+		{
+			if (k > 0 && col[k].first == out.i.back())
+				out.x.back() += col[k].second;
+			else
+			{
+				out.i.push_back(col[k].first);
+				out.x.push_back(col[k].second);
+				nz++;
+			}
+		}
+	}
+	out.p[m_n] = nz;
+}
+
+void CSparseOrdering::minimumDegree(const std::vector< std::vector<int> >& adj, std::vector<int>& order)
+{
+	int n = (int)adj.size();
+	std::vector< std::vector<int> > g(n);
+	std::set< std::pair<int, int> > queue;
+	for (int v = 0; v < n; v++)
+	{
+		g[v] = adj[v];
+		std::sort(g[v].begin(), g[v].end());
+		g[v].erase(std::unique(g[v].begin(), g[v].end()), g[v].end());
+		queue.insert(std::make_pair((int)g[v].size(), v));
+	}
+
+	order.clear();
+	order.reserve(n);
+	std::vector<int> merged;
+	while (!queue.empty())
+	{
+		int v = queue.begin()->second;
+		queue.erase(queue.begin());
+		order.push_back(v);
+
+		//the neighbours of v become a clique (the fill of eliminating v)
+		const std::vector<int>& nb = g[v];
+		for (size_t k = 0; k < nb.size(); k++)
+		{
+			int u = nb[k];
+			std::vector<int>& gu = g[u];
+			queue.erase(std::make_pair((int)gu.size(), u));
+			merged.clear();
+			std::set_union(gu.begin(), gu.end(), nb.begin(), nb.end(), std::back_inserter(merged));
+			gu.clear();
+			for (size_t t = 0; t < merged.size(); t++)
+				if (merged[t] != u && merged[t] != v)
+					gu.push_back(merged[t]);
+			queue.insert(std::make_pair((int)gu.size(), u));
+		}
+		std::vector<int>().swap(g[v]);
+	}
+}
+
+CSparseLU::CSparseLU()
+{
+	m_n = 0;
+}
+
+int CSparseLU::dfs(int j, int top)
+{
+	int* pstack = &m_stack[m_n];
+	int head = 0;
+	m_stack[0] = j;
+	while (head >= 0)
+	{
+		j = m_stack[head];
+		int k = m_pinv[j];
+		if (!m_mark[j])
+		{
+			m_mark[j] = 1;
+			pstack[head] = (k < 0) ? 0 : m_Lp[k] + 1;   //skip the pivot itself
+		}
+		bool done = true;
+		int pend = (k < 0) ? 0 : m_Lp[k + 1];
+		for (int p = pstack[head]; p < pend; p++)
+		{
+			int i = m_Li[p];
+			if (m_mark[i])
+				continue;
+			pstack[head] = p + 1;
+			m_stack[++head] = i;
+			done = false;
+			break;
+		}
+		if (done)
+		{
+			head--;
+			m_xi[--top] = j;
+		}
+	}
+	return top;
+}
+
+int CSparseLU::reach(const sp_matrix& A, int col)
+{
+	int top = m_n;
+	for (int p = A.p[col]; p < A.p[col + 1]; p++)
+		if (!m_mark[A.i[p]])
+			top = dfs(A.i[p], top);
+	for (int p = top; p < m_n; p++)
+		m_mark[m_xi[p]] = 0;
+	return top;
+}
+
+void CSparseLU::spsolve(const sp_matrix& A, int col, int top)
+{
+	for (int p = A.p[col]; p < A.p[col + 1]; p++)
+		m_x[A.i[p]] = A.x[p];
+	for (int p = top; p < m_n; p++)
+	{
+		int j = m_xi[p];
+		int k = m_pinv[j];
+		if (k < 0)
+			continue;
+		double xj = m_x[j];
+		for (int t = m_Lp[k] + 1; t < m_Lp[k + 1]; t++)
+			m_x[m_Li[t]] -= m_Lx[t] * xj;
+	}
+}
+
+bool CSparseLU::factor(const sp_matrix& A, const std::vector<int>& q, double tol)
+{
+	int n = A.n;
+	m_n = n;
+	m_q = q;
+	if ((int)m_q.size() != n)
+	{
+		m_q.resize(n);
+		for (int k = 0; k < n; k++)
+			m_q[k] = k;
+	}
+	m_pinv.assign(n, -1);
+	m_Lp.assign(n + 1, 0);
+	m_Up.assign(n + 1, 0);
+	m_Li.clear();
+	m_Lx.clear();
+	m_Ui.clear();
+	m_Ux.clear();
+	m_Li.reserve(4 * A.nnz());
+	m_Lx.reserve(4 * A.nnz());
+	m_Ui.reserve(4 * A.nnz());
+	m_Ux.reserve(4 * A.nnz());
+	m_x.assign(n, 0.0);
+	m_xi.resize(n);
+	m_stack.resize(2 * n);
+	m_mark.assign(n, 0);
+
+	for (int k = 0; k < n; k++)
+	{
+		m_Lp[k] = (int)m_Li.size();
+		m_Up[k] = (int)m_Ui.size();
+		int col = m_q[k];
+		int top = reach(A, col);
+		spsolve(A, col, top);
+
+		int ipiv = -1;
+		double a = -1;
+		for (int p = top; p < n; p++)
+		{
+			int i = m_xi[p];
+			if (m_pinv[i] < 0)
+			{
+				double t = fabs(m_x[i]);
+				if (t > a)
+				{
+					a = t;
+					ipiv = i;
+				}
+			}
+			else
+			{
+				m_Ui.push_back(m_pinv[i]);
+				m_Ux.push_back(m_x[i]);
+			}
+		}
+		if (ipiv < 0 || a <= 0)
+		{
+			m_n = 0;   //structurally or numerically singular
+			return false;
+		}
+		if (m_pinv[col] < 0 && fabs(m_x[col]) >= a * tol)
+			ipiv = col;
+
+		double pivot = m_x[ipiv];
+		m_Ui.push_back(k);
+		m_Ux.push_back(pivot);
+		m_pinv[ipiv] = k;
+		m_Li.push_back(ipiv);
+		m_Lx.push_back(1.0);
+		for (int p = top; p < n; p++)
+		{
+			int i = m_xi[p];
+			if (m_pinv[i] < 0)
+			{
+				m_Li.push_back(i);
+				m_Lx.push_back(m_x[i] / pivot);
+			}
+			m_x[i] = 0;
+		}
+	}
+	m_Lp[n] = (int)m_Li.size();
+	m_Up[n] = (int)m_Ui.size();
+	for (size_t p = 0; p < m_Li.size(); p++)
+		m_Li[p] = m_pinv[m_Li[p]];
+	return true;
+}
+
+bool CSparseLU::refactor(const sp_matrix& A)
+{
+	if (m_n == 0 || A.n != m_n)
+		return false;
+	std::vector<double>& w = m_x;
+	for (int k = 0; k < m_n; k++)
+	{
+		for (int p = m_Up[k]; p < m_Up[k + 1]; p++)
+			w[m_Ui[p]] = 0;
+		for (int p = m_Lp[k]; p < m_Lp[k + 1]; p++)
+			w[m_Li[p]] = 0;
+		int col = m_q[k];
+		for (int p = A.p[col]; p < A.p[col + 1]; p++)
+			w[m_pinv[A.i[p]]] += A.x[p];
+
+		//U entries are stored in dependency order, the diagonal last
+		int pdiag = m_Up[k + 1] - 1;
+		for (int p = m_Up[k]; p < pdiag; p++)
+		{
+			int j = m_Ui[p];
+			double ujk = w[j];
+			m_Ux[p] = ujk;
+			for (int t = m_Lp[j] + 1; t < m_Lp[j + 1]; t++)
+				w[m_Li[t]] -= m_Lx[t] * ujk;
+		}
+
+		double pivot = w[k];
+		double a = fabs(pivot);
+		for (int p = m_Lp[k] + 1; p < m_Lp[k + 1]; p++)
+			a = std::max(a, fabs(w[m_Li[p]]));
+		if (pivot == 0 || fabs(pivot) < 1e-3 * a)
+			return false;
+		m_Ux[pdiag] = pivot;
+		for (int p = m_Lp[k] + 1; p < m_Lp[k + 1]; p++)
+			m_Lx[p] = w[m_Li[p]] / pivot;
+	}
+	return true;
+}
+
+void CSparseLU::solve(const std::vector<double>& b, std::vector<double>& x, std::vector<double>& w) const
+{
+	w.resize(m_n);
+	for (int i = 0; i < m_n; i++)
+		w[m_pinv[i]] = b[i];
+	for (int k = 0; k < m_n; k++)
+	{
+		double wk = w[k];
+		for (int p = m_Lp[k] + 1; p < m_Lp[k + 1]; p++)
+			w[m_Li[p]] -= m_Lx[p] * wk;
+	}
+	for (int k = m_n - 1; k >= 0; k--)
+	{
+		int pdiag = m_Up[k + 1] - 1;
+		double wk = w[k] / m_Ux[pdiag];
+		w[k] = wk;
+		for (int p = m_Up[k]; p < pdiag; p++)
+			w[m_Ui[p]] -= m_Ux[p] * wk;
+	}
+	x.resize(m_n);
+	for (int k = 0; k < m_n; k++)
+		x[m_q[k]] = w[k];
+}
+
+CSparseCholesky::CSparseCholesky()
+{
+	m_n = 0;
+	m_bFactored = false;
+}
+
+//pattern of row k of L, in m_s[top .. n) in topological order
+int CSparseCholesky::ereach(int k)
+{
+	int top = m_n;
+	m_mark[k] = k;
+	for (int p = m_Cp[k]; p < m_Cp[k + 1]; p++)
+	{
+		int i = m_Ci[p];
+		if (i > k)
+			continue;
+		int len = 0;
+		for (; m_mark[i] != k; i = m_parent[i])
+		{
+			m_s[len++] = i;
+			m_mark[i] = k;
+		}
+		while (len > 0)
+			m_s[--top] = m_s[--len];
+	}
+	return top;
+}
+
+bool CSparseCholesky::analyze(const sp_matrix& A, const std::vector<int>& order)
+{
+	int n = A.n;
+	m_n = 0;
+	m_bFactored = false;
+	if (A.m != n || (int)order.size() != n)
+		return false;
+	m_perm = order;
+	m_pinv.assign(n, -1);
+	for (int k = 0; k < n; k++)
+		m_pinv[order[k]] = k;
+
+	//C = upper triangle of P A P^T and where each entry of A goes in it
+	int nz = A.nnz();
+	m_Cp.assign(n + 1, 0);
+	for (int j = 0; j < n; j++)
+		for (int p = A.p[j]; p < A.p[j + 1]; p++)
+		{
+			int pi = m_pinv[A.i[p]], pj = m_pinv[j];
+			if (pi <= pj)
+				m_Cp[pj + 1]++;
+		}
+	for (int k = 0; k < n; k++)
+		m_Cp[k + 1] += m_Cp[k];
+	m_Ci.resize(m_Cp[n]);
+	m_Cx.resize(m_Cp[n]);
+	m_map.assign(nz, -1);
+	std::vector<int> next(m_Cp.begin(), m_Cp.end() - 1);
+	for (int j = 0; j < n; j++)
+		for (int p = A.p[j]; p < A.p[j + 1]; p++)
+		{
+			int pi = m_pinv[A.i[p]], pj = m_pinv[j];
+			if (pi > pj)
+				continue;
+			m_map[p] = next[pj];
+			m_Ci[next[pj]++] = pi;
+		}
+
+	//elimination tree
+	m_parent.assign(n, -1);
+	std::vector<int> ancestor(n, -1);
+	for (int k = 0; k < n; k++)
+		for (int p = m_Cp[k]; p < m_Cp[k + 1]; p++)
+		{
+			int i = m_Ci[p];
+			while (i != -1 && i < k)
+			{
+				int inext = ancestor[i];
+				ancestor[i] = k;
+				if (inext == -1)
+					m_parent[i] = k;
+				i = inext;
+			}
+		}
+
+	//column counts from the row patterns
+	m_n = n;
+	m_s.resize(n);
+	m_mark.assign(n, -1);
+	std::vector<int> count(n, 1);
+	for (int k = 0; k < n; k++)
+		for (int top = ereach(k); top < n; top++)
+			count[m_s[top]]++;
+	m_Lp.assign(n + 1, 0);
+	for (int k = 0; k < n; k++)
+		m_Lp[k + 1] = m_Lp[k] + count[k];
+	m_Li.resize(m_Lp[n]);
+	m_Lx.resize(m_Lp[n]);
+	m_x.assign(n, 0);
+	m_c.resize(n);
+	return true;
+}
+
+bool CSparseCholesky::factor(const sp_matrix& A)
+{
+	m_bFactored = false;
+	if (m_n == 0 || A.n != m_n || A.nnz() != (int)m_map.size())
+		return false;
+	std::fill(m_Cx.begin(), m_Cx.end(), 0.0);
+	for (size_t p = 0; p < m_map.size(); p++)
+		if (m_map[p] >= 0)
+			m_Cx[m_map[p]] += A.x[p];
+
+	int n = m_n;
+	std::copy(m_Lp.begin(), m_Lp.end() - 1, m_c.begin());
+	std::fill(m_mark.begin(), m_mark.end(), -1);
+	for (int k = 0; k < n; k++)
+	{
+		int top = ereach(k);
+		m_x[k] = 0;
+		for (int p = m_Cp[k]; p < m_Cp[k + 1]; p++)
+			m_x[m_Ci[p]] += m_Cx[p];
+		double d = m_x[k];
+		m_x[k] = 0;
+		for (; top < n; top++)
+		{
+			//L(k,i) from the solve with the first k rows of L
+			int i = m_s[top];
+			double lki = m_x[i] / m_Lx[m_Lp[i]];
+			m_x[i] = 0;
+			for (int p = m_Lp[i] + 1; p < m_c[i]; p++)
+				m_x[m_Li[p]] -= m_Lx[p] * lki;
+			d -= lki * lki;
+			int p = m_c[i]++;
+			m_Li[p] = k;
+			m_Lx[p] = lki;
+		}
+		if (d <= 0)
+			return false;
+		int p = m_c[k]++;
+		m_Li[p] = k;
+		m_Lx[p] = sqrt(d);
+	}
+	m_bFactored = true;
+	return true;
+}
+
+void CSparseCholesky::solve(const std::vector<double>& b, std::vector<double>& x, std::vector<double>& w) const
+{
+	w.resize(m_n);
+	for (int k = 0; k < m_n; k++)
+		w[k] = b[m_perm[k]];
+	for (int k = 0; k < m_n; k++)
+	{
+		if (w[k] == 0)
+			continue;   //a right hand side with few entries only reaches their paths up the tree
+		double wk = w[k] / m_Lx[m_Lp[k]];
+		w[k] = wk;
+		for (int p = m_Lp[k] + 1; p < m_Lp[k + 1]; p++)
+			w[m_Li[p]] -= m_Lx[p] * wk;
+	}
+	for (int k = m_n - 1; k >= 0; k--)
+	{
+		double wk = w[k];
+		for (int p = m_Lp[k] + 1; p < m_Lp[k + 1]; p++)
+			wk -= m_Lx[p] * w[m_Li[p]];
+		w[k] = wk / m_Lx[m_Lp[k]];
+	}
+	x.resize(m_n);
+	for (int k = 0; k < m_n; k++)
+		x[m_perm[k]] = w[k];
+}
+
+bool CSparseCholesky::update(const std::vector<int>& rows, const std::vector<double>& values, bool bDowndate)
+{
+	//Davis and Hager: only the columns on the path from v's first entry to the root change
+	if (!m_bFactored || rows.empty())
+		return m_bFactored;
+	std::vector<double>& w = m_x;
+	int f = m_n;
+	for (size_t k = 0; k < rows.size(); k++)
+		f = std::min(f, m_pinv[rows[k]]);
+	for (int j = f; j != -1; j = m_parent[j])
+		w[j] = 0;
+	for (size_t k = 0; k < rows.size(); k++)
+		w[m_pinv[rows[k]]] += values[k];
+
+	double sigma = bDowndate ? -1.0 : 1.0, beta = 1, beta2 = 1;
+	for (int j = f; j != -1; j = m_parent[j])
+	{
+		int p = m_Lp[j];
+		double alpha = w[j] / m_Lx[p];
+		beta2 = beta * beta + sigma * alpha * alpha;
+		if (beta2 <= 0)
+			break;
+		beta2 = sqrt(beta2);
+		double delta = bDowndate ? beta2 / beta : beta / beta2;
+		double gamma = sigma * alpha / (beta2 * beta);
+		m_Lx[p] = delta * m_Lx[p] + (bDowndate ? 0 : gamma * w[j]);
+		beta = beta2;
+		for (p++; p < m_Lp[j + 1]; p++)
+		{
+			double w1 = w[m_Li[p]];
+			double w2 = w1 - alpha * m_Lx[p];
+			w[m_Li[p]] = w2;
+			m_Lx[p] = delta * m_Lx[p] + gamma * (bDowndate ? w2 : w1);
+		}
+	}
+	for (int j = f; j != -1; j = m_parent[j])
+		w[j] = 0;
+	if (beta2 <= 0)
+		m_bFactored = false;
+	return m_bFactored;
+}
+
+int CSparseCholesky::find(int i, int j) const
+{
+	std::vector<int>::const_iterator first = m_Li.begin() + m_Lp[j], last = m_Li.begin() + m_Lp[j + 1];
+	std::vector<int>::const_iterator it = std::lower_bound(first, last, i);
+	return (it != last && *it == i) ? (int)(it - m_Li.begin()) : -1;
+}
+
+void CSparseCholesky::inverseSubset(std::vector<double>& Z) const
+{
+	//L^T Z = L^-1, so Z(i,j) = (d(i,j) / L(j,j) - sum over k > j of L(k,j) Z(i,k)) / L(j,j). Every
+	//Z(i,k) it needs has i and k in column j's pattern, so it is in a later column of the
+	//pattern (which is chordal); each of those columns is walked once, adding its entries to the
+	//sums of both of their rows
+	int n = m_n;
+	Z.assign(m_Lx.size(), 0);
+	std::vector<double> lj(n, 0), s(n, 0);
+	std::vector<int> mark(n, -1);
+	for (int j = n - 1; j >= 0; j--)
+	{
+		int first = m_Lp[j], last = m_Lp[j + 1];
+		double ljj = m_Lx[first];
+		for (int q = first + 1; q < last; q++)
+		{
+			lj[m_Li[q]] = m_Lx[q];
+			mark[m_Li[q]] = j;
+		}
+		for (int q = first + 1; q < last; q++)
+		{
+			int k = m_Li[q];
+			double lkj = m_Lx[q];
+			for (int p = m_Lp[k]; p < m_Lp[k + 1]; p++)
+			{
+				int i = m_Li[p];
+				if (mark[i] != j)
+					continue;
+				s[i] += lkj * Z[p];
+				if (i != k)
+					s[k] += lj[i] * Z[p];
+			}
+		}
+		double d = 0;
+		for (int q = first + 1; q < last; q++)
+		{
+			int i = m_Li[q];
+			Z[q] = -s[i] / ljj;
+			s[i] = 0;
+			d += m_Lx[q] * Z[q];
+		}
+		Z[first] = (1 / ljj - d) / ljj;
+	}
+}
+
+double CSparseCholesky::inverse(const std::vector<double>& Z, int i, int j) const
+{
+	int pi = m_pinv[i], pj = m_pinv[j];
+	int at = pi >= pj ? find(pi, pj) : find(pj, pi);
+	return at < 0 ? 0 : Z[at];
+}
+
+void CSparseCholesky::positions(const sp_matrix& A, std::vector<int>& at) const
+{
+	at.resize(A.nnz());
+	for (int j = 0; j < A.n; j++)
+		for (int p = A.p[j]; p < A.p[j + 1]; p++)
+		{
+			int pi = m_pinv[A.i[p]], pj = m_pinv[j];
+			at[p] = pi >= pj ? find(pi, pj) : find(pj, pi);
+		}
+}
@@ -0,0 +1,144 @@
+#pragma once
+//
+// Sparse matrices for the network solvers: compressed column storage, a minimum degree
+// ordering for symmetric patterns and a left-looking LU (Gilbert-Peierls) with threshold
+// partial pivoting. factor() finds the pivots and the pattern of L and U; refactor() reuses
+// both for a matrix with the same pattern and only recomputes the values, which is what a
+// Newton iteration needs after the first one. Symmetric positive definite matrices (the
+// estimator's gain matrix) have an up-looking Cholesky whose analysis is done once per
+// pattern in the same way, and whose factor takes rank one updates and downdates.
+//
+#include <vector>
+
+// compressed column: column j holds rows i[p[j] .. p[j+1]) with values x[...]
+struct sp_matrix
+{
+	int m;
+	int n;
+	std::vector<int> p;
+	std::vector<int> i;
+	std::vector<double> x;
+
+	sp_matrix() : m(0), n(0) {}
+	int nnz() const { return p.empty() ? 0 : p[n]; }
+};
+
+// (row, column, value) entries in any order; duplicates are summed by compress()
+class CSparseBuilder
+{
+public:
+	CSparseBuilder(int m, int n) : m_m(m), m_n(n) {}
+	void add(int row, int col, double value);
+	void compress(sp_matrix& out) const;   // rows sorted within each column
+
+private:
+	struct entry
+	{
+		int row;
+		int col;
+		double value;
+	};
+	int m_m;
+	int m_n;
+	std::vector<entry> m_Entries;
+};
+
+class CSparseOrdering
+{
+public:
+	// minimum degree elimination order of the graph adj (symmetric, no self loops);
+	// order[k] is the node eliminated k-th
+	static void minimumDegree(const std::vector< std::vector<int> >& adj, std::vector<int>& order);
+};
+
+class CSparseLU
+{
+public:
+	CSparseLU();
+
+	// L U = P A Q with Q = q (identity when q is empty); a column's own row is taken as pivot
+	// when it is within tol of the largest candidate, so a well ordered matrix keeps its order
+	bool factor(const sp_matrix& A, const std::vector<int>& q, double tol = 0.1);
+	// same pivots and pattern as the last factor(); false when a pivot became too small
+	bool refactor(const sp_matrix& A);
+	// x = A^-1 b, b and x may be the same vector
+	void solve(const std::vector<double>& b, std::vector<double>& x) const { solve(b, x, m_work); }
+	// the same with the caller's scratch, so several threads can solve with one factorization
+	void solve(const std::vector<double>& b, std::vector<double>& x, std::vector<double>& work) const;
+
+	bool factored() const { return m_n > 0; }
+	int fill() const { return (int)(m_Li.size() + m_Ui.size()); }   // nonzeros of L and U
+
+private:
+	int reach(const sp_matrix& A, int col);
+	int dfs(int j, int top);
+	void spsolve(const sp_matrix& A, int col, int top);
+
+	int m_n;
+	std::vector<int> m_q;        // column order
+	std::vector<int> m_pinv;     // row -> pivot position
+	std::vector<int> m_Lp, m_Li; // unit lower, pivot first in each column, rows as positions
+	std::vector<double> m_Lx;
+	std::vector<int> m_Up, m_Ui; // upper, diagonal last in each column
+	std::vector<double> m_Ux;
+
+	// scratch
+	std::vector<double> m_x;
+	std::vector<int> m_xi;
+	std::vector<int> m_stack;    // dfs nodes, then their next child (2n)
+	std::vector<char> m_mark;
+	mutable std::vector<double> m_work;
+};
+
+// L L^T = P A P^T for a symmetric positive definite A given with both triangles
+class CSparseCholesky
+{
+public:
+	CSparseCholesky();
+
+	// elimination tree and pattern of L for A's pattern; order[k] is the row of A eliminated k-th
+	bool analyze(const sp_matrix& A, const std::vector<int>& order);
+	// values of L for a matrix with the analyzed pattern; false if A is not positive definite
+	bool factor(const sp_matrix& A);
+	// x = A^-1 b, b and x may be the same vector
+	void solve(const std::vector<double>& b, std::vector<double>& x) const { solve(b, x, m_work); }
+	// the same with the caller's scratch, so several threads can solve with one factorization
+	void solve(const std::vector<double>& b, std::vector<double>& x, std::vector<double>& work) const;
+	// L L^T +/- v v^T without a new factorization, for v whose pattern is that of a column (or
+	// row) of A: only the path from v's first entry up the elimination tree changes. rows are
+	// rows of A. false when a downdate would leave a matrix that is not positive definite,
+	// and the factor is then to be computed again
+	bool update(const std::vector<int>& rows, const std::vector<double>& values, bool bDowndate);
+	// the entries of A^-1 on the pattern of L (which holds A's own pattern), by the Takahashi
+	// recurrence from the last column back; Z is laid out like L, read it with inverse()
+	void inverseSubset(std::vector<double>& Z) const;
+	double inverse(const std::vector<double>& Z, int i, int j) const;   // A^-1(i, j), 0 off the pattern
+	// where each entry of A (analyzed pattern) is in Z, for repeated reads without a search
+	void positions(const sp_matrix& A, std::vector<int>& at) const;
+
+	bool analyzed() const { return m_n > 0; }
+	bool factored() const { return m_bFactored; }
+	int fill() const { return (int)m_Li.size(); }   // nonzeros of L
+
+private:
+	int ereach(int k);
+	int find(int i, int j) const;   // entry of L at row i, column j (positions, i >= j), -1 if none
+
+	int m_n;
+	std::vector<int> m_perm;     // position -> row of A
+	std::vector<int> m_pinv;     // row of A -> position
+	std::vector<int> m_Cp, m_Ci; // upper triangle of P A P^T
+	std::vector<double> m_Cx;
+	std::vector<int> m_map;      // entry of A -> entry of C, -1 below the diagonal
+	std::vector<int> m_parent;   // elimination tree
+	std::vector<int> m_Lp, m_Li; // diagonal first in each column, rows ascending
+	std::vector<double> m_Lx;
+	bool m_bFactored;
+
+	// scratch
+	std::vector<double> m_x;
+	std::vector<int> m_s;        // row pattern from ereach()
+	std::vector<int> m_c;
+	std::vector<int> m_mark;
+	mutable std::vector<double> m_work;
+};
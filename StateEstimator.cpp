@@ -0,0 +1,924 @@
+#include "stdafx.h"
+#include "StateEstimator.h"
+#include <math.h>
+#include <ctype.h>
+#include <time.h>
+#include <algorithm>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+static const double PI = 3.14159265358979323846;
+
+static int typeOf(const std::string& s)
+{
+	static const char* names[] = { "V", "P", "Q", "PF", "QF", "PT", "QT", "CB" };
+	for (size_t t = 0; t < sizeof(names) / sizeof(names[0]); t++)
+	{
+		const char* n = names[t];
+		size_t k = 0;
+		while (k < s.size() && n[k] && toupper((unsigned char)s[k]) == n[k])
+			k++;
+		if (k == s.size() && n[k] == 0)
+			return SE_VM + (int)t;
+	}
+	return 0;
+}
+
+static bool busType(int type)
+{
+	return type == SE_VM || type == SE_PINJ || type == SE_QINJ;
+}
+
+static unsigned __int64 pointKey(unsigned short ca, unsigned int address)
+{
+	return ((unsigned __int64)ca << 32) | address;
+}
+
+CStateEstimator::CStateEstimator()
+{
+	m_nPoints = 0;
+	m_bTopology = false;
+	m_bObserve = false;
+	m_nIslands = 0;
+	m_ref = -1;
+	m_nState = 0;
+	m_bGain = false;
+}
+
+bool CStateEstimator::readCsv(const char* file, const CPowerModel& model, std::vector<se_measurement>& meas)
+{
+	std::vector< std::vector<std::string> > rows;
+	if (!csvRows(file, rows))
+	{
+		TRACE(_T("CStateEstimator::readCsv, Failed to read the measurement file\n"));
+		return false;
+	}
+	const std::vector<std::string>& h = rows[0];
+	int cCa = csvColumn(h, "ca", 0), cAddress = csvColumn(h, "address", 1), cType = csvColumn(h, "type", 2);
+	int cElement = csvColumn(h, "element", 3), cSigma = csvColumn(h, "sigma", 4), cScale = csvColumn(h, "scale", 5);
+
+	se_measurement m;
+	m.value = 0;
+	m.valid = false;
+	m.suspect = false;
+	m.pseudo = false;
+	for (size_t i = 1; i < rows.size(); i++)
+	{
+		const std::vector<std::string>& v = rows[i];
+		if (v.empty())
+			continue;
+		m.type = cType < (int)v.size() ? typeOf(v[cType]) : 0;
+		m.ca = (unsigned short)csvValue(v, cCa, 0);
+		m.address = (unsigned int)csvValue(v, cAddress, 0);
+		m.scale = csvValue(v, cScale, 1.0);
+		m.sigma = csvValue(v, cSigma, m.type == SE_VM ? 0.005 : (m.type == SE_PINJ || m.type == SE_QINJ ? 2.0 : 1.0));
+		int element = (int)csvValue(v, cElement, -1);
+		m.element = -1;
+		if (busType(m.type))
+			m.element = model.busIndex(element);
+		else if (m.type != 0)
+			for (size_t l = 0; l < model.branches.size() && m.element < 0; l++)
+				if (model.branches[l].line == element)
+					m.element = (int)l;
+		if (m.element < 0 || m.sigma <= 0)
+		{
+			TRACE(_T("CStateEstimator::readCsv, Row %d has an unknown type or element\n"), (int)i);
+			continue;
+		}
+		meas.push_back(m);
+	}
+	return true;
+}
+
+bool CStateEstimator::setModel(const CPowerModel& model, const std::vector<se_measurement>& meas)
+{
+	m_Model = model;
+	m_Meas = meas;
+	m_nPoints = (int)meas.size();
+	m_Points.clear();
+	for (int m = 0; m < m_nPoints; m++)
+		m_Points[pointKey(m_Meas[m].ca, m_Meas[m].address)] = m;
+
+	//a pseudo V, P and Q per bus, in use when observe() places them; an injection's standard
+	//deviation is a share of the bus's peak load, fixed so a rank one downdate takes out what
+	//the update put in
+	se_measurement z;
+	z.ca = 0;
+	z.address = 0;
+	z.scale = 1;
+	z.value = 0;
+	z.valid = false;
+	z.suspect = false;
+	z.pseudo = true;
+	for (size_t k = 0; k < model.buses.size(); k++)
+	{
+		double peak = fabs(model.buses[k].pd);
+		for (size_t h = 0; h < 24 && !model.profile.empty(); h++)
+			peak = std::max(peak, fabs(model.profile[24 * k + h]));
+		z.element = (int)k;
+		z.type = SE_VM;
+		z.sigma = 0.05;
+		m_Meas.push_back(z);
+		z.type = SE_PINJ;
+		z.sigma = std::max(0.3 * peak, 1.0);
+		m_Meas.push_back(z);
+		z.type = SE_QINJ;
+		m_Meas.push_back(z);
+	}
+	m_vm.clear();
+	m_va.clear();
+	return prepare();
+}
+
+bool CStateEstimator::prepare()
+{
+	m_bTopology = false;
+	m_bObserve = true;
+	m_bGain = false;
+	m_inGain.assign(m_Meas.size(), 0);
+	int n = (int)m_Model.buses.size();
+	m_Model.makeYbus(m_Y, true);
+	m_Branch.resize(m_Model.branches.size());
+	for (size_t l = 0; l < m_Model.branches.size(); l++)
+	{
+		std::complex<double> yff, yft, ytf, ytt;
+		CPowerModel::branchAdmittance(m_Model.branches[l], yff, yft, ytf, ytt);
+		se_branch& y = m_Branch[l];
+		y.gff = yff.real(); y.bff = yff.imag(); y.gft = yft.real(); y.bft = yft.imag();
+		y.gtt = ytt.real(); y.btt = ytt.imag(); y.gtf = ytf.real(); y.btf = ytf.imag();
+		if (!m_Model.branches[l].status)
+			y = se_branch();
+	}
+
+	//the island of the first slack bus is estimated, its angle is the reference
+	m_ref = -1;
+	for (int k = 0; k < n && m_ref < 0; k++)
+		if (m_Model.buses[k].type == PF_SLACK)
+			m_ref = k;
+	m_active.assign(n, 0);
+	m_nState = 0;
+	m_th.assign(n, -1);
+	m_v.assign(n, -1);
+	m_Hp.assign(m_Meas.size() + 1, 0);
+	m_Hc.clear();
+	if (m_ref < 0)
+	{
+		m_Chol = CSparseCholesky();
+		return false;
+	}
+	std::vector<int> queue(1, m_ref);
+	m_active[m_ref] = 1;
+	for (size_t head = 0; head < queue.size(); head++)
+	{
+		int i = queue[head];
+		for (int p = m_Y.p[i]; p < m_Y.p[i + 1]; p++)
+			if (!m_active[m_Y.j[p]] && (m_Y.g[p] != 0 || m_Y.b[p] != 0))
+			{
+				m_active[m_Y.j[p]] = 1;
+				queue.push_back(m_Y.j[p]);
+			}
+	}
+
+	//buses each measurement depends on; they are coupled in G
+	std::vector< std::vector<int> > adj(n);
+	std::vector<int> dep;
+	for (size_t m = 0; m < m_Meas.size(); m++)
+	{
+		const se_measurement& z = m_Meas[m];
+		dep.clear();
+		if (busType(z.type) && m_active[z.element])
+		{
+			dep.push_back(z.element);
+			if (z.type != SE_VM)
+				for (int p = m_Y.p[z.element]; p < m_Y.p[z.element + 1]; p++)
+					if (m_Y.j[p] != z.element)
+						dep.push_back(m_Y.j[p]);
+		}
+		else if (z.type >= SE_PF && z.type <= SE_QT)
+		{
+			const pf_branch& br = m_Model.branches[z.element];
+			if (m_active[br.from] && m_active[br.to])
+			{
+				dep.push_back(br.from);
+				dep.push_back(br.to);
+			}
+		}
+		for (size_t a = 0; a < dep.size(); a++)
+			for (size_t b = 0; b < dep.size(); b++)
+				if (a != b)
+					adj[dep[a]].push_back(dep[b]);
+	}
+	std::vector<int> order;
+	CSparseOrdering::minimumDegree(adj, order);
+	for (int t = 0; t < n; t++)
+	{
+		int k = order[t];
+		if (!m_active[k])
+			continue;
+		if (k != m_ref)
+			m_th[k] = m_nState++;
+		m_v[k] = m_nState++;
+	}
+
+	//terms of each measurement, in the order evaluate() fills them
+	for (size_t m = 0; m < m_Meas.size(); m++)
+	{
+		const se_measurement& z = m_Meas[m];
+		if (busType(z.type) && m_active[z.element])
+		{
+			int k = z.element;
+			if (z.type != SE_VM)
+				m_Hc.push_back(m_th[k]);
+			m_Hc.push_back(m_v[k]);
+			if (z.type != SE_VM)
+				for (int p = m_Y.p[k]; p < m_Y.p[k + 1]; p++)
+					if (m_Y.j[p] != k)
+					{
+						m_Hc.push_back(m_th[m_Y.j[p]]);
+						m_Hc.push_back(m_v[m_Y.j[p]]);
+					}
+		}
+		else if (z.type >= SE_PF && z.type <= SE_QT)
+		{
+			const pf_branch& br = m_Model.branches[z.element];
+			if (m_active[br.from] && m_active[br.to])
+			{
+				m_Hc.push_back(m_th[br.from]);
+				m_Hc.push_back(m_v[br.from]);
+				m_Hc.push_back(m_th[br.to]);
+				m_Hc.push_back(m_v[br.to]);
+			}
+		}
+		m_Hp[m + 1] = (int)m_Hc.size();
+	}
+	m_Hx.resize(m_Hc.size());
+
+	//pattern of G and where each product of two terms lands in it
+	CSparseBuilder builder(m_nState, m_nState);
+	for (int s = 0; s < m_nState; s++)
+		builder.add(s, s, 0);
+	for (size_t m = 0; m < m_Meas.size(); m++)
+		for (int a = m_Hp[m]; a < m_Hp[m + 1]; a++)
+			for (int b = m_Hp[m]; b < m_Hp[m + 1]; b++)
+				if (m_Hc[a] >= 0 && m_Hc[b] >= 0 && m_Hc[a] != m_Hc[b])
+					builder.add(m_Hc[a], m_Hc[b], 0);
+	builder.compress(m_G);
+	m_Gp.assign(m_Meas.size() + 1, 0);
+	m_Gpos.clear();
+	for (size_t m = 0; m < m_Meas.size(); m++)
+	{
+		for (int a = m_Hp[m]; a < m_Hp[m + 1]; a++)
+			for (int b = m_Hp[m]; b < m_Hp[m + 1]; b++)
+			{
+				int pos = -1;
+				if (m_Hc[a] >= 0 && m_Hc[b] >= 0)
+				{
+					std::vector<int>::const_iterator first = m_G.i.begin() + m_G.p[m_Hc[b]];
+					std::vector<int>::const_iterator last = m_G.i.begin() + m_G.p[m_Hc[b] + 1];
+					pos = (int)(std::lower_bound(first, last, m_Hc[a]) - m_G.i.begin());
+				}
+				m_Gpos.push_back(pos);
+			}
+		m_Gp[m + 1] = (int)m_Gpos.size();
+	}
+
+	std::vector<int> identity(m_nState);
+	for (int s = 0; s < m_nState; s++)
+		identity[s] = s;
+	if (!m_Chol.analyze(m_G, identity))
+		return false;
+	m_Chol.positions(m_G, m_Zpos);
+	return true;
+}
+
+//root of k's island, halving the path on the way
+static int root(std::vector<int>& uf, int k)
+{
+	while (uf[k] != k)
+	{
+		uf[k] = uf[uf[k]];
+		k = uf[k];
+	}
+	return k;
+}
+
+//the island other than k's own among k and its neighbours, -1 if there is none, -2 if more than one
+static int otherIsland(const pf_ybus& Y, int k, std::vector<int>& uf)
+{
+	int own = root(uf, k), other = -1;
+	for (int p = Y.p[k]; p < Y.p[k + 1]; p++)
+	{
+		if (Y.g[p] == 0 && Y.b[p] == 0)
+			continue;   //out of service
+		int r = root(uf, Y.j[p]);
+		if (r == own || r == other)
+			continue;
+		if (other >= 0)
+			return -2;
+		other = r;
+	}
+	return other;
+}
+
+//joins the two islands of each injection that touches two, until none does; returns the joins
+static int joinInjections(const pf_ybus& Y, const std::vector<char>& inj, std::vector<int>& uf)
+{
+	int joins = 0;
+	bool bJoined = true;
+	while (bJoined)
+	{
+		bJoined = false;
+		for (int k = 0; k < Y.n; k++)
+		{
+			if (!inj[k])
+				continue;
+			int r = otherIsland(Y, k, uf);
+			if (r < 0)
+				continue;
+			uf[r] = root(uf, k);
+			joins++;
+			bJoined = true;
+		}
+	}
+	return joins;
+}
+
+void CStateEstimator::observe()
+{
+	m_bObserve = false;
+	int n = (int)m_Model.buses.size();
+	for (size_t m = m_nPoints; m < m_Meas.size(); m++)
+		m_Meas[m].valid = false;
+	m_island.assign(n, -1);
+	m_nIslands = 0;
+	if (m_ref < 0)
+		return;
+
+	//what each bus and branch has, one bit per type; P and Q together count
+	std::vector<char> bus(n, 0), branch(m_Model.branches.size(), 0);
+	for (int m = 0; m < m_nPoints; m++)
+	{
+		if (!used(m))
+			continue;
+		const se_measurement& z = m_Meas[m];
+		if (busType(z.type))
+			bus[z.element] |= 1 << (z.type - SE_VM);
+		else if (z.type >= SE_PF && z.type <= SE_QT)
+			branch[z.element] |= 1 << (z.type - SE_PF);
+	}
+	std::vector<int> uf(n);
+	for (int k = 0; k < n; k++)
+		uf[k] = k;
+	for (size_t l = 0; l < branch.size(); l++)
+		if (m_Model.branches[l].status && ((branch[l] & 3) == 3 || (branch[l] & 12) == 12))
+		{
+			int a = root(uf, m_Model.branches[l].from), b = root(uf, m_Model.branches[l].to);
+			if (a != b)
+				uf[a] = b;
+		}
+	std::vector<char> inj(n, 0);
+	for (int k = 0; k < n; k++)
+		inj[k] = m_active[k] && (bus[k] & 6) == 6;
+	joinInjections(m_Y, inj, uf);
+
+	//islands numbered from the reference bus's
+	std::vector<int> number(n, -1);
+	number[root(uf, m_ref)] = m_nIslands++;
+	for (int k = 0; k < n; k++)
+		if (m_active[k])
+		{
+			int r = root(uf, k);
+			if (number[r] < 0)
+				number[r] = m_nIslands++;
+			m_island[k] = number[r];
+		}
+
+	//a pseudo-injection where it joins two islands, and whatever the real ones join after it
+	int left = m_nIslands, placed = 0;
+	bool bPlaced = true;
+	while (left > 1 && bPlaced)
+	{
+		bPlaced = false;
+		for (int k = 0; k < n && left > 1; k++)
+		{
+			if (!m_active[k] || inj[k])
+				continue;
+			int r = otherIsland(m_Y, k, uf);
+			if (r < 0)
+				continue;
+			uf[r] = root(uf, k);
+			inj[k] = 1;
+			m_Meas[m_nPoints + 3 * k + 1].valid = m_Meas[m_nPoints + 3 * k + 2].valid = true;
+			left -= 1 + joinInjections(m_Y, inj, uf);
+			placed++;
+			bPlaced = true;
+		}
+	}
+	if (left > 1)
+	{ //no single one joins what is left: every bus outside the reference island gets one
+		int ref = root(uf, m_ref);
+		for (int k = 0; k < n; k++)
+			if (m_active[k] && !inj[k] && root(uf, k) != ref)
+			{
+				m_Meas[m_nPoints + 3 * k + 1].valid = m_Meas[m_nPoints + 3 * k + 2].valid = true;
+				placed++;
+			}
+	}
+
+	//and the voltage level needs one magnitude
+	bool bVoltage = false;
+	for (int k = 0; k < n && !bVoltage; k++)
+		bVoltage = (bus[k] & 1) != 0;
+	if (!bVoltage)
+	{
+		m_Meas[m_nPoints + 3 * m_ref].valid = true;
+		placed++;
+	}
+	TRACE(_T("CStateEstimator::observe, %d observable islands, %d pseudo-measurements\n"), m_nIslands, placed);
+}
+
+void CStateEstimator::pseudoValues(int hour)
+{
+	if (hour < 0)
+	{
+		time_t now = time(NULL);
+		hour = localtime(&now)->tm_hour;
+	}
+	for (size_t k = 0; k < m_Model.buses.size(); k++)
+	{
+		const pf_bus& bus = m_Model.buses[k];
+		double load = m_Model.profile.empty() ? bus.pd : m_Model.profile[24 * k + hour % 24];
+		se_measurement* z = &m_Meas[m_nPoints + 3 * k];
+		z[0].value = bus.vm;
+		z[1].value = bus.pg - load;
+		z[2].value = bus.qg - (bus.pd != 0 ? bus.qd * load / bus.pd : bus.qd);
+	}
+}
+
+int CStateEstimator::measure(const std::vector<pdb_point>& points)
+{
+	int changed = 0;
+	for (size_t i = 0; i < points.size(); i++)
+	{
+		const pdb_point& pt = points[i];
+		std::unordered_map<unsigned __int64, int>::const_iterator it = m_Points.find(pointKey(pt.ca, pt.address));
+		if (it == m_Points.end())
+			continue;
+		se_measurement& z = m_Meas[it->second];
+		bool bValid = (pt.quality & (PDB_QUALITY_IV | PDB_QUALITY_NT)) == 0;
+		double value = pt.value * z.scale;
+		if (z.type == SE_BREAKER)
+		{ //a double point is closed at 2, open at 1 and undetermined otherwise
+			if (pt.type == iec104_class::M_DP_NA_1 || pt.type == iec104_class::M_DP_TB_1)
+			{
+				bValid = bValid && (pt.value == 1 || pt.value == 2);
+				value = pt.value == 2 ? 1 : 0;
+			}
+			else
+				value = pt.value != 0 ? 1 : 0;
+			if (bValid && m_Model.branches[z.element].status != (value != 0))
+				switchBranch(z.element, value != 0);
+		}
+		if (value != z.value || bValid != z.valid)
+		{
+			changed++;
+			m_bObserve = m_bObserve || bValid != z.valid || z.suspect;
+			z.suspect = false;   //a new value gets a new chance
+		}
+		z.value = value;
+		z.valid = bValid;
+	}
+	return changed;
+}
+
+double CStateEstimator::evaluate(int m, const std::vector<double>& vm, const std::vector<double>& va)
+{
+	const se_measurement& z = m_Meas[m];
+	double* H = &m_Hx[0] + m_Hp[m];
+	if (z.type == SE_VM)
+	{
+		H[0] = 1;
+		return vm[z.element];
+	}
+	if (z.type == SE_PINJ || z.type == SE_QINJ)
+	{
+		int k = z.element;
+		double Vk = vm[k], P = 0, Q = 0, Gkk = 0, Bkk = 0;
+		int t = 2;
+		bool bP = z.type == SE_PINJ;
+		for (int p = m_Y.p[k]; p < m_Y.p[k + 1]; p++)
+		{
+			int j = m_Y.j[p];
+			double G = m_Y.g[p], B = m_Y.b[p];
+			if (j == k)
+			{
+				Gkk = G;
+				Bkk = B;
+				continue;
+			}
+			double Vj = vm[j], c = cos(va[k] - va[j]), s = sin(va[k] - va[j]);
+			double gcbs = G * c + B * s, gsbc = G * s - B * c;
+			P += Vk * Vj * gcbs;
+			Q += Vk * Vj * gsbc;
+			H[t++] = bP ? Vk * Vj * gsbc : -Vk * Vj * gcbs;
+			H[t++] = bP ? Vk * gcbs : Vk * gsbc;
+		}
+		P += Vk * Vk * Gkk;
+		Q -= Vk * Vk * Bkk;
+		if (bP)
+		{
+			H[0] = -Q - Bkk * Vk * Vk;
+			H[1] = P / Vk + Gkk * Vk;
+			return P;
+		}
+		H[0] = P - Gkk * Vk * Vk;
+		H[1] = Q / Vk - Bkk * Vk;
+		return Q;
+	}
+
+	//flow at one end: terms are th(from), V(from), th(to), V(to)
+	const pf_branch& br = m_Model.branches[z.element];
+	const se_branch& y = m_Branch[z.element];
+	bool bFrom = z.type == SE_PF || z.type == SE_QF;
+	int i = bFrom ? br.from : br.to, j = bFrom ? br.to : br.from;
+	int ti = bFrom ? 0 : 2, tj = bFrom ? 2 : 0;
+	double gii = bFrom ? y.gff : y.gtt, bii = bFrom ? y.bff : y.btt;
+	double gij = bFrom ? y.gft : y.gtf, bij = bFrom ? y.bft : y.btf;
+	double Vi = vm[i], Vj = vm[j], c = cos(va[i] - va[j]), s = sin(va[i] - va[j]);
+	double gcbs = gij * c + bij * s, gsbc = gij * s - bij * c;
+	if (z.type == SE_PF || z.type == SE_PT)
+	{
+		H[ti] = -Vi * Vj * gsbc;
+		H[tj] = Vi * Vj * gsbc;
+		H[ti + 1] = 2 * Vi * gii + Vj * gcbs;
+		H[tj + 1] = Vi * gcbs;
+		return Vi * Vi * gii + Vi * Vj * gcbs;
+	}
+	H[ti] = Vi * Vj * gcbs;
+	H[tj] = -Vi * Vj * gcbs;
+	H[ti + 1] = -2 * Vi * bii + Vj * gsbc;
+	H[tj + 1] = Vi * gsbc;
+	return -Vi * Vi * bii + Vi * Vj * gsbc;
+}
+
+void CStateEstimator::gain(const std::vector<double>& vm, const std::vector<double>& va, std::vector<double>& rhs, bool bMatrix)
+{
+	double base = m_Model.baseMVA;
+	if (bMatrix)
+		std::fill(m_G.x.begin(), m_G.x.end(), 0.0);
+	rhs.assign(m_nState, 0.0);
+	for (size_t m = 0; m < m_Meas.size(); m++)
+	{
+		const se_measurement& z = m_Meas[m];
+		int first = m_Hp[m], count = m_Hp[m + 1] - first;
+		if (!used((int)m))
+			continue;
+		double unit = z.type == SE_VM ? 1.0 : base;
+		double w = unit * unit / (z.sigma * z.sigma);
+		double r = z.value / unit - evaluate((int)m, vm, va);
+		const int* pos = &m_Gpos[m_Gp[m]];
+		for (int a = 0; a < count; a++)
+		{
+			int ca = m_Hc[first + a];
+			if (ca < 0)
+				continue;
+			double wha = w * m_Hx[first + a];
+			rhs[ca] += wha * r;
+			if (bMatrix)
+				for (int b = 0; b < count; b++)
+					if (pos[a * count + b] >= 0)
+						m_G.x[pos[a * count + b]] += wha * m_Hx[first + b];
+		}
+	}
+}
+
+double CStateEstimator::step(std::vector<double>& vm, std::vector<double>& va, const std::vector<double>& dx) const
+{
+	double change = 0;
+	for (size_t k = 0; k < vm.size(); k++)
+	{
+		if (m_th[k] >= 0)
+			va[k] += dx[m_th[k]];
+		if (m_v[k] >= 0)
+			vm[k] += dx[m_v[k]];
+	}
+	for (int s = 0; s < m_nState; s++)
+		change = std::max(change, fabs(dx[s]));
+	return change;
+}
+
+bool CStateEstimator::updateGain(int m, bool bDowndate)
+{
+	//a measurement adds w h h^T, h its row where the gain was formed
+	const se_measurement& z = m_Meas[m];
+	double unit = z.type == SE_VM ? 1.0 : m_Model.baseMVA;
+	double sw = unit / z.sigma;
+	std::vector<int> rows;
+	std::vector<double> values;
+	evaluate(m, m_vm0, m_va0);
+	for (int a = m_Hp[m]; a < m_Hp[m + 1]; a++)
+		if (m_Hc[a] >= 0 && m_Hx[a] != 0)
+		{
+			rows.push_back(m_Hc[a]);
+			values.push_back(sw * m_Hx[a]);
+		}
+	if (!m_Chol.update(rows, values, bDowndate))
+		m_bGain = false;
+	return m_bGain;
+}
+
+bool CStateEstimator::trackGain()
+{
+	if (!m_bGain || !m_Chol.factored())
+		return false;
+	std::vector<int> changed;
+	for (size_t m = 0; m < m_Meas.size(); m++)
+		if (used((int)m) != (m_inGain[m] != 0))
+			changed.push_back((int)m);
+	if ((int)changed.size() > m_nState / 20 + 1)
+		return false;   //a new factorization costs less
+
+	for (size_t c = 0; c < changed.size(); c++)
+	{
+		int m = changed[c];
+		if (!updateGain(m, !used(m)))
+			return false;
+		m_inGain[m] = used(m);
+	}
+	return true;
+}
+
+void CStateEstimator::switchBranch(int branch, bool bInService)
+{
+	pf_branch& br = m_Model.branches[branch];
+	if (m_bTopology || !m_active[br.from] || !m_active[br.to])
+	{ //energizing a dead part starts the preparation over
+		br.status = bInService;
+		m_bTopology = true;
+		return;
+	}
+
+	//the rows the branch is in leave the gain as they were and come back as they are now
+	std::vector<int> rows;
+	for (size_t m = 0; m < m_Meas.size(); m++)
+	{
+		const se_measurement& z = m_Meas[m];
+		if (((z.type == SE_PINJ || z.type == SE_QINJ) && (z.element == br.from || z.element == br.to)) ||
+			(z.type >= SE_PF && z.type <= SE_QT && z.element == branch))
+			if (m_inGain[m])
+				rows.push_back((int)m);
+	}
+	for (size_t r = 0; r < rows.size() && m_bGain; r++)
+		updateGain(rows[r], true);
+	br.status = bInService;
+	m_Model.stampBranch(m_Y, branch, bInService ? 1 : -1);
+	se_branch& y = m_Branch[branch];
+	y = se_branch();
+	if (bInService)
+	{
+		std::complex<double> yff, yft, ytf, ytt;
+		CPowerModel::branchAdmittance(br, yff, yft, ytf, ytt);
+		y.gff = yff.real(); y.bff = yff.imag(); y.gft = yft.real(); y.bft = yft.imag();
+		y.gtt = ytt.real(); y.btt = ytt.imag(); y.gtf = ytf.real(); y.btf = ytf.imag();
+	}
+	for (size_t r = 0; r < rows.size() && m_bGain; r++)
+		updateGain(rows[r], false);
+	m_bObserve = true;
+
+	//opening the last way between two parts leaves one without the reference
+	if (!bInService)
+	{
+		std::vector<char> seen(m_Model.buses.size(), 0);
+		std::vector<int> queue(1, br.from);
+		seen[br.from] = 1;
+		for (size_t head = 0; head < queue.size() && !seen[br.to]; head++)
+			for (int p = m_Y.p[queue[head]]; p < m_Y.p[queue[head] + 1]; p++)
+				if (!seen[m_Y.j[p]] && (m_Y.g[p] != 0 || m_Y.b[p] != 0))
+				{
+					seen[m_Y.j[p]] = 1;
+					queue.push_back(m_Y.j[p]);
+				}
+		m_bTopology = !seen[br.to];
+	}
+}
+
+bool CStateEstimator::iterate(std::vector<double>& vm, std::vector<double>& va, const se_options& opt, int& iterations, bool& bTracked)
+{
+	std::vector<double> rhs, dx;
+	if (opt.tracking && trackGain())
+	{ //the gain of an earlier state: an iteration is the right hand side and two triangular solves
+		std::vector<double> vmStart(vm), vaStart(va);
+		double last = 0;
+		for (int it = 0; it < opt.maxIterations; it++)
+		{
+			gain(vm, va, rhs, false);
+			m_Chol.solve(rhs, dx);
+			double change = step(vm, va, dx);
+			iterations++;
+			if (change < opt.tolerance)
+			{
+				bTracked = true;
+				return true;
+			}
+			if (it > 0 && change > last)
+				break;
+			last = change;
+		}
+		vm = vmStart;   //too far from where the gain was formed, Gauss-Newton from the start
+		va = vaStart;
+	}
+
+	for (int it = 0; it < opt.maxIterations; it++)
+	{
+		gain(vm, va, rhs, true);
+		m_bGain = m_Chol.factor(m_G);
+		if (!m_bGain)
+		{
+			TRACE(_T("CStateEstimator::iterate, Gain matrix is singular, the network is not observable\n"));
+			return false;
+		}
+		for (size_t m = 0; m < m_Meas.size(); m++)
+			m_inGain[m] = used((int)m);
+		m_vm0 = vm;
+		m_va0 = va;
+		m_Chol.solve(rhs, dx);
+		iterations++;
+		if (step(vm, va, dx) < opt.tolerance)
+			return true;
+	}
+	return false;
+}
+
+int CStateEstimator::normalize(const std::vector<double>& vm, const std::vector<double>& va, std::vector<double>& rN)
+{
+	//Omega = R - H G^-1 H^T; the diagonal only needs G^-1 where two states share a measurement,
+	//which is inside the pattern of G. G is the one the estimate converged with
+	std::vector<double> Z;
+	rN.assign(m_Meas.size(), 0);
+	if (!m_Chol.factored())
+		return -1;
+	m_Chol.inverseSubset(Z);
+
+	double base = m_Model.baseMVA;
+	int worst = -1;
+	for (size_t m = 0; m < m_Meas.size(); m++)
+	{
+		if (!used((int)m) || m_Meas[m].pseudo)
+			continue;
+		const se_measurement& z = m_Meas[m];
+		int first = m_Hp[m], count = m_Hp[m + 1] - first;
+		double unit = z.type == SE_VM ? 1.0 : base;
+		double r = z.value / unit - evaluate((int)m, vm, va);
+		const int* pos = &m_Gpos[m_Gp[m]];
+		double hZh = 0;
+		for (int a = 0; a < count; a++)
+			for (int b = 0; b < count; b++)
+				if (pos[a * count + b] >= 0)
+					hZh += m_Hx[first + a] * m_Hx[first + b] * Z[m_Zpos[pos[a * count + b]]];
+		double R = z.sigma * z.sigma / (unit * unit);
+		double omega = R - hZh;
+		if (omega < 1e-6 * R)
+			continue;   //critical, its error cannot be told from the state's
+		rN[m] = fabs(r) / sqrt(omega);
+		if (worst < 0 || rN[m] > rN[worst])
+			worst = (int)m;
+	}
+	return worst;
+}
+
+//value of the chi-square distribution with dof degrees of freedom that is exceeded with
+//probability 1 - confidence, by the Wilson-Hilferty transform of the normal quantile
+static double chiSquare(int dof, double confidence)
+{
+	double t = sqrt(-2 * log(1 - confidence));
+	double z = t - (2.515517 + 0.802853 * t + 0.010328 * t * t) / (1 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+	double a = 2.0 / (9.0 * dof);
+	double c = 1 - a + z * sqrt(a);
+	return dof * c * c * c;
+}
+
+bool CStateEstimator::estimate(se_result& res, const se_options& opt)
+{
+	res = se_result();
+	if (m_bTopology)
+		prepare();
+	if (!m_Chol.analyzed())
+		return false;
+	if (m_bObserve)
+		observe();
+	pseudoValues(opt.hour);
+	res.islands = m_nIslands;
+	res.island = m_island;
+
+	int nMeas = 0;
+	for (size_t m = 0; m < m_Meas.size(); m++)
+		if (used((int)m))
+		{
+			nMeas++;
+			res.pseudo += m_Meas[m].pseudo;
+		}
+	if (nMeas < m_nState)
+	{
+		TRACE(_T("CStateEstimator::estimate, %d measurements for %d states\n"), nMeas, m_nState);
+		return false;
+	}
+
+	int n = (int)m_Model.buses.size();
+	std::vector<double> vm(n, 1.0), va(n, m_Model.buses[m_ref].va * PI / 180);
+	if (opt.tracking && (int)m_vm.size() == n)
+	{
+		vm = m_vm;
+		va = m_va;
+	}
+	res.converged = iterate(vm, va, opt, res.iterations, res.tracked);
+	res.measurements = nMeas - res.pseudo;
+	finish(vm, va, res);
+
+	//while the residuals are too large for the redundancy, the measurement with the largest
+	//normalized residual goes and the estimate goes on from where it was
+	int removed = 0;
+	while (opt.badData && res.converged && nMeas > m_nState)
+	{
+		res.threshold = chiSquare(nMeas - m_nState, opt.confidence);
+		if (res.objective <= res.threshold)
+			break;
+		int worst = normalize(vm, va, res.normalized);
+		if (worst < 0 || res.normalized[worst] < opt.identify || removed >= opt.maxRemovals)
+		{
+			res.badData = true;
+			break;
+		}
+		TRACE(_T("CStateEstimator::estimate, Point %d:%u is suspect, normalized residual %.1f\n"),
+			(int)m_Meas[worst].ca, m_Meas[worst].address, res.normalized[worst]);
+		m_Meas[worst].suspect = true;
+		removed++;
+		nMeas--;
+		res.measurements--;
+		res.converged = iterate(vm, va, opt, res.iterations, res.tracked);
+		finish(vm, va, res);
+	}
+	for (size_t m = 0; m < m_Meas.size(); m++)
+		res.suspects += m_Meas[m].suspect;
+	if (res.converged)
+	{
+		m_vm = vm;
+		m_va = va;
+	}
+	return res.converged;
+}
+
+void CStateEstimator::finish(const std::vector<double>& vm, const std::vector<double>& va, se_result& res)
+{
+	int n = (int)m_Model.buses.size();
+	double base = m_Model.baseMVA;
+	res.vm.assign(n, 0);
+	res.va.assign(n, 0);
+	for (int k = 0; k < n; k++)
+		if (m_active[k])
+		{
+			res.vm[k] = vm[k];
+			res.va[k] = va[k] * 180 / PI;
+		}
+
+	//every measurement gets its estimate, the missing ones included
+	res.estimate.assign(m_Meas.size(), 0);
+	res.objective = 0;
+	for (size_t m = 0; m < m_Meas.size(); m++)
+	{
+		const se_measurement& z = m_Meas[m];
+		if (m_Hp[m + 1] == m_Hp[m])
+		{
+			if (z.type == SE_BREAKER)
+				res.estimate[m] = m_Model.branches[z.element].status ? 1 : 0;
+			continue;
+		}
+		double unit = z.type == SE_VM ? 1.0 : base;
+		res.estimate[m] = evaluate((int)m, vm, va) * unit;
+		if (used((int)m))
+		{
+			double r = (z.value - res.estimate[m]) / z.sigma;
+			res.objective += r * r;
+		}
+	}
+
+	res.flows.resize(m_Model.branches.size());
+	for (size_t l = 0; l < m_Model.branches.size(); l++)
+	{
+		const pf_branch& br = m_Model.branches[l];
+		pf_flow& f = res.flows[l];
+		f.pf = f.qf = f.pt = f.qt = 0;
+		if (!br.status || !m_active[br.from])
+			continue;
+		std::complex<double> yff, yft, ytf, ytt;
+		CPowerModel::branchAdmittance(br, yff, yft, ytf, ytt);
+		std::complex<double> Vf = std::polar(vm[br.from], va[br.from]), Vt = std::polar(vm[br.to], va[br.to]);
+		std::complex<double> Sf = Vf * std::conj(yff * Vf + yft * Vt) * base;
+		std::complex<double> St = Vt * std::conj(ytf * Vf + ytt * Vt) * base;
+		f.pf = Sf.real();
+		f.qf = Sf.imag();
+		f.pt = St.real();
+		f.qt = St.imag();
+	}
+}
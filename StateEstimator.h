@@ -0,0 +1,183 @@
+#pragma once
+//
+// Weighted least squares state estimation on a CPowerModel from the point database. Each
+// measurement (a bus voltage magnitude or injection, a flow at one end of a branch) is a
+// point with its standard deviation; the estimate is the set of bus voltages that minimises
+// the sum of ((z - h(x)) / sigma)^2 over the points that are valid, found by Gauss-Newton on
+// the normal equations G dx = H^T W (z - h(x)), G = H^T W H.
+//
+// G has the same pattern in every iteration and every cycle as long as the topology and the
+// list of measurements stay the same (a missing value only changes numbers), so its ordering,
+// the position of each measurement's terms in it and the symbolic Cholesky analysis are done
+// when the model is set, and an iteration only refills and refactors it. Breaker points
+// switch their branch in and out of service. A branch out of service keeps its place in Ybus
+// and in G with zeros, so a switch changes the branch's admittances in Ybus and, in the
+// factorized gain, the rows of the measurements it is in (downdated as they were, updated as
+// they are); only energizing a dead part or splitting one off starts the preparation over.
+//
+// Bad data: when the weighted sum of squared residuals exceeds what the redundancy allows
+// (a chi-square test), the measurement with the largest normalized residual r / sqrt(Omega),
+// Omega = R - H G^-1 H^T, is marked suspect and the estimate goes on without it from the
+// state it had reached. Omega's diagonal only needs G^-1 where two states share a
+// measurement, which the Takahashi recurrence gives on the pattern of the factor without
+// inverting G. A suspect stays out until its point brings a new value.
+//
+// Tracking: consecutive cycles differ little, so a tracking estimate starts from the last one
+// and keeps the factorized gain of an earlier state for as long as the iterations with it
+// converge; a cycle is then the right hand side and a forward and back substitution per
+// iteration. Points that go invalid or come back change the gain by w h h^T each, applied as
+// rank one downdates and updates of the factor rather than a new factorization.
+//
+// Observability: a branch with both flows measured at one end joins its buses' observable
+// islands, and a bus with both injections measured joins the two islands its own and its
+// neighbours' buses fall into when there are only two; this goes on until nothing joins.
+// When points are missing and more than one island is left, pseudo-injections from the
+// buses' load profiles are placed where one joins two islands, one per island to join,
+// and at every bus of what is left if that does not get there. Every bus has a slot for
+// a pseudo-measurement from the start, so placing one changes no pattern, and the analysis
+// only runs again when a point's validity changes.
+//
+// measdata.csv maps points to measurements: ca,address,type,element,sigma,scale with type one
+// of V, P, Q (bus injection, generation less load), PF, QF, PT, QT (flow into the branch at
+// its from or to end) or CB (breaker), element the bus_i of a bus or the row of a branch in
+// branchdata.csv, and the point's value times scale in pu for V, MW / MVAr otherwise.
+//
+#include "PowerFlow.h"
+#include "PointDatabase.h"
+#include <unordered_map>
+
+#define SE_VM		1   // bus voltage magnitude, pu
+#define SE_PINJ		2   // bus injection, MW
+#define SE_QINJ		3   // MVAr
+#define SE_PF		4   // flow into the branch at its from end, MW
+#define SE_QF		5   // MVAr
+#define SE_PT		6   // at its to end, MW
+#define SE_QT		7   // MVAr
+#define SE_BREAKER	8   // branch in service when closed, single or double point
+
+struct se_measurement
+{
+	int type;
+	int element;            // bus or branch of the model
+	unsigned short ca;
+	unsigned int address;
+	double scale;           // point value times scale is in the unit of the type
+	double sigma;           // standard deviation, same unit
+	double value;           // last value, scaled
+	bool valid;             // received, and neither iv nor nt
+	bool suspect;           // left out as bad data until the value changes
+	bool pseudo;            // placed by the observability analysis, not a point
+};
+
+struct se_options
+{
+	int maxIterations;
+	double tolerance;       // largest state change, pu / radians
+	bool badData;           // detect and identify bad data
+	double confidence;      // of the chi-square detection test
+	double identify;        // smallest normalized residual taken for bad data
+	int maxRemovals;        // measurements made suspect in one estimate at most
+	bool tracking;          // from the last estimate with the gain it was made with
+	int hour;               // of the load profile for pseudo-measurements, -1 for the hour now
+
+	se_options() : maxIterations(10), tolerance(1e-4), badData(true), confidence(0.99), identify(3.0), maxRemovals(5),
+		tracking(false), hour(-1) {}
+};
+
+struct se_result
+{
+	bool converged;
+	bool tracked;                 // converged with an earlier gain
+	int iterations;
+	int measurements;             // valid points in the estimate
+	int pseudo;                   // pseudo-measurements in the estimate
+	int islands;                  // observable islands of the valid points
+	std::vector<int> island;      // per bus, 0 for the reference bus's island, -1 outside the estimate
+	double objective;             // weighted sum of squared residuals
+	double threshold;             // chi-square limit of the objective, 0 when not tested
+	bool badData;                 // the test failed and no suspect could be identified
+	int suspects;                 // measurements left out as bad data
+	std::vector<double> normalized;  // per measurement, from the last identification
+	std::vector<double> vm, va;   // pu / degrees, 0 on buses outside the estimated island
+	std::vector<pf_flow> flows;   // per model branch, MW / MVAr
+	std::vector<double> estimate; // per measurement, h(x) in its unit
+
+	se_result() : converged(false), tracked(false), iterations(0), measurements(0), pseudo(0), islands(0), objective(0), threshold(0), badData(false), suspects(0) {}
+};
+
+class CStateEstimator
+{
+public:
+	CStateEstimator();
+
+	// measurements of the map file, elements resolved against the model; unknown ones are skipped
+	static bool readCsv(const char* file, const CPowerModel& model, std::vector<se_measurement>& meas);
+
+	// copies the model and the measurement list and prepares the gain matrix
+	bool setModel(const CPowerModel& model, const std::vector<se_measurement>& meas);
+	// new values from the point database, a whole snapshot or the changes since the last call;
+	// returns the number of measurements that changed value or validity
+	int measure(const std::vector<pdb_point>& points);
+	bool estimate(se_result& res, const se_options& opt = se_options());
+
+	const CPowerModel& model() const { return m_Model; }
+	// the points of setModel() in their order, then a pseudo V, P and Q per bus
+	const std::vector<se_measurement>& measurements() const { return m_Meas; }
+	int states() const { return m_nState; }
+	int gainFill() const { return m_Chol.fill(); }
+
+private:
+	bool prepare();
+	// observable islands of the valid points, and the pseudo-measurements that join them
+	void observe();
+	void pseudoValues(int hour);
+	bool used(int m) const { return m_Meas[m].valid && !m_Meas[m].suspect && m_Hp[m + 1] > m_Hp[m]; }
+	// H^T W (z - h(x)) at vm/va, and G when bMatrix
+	void gain(const std::vector<double>& vm, const std::vector<double>& va, std::vector<double>& rhs, bool bMatrix);
+	double step(std::vector<double>& vm, std::vector<double>& va, const std::vector<double>& dx) const;
+	// brings the factorized gain up to date with the measurements in use; false if it has to be formed again
+	bool trackGain();
+	bool updateGain(int m, bool bDowndate);
+	void switchBranch(int branch, bool bInService);
+	bool iterate(std::vector<double>& vm, std::vector<double>& va, const se_options& opt, int& iterations, bool& bTracked);
+	// normalized residuals at vm/va into rN; returns the largest, -1 if none
+	int normalize(const std::vector<double>& vm, const std::vector<double>& va, std::vector<double>& rN);
+	// h(x) of measurement m and its row of H, in the order of m_Hc
+	double evaluate(int m, const std::vector<double>& vm, const std::vector<double>& va);
+	void finish(const std::vector<double>& vm, const std::vector<double>& va, se_result& res);
+
+	struct se_branch
+	{
+		double gff, bff, gft, bft;   // from end: If = yff Vf + yft Vt
+		double gtt, btt, gtf, btf;   // to end: It = ytf Vf + ytt Vt
+	};
+
+	CPowerModel m_Model;
+	std::vector<se_measurement> m_Meas;
+	int m_nPoints;                          // m_Meas[0 .. m_nPoints) are points
+	std::unordered_map<unsigned __int64, int> m_Points;   // ca << 32 | address -> m_Meas
+	bool m_bTopology;                       // a breaker moved since prepare()
+	bool m_bObserve;                        // a point's validity changed since observe()
+	std::vector<int> m_island;
+	int m_nIslands;
+
+	pf_ybus m_Y;
+	std::vector<se_branch> m_Branch;
+	std::vector<char> m_active;             // bus reaches the reference bus
+	int m_ref;
+	std::vector<int> m_th, m_v;             // state of a bus's angle and magnitude, -1 if none
+	int m_nState;
+
+	std::vector<int> m_Hp;                  // measurement m has terms m_Hp[m] .. m_Hp[m+1)
+	std::vector<int> m_Hc;                  // state of each term, -1 for the reference angle
+	std::vector<double> m_Hx;               // dh/dx at the current state
+	std::vector<int> m_Gp;                  // terms a, b of m go to m_G.x[m_Gpos[m_Gp[m] + a * count + b]]
+	std::vector<int> m_Gpos;
+	sp_matrix m_G;
+	CSparseCholesky m_Chol;
+	std::vector<int> m_Zpos;                // entry of m_G -> entry of the inverse subset
+	bool m_bGain;                           // m_Chol holds a gain for this topology
+	std::vector<char> m_inGain;             // measurement is in that gain
+	std::vector<double> m_vm0, m_va0;       // state the gain was formed at, radians
+	std::vector<double> m_vm, m_va;         // last estimate, radians
+};
@@ -0,0 +1,268 @@
+#include "stdafx.h"
+#include "TelemetryBus.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// telemetry_filter
+
+telemetry_filter::telemetry_filter()
+{
+	bAllTypes = true;
+	memset(types, 0, sizeof(types));
+}
+
+void telemetry_filter::onlyType(unsigned char type)
+{
+	bAllTypes = false;
+	types[type >> 6] |= 1ull << (type & 63);
+}
+
+void telemetry_filter::onlyCA(unsigned short ca)
+{
+	cas.push_back(ca);
+}
+
+void telemetry_filter::onlyAddresses(unsigned int first, unsigned int last)
+{
+	addresses.push_back(std::make_pair(first, last));
+}
+
+bool telemetry_filter::matchCA(unsigned short ca) const
+{
+	if (cas.empty())
+		return true;
+	for (size_t i = 0; i < cas.size(); i++)
+	{
+		if (cas[i] == ca)
+			return true;
+	}
+	return false;
+}
+
+bool telemetry_filter::matchAddress(unsigned int address) const
+{
+	if (addresses.empty())
+		return true;
+	for (size_t i = 0; i < addresses.size(); i++)
+	{
+		if (address >= addresses[i].first && address <= addresses[i].second)
+			return true;
+	}
+	return false;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CTelemetrySubscription
+
+CTelemetrySubscription::CTelemetrySubscription(LPCTSTR lpszName, const telemetry_filter& filter, size_t maxDepth, telemetry_overflow overflow)
+	: m_sName(lpszName), m_filter(filter)
+{
+	m_maxDepth = (maxDepth > 0) ? maxDepth : 1;
+	m_overflow = overflow;
+	m_hRoom = CreateEvent(NULL, TRUE, TRUE, NULL);
+	m_bClosed = false;
+	m_hWnd = NULL;
+	m_nMsg = 0;
+	m_hEvent = NULL;
+	m_bSignalled = false;
+	memset(&m_stats, 0, sizeof(m_stats));
+	InitializeCriticalSection(&m_cs);
+}
+
+CTelemetrySubscription::~CTelemetrySubscription()
+{
+	CloseHandle(m_hRoom);
+	DeleteCriticalSection(&m_cs);
+}
+
+bool CTelemetrySubscription::accepts(const telemetry_batch& batch) const
+{
+	//mixed batches are queued and filtered per object by the consumer
+	if (!batch.uniform)
+		return true;
+	return m_filter.matchType(batch.type) && m_filter.matchCA(batch.ca);
+}
+
+void CTelemetrySubscription::push(const telemetry_ptr& batch)
+{
+	EnterCriticalSection(&m_cs);
+	if (m_overflow == TELEMETRY_BLOCK && m_Queue.size() >= m_maxDepth && !m_bClosed)
+	{
+		//the consumer was notified and is still draining, pop() sets m_hRoom
+		m_stats.blocked++;
+		while (m_Queue.size() >= m_maxDepth && !m_bClosed)
+		{
+			ResetEvent(m_hRoom);
+			LeaveCriticalSection(&m_cs);
+			WaitForSingleObject(m_hRoom, INFINITE);
+			EnterCriticalSection(&m_cs);
+		}
+	}
+	if (m_Queue.size() >= m_maxDepth)
+	{
+		m_Queue.pop_front();
+		m_stats.dropped++;
+	}
+	m_Queue.push_back(batch);
+	m_stats.enqueued++;
+	m_stats.objects += batch->obj.size();
+	if (m_Queue.size() > m_stats.highWater)
+		m_stats.highWater = (unsigned int)m_Queue.size();
+	bool bNotify = !m_bSignalled;
+	m_bSignalled = true;
+	LeaveCriticalSection(&m_cs);
+
+	//one wake up per drain, not one per batch
+	if (bNotify)
+	{
+		if (m_hWnd != NULL)
+			::PostMessage(m_hWnd, m_nMsg, 0, (LPARAM)this);
+		if (m_hEvent != NULL)
+			SetEvent(m_hEvent);
+	}
+}
+
+bool CTelemetrySubscription::pop(telemetry_ptr& batch)
+{
+	bool bFound = false;
+	EnterCriticalSection(&m_cs);
+	if (m_Queue.empty())
+		m_bSignalled = false;
+	else
+	{
+		batch.swap(m_Queue.front());
+		m_Queue.pop_front();
+		m_stats.delivered++;
+		bFound = true;
+		if (m_overflow == TELEMETRY_BLOCK && m_Queue.size() + 1 == m_maxDepth)
+			SetEvent(m_hRoom);
+	}
+	LeaveCriticalSection(&m_cs);
+	return bFound;
+}
+
+void CTelemetrySubscription::close()
+{
+	EnterCriticalSection(&m_cs);
+	m_bClosed = true;
+	SetEvent(m_hRoom);
+	LeaveCriticalSection(&m_cs);
+}
+
+void CTelemetrySubscription::getStats(telemetry_stats& stats)
+{
+	EnterCriticalSection(&m_cs);
+	stats = m_stats;
+	stats.depth = (unsigned int)m_Queue.size();
+	LeaveCriticalSection(&m_cs);
+}
+
+//////////////////////////////////////////////////////////////////////
+// CTelemetryBus
+
+CTelemetryBus::CTelemetryBus()
+	: m_pSubs(new sub_list)
+{
+	m_seq = 0;
+	InitializeCriticalSection(&m_cs);
+}
+
+CTelemetryBus::~CTelemetryBus()
+{
+	DeleteCriticalSection(&m_cs);
+}
+
+void CTelemetryBus::add(const telemetry_sub& pSub)
+{
+	EnterCriticalSection(&m_cs);
+	std::shared_ptr<sub_list> pNew(new sub_list(*m_pSubs));
+	pNew->push_back(pSub);
+	m_pSubs = pNew;
+	LeaveCriticalSection(&m_cs);
+}
+
+telemetry_sub CTelemetryBus::subscribeWindow(LPCTSTR lpszName, const telemetry_filter& filter, HWND hWnd, UINT nMsg, size_t maxDepth)
+{
+	telemetry_sub pSub(new CTelemetrySubscription(lpszName, filter, maxDepth, TELEMETRY_DROP_OLDEST));
+	pSub->m_hWnd = hWnd;
+	pSub->m_nMsg = nMsg;
+	add(pSub);
+	return pSub;
+}
+
+telemetry_sub CTelemetryBus::subscribeEvent(LPCTSTR lpszName, const telemetry_filter& filter, HANDLE hEvent, size_t maxDepth,
+	telemetry_overflow overflow)
+{
+	telemetry_sub pSub(new CTelemetrySubscription(lpszName, filter, maxDepth, overflow));
+	pSub->m_hEvent = hEvent;
+	add(pSub);
+	return pSub;
+}
+
+void CTelemetryBus::unsubscribe(const telemetry_sub& pSub)
+{
+	EnterCriticalSection(&m_cs);
+	std::shared_ptr<sub_list> pNew(new sub_list);
+	for (size_t i = 0; i < m_pSubs->size(); i++)
+	{
+		if ((*m_pSubs)[i] != pSub)
+			pNew->push_back((*m_pSubs)[i]);
+	}
+	m_pSubs = pNew;
+	LeaveCriticalSection(&m_cs);
+	//a publish that still holds the old list may be waiting on it
+	if (pSub)
+		pSub->close();
+}
+
+void CTelemetryBus::publish(const iec_obj* obj, int numpoints, __int64 rxtime)
+{
+	if (numpoints <= 0)
+		return;
+
+	std::shared_ptr<telemetry_batch> pBatch(new telemetry_batch);
+	pBatch->rxtime = rxtime;
+	pBatch->obj.assign(obj, obj + numpoints);
+	pBatch->type = obj[0].type;
+	pBatch->ca = obj[0].ca;
+	pBatch->uniform = true;
+	for (int i = 1; i < numpoints; i++)
+	{
+		if (obj[i].type != pBatch->type || obj[i].ca != pBatch->ca)
+		{
+			pBatch->uniform = false;
+			break;
+		}
+	}
+
+	EnterCriticalSection(&m_cs);
+	pBatch->seq = ++m_seq;
+	std::shared_ptr<const sub_list> pSubs = m_pSubs;
+	LeaveCriticalSection(&m_cs);
+
+	telemetry_ptr pShared(pBatch);
+	for (size_t i = 0; i < pSubs->size(); i++)
+	{
+		CTelemetrySubscription* pSub = (*pSubs)[i].get();
+		if (pSub->accepts(*pShared))
+			pSub->push(pShared);
+	}
+}
+
+unsigned __int64 CTelemetryBus::published()
+{
+	EnterCriticalSection(&m_cs);
+	unsigned __int64 seq = m_seq;
+	LeaveCriticalSection(&m_cs);
+	return seq;
+}
+
+void CTelemetryBus::subscriptions(std::vector<telemetry_sub>& out)
+{
+	EnterCriticalSection(&m_cs);
+	out.assign(m_pSubs->begin(), m_pSubs->end());
+	LeaveCriticalSection(&m_cs);
+}
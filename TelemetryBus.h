@@ -0,0 +1,129 @@
+#pragma once
+//
+// Telemetry bus: every dataIndication batch is copied once into an immutable, reference
+// counted batch and queued to each subscriber whose filter can match it. Subscribers drain
+// their own queue on their own thread, woken by a posted window message or an event.
+// A full queue either drops its oldest batch, for consumers that only show the latest
+// values, or holds up the publisher until the consumer makes room, for consumers that
+// must see every sample (TCP flow control then reaches the RTU). Both are counted.
+//
+#include "iec104_class.h"
+#include <vector>
+#include <deque>
+#include <memory>
+
+struct telemetry_batch
+{
+	unsigned __int64 seq;      // publish order, starts at 1
+	__int64 rxtime;            // ms since 1970-01-01 UTC
+	bool uniform;              // all objects share type and ca (one ASDU)
+	unsigned char type;        // valid when uniform
+	unsigned short ca;         // valid when uniform
+	std::vector<iec_obj> obj;
+};
+typedef std::shared_ptr<const telemetry_batch> telemetry_ptr;
+
+struct telemetry_filter
+{
+	telemetry_filter();        // passes everything
+	// the first call of each kind restricts the filter, later calls widen it again
+	void onlyType(unsigned char type);
+	void onlyCA(unsigned short ca);
+	void onlyAddresses(unsigned int first, unsigned int last);
+
+	bool matchType(unsigned char type) const
+		{ return bAllTypes || (types[type >> 6] & (1ull << (type & 63))) != 0; }
+	bool matchCA(unsigned short ca) const;
+	bool matchAddress(unsigned int address) const;
+	bool matches(const iec_obj& obj) const
+		{ return matchType(obj.type) && matchCA(obj.ca) && matchAddress(obj.address); }
+
+	bool bAllTypes;
+	unsigned __int64 types[4];
+	std::vector<unsigned short> cas;
+	std::vector< std::pair<unsigned int, unsigned int> > addresses;
+};
+
+// what push() does with a full queue
+enum telemetry_overflow
+{
+	TELEMETRY_DROP_OLDEST,       // the oldest batch is discarded
+	TELEMETRY_BLOCK              // the publisher waits for room, dropped only once unsubscribed
+};
+
+struct telemetry_stats
+{
+	unsigned __int64 enqueued;   // batches queued
+	unsigned __int64 delivered;  // batches popped
+	unsigned __int64 dropped;    // batches discarded on overflow
+	unsigned __int64 blocked;    // pushes that waited for room
+	unsigned __int64 objects;    // objects in the queued batches
+	unsigned int depth;          // batches waiting now
+	unsigned int highWater;      // largest depth seen
+};
+
+class CTelemetrySubscription
+{
+public:
+	~CTelemetrySubscription();
+
+	// next batch for this subscriber; drain until it returns false, the next batch
+	// published after that notifies again
+	bool pop(telemetry_ptr& batch);
+	// per object check, batches were only prefiltered on type and ca
+	bool matches(const iec_obj& obj) const { return m_filter.matches(obj); }
+	const telemetry_filter& filter() const { return m_filter; }
+	const CString& name() const { return m_sName; }
+	void getStats(telemetry_stats& stats);
+
+private:
+	friend class CTelemetryBus;
+	CTelemetrySubscription(LPCTSTR lpszName, const telemetry_filter& filter, size_t maxDepth, telemetry_overflow overflow);
+	bool accepts(const telemetry_batch& batch) const;
+	void push(const telemetry_ptr& batch);
+	void close();              // unsubscribed: a blocked push returns and drops
+
+	CString m_sName;
+	telemetry_filter m_filter;
+	size_t m_maxDepth;
+	telemetry_overflow m_overflow;
+	HANDLE m_hRoom;            // manual reset, set while the queue has room or is closed
+	bool m_bClosed;
+	HWND m_hWnd;
+	UINT m_nMsg;
+	HANDLE m_hEvent;
+	std::deque<telemetry_ptr> m_Queue;
+	bool m_bSignalled;
+	telemetry_stats m_stats;
+	CRITICAL_SECTION m_cs;
+};
+typedef std::shared_ptr<CTelemetrySubscription> telemetry_sub;
+
+class CTelemetryBus
+{
+public:
+	CTelemetryBus();
+	~CTelemetryBus();
+
+	// nMsg is posted to hWnd with the subscription as lParam; a full queue drops, the window
+	// thread must never hold up the receive thread
+	telemetry_sub subscribeWindow(LPCTSTR lpszName, const telemetry_filter& filter, HWND hWnd, UINT nMsg, size_t maxDepth = 4096);
+	// hEvent is set, use an auto reset event; with TELEMETRY_BLOCK the consumer must not publish
+	telemetry_sub subscribeEvent(LPCTSTR lpszName, const telemetry_filter& filter, HANDLE hEvent, size_t maxDepth = 4096,
+		telemetry_overflow overflow = TELEMETRY_DROP_OLDEST);
+	void unsubscribe(const telemetry_sub& pSub);
+
+	// called on the receive thread, waits while a blocking subscriber's queue is full
+	void publish(const iec_obj* obj, int numpoints, __int64 rxtime);
+	unsigned __int64 published();
+	void subscriptions(std::vector<telemetry_sub>& out);
+
+private:
+	typedef std::vector<telemetry_sub> sub_list;
+	void add(const telemetry_sub& pSub);
+
+	// replaced, never modified, so publish() only holds the lock to copy the pointer
+	std::shared_ptr<const sub_list> m_pSubs;
+	unsigned __int64 m_seq;
+	CRITICAL_SECTION m_cs;
+};
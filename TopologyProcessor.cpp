@@ -0,0 +1,567 @@
+#include "stdafx.h"
+#include "TopologyProcessor.h"
+#include <limits.h>
+#include <algorithm>
+#include <map>
+#include <string>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CTopologyProcessor::CTopologyProcessor()
+{
+}
+
+bool CTopologyProcessor::readCsv(const char* nodeFile, const char* switchFile, const char* branchFile,
+	std::vector<tp_node>& nodes, std::vector<tp_switch>& switches, std::vector<pf_branch>& branches)
+{
+	std::vector< std::vector<std::string> > nodeRows, switchRows, branchRows;
+	if (!csvRows(nodeFile, nodeRows) || !csvRows(switchFile, switchRows) || !csvRows(branchFile, branchRows))
+	{
+		TRACE(_T("CTopologyProcessor::readCsv, Failed to read the node, switch or branch file\n"));
+		return false;
+	}
+
+	const std::vector<std::string>& nh = nodeRows[0];
+	int cNode = csvColumn(nh, "node", 0), cStation = csvColumn(nh, "station", 1), cType = csvColumn(nh, "type", 2);
+	int cPd = csvColumn(nh, "pd"), cQd = csvColumn(nh, "qd"), cGs = csvColumn(nh, "gs"), cBs = csvColumn(nh, "bs");
+	int cPg = csvColumn(nh, "pg"), cQg = csvColumn(nh, "qg"), cVm = csvColumn(nh, "vm"), cKV = csvColumn(nh, "baseKV");
+
+	nodes.clear();
+	std::map<int, int> index;   // node number -> nodes
+	tp_node node;
+	for (size_t i = 1; i < nodeRows.size(); i++)
+	{
+		const std::vector<std::string>& v = nodeRows[i];
+		if (v.empty())
+			continue;
+		node.number = (int)csvValue(v, cNode, 0);
+		node.station = (int)csvValue(v, cStation, 0);
+		node.type = (int)csvValue(v, cType, PF_PQ);
+		if (node.type != PF_PV && node.type != PF_SLACK)
+			node.type = PF_PQ;
+		node.pd = csvValue(v, cPd, 0);
+		node.qd = csvValue(v, cQd, 0);
+		node.gs = csvValue(v, cGs, 0);
+		node.bs = csvValue(v, cBs, 0);
+		node.pg = csvValue(v, cPg, 0);
+		node.qg = csvValue(v, cQg, 0);
+		node.vm = csvValue(v, cVm, 1.0);
+		node.baseKV = csvValue(v, cKV, 0);
+		if (!index.insert(std::make_pair(node.number, (int)nodes.size())).second)
+		{
+			TRACE(_T("CTopologyProcessor::readCsv, Node %d is there twice\n"), node.number);
+			continue;
+		}
+		nodes.push_back(node);
+	}
+
+	const std::vector<std::string>& sh = switchRows[0];
+	int cFrom = csvColumn(sh, "from", 0), cTo = csvColumn(sh, "to", 1), cStatus = csvColumn(sh, "status", 2);
+	int cCA = csvColumn(sh, "ca", 3), cAddress = csvColumn(sh, "address", 4);
+
+	switches.clear();
+	tp_switch sw;
+	for (size_t i = 1; i < switchRows.size(); i++)
+	{
+		const std::vector<std::string>& v = switchRows[i];
+		if (v.empty())
+			continue;
+		std::map<int, int>::const_iterator f = index.find((int)csvValue(v, cFrom, 0));
+		std::map<int, int>::const_iterator t = index.find((int)csvValue(v, cTo, 0));
+		if (f == index.end() || t == index.end() || f->second == t->second)
+		{
+			TRACE(_T("CTopologyProcessor::readCsv, Switch %d has an unknown node\n"), (int)i);
+			continue;
+		}
+		sw.from = f->second;
+		sw.to = t->second;
+		sw.closed = csvValue(v, cStatus, 1) != 0;
+		sw.ca = (unsigned short)csvValue(v, cCA, 0);
+		sw.address = (unsigned int)csvValue(v, cAddress, 0);
+		switches.push_back(sw);
+	}
+
+	const std::vector<std::string>& lh = branchRows[0];
+	int cF = csvColumn(lh, "fnode", 0), cT = csvColumn(lh, "tnode", 1);
+	int cR = csvColumn(lh, "r"), cX = csvColumn(lh, "x"), cB = csvColumn(lh, "b"), cRatio = csvColumn(lh, "ratio");
+	int cAngle = csvColumn(lh, "angle"), cRate = csvColumn(lh, "rate"), cOn = csvColumn(lh, "status");
+
+	branches.clear();
+	pf_branch br;
+	for (size_t i = 1; i < branchRows.size(); i++)
+	{
+		const std::vector<std::string>& v = branchRows[i];
+		if (v.empty())
+			continue;
+		std::map<int, int>::const_iterator f = index.find((int)csvValue(v, cF, 0));
+		std::map<int, int>::const_iterator t = index.find((int)csvValue(v, cT, 0));
+		if (f == index.end() || t == index.end())
+		{
+			TRACE(_T("CTopologyProcessor::readCsv, Branch %d has an unknown node\n"), (int)i);
+			continue;
+		}
+		br.from = f->second;
+		br.to = t->second;
+		br.line = (int)i - 1;
+		br.r = csvValue(v, cR, 0);
+		br.x = csvValue(v, cX, 0);
+		br.b = csvValue(v, cB, 0);
+		br.ratio = csvValue(v, cRatio, 0);
+		br.angle = csvValue(v, cAngle, 0);
+		br.rate = csvValue(v, cRate, 0);
+		br.status = csvValue(v, cOn, 1) != 0;
+		if (br.r == 0 && br.x == 0)
+		{
+			//there is no length to take typical values from, and a zero impedance is a switch
+			TRACE(_T("CTopologyProcessor::readCsv, Branch %d has no impedance\n"), (int)i);
+			continue;
+		}
+		branches.push_back(br);
+	}
+	return !nodes.empty();
+}
+
+void CTopologyProcessor::setModel(const std::vector<tp_node>& nodes, const std::vector<tp_switch>& switches,
+	const std::vector<pf_branch>& branches, double baseMVA)
+{
+	m_Nodes = nodes;
+	m_Switches = switches;
+	m_Model.baseMVA = baseMVA;
+	m_Model.branches = branches;
+	m_Model.profile.clear();
+	int n = (int)nodes.size();
+	int nl = (int)branches.size();
+
+	m_nodeFrom.resize(nl);
+	m_nodeTo.resize(nl);
+	for (int l = 0; l < nl; l++)
+	{
+		m_nodeFrom[l] = branches[l].from;
+		m_nodeTo[l] = branches[l].to;
+	}
+
+	//node -> switches and node -> branches
+	m_Swp.assign(n + 1, 0);
+	for (size_t s = 0; s < switches.size(); s++)
+	{
+		m_Swp[switches[s].from + 1]++;
+		m_Swp[switches[s].to + 1]++;
+	}
+	for (int k = 0; k < n; k++)
+		m_Swp[k + 1] += m_Swp[k];
+	m_Swl.resize(m_Swp[n]);
+	std::vector<int> next(m_Swp.begin(), m_Swp.end() - 1);
+	for (size_t s = 0; s < switches.size(); s++)
+	{
+		m_Swl[next[switches[s].from]++] = (int)s;
+		m_Swl[next[switches[s].to]++] = (int)s;
+	}
+	m_Brp.assign(n + 1, 0);
+	for (int l = 0; l < nl; l++)
+	{
+		m_Brp[m_nodeFrom[l] + 1]++;
+		if (m_nodeTo[l] != m_nodeFrom[l])
+			m_Brp[m_nodeTo[l] + 1]++;
+	}
+	for (int k = 0; k < n; k++)
+		m_Brp[k + 1] += m_Brp[k];
+	m_Brl.resize(m_Brp[n]);
+	next.assign(m_Brp.begin(), m_Brp.end() - 1);
+	for (int l = 0; l < nl; l++)
+	{
+		m_Brl[next[m_nodeFrom[l]]++] = l;
+		if (m_nodeTo[l] != m_nodeFrom[l])
+			m_Brl[next[m_nodeTo[l]]++] = l;
+	}
+
+	//a bus per set of nodes joined by closed switches
+	m_uf.resize(n);
+	for (int k = 0; k < n; k++)
+		m_uf[k] = k;
+	for (size_t s = 0; s < switches.size(); s++)
+	{
+		if (!switches[s].closed)
+			continue;
+		int a = root(switches[s].from), b = root(switches[s].to);
+		if (a != b)
+			m_uf[std::max(a, b)] = std::min(a, b);
+	}
+	m_busOf.assign(n, -1);
+	m_busNodes.clear();
+	for (int k = 0; k < n; k++)
+	{
+		int r = root(k);
+		if (m_busOf[r] < 0)
+		{
+			m_busOf[r] = (int)m_busNodes.size();
+			m_busNodes.push_back(std::vector<int>());
+		}
+		m_busOf[k] = m_busOf[r];
+		m_busNodes[m_busOf[k]].push_back(k);
+	}
+	int nb = (int)m_busNodes.size();
+	m_Model.buses.resize(nb);
+	for (int b = 0; b < nb; b++)
+		makeBus(b);
+	for (int l = 0; l < nl; l++)
+	{
+		m_Model.branches[l].from = m_busOf[m_nodeFrom[l]];
+		m_Model.branches[l].to = m_busOf[m_nodeTo[l]];
+	}
+
+	m_Points.clear();
+	for (size_t s = 0; s < switches.size(); s++)
+	{
+		if (switches[s].ca != 0)
+			m_Points[((unsigned __int64)switches[s].ca << 32) | switches[s].address] = (int)s;
+	}
+
+	//islands
+	m_island.assign(nb, -1);
+	m_Islands.clear();
+	m_freeIslands.clear();
+	for (int b = 0; b < nb; b++)
+	{
+		if (m_island[b] < 0)
+			label(b, -1, newIsland());
+	}
+	for (int k = 0; k < n; k++)
+	{
+		tp_island& isl = m_Islands[m_island[m_busOf[k]]];
+		isl.nodes++;
+		if (nodes[k].type != PF_PQ)
+			isl.sources++;
+	}
+
+	m_nodeMark.assign(n, 0);
+	m_busMark.assign(nb, 0);
+	TRACE(_T("CTopologyProcessor::setModel, %d nodes, %d buses, %d islands\n"), n, nb, islands());
+}
+
+bool CTopologyProcessor::setSwitch(int sw, bool bClosed)
+{
+	tp_switch& s = m_Switches[sw];
+	if (s.closed == bClosed)
+		return false;
+	s.closed = bClosed;
+	int a = m_busOf[s.from], b = m_busOf[s.to];
+	if (bClosed)
+	{
+		if (a == b)
+			return false;   //already joined through other switches
+		merge(a, b);
+		return true;
+	}
+	return split(a, s);
+}
+
+bool CTopologyProcessor::setBranch(int branch, bool bInService)
+{
+	pf_branch& br = m_Model.branches[branch];
+	if (br.status == bInService)
+		return false;
+	br.status = bInService;
+	if (br.from == br.to)
+		return true;
+	if (bInService)
+		join(br.from, br.to);
+	else
+		divide(br.from, br.to);
+	return true;
+}
+
+int CTopologyProcessor::findSwitch(unsigned short ca, unsigned int address) const
+{
+	std::unordered_map<unsigned __int64, int>::const_iterator it = m_Points.find(((unsigned __int64)ca << 32) | address);
+	return it == m_Points.end() ? -1 : it->second;
+}
+
+int CTopologyProcessor::root(int node)
+{
+	while (m_uf[node] != node)
+	{
+		m_uf[node] = m_uf[m_uf[node]];
+		node = m_uf[node];
+	}
+	return node;
+}
+
+void CTopologyProcessor::makeBus(int b)
+{
+	pf_bus& bus = m_Model.buses[b];
+	const std::vector<int>& nodes = m_busNodes[b];
+	bus.number = INT_MAX;
+	bus.station = m_Nodes[nodes[0]].station;
+	bus.type = PF_PQ;
+	bus.pd = bus.qd = bus.gs = bus.bs = bus.pg = bus.qg = 0;
+	bus.vm = 1.0;
+	bus.va = 0;
+	bus.baseKV = 0;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		const tp_node& node = m_Nodes[nodes[i]];
+		bus.number = std::min(bus.number, node.number);
+		if (node.type > bus.type)
+		{
+			bus.type = node.type;
+			bus.vm = node.vm;
+		}
+		bus.pd += node.pd;
+		bus.qd += node.qd;
+		bus.gs += node.gs;
+		bus.bs += node.bs;
+		bus.pg += node.pg;
+		bus.qg += node.qg;
+		bus.baseKV = std::max(bus.baseKV, node.baseKV);
+	}
+}
+
+void CTopologyProcessor::attach(int b)
+{
+	const std::vector<int>& nodes = m_busNodes[b];
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		int k = nodes[i];
+		for (int p = m_Brp[k]; p < m_Brp[k + 1]; p++)
+		{
+			pf_branch& br = m_Model.branches[m_Brl[p]];
+			if (m_nodeFrom[m_Brl[p]] == k)
+				br.from = b;
+			if (m_nodeTo[m_Brl[p]] == k)
+				br.to = b;
+		}
+	}
+}
+
+void CTopologyProcessor::removeBus(int b)
+{
+	int last = (int)m_Model.buses.size() - 1;
+	if (b != last)
+	{
+		m_Model.buses[b] = m_Model.buses[last];
+		m_busNodes[b].swap(m_busNodes[last]);
+		m_island[b] = m_island[last];
+		const std::vector<int>& nodes = m_busNodes[b];
+		for (size_t i = 0; i < nodes.size(); i++)
+			m_busOf[nodes[i]] = b;
+		attach(b);
+	}
+	m_Model.buses.pop_back();
+	m_busNodes.pop_back();
+	m_island.pop_back();
+}
+
+void CTopologyProcessor::merge(int a, int b)
+{
+	std::vector<int>& nodes = m_busNodes[a];
+	for (size_t i = 0; i < m_busNodes[b].size(); i++)
+	{
+		m_busOf[m_busNodes[b][i]] = a;
+		nodes.push_back(m_busNodes[b][i]);
+	}
+	m_busNodes[b].clear();
+	makeBus(a);
+	attach(a);
+
+	join(a, b);
+	removeBus(b);
+}
+
+void CTopologyProcessor::join(int a, int b)
+{
+	//the smaller island takes the larger one's label
+	int x = m_island[a], y = m_island[b];
+	if (x == y)
+		return;
+	int big = m_Islands[x].nodes >= m_Islands[y].nodes ? x : y;
+	int small = big == x ? y : x;
+	m_Islands[big].nodes += m_Islands[small].nodes;
+	m_Islands[big].sources += m_Islands[small].sources;
+	m_Islands[small].nodes = m_Islands[small].sources = 0;
+	m_freeIslands.push_back(small);
+	label(a, small, big);
+}
+
+bool CTopologyProcessor::split(int a, const tp_switch& sw)
+{
+	//nodes of the bus still reached from the switch's from end
+	std::vector<int>& queue = m_queue[0];
+	queue.clear();
+	queue.push_back(sw.from);
+	m_nodeMark[sw.from] = 1;
+	for (size_t h = 0; h < queue.size(); h++)
+	{
+		int k = queue[h];
+		for (int p = m_Swp[k]; p < m_Swp[k + 1]; p++)
+		{
+			const tp_switch& s = m_Switches[m_Swl[p]];
+			if (!s.closed)
+				continue;
+			int j = s.from == k ? s.to : s.from;
+			if (!m_nodeMark[j])
+			{
+				m_nodeMark[j] = 1;
+				queue.push_back(j);
+			}
+		}
+	}
+	bool bJoined = m_nodeMark[sw.to] != 0;
+	for (size_t h = 0; h < queue.size(); h++)
+		m_nodeMark[queue[h]] = 0;
+	if (bJoined)
+		return false;
+
+	//the rest of the nodes are a new bus
+	int c = (int)m_Model.buses.size();
+	std::vector<int> rest;
+	const std::vector<int>& nodes = m_busNodes[a];
+	for (size_t h = 0; h < queue.size(); h++)
+		m_nodeMark[queue[h]] = 1;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (!m_nodeMark[nodes[i]])
+		{
+			rest.push_back(nodes[i]);
+			m_busOf[nodes[i]] = c;
+		}
+	}
+	for (size_t h = 0; h < queue.size(); h++)
+		m_nodeMark[queue[h]] = 0;
+	m_busNodes[a] = queue;
+	m_busNodes.push_back(rest);
+	m_Model.buses.push_back(pf_bus());
+	m_island.push_back(m_island[a]);
+	if (m_busMark.size() < m_Model.buses.size())
+		m_busMark.resize(m_Model.buses.size(), 0);
+	makeBus(a);
+	makeBus(c);
+	attach(c);
+	divide(a, c);
+	return true;
+}
+
+void CTopologyProcessor::divide(int a, int c)
+{
+	//a search from each half, the smaller frontier first, until they meet or one runs out
+	std::vector<int>* side = m_queue;
+	side[0].clear();
+	side[1].clear();
+	side[0].push_back(a);
+	side[1].push_back(c);
+	m_busMark[a] = 1;
+	m_busMark[c] = 2;
+	size_t head[2] = { 0, 0 };
+	int alone = -1;
+	bool bMet = false;
+	while (!bMet)
+	{
+		if (head[0] == side[0].size())
+		{
+			alone = 0;
+			break;
+		}
+		if (head[1] == side[1].size())
+		{
+			alone = 1;
+			break;
+		}
+		int s = side[0].size() - head[0] <= side[1].size() - head[1] ? 0 : 1;
+		neighbours(side[s][head[s]++], m_nb);
+		for (size_t i = 0; i < m_nb.size() && !bMet; i++)
+		{
+			int j = m_nb[i];
+			if (m_busMark[j] == s + 1)
+				continue;
+			if (m_busMark[j] != 0)
+				bMet = true;
+			else
+			{
+				m_busMark[j] = (char)(s + 1);
+				side[s].push_back(j);
+			}
+		}
+	}
+	for (int s = 0; s < 2; s++)
+	{
+		for (size_t i = 0; i < side[s].size(); i++)
+			m_busMark[side[s][i]] = 0;
+	}
+
+	if (alone >= 0)
+	{
+		int old = m_island[a];
+		int isl = newIsland();
+		tp_island& part = m_Islands[isl];
+		for (size_t i = 0; i < side[alone].size(); i++)
+		{
+			int b = side[alone][i];
+			m_island[b] = isl;
+			const std::vector<int>& bn = m_busNodes[b];
+			part.nodes += (int)bn.size();
+			for (size_t k = 0; k < bn.size(); k++)
+			{
+				if (m_Nodes[bn[k]].type != PF_PQ)
+					part.sources++;
+			}
+		}
+		m_Islands[old].nodes -= part.nodes;
+		m_Islands[old].sources -= part.sources;
+	}
+}
+
+void CTopologyProcessor::label(int bus, int from, int to)
+{
+	std::vector<int>& queue = m_queue[0];
+	queue.clear();
+	queue.push_back(bus);
+	m_island[bus] = to;
+	for (size_t h = 0; h < queue.size(); h++)
+	{
+		neighbours(queue[h], m_nb);
+		for (size_t i = 0; i < m_nb.size(); i++)
+		{
+			int j = m_nb[i];
+			if (m_island[j] == from)
+			{
+				m_island[j] = to;
+				queue.push_back(j);
+			}
+		}
+	}
+}
+
+int CTopologyProcessor::newIsland()
+{
+	tp_island isl;
+	isl.nodes = isl.sources = 0;
+	if (!m_freeIslands.empty())
+	{
+		int i = m_freeIslands.back();
+		m_freeIslands.pop_back();
+		m_Islands[i] = isl;
+		return i;
+	}
+	m_Islands.push_back(isl);
+	return (int)m_Islands.size() - 1;
+}
+
+void CTopologyProcessor::neighbours(int bus, std::vector<int>& out) const
+{
+	out.clear();
+	const std::vector<int>& nodes = m_busNodes[bus];
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		int k = nodes[i];
+		for (int p = m_Brp[k]; p < m_Brp[k + 1]; p++)
+		{
+			const pf_branch& br = m_Model.branches[m_Brl[p]];
+			if (!br.status)
+				continue;
+			int j = br.from == bus ? br.to : br.from;
+			if (j != bus)
+				out.push_back(j);
+		}
+	}
+}
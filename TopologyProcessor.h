@@ -0,0 +1,106 @@
+#pragma once
+//
+// Topology processor: reduces a node-breaker model (connectivity nodes in substations,
+// switches between nodes of one substation, branches between any two nodes) to the bus/branch
+// model the solvers take. Nodes joined by closed switches are one bus (union-find over the
+// switches), a bus's loads, generation and shunts are its nodes', and a branch runs between
+// the buses of its end nodes. Islands are the buses connected by branches in service; one is
+// energized when it has a node with a generator (PV or slack).
+//
+// A switch that moves changes only its own bus: closing one merges two buses, opening one
+// searches that bus's nodes over its closed switches and splits off the nodes it no longer
+// reaches. Islands follow with the same locality: a merge relabels the smaller of two
+// islands, and a split races a search from each half until they meet or one of them runs
+// out, which is then the island that split off; a branch switched in or out joins or splits
+// islands the same way. Buses keep their indices except the one a merge frees, whose place
+// the last bus takes.
+//
+// nodedata.csv: node,station,type,pd,qd,gs,bs,pg,qg,vm,baseKV; switchdata.csv:
+// from,to,status,ca,address with from/to node numbers and the switch's position point;
+// nodebranchdata.csv: fnode,tnode and the electrical columns of branchdata.csv.
+//
+#include "PowerModel.h"
+#include <unordered_map>
+
+struct tp_node
+{
+	int number;        // node number of the files
+	int station;       // substation
+	int type;          // PF_PQ, or PF_PV / PF_SLACK when a generator is connected here
+	double pd, qd;     // MW / MVAr
+	double gs, bs;     // MW / MVAr at 1 pu
+	double pg, qg;     // MW / MVAr
+	double vm;         // setpoint of a generator node, pu
+	double baseKV;
+};
+
+struct tp_switch
+{
+	int from, to;      // nodes
+	bool closed;
+	unsigned short ca; // position point, 0 when it has none
+	unsigned int address;
+};
+
+class CTopologyProcessor
+{
+public:
+	CTopologyProcessor();
+
+	// the three files with branch ends and switch ends resolved to node indices
+	static bool readCsv(const char* nodeFile, const char* switchFile, const char* branchFile,
+		std::vector<tp_node>& nodes, std::vector<tp_switch>& switches, std::vector<pf_branch>& branches);
+
+	// buses and islands of the whole network; branches have node indices as from/to
+	void setModel(const std::vector<tp_node>& nodes, const std::vector<tp_switch>& switches,
+		const std::vector<pf_branch>& branches, double baseMVA = 100);
+	// a switch moved; true if buses were merged or split
+	bool setSwitch(int sw, bool bClosed);
+	// a branch in or out of service, its islands joined or split the same way; false if it already was
+	bool setBranch(int branch, bool bInService);
+	int findSwitch(unsigned short ca, unsigned int address) const;   // -1 if no switch has the point
+
+	const CPowerModel& model() const { return m_Model; }
+	int busOf(int node) const { return m_busOf[node]; }
+	int island(int bus) const { return m_island[bus]; }       // equal for buses of one island
+	bool energized(int bus) const { return m_Islands[m_island[bus]].sources > 0; }
+	int islands() const { return (int)(m_Islands.size() - m_freeIslands.size()); }
+
+private:
+	struct tp_island
+	{
+		int nodes;
+		int sources;     // nodes with a generator
+	};
+	int root(int node);
+	void makeBus(int bus);          // pf_bus of the bus's nodes
+	void attach(int bus);           // branch ends at the bus's nodes
+	void removeBus(int bus);        // the last bus takes its place
+	void merge(int a, int b);
+	void join(int a, int b);        // one island of the two buses' islands, a branch or a bus joining them
+	bool split(int a, const tp_switch& sw);   // false if the nodes are still joined
+	void divide(int a, int c);      // buses of one island that may have come apart: the half that is alone is a new island
+	void label(int bus, int from, int to);   // relabels the island buses reachable from bus
+	int newIsland();
+	void neighbours(int bus, std::vector<int>& out) const;   // buses across branches in service
+
+	std::vector<tp_node> m_Nodes;
+	std::vector<tp_switch> m_Switches;
+	std::vector<int> m_nodeFrom, m_nodeTo;       // branch ends as nodes
+	std::vector<int> m_Swp, m_Swl;               // switches of node k at m_Swl[m_Swp[k] .. m_Swp[k+1])
+	std::vector<int> m_Brp, m_Brl;               // branches of node k, the same way
+	CPowerModel m_Model;
+	std::vector<int> m_busOf;                    // node -> bus
+	std::vector< std::vector<int> > m_busNodes;  // bus -> nodes
+	std::vector<int> m_island;                   // bus -> m_Islands
+	std::vector<tp_island> m_Islands;
+	std::vector<int> m_freeIslands;
+	std::unordered_map<unsigned __int64, int> m_Points;   // ca << 32 | address -> switch
+
+	// scratch, marks are zero between calls
+	std::vector<int> m_uf;
+	std::vector<char> m_nodeMark;
+	std::vector<char> m_busMark;
+	std::vector<int> m_queue[2];
+	std::vector<int> m_nb;
+};
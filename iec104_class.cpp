@@ -28,6 +28,7 @@
  */
 
 #include "stdafx.h"
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -46,20 +47,36 @@ iec104_class::iec104_class()
 
     msg_supervisory = true;
     seq_order_check = true;
-    connectedTCP = false;
+    broken_msg = false;
 
-    tout_startdtact = -1;
-    tout_supervisory = -1;
-    tout_testfr = -1;
-    tout_gi = -1;
     VS = 0;
     VR = 0;
-    TxOk = false;
+    mSession.attach( this );
+    mFile.attach( this );
+    mDecoder = NULL;
+    rxStation = -1;
+    giStaging = false;
+    giOpen = 0;
+    giIdle = 0;
+    giTimeout = 30;
+    txhasI = false;
+    txdepth = 0;
+    memset( &txstats, 0, sizeof( txstats ) );
+    InitializeCriticalSection( &txlock );
+    InitializeCriticalSection( &rxlock );
     masterAddress = 0;
     slaveAddress = 0;
     GIObjectCnt = 0;
 }
 
+iec104_class::~iec104_class()
+{
+    // the derived class detached in its own destructor, before its dataIndication went away
+    assert( mDecoder == NULL );
+    DeleteCriticalSection( &rxlock );
+    DeleteCriticalSection( &txlock );
+}
+
 void iec104_class::disableSequenceOrderCheck()
 {
     seq_order_check = false;
@@ -75,6 +92,17 @@ void iec104_class::setPortTCP( unsigned port )
     Port = port;
 }
 
+void iec104_class::setInterrogationTimeout( int seconds )
+{
+    EnterCriticalSection( &rxlock );
+    beginBatch();
+    if ( seconds <= 0 && giStaging )
+        commitGI();
+    giTimeout = seconds;
+    endBatch();
+    LeaveCriticalSection( &rxlock );
+}
+
 void iec104_class::setSecondaryIP(char * ip)
 {
     strncpy( slaveIP, ip, 20 );
@@ -95,6 +123,31 @@ int iec104_class::getSecondaryAddress()
     return slaveAddress;
 }
 
+void iec104_class::addStation( unsigned short ca )
+{
+    // solicitGI reads the stations under txlock only
+    EnterCriticalSection( &rxlock );
+    beginBatch();
+    mStations.add( ca );
+    endBatch();
+    LeaveCriticalSection( &rxlock );
+}
+
+void iec104_class::getStationStats( std::vector<iec104_station_stats> & out )
+{
+    EnterCriticalSection( &rxlock );
+    mStations.getStats( out );
+    LeaveCriticalSection( &rxlock );
+}
+
+unsigned __int64 iec104_class::getUnroutedCount()
+{
+    EnterCriticalSection( &rxlock );
+    unsigned __int64 n = mStations.unrouted();
+    LeaveCriticalSection( &rxlock );
+    return n;
+}
+
 void iec104_class::setPrimaryAddress(int addr)
 {
     masterAddress = addr;
@@ -107,87 +160,178 @@ int iec104_class::getPrimaryAddress()
 
 void iec104_class::onConnectTCP()
 {
-    connectedTCP = true;
-    TxOk = false;
     VS = 0;
     VR = 0;
+    broken_msg = false;
     mLog.pushMsg("*** TCP CONNECT!");
-    sendStartDTACT();
+    mSession.w = msg_supervisory ? 8 : 1;
+    mSession.connected(); // sends STARTDTACT
 }
 
 void iec104_class::onDisconnectTCP()
 {
-    connectedTCP = false;
-    tout_startdtact = -1;
-    tout_supervisory = -1;
-    tout_gi = -1;
-    TxOk = false;
     mLog.pushMsg("*** TCP DISCONNECT!");
+    if ( mDecoder != NULL )
+        mDecoder->submit( this, NULL, 0 ); // committed by decodeAPDU, behind the ASDUs still queued
+    else
+    {
+        EnterCriticalSection( &rxlock );
+        beginBatch();
+        // what arrived of the interrogation is still newer than what the user has
+        commitGI();
+        endBatch();
+        LeaveCriticalSection( &rxlock );
+    }
+    mSession.disconnected();
+    mFile.disconnected();
 }
 
 void iec104_class::onTimerSecond()
 {
-    iec_apdu apdu;
-    static unsigned int cnts = 1;
-
-    cnts++;
+    EnterCriticalSection( &rxlock );
+    beginBatch();
+    mSession.tick();
+    mFile.tick();
+    if ( giStaging && ++giIdle >= giTimeout )
+    {
+        mLog.pushMsg( "--> ERROR: NO INTERROGATION ACT TERM" );
+        commitGI();
+        mSession.giTerminated();
+    }
+    endBatch();
+    LeaveCriticalSection( &rxlock );
+}
 
-    if ( ! (cnts % 5) )
-        if ( !connectedTCP )
-            connectTCP();
+void iec104_class::stopDT()
+{
+    EnterCriticalSection( &rxlock ); // the disconnect commits the interrogation
+    beginBatch();
+    mSession.stop();
+    endBatch();
+    LeaveCriticalSection( &rxlock );
+}
 
-    if (connectedTCP)
-    {
-        if ( tout_startdtact > 0 )
-            tout_startdtact--;
-        if ( tout_startdtact==0 )  // timeout of startdtact: retry
-            sendStartDTACT();
+void iec104_class::setDecoder( iec104_decoder * decoder )
+{
+    EnterCriticalSection( &rxlock );
+    beginBatch();
+    iec104_decoder * old = mDecoder;
+    mDecoder = decoder;
+    endBatch();
+    LeaveCriticalSection( &rxlock );
+    // outside the lock: the old decoder's workers take it to finish this session's queue
+    if ( old != NULL && old != decoder )
+        old->remove( this );
+}
 
-        if ( tout_gi > 0 )
-          {
-            tout_gi--;
-            if ( tout_gi == 0 )
-              solicitGI();
-          }
+void iec104_class::decodeAPDU( iec_apdu * papdu, int sz )
+{
+    EnterCriticalSection( &rxlock );
+    if ( sz == 0 )
+    { // the link went down: what arrived of the interrogation is still newer than what the user has
+        beginBatch();
+        commitGI();
+        endBatch();
+    }
+    else
+    if ( papdu->asduh.type < C_SC_NA_1 )
+    { // sequence numbers and acknowledgements were handled when the frame was received; monitored
+      // values only touch the decode state, the receive thread is not held up while they are indicated
+        parseAPDU( papdu, sz, false );
+    }
+    else
+    { // confirmations, GI and file transfer move the session on and may answer
+        beginBatch();
+        parseAPDU( papdu, sz, false );
+        endBatch();
+    }
+    LeaveCriticalSection( &rxlock );
+}
 
+void iec104_class::beginBatch()
+{
+    EnterCriticalSection( &txlock );
+    txdepth++;
+}
 
-        if (msg_supervisory)
+void iec104_class::endBatch()
+{
+    if ( --txdepth == 0 && !txbuf.empty() )
+    {
+        // the newest VR acknowledges everything received so far
+        for ( size_t i = 0; i < txframes.size(); i++ )
         {
-        if (tout_supervisory > 0)
-          tout_supervisory--;
-        if (tout_supervisory > 0)
-          tout_supervisory--;
-
-        if (tout_supervisory == 0)
-          {
-           tout_supervisory = -1;
-           sendSupervisory();
-          }
+            txbuf[txframes[i] + 4] = (unsigned char)( VR & 0xFF );
+            txbuf[txframes[i] + 5] = (unsigned char)( VR >> 8 );
         }
-
+        sendTCP( (char *)&txbuf[0], (int)txbuf.size() );
+        txstats.writes++;
+        txbuf.clear();
+        txframes.clear();
+        txhasI = false;
     }
+    LeaveCriticalSection( &txlock );
+}
 
-    // if connected and no data received, send TESTFRACT
-    if ( connectedTCP && TxOk )
-    {
-        if ( tout_testfr > 0 )
-          {
-            tout_testfr--;
-            if ( tout_testfr == 0 )
+iec_txstats iec104_class::getTxStats()
+{
+    EnterCriticalSection( &txlock );
+    iec_txstats st = txstats;
+    LeaveCriticalSection( &txlock );
+    return st;
+}
+
+void iec104_class::queueAPDU( const iec_apdu * papdu, int sz )
+{
+    bool isI = ( papdu->NS & 0x01 ) == 0;
+    bool isS = ( papdu->NS & 0x03 ) == SUPERVISORY;
+
+    beginBatch();
+    if ( isS && txhasI )
+    { // the queued I frame carries the acknowledgement
+        txstats.suppressed++;
+        endBatch();
+        return;
+    }
+    if ( isI && !txhasI )
+    { // so will this one: drop the S frames queued before it
+        for ( size_t i = txframes.size(); i-- > 0; )
+        {
+            int off = txframes[i];
+            if ( ( txbuf[off + 2] & 0x03 ) == SUPERVISORY )
             {
-                apdu.start = START;
-                apdu.length = 4;
-                apdu.NS = TESTFRACT;
-                apdu.NR = 0;
-                sendTCP((char *)&apdu, 6);
-                mLog.pushMsg("<-- TESTFRACT");
+                txbuf.erase( txbuf.begin() + off, txbuf.begin() + off + 6 );
+                for ( size_t j = i + 1; j < txframes.size(); j++ )
+                    txframes[j] -= 6;
+                txframes.erase( txframes.begin() + i );
+                txstats.suppressed++;
             }
-          }
+        }
+        txhasI = true;
     }
-
+    if ( isI || isS )
+        txframes.push_back( (int)txbuf.size() );
+    txbuf.insert( txbuf.end(), (const unsigned char *)papdu, (const unsigned char *)papdu + sz );
+    txstats.frames++;
+    if ( isI )
+        mSession.acknowledged();
+    endBatch();
 }
 
 void iec104_class::solicitGI()
+{
+    if ( !mStations.configured() )
+    {
+        solicitGI( (unsigned short)slaveAddress );
+        return;
+    }
+    beginBatch();
+    for ( int i = 0; i < mStations.count(); i++ )
+        solicitGI( mStations.at( i ).ca );
+    endBatch();
+}
+
+void iec104_class::solicitGI( unsigned short ca )
 {
     iec_apdu wapdu;
 
@@ -202,12 +346,12 @@ void iec104_class::solicitGI()
     wapdu.asduh.t = 0;
     wapdu.asduh.pn = 0;
     wapdu.asduh.oa = masterAddress;
-    wapdu.asduh.ca = slaveAddress;
+    wapdu.asduh.ca = ca;
     wapdu.dados[0] = 0x00;
     wapdu.dados[1] = 0x00;
     wapdu.dados[2] = 0x00;
     wapdu.dados[3] = 0x14;
-    sendTCP((char *)&wapdu, 16);
+    queueAPDU( &wapdu, 16 );
     VS += 2;
     mLog.pushMsg( "<-- INTERROGATION " );
 }
@@ -232,7 +376,7 @@ void iec104_class::solicitIntegratedTotal()
 	wapdu.dados[1] = 0x00;
 	wapdu.dados[2] = 0x00;
 	wapdu.dados[3] = 0x45;
-	sendTCP((char *)&wapdu, 16);
+	queueAPDU( &wapdu, 16 );
 	VS += 2;
 	mLog.pushMsg( "<-- INTEGRAL TOTAL " );
 }
@@ -266,7 +410,7 @@ void iec104_class::confTestCommand()
     wapdu.asdu107.time.min = agora->tm_min;
     wapdu.asdu107.time.msec = agora->tm_sec * 1000;
 
-    sendTCP( (char *)&wapdu, 22+2 );
+    queueAPDU( &wapdu, 22+2 );
     VS += 2;
 
     mLog.pushMsg( "<-- TEST COMMAND CONF " );
@@ -275,23 +419,25 @@ void iec104_class::confTestCommand()
 void iec104_class::sendStartDTACT()
 {
     // send STARTDTACT: enable data transfer
+    sendControl( STARTDTACT, "<-- STARTDTACT" );
+}
+
+void iec104_class::sendControl( unsigned char code, const char * logmsg )
+{
     iec_apdu apdu;
     apdu.start=START;
     apdu.length=4;
-    apdu.NS=STARTDTACT;
+    apdu.NS=code;
     apdu.NR=0;
-    sendTCP((char *)&apdu, 6);
-    mLog.pushMsg("<-- STARTDTACT");
-    tout_startdtact=t1_startdtact;
+    queueAPDU( &apdu, 6 );
+    mLog.pushMsg(logmsg);
 }
 
 // tcp packet ready to be read from connection with the iec104 slave
 void iec104_class::packetReadyTCP()
 {
-    static bool broken_msg=false;
-    static iec_apdu apdu;
     unsigned char * br;
-    br = (unsigned char*)&apdu;
+    br = (unsigned char*)&rx_apdu;
     int bytesrec;
     unsigned char byt;
     unsigned char len;
@@ -326,14 +472,6 @@ void iec104_class::packetReadyTCP()
          return;
          }
 
-	 /*ַȷҲᱨ
-      if ( apdu.asduh.ca != slaveAddress && len>4 )
-        {
-        broken_msg=false;
-        mLog.pushMsg("--> ASDU WITH UNEXPECTED ORIGIN! Ignoring...");
-        // continue;
-        }
-		*/
       broken_msg=false;
 
       if (mLog.isLogging())
@@ -346,8 +484,17 @@ void iec104_class::packetReadyTCP()
         mLog.pushMsg(buflog);
         }
 
-      userprocAPDU( &apdu, len + 2 );
-      parseAPDU( &apdu, len + 2 );
+      // decoded here without a decoder: the decode state is locked first, as everywhere
+      bool here = ( mDecoder == NULL );
+      if ( here )
+        EnterCriticalSection( &rxlock );
+      // answers and acknowledgements to this apdu go out in one write
+      beginBatch();
+      userprocAPDU( &rx_apdu, len + 2 );
+      parseAPDU( &rx_apdu, len + 2 );
+      endBatch();
+      if ( here )
+        LeaveCriticalSection( &rxlock );
       break;
       }
 
@@ -389,13 +536,9 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
         return;
     }
 
-	/*ҵĴ
-    if ( papdu->asduh.ca != slaveAddress && sz>6)
-    { // invalid frame
-        mLog.pushMsg("--> ASDU WITH UNEXPECTED ORIGIN! Ignoring...");
-        return;
-    }
-	*/
+
+    if ( accountandrespond )
+        mSession.frameReceived();
 
     if (sz==6)
     { // Control messages
@@ -408,7 +551,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
             wapdu.length=4;
             wapdu.NS=STARTDTCON;
             wapdu.NR=0;
-            sendTCP((char *)&wapdu, 6);
+            queueAPDU( &wapdu, 6 );
             mLog.pushMsg("    STARTDTCON");
             break;
             
@@ -418,15 +561,13 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
             wapdu.length=4;
             wapdu.NS=TESTFRCON;
             wapdu.NR=0;
-            sendTCP((char *)&wapdu, 6);
+            queueAPDU( &wapdu, 6 );
             mLog.pushMsg("   TESTFRCON");
             break;
             
         case STARTDTCON:
             mLog.pushMsg("--> STARTDTCON");
-            tout_startdtact=-1; // flag confirmation of STARTDT, not to timeout
-            TxOk=true;
-            tout_gi=10;
+            mSession.controlReceived( STARTDTCON ); // GI follows after the session GI delay
             break;
             
         case STOPDTACT:
@@ -436,12 +577,12 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
             
         case STOPDTCON:
             mLog.pushMsg("--> STOPDTCON");
-            // do what?
+            mSession.controlReceived( STOPDTCON );
             break;
             
         case TESTFRCON:
             mLog.pushMsg("--> TESTFRCON");
-            // do what?
+            mSession.controlReceived( TESTFRCON );
             break;
             
         case SUPERVISORY:
@@ -474,7 +615,25 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
           }
 
         VR = VR_NEW + 2;
+
+        if ( mDecoder != NULL )
+          {
+          mDecoder->submit( this, papdu, sz );
+          mSession.dataReceived();
+          return;
+          }
+        }
+
+        // after the sequence accounting: an ASDU of another station is still acknowledged
+        rxStation = mStations.route( papdu->asduh.ca );
+        if ( rxStation < 0 )
+        {
+            mLog.pushMsg("--> ASDU WITH UNEXPECTED ORIGIN! Ignoring...");
+            return;
         }
+        mStations.at( rxStation ).asdus++;
+        if ( papdu->asduh.pn )
+            mStations.at( rxStation ).negative++;
 
         oss.str("");
         oss << "    CA "
@@ -527,7 +686,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].sb=pobj->sb;
                       piecarr[i].iv=pobj->iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
@@ -567,7 +726,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].sb=pobj->sb;
                       piecarr[i].iv=pobj->iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
@@ -608,11 +767,16 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].sb=pobj->sb;
                       piecarr[i].iv=pobj->iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
         case M_ME_NA_1:	// 9: ANALOGIC NORMALIZED
+            if ( papdu->asduh.sq )
+              {
+                parseSequence( papdu, sz );
+                break;
+              }
             {
                 unsigned int addr24=0;
                 iec_type9 *pobj;
@@ -648,11 +812,16 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].sb=pobj->sb;
                       piecarr[i].iv=pobj->iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
         case M_ME_NB_1:	// 11: ANALOGIC CONVERTED
+            if ( papdu->asduh.sq )
+              {
+                parseSequence( papdu, sz );
+                break;
+              }
             {
                 unsigned int addr24=0;
                 iec_type11 *pobj;
@@ -688,11 +857,16 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].sb=pobj->sb;
                       piecarr[i].iv=pobj->iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
         case M_ME_NC_1:	// 13: ANALOGIC FLOATING POINT
+            if ( papdu->asduh.sq )
+              {
+                parseSequence( papdu, sz );
+                break;
+              }
             {
 				unsigned int addr24=0;
 				iec_type13 *pobj;
@@ -728,7 +902,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
 					piecarr[i].sb=pobj->sb;
 					piecarr[i].iv=pobj->iv;
 				}
-				dataIndication(piecarr, papdu->asduh.num);
+				indicate(piecarr, papdu->asduh.num);
 				delete[] piecarr;
 			}
 			break;
@@ -769,7 +943,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
 					piecarr[i].type=papdu->asduh.type;
 					piecarr[i].value=pobj->mv;
 				}
-				dataIndication(piecarr, papdu->asduh.num);
+				indicate(piecarr, papdu->asduh.num);
 				delete[] piecarr;
 			}
 			break;
@@ -816,7 +990,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].timetag.msec=pobj->time.msec;
                       piecarr[i].timetag.iv=pobj->time.iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
@@ -863,7 +1037,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].timetag.msec=pobj->time.msec;
                       piecarr[i].timetag.iv=pobj->time.iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
@@ -911,7 +1085,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].timetag.msec=pobj->time.msec;
                       piecarr[i].timetag.iv=pobj->time.iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
@@ -964,7 +1138,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].timetag.msec=pobj->time.msec;
                       piecarr[i].timetag.iv=pobj->time.iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
@@ -1011,7 +1185,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].timetag.msec=pobj->time.msec;
                       piecarr[i].timetag.iv=pobj->time.iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
@@ -1058,7 +1232,7 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                       piecarr[i].timetag.msec=pobj->time.msec;
                       piecarr[i].timetag.iv=pobj->time.iv;
                    }
-                dataIndication(piecarr, papdu->asduh.num);
+                indicate(piecarr, papdu->asduh.num);
                 delete[] piecarr;
             }
             break;
@@ -1320,8 +1494,17 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
         case INTERROGATION: // GI
             if (papdu->asduh.cause==ACTCONFIRM)
             {
-                GIObjectCnt=0;
-                tout_gi=0;
+                iec104_station_stats & st = mStations.at( rxStation );
+                if ( giOpen == 0 )
+                    GIObjectCnt=0;
+                if ( !st.interrogating )
+                {
+                    st.interrogating = true;
+                    giOpen++;
+                }
+                giStaging = giTimeout > 0;
+                giIdle = 0;
+                mSession.giConfirmed();
                 mLog.pushMsg("    INTERROGATION ACT CON ------------------------------------------------------------------------");
                 interrogationActConfIndication();
             }
@@ -1334,6 +1517,17 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                         << GIObjectCnt;
                 mLog.pushMsg((char*)oss.str().c_str());
 
+                iec104_station_stats & st = mStations.at( rxStation );
+                st.gis++;
+                if ( st.interrogating )
+                {
+                    st.interrogating = false;
+                    giOpen--;
+                }
+                // stations interrogated together are delivered together
+                if ( giOpen == 0 )
+                    commitGI();
+                mSession.giTerminated();
                 interrogationActTermIndication();
                 }
             else
@@ -1361,37 +1555,235 @@ void iec104_class::parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond)
                 confTestCommand();
             }
             break;
+        case F_FR_NA_1: // 120..126: file transfer
+        case F_SR_NA_1:
+        case F_SC_NA_1:
+        case F_LS_NA_1:
+        case F_AF_NA_1:
+        case F_SG_NA_1:
+        case F_DR_TA_1:
+            mFile.received( (const unsigned char *)&papdu->asduh, sz - 6 );
+            break;
         default:
             mLog.pushMsg("!!! TYPE NOT IMPLEMENTED");
             break;
         }
 
         if ( accountandrespond )
-        {
+            mSession.dataReceived(); // supervisory window control after w messages or t2 seconds
+    }
+}
 
-            tout_testfr=t3_testfr;
+void iec104_class::parseSequence( iec_apdu * papdu, int sz )
+{
+    iec_seqdata seq;
+    int num = iec104_seqdecode::decode( papdu, sz, &seq );
 
-            if (msg_supervisory)
-            {
-                // will wait t2 seconds or n messages to send supervisory window control
-                if (tout_supervisory<0)
-                    tout_supervisory=t2_supervisory;
+    if ( num < 0 )
+        return;
+    if ( papdu->asduh.cause == 20 )
+        GIObjectCnt += num;
+    if ( num < papdu->asduh.num )
+        mLog.pushMsg( "--> ERROR: TRUNCATED SEQUENCE ASDU" );
+    mStations.at( rxStation ).objects += num;
+    if ( num > 0 && giStaging )
+        stageSequence( &seq );
+    else
+    if ( num > 0 )
+        dataIndicationSeq( &seq );
+}
 
-                if (tout_supervisory>0)
-                    tout_supervisory--;
+void iec104_class::dataIndicationSeq( iec_seqdata * seq )
+{
+    iec_obj *piecarr = new iec_obj [seq->num];
+
+    for ( int i=0; i<seq->num; i++ )
+       {
+         unsigned char q = seq->qds[i];
+         piecarr[i].address=seq->base+i;
+         piecarr[i].ca=seq->ca;
+         piecarr[i].cause=seq->cause;
+         piecarr[i].pn=seq->pn;
+         piecarr[i].type=seq->type;
+         piecarr[i].value=seq->value[i];
+         piecarr[i].ov=q & 0x01;
+         piecarr[i].bl=(q >> 4) & 0x01;
+         piecarr[i].sb=(q >> 5) & 0x01;
+         piecarr[i].nt=(q >> 6) & 0x01;
+         piecarr[i].iv=(q >> 7) & 0x01;
+       }
+    dataIndication(piecarr, seq->num);
+    delete[] piecarr;
+}
 
-                if (tout_supervisory==0)
-                {
-                    tout_supervisory=-1;
-                    sendSupervisory();
-                }
-            }
-            else
-                sendSupervisory();
+void iec104_class::indicate( iec_obj * obj, int numpoints )
+{
+    mStations.at( rxStation ).objects += numpoints;
+    if ( !giStaging || numpoints <= 0 )
+    {
+        dataIndication( obj, numpoints );
+        return;
+    }
+    // spontaneous objects are held too, behind the responses received before them,
+    // or the older interrogation values would overwrite them on commit
+    giShadow.insert( giShadow.end(), obj, obj + numpoints );
+    if ( obj[0].cause == 20 )
+        giIdle = 0;
+}
+
+void iec104_class::stageSequence( const iec_seqdata * seq )
+{
+    size_t at = giShadow.size();
+    giShadow.resize( at + seq->num );
+    for ( int i=0; i<seq->num; i++ )
+       {
+         unsigned char q = seq->qds[i];
+         iec_obj & o = giShadow[at + i];
+         o.address=seq->base+i;
+         o.ca=seq->ca;
+         o.cause=seq->cause;
+         o.pn=seq->pn;
+         o.type=seq->type;
+         o.value=seq->value[i];
+         o.ov=q & 0x01;
+         o.bl=(q >> 4) & 0x01;
+         o.sb=(q >> 5) & 0x01;
+         o.nt=(q >> 6) & 0x01;
+         o.iv=(q >> 7) & 0x01;
+       }
+    if ( seq->cause == 20 )
+        giIdle = 0;
+}
+
+void iec104_class::commitGI()
+{
+    giStaging = false;
+    giOpen = 0;
+    for ( int i = 0; i < mStations.count(); i++ )
+        mStations.at( i ).interrogating = false;
+    if ( giShadow.empty() )
+        return;
+    // swapped out first: the user may start another GI from the indication
+    std::vector<iec_obj> objs;
+    objs.swap( giShadow );
+    interrogationIndication( &objs[0], (int)objs.size() );
+    objs.clear();
+    if ( giShadow.empty() )
+        objs.swap( giShadow ); // keep the capacity for the next GI
+}
+
+void iec104_class::interrogationIndication( iec_obj * obj, int numpoints )
+{
+    int first = 0;
+    for ( int i=1; i<=numpoints; i++ )
+        if ( i == numpoints || obj[i].type != obj[first].type )
+        {
+            dataIndication( obj + first, i - first );
+            first = i;
         }
+}
+
+void iec104_class::sessionConnect()
+{
+    connectTCP();
+}
+
+void iec104_class::sessionDisconnect()
+{
+    disconnectTCP();
+}
+
+void iec104_class::sessionSendU( unsigned char code )
+{
+    switch ( code )
+    {
+    case STARTDTACT: sendStartDTACT(); break;
+    case STOPDTACT: sendControl( code, "<-- STOPDTACT" ); break;
+    case TESTFRACT: sendControl( code, "<-- TESTFRACT" ); break;
+    default: sendControl( code, "<-- CONTROL" ); break;
     }
 }
 
+void iec104_class::sessionSendS()
+{
+    sendSupervisory();
+}
+
+void iec104_class::sessionSendGI()
+{
+    solicitGI();
+}
+
+void iec104_class::sessionLog( const char * msg )
+{
+    mLog.pushMsg(msg);
+}
+
+bool iec104_class::callDirectory( unsigned int ioa )
+{
+    beginBatch();
+    bool ok = txReady() && mFile.callDirectory( ioa );
+    endBatch();
+    return ok;
+}
+
+bool iec104_class::getFile( unsigned int ioa, unsigned short nof, const char * path )
+{
+    beginBatch();
+    bool ok = txReady() && mFile.getFile( ioa, nof, path );
+    endBatch();
+    return ok;
+}
+
+void iec104_class::abortFile()
+{
+    beginBatch();
+    mFile.abort();
+    endBatch();
+}
+
+bool iec104_class::fileSend( unsigned char type, unsigned char cause, unsigned int ioa, const unsigned char * obj, int sz )
+{
+    if ( !txReady() )
+        return false;
+
+    iec_apdu wapdu;
+    wapdu.start = START;
+    wapdu.length = (unsigned char)( 4 + sizeof( iec_unit_id ) + 3 + sz );
+    wapdu.NS = VS;
+    wapdu.NR = VR;
+    wapdu.asduh.type = type;
+    wapdu.asduh.num = 1;
+    wapdu.asduh.sq = 0;
+    wapdu.asduh.cause = cause;
+    wapdu.asduh.t = 0;
+    wapdu.asduh.pn = 0;
+    wapdu.asduh.oa = masterAddress;
+    wapdu.asduh.ca = slaveAddress;
+    wapdu.dados[0] = (unsigned char)( ioa & 0xFF );
+    wapdu.dados[1] = (unsigned char)( ( ioa >> 8 ) & 0xFF );
+    wapdu.dados[2] = (unsigned char)( ( ioa >> 16 ) & 0xFF );
+    memcpy( wapdu.dados + 3, obj, sz );
+    queueAPDU( &wapdu, wapdu.length + 2 );
+    VS += 2;
+    return true;
+}
+
+void iec104_class::fileDirectory( const iec_file_entry * entries, int n )
+{
+    fileDirectoryIndication( entries, n );
+}
+
+void iec104_class::fileDone( unsigned short nof, int result, unsigned long bytes )
+{
+    fileTransferIndication( nof, result, bytes );
+}
+
+void iec104_class::fileLog( const char * msg )
+{
+    mLog.pushMsg(msg);
+}
+
 void iec104_class::sendSupervisory()
 {
 stringstream oss;
@@ -1401,12 +1793,15 @@ apdu.start=START;
 apdu.length=4;
 apdu.NS=SUPERVISORY;
 apdu.NR=VR;
-sendTCP((char *)&apdu, 6);
+queueAPDU( &apdu, 6 );
 
-oss.str("");
-oss.setf ( ios::hex, ios::basefield );
-oss << "<-- SUPERVISORY " << VR;
-mLog.pushMsg((char*)(oss.str().c_str()));
+if (mLog.isLogging())
+  {
+  oss.str("");
+  oss.setf ( ios::hex, ios::basefield );
+  oss << "<-- SUPERVISORY " << VR;
+  mLog.pushMsg((char*)(oss.str().c_str()));
+  }
 }
 
 bool iec104_class::sendCommand(iec_obj *obj)
@@ -1417,7 +1812,8 @@ tm *agora=localtime(&tm1);
 stringstream oss;
 
 obj->cause = ACTIVATION;
-obj->ca = slaveAddress;
+if ( obj->ca == 0 ) // no station given: the secondary address
+  obj->ca = slaveAddress;
 
 switch (obj->type)
   {
@@ -1440,7 +1836,7 @@ switch (obj->type)
     apducmd.nsq45.obj.res = 0;
     apducmd.nsq45.obj.qu = obj->qu;
     apducmd.nsq45.obj.se = obj->se;
-    sendTCP( (char *)&apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
+    queueAPDU( &apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
     VS+=2;
 
     oss.str("");
@@ -1473,7 +1869,7 @@ switch (obj->type)
     apducmd.nsq46.obj.dcs = obj->dcs;
     apducmd.nsq46.obj.qu = obj->qu;
     apducmd.nsq46.obj.se = obj->se;
-    sendTCP( (char *)&apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
+    queueAPDU( &apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
     VS+=2;
 
     oss.str("");
@@ -1505,7 +1901,7 @@ switch (obj->type)
     apducmd.nsq47.obj.rcs = obj->rcs;
     apducmd.nsq47.obj.qu = obj->qu;
     apducmd.nsq47.obj.se = obj->se;
-    sendTCP( (char *)&apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
+    queueAPDU( &apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
     VS+=2;
     oss.str("");
     oss << "<-- STEP REG. COMMAND ADDRESS "
@@ -1551,7 +1947,7 @@ switch (obj->type)
     apducmd.nsq58.obj.time.res2=0;
     apducmd.nsq58.obj.time.res3=0;
     apducmd.nsq58.obj.time.res4=0;
-    sendTCP( (char *)&apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
+    queueAPDU( &apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
     VS+=2;
 
     oss.str("");
@@ -1598,7 +1994,7 @@ switch (obj->type)
     apducmd.nsq59.obj.time.res2=0;
     apducmd.nsq59.obj.time.res3=0;
     apducmd.nsq59.obj.time.res4=0;
-    sendTCP( (char *)&apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
+    queueAPDU( &apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
     VS+=2;
 
     oss.str("");
@@ -1644,7 +2040,7 @@ switch (obj->type)
     apducmd.nsq60.obj.time.res2=0;
     apducmd.nsq60.obj.time.res3=0;
     apducmd.nsq60.obj.time.res4=0;
-    sendTCP( (char *)&apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
+    queueAPDU( &apducmd, apducmd.length + sizeof(apducmd.start) + sizeof(apducmd.length) );
     VS+=2;
     oss.str("");
     oss << "<-- STEP REG. COMMAND W/TIME ADDRESS "
@@ -1661,6 +2057,11 @@ switch (obj->type)
     return false;
   }
 
+EnterCriticalSection( &rxlock );
+int slot = mStations.find( obj->ca );
+if ( slot >= 0 )
+  mStations.at( slot ).commands++;
+LeaveCriticalSection( &rxlock );
 return true;
 }
 
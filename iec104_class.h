@@ -34,7 +34,12 @@
 // IEC 60870-5-104 BASE CLASS, MASTER IMPLEMENTATION
 
 #include "iec104_types.h"
+#include "iec104_seqdecode.h"
+#include "iec104_session.h"
+#include "iec104_file.h"
+#include "iec104_stations.h"
 #include "logmsg.h"
+#include <vector>
 
 struct iec_obj {
     unsigned int address;  // 3 byte address
@@ -69,7 +74,27 @@ struct iec_obj {
     unsigned char pn :1; // 0=positive, 1=negative
 };
 
-class iec104_class
+// outgoing frame counters
+struct iec_txstats {
+    unsigned long frames; // frames queued
+    unsigned long writes; // sendTCP calls
+    unsigned long suppressed; // S frames not sent, an I frame carried the acknowledgement
+};
+
+class iec104_class;
+
+// takes I frame ASDUs off the receive thread; each one is handed back to
+// session->decodeAPDU(), in the order submitted for that session
+class iec104_decoder
+{
+public:
+    virtual ~iec104_decoder() {}
+    virtual void submit( iec104_class * session, const iec_apdu * papdu, int sz ) = 0; // sz 0: disconnected
+    virtual void drain() = 0; // returns when everything submitted was decoded
+    virtual void remove( iec104_class * session ) = 0; // session goes away, waits for its queue
+};
+
+class iec104_class : protected iec104_session_link, protected iec104_file_link
 {
     public:
 
@@ -102,6 +127,13 @@ class iec104_class
     static const unsigned int C_CS_NA_1 = 103; // clock synchronization command
     static const unsigned int C_RP_NA_1 = 105; // reset process command
     static const unsigned int C_TS_TA_1 = 107; // test command with time tag CP56Time2a
+    static const unsigned int F_FR_NA_1 = 120; // file ready
+    static const unsigned int F_SR_NA_1 = 121; // section ready
+    static const unsigned int F_SC_NA_1 = 122; // call directory, select file, call file, call section
+    static const unsigned int F_LS_NA_1 = 123; // last section, last segment
+    static const unsigned int F_AF_NA_1 = 124; // ack file, ack section
+    static const unsigned int F_SG_NA_1 = 125; // segment
+    static const unsigned int F_DR_TA_1 = 126; // directory
 
     /* cause of transmition (standard) */
     static const unsigned int CYCLIC = 1;
@@ -112,6 +144,7 @@ class iec104_class
     static const unsigned int ACTCONFIRM = 7;
     static const unsigned int DEACTIVATION = 8;
     static const unsigned int ACTTERM = 10;
+    static const unsigned int FILE_TRANSFER = 13;
 
     static const unsigned int SUPERVISORY = 0x01;
     static const unsigned int STARTDTACT = 0x07;
@@ -135,50 +168,87 @@ class iec104_class
 
     // ---- user called funcions, must be called by the user -----------------
     iec104_class(); // user called constructor on derived class
+    virtual ~iec104_class();
     void onConnectTCP(); // user called, when tcp connected
     void onDisconnectTCP(); // user called, when tcp disconnected
     void onTimerSecond();  // user called, each second timer
     void packetReadyTCP(); // user called, when packet ready to be read from tcp connection
-
-    void solicitGI();  // General Interrogation
+    void stopDT(); // STOPDT, then disconnect (reconnects after the session reconnect delay)
+    void beginBatch(); // frames queued until the matching endBatch go out in one sendTCP
+    void endBatch();
+    iec_txstats getTxStats();
+    const iec104_session & getSession() const { return mSession; }
+    // decode I frames elsewhere (NULL: on the receive thread), set while no frame is being received;
+    // a derived class that sets a decoder calls setDecoder( NULL ) in its own destructor, the workers
+    // may still be in its dataIndication
+    void setDecoder( iec104_decoder * decoder );
+    void decodeAPDU( iec_apdu * papdu, int sz ); // called by the decoder for each submitted APDU
+
+    void solicitGI();  // General Interrogation (of each added station, if any)
+    void solicitGI( unsigned short ca ); // GI of one station, IEC104_CA_BROADCAST: every station behind the link
 	void solicitIntegratedTotal();//ٻ
     void setSecondaryIP( char * ip );
     char * getSecondaryIP();
     void setSecondaryAddress( int addr );
+    void addStation( unsigned short ca ); // only ASDUs of added stations are processed (none added: every CA)
+    void getStationStats( std::vector<iec104_station_stats> & out ); // per CA, in the order first seen or added
+    unsigned __int64 getUnroutedCount(); // ASDUs ignored because their CA was not added
     int getSecondaryAddress();
     void setPrimaryAddress( int addr );
     int getPrimaryAddress();
     void disableSequenceOrderCheck();  // allow sequence out of order
     bool sendCommand( iec_obj *obj ); // Command, return false if not send
+    bool callDirectory( unsigned int ioa = 0 ); // directory, see fileDirectoryIndication
+    bool getFile( unsigned int ioa, unsigned short nof, const char * path ); // retrieve a file into path, see fileTransferIndication
+    void abortFile();
+    const iec104_file_transfer & getFileTransfer() const { return mFile; }
     int getPortTCP();
     void setPortTCP( unsigned port );
+    void setInterrogationTimeout( int seconds ); // GI responses are held until ACTTERM, or this long without one (0: not held)
 
 private:
     unsigned short VS;  // sender packet control counter
     unsigned short VR;  // receiver packet control counter
     void confTestCommand(); // test command activation confirmation
     void sendStartDTACT(); // send STARTDTACT
-    int tout_startdtact; // timeout control
+    void sendControl( unsigned char code, const char * logmsg ); // send a U frame
     void sendSupervisory(); // send supervisory window control frame
-    int tout_supervisory;  // countdown to send supervisory window control
-    int tout_gi; // countdown to send general interrogation
-    int tout_testfr; // countdown to send test frame
-    bool connectedTCP; // tcp connection state
+    iec104_session mSession; // connect, STARTDT, GI, transfer, TESTFR and STOPDT life cycle
+    iec104_file_transfer mFile; // file transfer in progress
+    iec104_decoder * mDecoder;
+    iec104_stations mStations; // routing and statistics per CA
+    int rxStation; // station of the ASDU being decoded
+    std::vector<iec_obj> giShadow; // objects received while staging, in arrival order, not yet delivered
+    bool giStaging; // from the first GI ACTCON until every confirmed station sent ACTTERM
+    int giOpen; // stations between GI ACTCON and ACTTERM
+    int giIdle; // seconds since the last interrogation response
+    int giTimeout;
+    void indicate( iec_obj * obj, int numpoints ); // dataIndication, or held while a GI is staged
+    void stageSequence( const iec_seqdata * seq );
+    void commitGI(); // deliver the held responses, the GI is over for every station
+    bool broken_msg; // packetReadyTCP: apdu header read, body still pending
+    iec_apdu rx_apdu; // packetReadyTCP: apdu being received
+    void queueAPDU( const iec_apdu * papdu, int sz ); // queue a frame, sent when the outermost batch ends
+    std::vector<unsigned char> txbuf; // queued frames back to back, capacity kept between writes
+    std::vector<int> txframes; // offsets of queued I and S frames, NR is stamped when written
+    bool txhasI; // an I frame is queued
+    int txdepth; // batch nesting
+    iec_txstats txstats;
+    CRITICAL_SECTION txlock;
+    CRITICAL_SECTION rxlock; // decode state: stations, GI staging; taken before txlock, held by decodeAPDU
     bool seq_order_check; // if set: test message order, disconnect if out of order
     unsigned char masterAddress; // master link address (primary address, originator address, oa)
     unsigned short slaveAddress; // slave link address (secondary address, common address of ASDU, ca)
     unsigned Port; // iec104 tcp port (defaults to 2404)
     char slaveIP[20]; // slave (secondary, RTU) IP address
-    static const int t3_testfr = 10;
-    static const int t2_supervisory = 8;
-    static const int t1_startdtact = 6;
 
     protected:
     void parseAPDU(iec_apdu * papdu, int sz, bool accountandrespond = true); // parse APDU, ( accountandrespond == false : process the apdu out of the normal handshake )
+    void parseSequence(iec_apdu * papdu, int sz); // bulk decode of SQ=1 measured values (types 9, 11, 13)
 
     int msg_supervisory;
 
-    bool TxOk; // ready to transmit state (STARTDTCON received)
+    bool txReady() const { return mSession.canTransmit(); } // STARTDTCON received
     unsigned GIObjectCnt; // contador de objetos da GI
 	unsigned ITObjectCnt; // ۻ
 
@@ -198,6 +268,11 @@ private:
 
     // user point process, user provided. (on one call must be only objects of one type)
     virtual void dataIndication( iec_obj * /*obj*/, int /*numpoints*/){};
+    // user point process for SQ=1 measured values in struct-of-arrays form (default: converts to iec_obj and calls dataIndication)
+    virtual void dataIndicationSeq( iec_seqdata * seq );
+    // all objects of one interrogation (cause 20) and any received with them, delivered together on ACTTERM,
+    // in the order received and of any type (default: dataIndication for each run of objects of one type)
+    virtual void interrogationIndication( iec_obj * obj, int numpoints );
     // inform user that ACTCONFIRM of Interrogation was received from slave
     virtual void interrogationActConfIndication(){};
     // inform user that ACTTERM of Interrogation was received from slave
@@ -208,6 +283,24 @@ private:
     virtual void commandActTermIndication( iec_obj * /*obj*/ ){};
     // user process APDU
     virtual void userprocAPDU(iec_apdu * /* papdu */, int /* sz */){};
+    // directory received after callDirectory (entries is NULL when n is 0)
+    virtual void fileDirectoryIndication( const iec_file_entry * /*entries*/, int /*n*/ ){};
+    // file transfer ended, result is an iec104_file_transfer::Result
+    virtual void fileTransferIndication( unsigned short /*nof*/, int /*result*/, unsigned long /*bytes*/ ){};
+
+    // ---- session actions ----------------------------------------------------
+    void sessionConnect();
+    void sessionDisconnect();
+    void sessionSendU( unsigned char code );
+    void sessionSendS();
+    void sessionSendGI();
+    void sessionLog( const char * msg );
+
+    // ---- file transfer actions ----------------------------------------------
+    bool fileSend( unsigned char type, unsigned char cause, unsigned int ioa, const unsigned char * obj, int sz );
+    void fileDirectory( const iec_file_entry * entries, int n );
+    void fileDone( unsigned short nof, int result, unsigned long bytes );
+    void fileLog( const char * msg );
 
     // -------------------------------------------------------------------------
 
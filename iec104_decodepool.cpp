@@ -0,0 +1,324 @@
+#include "stdafx.h"
+#include <string.h>
+
+#include "iec104_decodepool.h"
+
+iec104_decodepool::iec104_decodepool()
+{
+    nextHome = 0;
+    exiting = false;
+    submitted = 0;
+    busy = 0;
+    hIdle = CreateEvent( NULL, TRUE, TRUE, NULL );
+    InitializeCriticalSection( &mapcs );
+    InitializeCriticalSection( &idlecs );
+}
+
+iec104_decodepool::~iec104_decodepool()
+{
+    stop();
+    for ( std::unordered_map<iec104_class *, session_queue *>::iterator it = sessions.begin(); it != sessions.end(); ++it )
+    {
+        CloseHandle( it->second->hIdle );
+        DeleteCriticalSection( &it->second->cs );
+        delete it->second;
+    }
+    CloseHandle( hIdle );
+    DeleteCriticalSection( &idlecs );
+    DeleteCriticalSection( &mapcs );
+}
+
+bool iec104_decodepool::start( int nworkers )
+{
+    if ( !pool.empty() )
+        return true;
+    if ( nworkers <= 0 )
+    {
+        SYSTEM_INFO si;
+        GetSystemInfo( &si );
+        nworkers = ( si.dwNumberOfProcessors > 0 ) ? (int)si.dwNumberOfProcessors : 1;
+    }
+
+    exiting = false;
+    for ( int i = 0; i < nworkers; i++ )
+    {
+        worker * w = new worker;
+        w->owner = this;
+        w->index = i;
+        w->idle = false;
+        w->load = 0;
+        w->hWake = CreateEvent( NULL, FALSE, FALSE, NULL );
+        w->decoded = w->runs = w->steals = 0;
+        InitializeCriticalSection( &w->cs );
+        w->pThread = AfxBeginThread( threadWorker, w, THREAD_PRIORITY_NORMAL, 0, CREATE_SUSPENDED );
+        if ( w->pThread == NULL )
+        {
+            CloseHandle( w->hWake );
+            DeleteCriticalSection( &w->cs );
+            delete w;
+            break;
+        }
+        w->pThread->m_bAutoDelete = FALSE;
+        pool.push_back( w );
+    }
+    if ( pool.empty() )
+        return false;
+    // sessions are only assigned to workers that exist; what was submitted before is scheduled now
+    EnterCriticalSection( &mapcs );
+    for ( std::unordered_map<iec104_class *, session_queue *>::iterator it = sessions.begin(); it != sessions.end(); ++it )
+    {
+        session_queue * q = it->second;
+        q->home = nextHome++ % (int)pool.size();
+        EnterCriticalSection( &q->cs );
+        if ( !q->queued && !q->bytes.empty() )
+        {
+            setQueued( q, true );
+            schedule( q, pool[q->home] );
+        }
+        LeaveCriticalSection( &q->cs );
+    }
+    LeaveCriticalSection( &mapcs );
+    for ( size_t i = 0; i < pool.size(); i++ )
+        pool[i]->pThread->ResumeThread();
+    return true;
+}
+
+void iec104_decodepool::stop()
+{
+    if ( pool.empty() )
+        return;
+    drain();
+    exiting = true;
+    for ( size_t i = 0; i < pool.size(); i++ )
+        SetEvent( pool[i]->hWake );
+    for ( size_t i = 0; i < pool.size(); i++ )
+    {
+        worker * w = pool[i];
+        WaitForSingleObject( w->pThread->m_hThread, INFINITE );
+        delete w->pThread;
+        CloseHandle( w->hWake );
+        DeleteCriticalSection( &w->cs );
+        delete w;
+    }
+    pool.clear();
+}
+
+iec104_decodepool::session_queue * iec104_decodepool::find( iec104_class * session )
+{
+    std::unordered_map<iec104_class *, session_queue *>::iterator it = sessions.find( session );
+    if ( it != sessions.end() )
+        return it->second;
+
+    session_queue * q = new session_queue;
+    q->session = session;
+    q->home = pool.empty() ? 0 : nextHome++ % (int)pool.size();
+    q->queued = false;
+    q->hIdle = CreateEvent( NULL, TRUE, TRUE, NULL );
+    InitializeCriticalSection( &q->cs );
+    sessions[session] = q;
+    return q;
+}
+
+void iec104_decodepool::submit( iec104_class * session, const iec_apdu * papdu, int sz )
+{
+    // not started: queued until start(), never decoded here under the receive thread's txlock
+    EnterCriticalSection( &mapcs );
+    session_queue * q = find( session );
+    submitted++;
+    LeaveCriticalSection( &mapcs );
+
+    EnterCriticalSection( &q->cs );
+    size_t at = q->bytes.size();
+    q->bytes.resize( at + 2 + sz );
+    q->bytes[at] = (unsigned char)( sz & 0xFF );
+    q->bytes[at + 1] = (unsigned char)( sz >> 8 );
+    if ( sz > 0 )
+        memcpy( &q->bytes[at + 2], papdu, sz );
+    if ( !q->queued && !pool.empty() )
+    {
+        setQueued( q, true );
+        schedule( q, pool[q->home] );
+    }
+    LeaveCriticalSection( &q->cs );
+}
+
+void iec104_decodepool::setQueued( session_queue * q, bool queued )
+{
+    q->queued = queued;
+    if ( queued )
+        ResetEvent( q->hIdle );
+    else
+        SetEvent( q->hIdle );
+
+    EnterCriticalSection( &idlecs );
+    busy += queued ? 1 : -1;
+    if ( busy == 0 )
+        SetEvent( hIdle );
+    else
+        ResetEvent( hIdle );
+    LeaveCriticalSection( &idlecs );
+}
+
+void iec104_decodepool::schedule( session_queue * q, worker * w )
+{
+    EnterCriticalSection( &w->cs );
+    w->ready.push_back( q );
+    w->load = (LONG)w->ready.size();
+    LeaveCriticalSection( &w->cs );
+    SetEvent( w->hWake );
+
+    // someone idle can take it if the home worker is busy
+    if ( !w->idle )
+        for ( size_t i = 0; i < pool.size(); i++ )
+            if ( pool[i]->idle )
+            {
+                SetEvent( pool[i]->hWake );
+                break;
+            }
+}
+
+iec104_decodepool::session_queue * iec104_decodepool::take( worker * w )
+{
+    session_queue * q = NULL;
+    EnterCriticalSection( &w->cs );
+    if ( !w->ready.empty() )
+    {
+        q = w->ready.front();
+        w->ready.pop_front();
+        w->load = (LONG)w->ready.size();
+    }
+    LeaveCriticalSection( &w->cs );
+    if ( q != NULL )
+        return q;
+
+    // steal from the worker with the longest run queue, from its far end
+    worker * victim = NULL;
+    LONG most = 0;
+    for ( size_t i = 0; i < pool.size(); i++ )
+    {
+        LONG n = pool[i]->load; // a hint, checked again under the lock
+        if ( pool[i] != w && n > most )
+        {
+            most = n;
+            victim = pool[i];
+        }
+    }
+    if ( victim == NULL )
+        return NULL;
+    EnterCriticalSection( &victim->cs );
+    if ( !victim->ready.empty() )
+    {
+        q = victim->ready.back();
+        victim->ready.pop_back();
+        victim->load = (LONG)victim->ready.size();
+    }
+    LeaveCriticalSection( &victim->cs );
+    if ( q != NULL )
+        w->steals++;
+    return q;
+}
+
+void iec104_decodepool::run( worker * w )
+{
+    std::vector<unsigned char> local;
+
+    while ( true )
+    {
+        session_queue * q = take( w );
+        if ( q == NULL )
+        {
+            // idle first, then look again, so a schedule() in between is not missed
+            w->idle = true;
+            q = take( w );
+            if ( q == NULL )
+            {
+                if ( exiting )
+                    break;
+                WaitForSingleObject( w->hWake, INFINITE );
+                w->idle = false;
+                continue;
+            }
+            w->idle = false;
+        }
+        w->runs++;
+
+        EnterCriticalSection( &q->cs );
+        local.swap( q->bytes );
+        LeaveCriticalSection( &q->cs );
+
+        size_t at = 0;
+        while ( at + 2 <= local.size() )
+        {
+            int sz = local[at] | ( local[at + 1] << 8 );
+            q->session->decodeAPDU( (iec_apdu *)( local.data() + at + 2 ), sz );
+            at += 2 + sz;
+            w->decoded++;
+        }
+        local.clear();
+
+        // more arrived meanwhile: this worker keeps the session, behind the others it has
+        EnterCriticalSection( &q->cs );
+        if ( q->bytes.empty() )
+            setQueued( q, false ); // q may be deleted by remove() once its cs is left
+        else
+        {
+            EnterCriticalSection( &w->cs );
+            w->ready.push_back( q );
+            w->load = (LONG)w->ready.size();
+            LeaveCriticalSection( &w->cs );
+        }
+        LeaveCriticalSection( &q->cs );
+    }
+}
+
+UINT iec104_decodepool::threadWorker( LPVOID lParam )
+{
+    worker * w = (worker *)lParam;
+    w->owner->run( w );
+    return 0;
+}
+
+void iec104_decodepool::drain()
+{
+    // set by the worker that releases the last queued session
+    WaitForSingleObject( hIdle, INFINITE );
+}
+
+void iec104_decodepool::remove( iec104_class * session )
+{
+    EnterCriticalSection( &mapcs );
+    std::unordered_map<iec104_class *, session_queue *>::iterator it = sessions.find( session );
+    if ( it == sessions.end() )
+    {
+        LeaveCriticalSection( &mapcs );
+        return;
+    }
+    session_queue * q = it->second;
+    sessions.erase( it );
+    LeaveCriticalSection( &mapcs );
+
+    // the session detached, nothing more is submitted for it; the worker holding its queue
+    // sets hIdle with the queue's cs held, taken here so it has left it too
+    WaitForSingleObject( q->hIdle, INFINITE );
+    EnterCriticalSection( &q->cs );
+    LeaveCriticalSection( &q->cs );
+    CloseHandle( q->hIdle );
+    DeleteCriticalSection( &q->cs );
+    delete q;
+}
+
+iec104_decodepool_stats iec104_decodepool::getStats()
+{
+    iec104_decodepool_stats st;
+    memset( &st, 0, sizeof( st ) );
+    EnterCriticalSection( &mapcs );
+    st.submitted = submitted;
+    LeaveCriticalSection( &mapcs );
+    for ( size_t i = 0; i < pool.size(); i++ )
+    {
+        st.decoded += pool[i]->decoded;
+        st.runs += pool[i]->runs;
+        st.steals += pool[i]->steals;
+    }
+    return st;
+}
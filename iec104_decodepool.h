@@ -0,0 +1,82 @@
+#ifndef IEC104_DECODEPOOL_H
+#define IEC104_DECODEPOOL_H
+
+// Decode worker pool for many IEC 104 sessions. The receive thread only frames APDUs and keeps
+// the sequence numbers (iec104_class::setDecoder); the ASDUs are queued per session and decoded
+// on the workers. A session's queue belongs to one worker at a time, so its ASDUs are decoded in
+// order. Every session has a home worker; a worker with nothing of its own to do steals a whole
+// session queue from the most loaded worker, so one RTU sending a large GI does not hold up
+// the others. Monitored values are decoded and indicated without the session's txlock, so the
+// receive thread keeps framing and acknowledging meanwhile.
+//
+// For a front end with many RTUs: the application's one session decodes on its receive thread.
+// The pool is driven by iec104_sim_decodeLoad, which /benchmark runs with 1,000 sessions at
+// 1, 2, 4 and 8 workers. start() before the sessions submit; until then ASDUs are only queued.
+
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+#include "iec104_class.h"
+
+struct iec104_decodepool_stats {
+    unsigned __int64 submitted; // ASDUs queued
+    unsigned __int64 decoded; // ASDUs decoded
+    unsigned __int64 runs; // session queues taken by a worker
+    unsigned __int64 steals; // of those, taken from another worker
+};
+
+class iec104_decodepool : public iec104_decoder
+{
+public:
+    iec104_decodepool();
+    ~iec104_decodepool();
+
+    bool start( int workers = 0 ); // 0: one per processor
+    void stop(); // decodes what is queued, then ends the workers
+    void drain(); // returns when every queued ASDU was decoded
+    void remove( iec104_class * session ); // setDecoder( NULL ) in the session's destructor; waits for its queue
+    void submit( iec104_class * session, const iec_apdu * papdu, int sz );
+    int workers() const { return (int)pool.size(); }
+    iec104_decodepool_stats getStats();
+
+private:
+    struct session_queue {
+        iec104_class * session;
+        int home; // worker it is queued on when it becomes ready
+        std::vector<unsigned char> bytes; // size (2 bytes) and APDU, back to back
+        bool queued; // on a run queue or being decoded
+        HANDLE hIdle; // manual reset, set while not queued; remove() waits on it
+        CRITICAL_SECTION cs;
+    };
+    struct worker {
+        iec104_decodepool * owner;
+        int index;
+        std::deque<session_queue *> ready; // sessions with ASDUs waiting
+        volatile bool idle;
+        volatile LONG load; // ready.size(), read without the lock when choosing a victim
+        HANDLE hWake;
+        CWinThread * pThread;
+        unsigned __int64 decoded, runs, steals;
+        CRITICAL_SECTION cs;
+    };
+
+    static UINT threadWorker( LPVOID lParam );
+    void run( worker * w );
+    session_queue * take( worker * w ); // own queue first, then steal
+    void schedule( session_queue * q, worker * w ); // q->cs held
+    void setQueued( session_queue * q, bool queued ); // q->cs held
+    session_queue * find( iec104_class * session );
+
+    std::vector<worker *> pool;
+    std::unordered_map<iec104_class *, session_queue *> sessions;
+    int nextHome;
+    volatile bool exiting;
+    unsigned __int64 submitted;
+    CRITICAL_SECTION mapcs; // sessions, nextHome, submitted
+    int busy; // sessions queued
+    HANDLE hIdle; // manual reset, set while busy is 0; drain() waits on it
+    CRITICAL_SECTION idlecs; // busy and hIdle, taken under a session's cs
+};
+
+#endif // IEC104_DECODEPOOL_H
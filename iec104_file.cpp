@@ -0,0 +1,387 @@
+#include "stdafx.h"
+#include <string.h>
+#include <stdio.h>
+
+#include "iec104_file.h"
+
+// file transfer types and qualifiers, as in iec104_class
+static const unsigned char F_FR_NA_1 = 120; // file ready
+static const unsigned char F_SR_NA_1 = 121; // section ready
+static const unsigned char F_SC_NA_1 = 122; // call directory, select file, call file, call section
+static const unsigned char F_LS_NA_1 = 123; // last section, last segment
+static const unsigned char F_AF_NA_1 = 124; // ack file, ack section
+static const unsigned char F_SG_NA_1 = 125; // segment
+static const unsigned char F_DR_TA_1 = 126; // directory
+
+static const unsigned char REQUEST = 5;
+static const unsigned char FILE_TRANSFER = 13;
+
+static const unsigned char SCQ_DIRECTORY = 0;
+static const unsigned char SCQ_SELECT_FILE = 1;
+static const unsigned char SCQ_REQUEST_FILE = 2;
+static const unsigned char SCQ_DEACTIVATE_FILE = 3;
+static const unsigned char SCQ_REQUEST_SECTION = 6;
+
+static const unsigned char LSQ_FILE = 1; // file transfer without deactivation
+static const unsigned char LSQ_FILE_DEACT = 2;
+static const unsigned char LSQ_SECTION = 3; // section transfer without deactivation
+static const unsigned char LSQ_SECTION_DEACT = 4;
+
+static const unsigned char AFQ_FILE_OK = 1;
+static const unsigned char AFQ_FILE_BAD = 2;
+static const unsigned char AFQ_SECTION_OK = 3;
+static const unsigned char AFQ_SECTION_BAD = 4;
+
+static const unsigned char SOF_LFD = 0x20; // last file of the directory
+
+static const int FILE_BUFFER = 65536;
+
+static unsigned int rd24( const unsigned char * p )
+{
+    return p[0] | ( p[1] << 8 ) | ( (unsigned int)p[2] << 16 );
+}
+
+static unsigned short rd16( const unsigned char * p )
+{
+    return (unsigned short)( p[0] | ( p[1] << 8 ) );
+}
+
+iec104_file_transfer::iec104_file_transfer()
+{
+    timeout = 30;
+    retries = 3;
+
+    link = NULL;
+    st = IDLE;
+    idle = 0;
+    ioa = 0;
+    nof = 0;
+    fp = NULL;
+    length = written = 0;
+    nos = 0;
+    sectionLength = sectionBytes = 0;
+    sectionSum = fileSum = 0;
+    failures = 0;
+}
+
+iec104_file_transfer::~iec104_file_transfer()
+{
+    if ( fp != NULL )
+    {
+        fclose( fp );
+        remove( ( path + ".part" ).c_str() );
+    }
+}
+
+void iec104_file_transfer::log( const char * fmt, unsigned a, unsigned b )
+{
+    char buf[128];
+    sprintf( buf, fmt, a, b );
+    link->fileLog( buf );
+}
+
+bool iec104_file_transfer::callDirectory( unsigned int pioa )
+{
+    if ( st != IDLE )
+        return false;
+    unsigned char obj[4] = { 0, 0, 0, SCQ_DIRECTORY };
+    if ( !link->fileSend( F_SC_NA_1, REQUEST, pioa, obj, 4 ) )
+        return false;
+    entries.clear();
+    ioa = pioa;
+    st = DIRECTORY;
+    idle = 0;
+    link->fileLog( "<-- CALL DIRECTORY" );
+    return true;
+}
+
+bool iec104_file_transfer::getFile( unsigned int pioa, unsigned short pnof, const char * ppath )
+{
+    if ( st != IDLE )
+        return false;
+
+    path = ppath;
+    fp = fopen( ( path + ".part" ).c_str(), "wb" );
+    if ( fp == NULL )
+    {
+        link->fileLog( "--> ERROR: FILE TRANSFER, CANNOT CREATE THE DESTINATION FILE" );
+        return false;
+    }
+    setvbuf( fp, NULL, _IOFBF, FILE_BUFFER );
+
+    ioa = pioa;
+    nof = pnof;
+    length = written = 0;
+    sectionBytes = 0;
+    fileSum = 0;
+    failures = 0;
+    if ( !select( SCQ_SELECT_FILE, 0 ) )
+    {
+        fclose( fp );
+        fp = NULL;
+        remove( ( path + ".part" ).c_str() );
+        return false;
+    }
+    st = SELECTING;
+    idle = 0;
+    log( "<-- SELECT FILE %u IOA %u", nof, ioa );
+    return true;
+}
+
+void iec104_file_transfer::abort()
+{
+    if ( st == IDLE )
+        return;
+    if ( st != DIRECTORY )
+        select( SCQ_DEACTIVATE_FILE, 0 );
+    finish( ABORTED );
+}
+
+void iec104_file_transfer::disconnected()
+{
+    if ( st != IDLE )
+        finish( ABORTED );
+}
+
+void iec104_file_transfer::tick()
+{
+    if ( st == IDLE || ++idle < timeout )
+        return;
+    link->fileLog( "--> ERROR: FILE TRANSFER TIMEOUT" );
+    if ( st != DIRECTORY )
+        select( SCQ_DEACTIVATE_FILE, 0 );
+    finish( TIMEOUT );
+}
+
+bool iec104_file_transfer::select( unsigned char scq, unsigned char pnos )
+{
+    unsigned char obj[4] = { (unsigned char)( nof & 0xFF ), (unsigned char)( nof >> 8 ), pnos, scq };
+    return link->fileSend( F_SC_NA_1, FILE_TRANSFER, ioa, obj, 4 );
+}
+
+bool iec104_file_transfer::acknowledge( unsigned char afq, unsigned char pnos )
+{
+    unsigned char obj[4] = { (unsigned char)( nof & 0xFF ), (unsigned char)( nof >> 8 ), pnos, afq };
+    return link->fileSend( F_AF_NA_1, FILE_TRANSFER, ioa, obj, 4 );
+}
+
+void iec104_file_transfer::finish( Result r )
+{
+    State was = st;
+    st = IDLE;
+    if ( was == DIRECTORY )
+    {
+        link->fileDirectory( entries.empty() ? NULL : &entries[0], (int)entries.size() );
+        return;
+    }
+
+    if ( fp != NULL )
+    {
+        if ( fclose( fp ) != 0 && r == OK )
+            r = IOERROR;
+        fp = NULL;
+    }
+    std::string part = path + ".part";
+    if ( r == OK )
+    {
+        remove( path.c_str() );
+        if ( rename( part.c_str(), path.c_str() ) != 0 )
+            r = IOERROR;
+    }
+    if ( r != OK )
+        remove( part.c_str() );
+    log( "--> FILE %u TRANSFER END, RESULT %u", nof, (unsigned)r );
+    link->fileDone( nof, (int)r, written );
+}
+
+void iec104_file_transfer::received( const unsigned char * asdu, int sz )
+{
+    if ( st == IDLE || sz < 6 + 3 )
+        return;
+
+    unsigned char type = asdu[0];
+    if ( type == F_DR_TA_1 )
+    {
+        if ( st == DIRECTORY )
+            directory( asdu, sz );
+        return;
+    }
+
+    // the other types carry one object whose name of file must be ours
+    const unsigned char * obj = asdu + 6 + 3;
+    int osz = sz - 6 - 3;
+    if ( st == DIRECTORY || osz < 3 || rd16( obj ) != nof )
+        return;
+    idle = 0;
+
+    switch ( type )
+    {
+    case F_FR_NA_1:
+        if ( osz >= 6 )
+            fileReady( obj );
+        break;
+    case F_SR_NA_1:
+        if ( osz >= 7 )
+            sectionReady( obj );
+        break;
+    case F_SG_NA_1:
+        segment( obj, osz );
+        break;
+    case F_LS_NA_1:
+        if ( osz >= 5 )
+            last( obj );
+        break;
+    default:
+        break;
+    }
+}
+
+void iec104_file_transfer::directory( const unsigned char * asdu, int sz )
+{
+    // NOF(2) LOF(3) SOF(1) CP56Time2a(7)
+    const int esz = 13;
+    int num = asdu[1] & 0x7F;
+    bool sq = ( asdu[1] & 0x80 ) != 0;
+    const unsigned char * p = asdu + 6;
+    const unsigned char * end = asdu + sz;
+    unsigned int addr = 0;
+    bool lastfile = false;
+    idle = 0;
+
+    for ( int i = 0; i < num; i++ )
+    {
+        if ( !sq || i == 0 )
+        {
+            if ( p + 3 > end )
+                break;
+            addr = rd24( p );
+            p += 3;
+        }
+        else
+            addr++;
+        if ( p + esz > end )
+            break;
+
+        iec_file_entry e;
+        e.ca = rd16( asdu + 4 );
+        e.ioa = addr;
+        e.nof = rd16( p );
+        e.length = rd24( p + 2 );
+        e.status = p[5];
+        memcpy( &e.time, p + 6, sizeof( e.time ) );
+        entries.push_back( e );
+        if ( e.status & SOF_LFD )
+            lastfile = true;
+        p += esz;
+    }
+
+    if ( lastfile )
+    {
+        log( "--> DIRECTORY: %u FILES", (unsigned)entries.size() );
+        finish( OK );
+    }
+}
+
+void iec104_file_transfer::fileReady( const unsigned char * obj )
+{
+    // NOF(2) LOF(3) FRQ(1)
+    if ( st != SELECTING )
+        return;
+    if ( obj[5] & 0x80 )
+    {
+        link->fileLog( "--> FILE NOT READY" );
+        finish( REFUSED );
+        return;
+    }
+    length = rd24( obj + 2 );
+    log( "--> FILE %u READY, %u BYTES", nof, length );
+    if ( select( SCQ_REQUEST_FILE, 0 ) )
+        st = REQUESTED;
+}
+
+void iec104_file_transfer::sectionReady( const unsigned char * obj )
+{
+    // NOF(2) NOS(1) LOF(3) SRQ(1)
+    if ( st != REQUESTED )
+        return;
+    if ( obj[6] & 0x80 )
+    {
+        link->fileLog( "--> SECTION NOT READY" );
+        select( SCQ_DEACTIVATE_FILE, 0 );
+        finish( REFUSED );
+        return;
+    }
+    nos = obj[2];
+    sectionLength = rd24( obj + 3 );
+    sectionBytes = 0;
+    sectionSum = 0;
+    if ( select( SCQ_REQUEST_SECTION, nos ) )
+        st = SECTION;
+}
+
+void iec104_file_transfer::segment( const unsigned char * obj, int sz )
+{
+    // NOF(2) NOS(1) LOS(1) segment
+    if ( st != SECTION || sz < 4 || obj[2] != nos )
+        return;
+    int los = obj[3];
+    if ( los > sz - 4 )
+        los = sz - 4;
+
+    const unsigned char * data = obj + 4;
+    if ( fwrite( data, 1, los, fp ) != (size_t)los )
+    {
+        link->fileLog( "--> ERROR: FILE TRANSFER, WRITE FAILED" );
+        select( SCQ_DEACTIVATE_FILE, 0 );
+        finish( IOERROR );
+        return;
+    }
+    for ( int i = 0; i < los; i++ )
+        sectionSum += data[i];
+    sectionBytes += los;
+}
+
+void iec104_file_transfer::last( const unsigned char * obj )
+{
+    // NOF(2) NOS(1) LSQ(1) CHS(1)
+    unsigned char lsq = obj[3];
+    unsigned char chs = obj[4];
+
+    if ( ( lsq == LSQ_SECTION || lsq == LSQ_SECTION_DEACT ) && st == SECTION && obj[2] == nos )
+    {
+        if ( chs == sectionSum && ( sectionLength == 0 || sectionBytes == sectionLength ) )
+        {
+            written += sectionBytes;
+            fileSum += sectionSum;
+            acknowledge( AFQ_SECTION_OK, nos );
+        }
+        else
+        {
+            // the outstation offers the section again, it overwrites what was written
+            log( "--> SECTION %u CHECKSUM ERROR, %u BYTES", nos, sectionBytes );
+            if ( ++failures > retries || fseek( fp, (long)written, SEEK_SET ) != 0 )
+            {
+                acknowledge( AFQ_FILE_BAD, nos );
+                finish( CHECKSUM );
+                return;
+            }
+            acknowledge( AFQ_SECTION_BAD, nos );
+        }
+        sectionBytes = 0;
+        st = REQUESTED;
+    }
+    else
+    if ( ( lsq == LSQ_FILE || lsq == LSQ_FILE_DEACT ) && st == REQUESTED )
+    {
+        if ( chs == fileSum && ( length == 0 || written == length ) )
+        {
+            acknowledge( AFQ_FILE_OK, 0 );
+            finish( OK );
+        }
+        else
+        {
+            acknowledge( AFQ_FILE_BAD, 0 );
+            finish( CHECKSUM );
+        }
+    }
+}
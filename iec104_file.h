@@ -0,0 +1,96 @@
+#ifndef IEC104_FILE_H
+#define IEC104_FILE_H
+
+// IEC 60870-5-104 file transfer, control direction (master retrieves from the outstation):
+// call directory, select file, request file, request section, segments, last segment/section
+// with checksum and the file/section acknowledgements. Segments are written to the destination
+// file as they arrive, so memory use does not depend on the file size. The file is written as
+// <path>.part and renamed to path when the file checksum matches.
+// One section is requested at a time and only after the previous one was acknowledged, so the
+// outstation's real-time frames pass between sections.
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "iec104_types.h"
+
+struct iec_file_entry {
+    unsigned short ca;
+    unsigned int ioa; // information object address of the file
+    unsigned short nof; // name of file
+    unsigned int length; // LOF, bytes
+    unsigned char status; // SOF: status (bits 0-4), LFD last file (bit 5), FOR subdirectory (bit 6), FA active (bit 7)
+    cp56time2a time; // creation time
+};
+
+// the protocol engine, as seen from the file transfer
+class iec104_file_link
+{
+public:
+    virtual ~iec104_file_link() {}
+    // queue an ASDU with one object; obj is what follows the object address
+    virtual bool fileSend( unsigned char type, unsigned char cause, unsigned int ioa, const unsigned char * obj, int sz ) = 0;
+    virtual void fileDirectory( const iec_file_entry * entries, int n ) = 0;
+    virtual void fileDone( unsigned short nof, int result, unsigned long bytes ) = 0;
+    virtual void fileLog( const char * msg ) = 0;
+};
+
+class iec104_file_transfer
+{
+public:
+    enum State { IDLE, DIRECTORY, SELECTING, REQUESTED, SECTION };
+    enum Result { OK, REFUSED, CHECKSUM, TIMEOUT, IOERROR, ABORTED };
+
+    iec104_file_transfer();
+    ~iec104_file_transfer();
+    void attach( iec104_file_link * plink ) { link = plink; }
+
+    int timeout; // seconds without progress before the transfer is abandoned
+    int retries; // negative section acknowledgements before the file is abandoned
+
+    // ---- user requests, false if a transfer is in progress or nothing could be sent --
+    bool callDirectory( unsigned int ioa );
+    bool getFile( unsigned int ioa, unsigned short nof, const char * path );
+    void abort();
+
+    // ---- from the protocol engine -------------------------------------------
+    void received( const unsigned char * asdu, int sz ); // types 120 to 126
+    void tick(); // each second
+    void disconnected();
+
+    State state() const { return st; }
+    bool busy() const { return st != IDLE; }
+    unsigned long bytesReceived() const { return written + sectionBytes; }
+    unsigned long fileLength() const { return length; }
+
+private:
+    void directory( const unsigned char * asdu, int sz );
+    void fileReady( const unsigned char * obj );
+    void sectionReady( const unsigned char * obj );
+    void segment( const unsigned char * obj, int sz );
+    void last( const unsigned char * obj );
+    bool select( unsigned char scq, unsigned char nos );
+    bool acknowledge( unsigned char afq, unsigned char nos );
+    void finish( Result r );
+    void log( const char * fmt, unsigned a, unsigned b = 0 );
+
+    iec104_file_link * link;
+    State st;
+    int idle; // seconds since the last progress
+    std::vector<iec_file_entry> entries;
+    unsigned int ioa;
+    unsigned short nof;
+    std::string path;
+    FILE * fp;
+    unsigned long length; // LOF of the file
+    unsigned long written; // bytes of acknowledged sections
+    unsigned char nos; // section being received
+    unsigned long sectionLength;
+    unsigned long sectionBytes;
+    unsigned char sectionSum;
+    unsigned char fileSum;
+    int failures; // negative section acknowledgements sent
+};
+
+#endif // IEC104_FILE_H
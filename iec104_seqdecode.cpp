@@ -0,0 +1,244 @@
+#include "stdafx.h"
+#include <string.h>
+#include <intrin.h>
+#include <immintrin.h>
+
+#include "iec104_seqdecode.h"
+
+// start(1) + length(1) + NS(2) + NR(2) + ASDU header(6) + IOA(3)
+static const int SEQ_FIRST_ELEMENT = 15;
+
+int iec104_seqdecode::level = -1;
+
+static const unsigned char * seqElements( const iec_apdu * papdu )
+{
+    return (const unsigned char *)papdu + SEQ_FIRST_ELEMENT;
+}
+
+static int seqElementSize( unsigned char type )
+{
+    switch ( type )
+    {
+    case 9:  // M_ME_NA_1
+    case 11: // M_ME_NB_1
+        return 3;
+    case 13: // M_ME_NC_1
+        return 5;
+    default:
+        return 0;
+    }
+}
+
+// scalar decode of elements [from, to)
+static void seqScalar( const unsigned char * p, int elemsz, int from, int to, iec_seqdata * out )
+{
+    if ( elemsz == 5 )
+    {
+        for ( int i = from; i < to; i++ )
+        {
+            memcpy( &out->value[i], p + 5 * i, 4 );
+            out->qds[i] = p[5 * i + 4];
+        }
+    }
+    else
+    {
+        for ( int i = from; i < to; i++ )
+        {
+            unsigned short mv = (unsigned short)( p[3 * i] | ( p[3 * i + 1] << 8 ) );
+            out->value[i] = mv;
+            out->qds[i] = p[3 * i + 2];
+        }
+    }
+}
+
+bool iec104_seqdecode::supports( unsigned char type )
+{
+    return seqElementSize( type ) != 0;
+}
+
+int iec104_seqdecode::prepare( const iec_apdu * papdu, int sz, iec_seqdata * out, int elemsz )
+{
+    int avail = sz - SEQ_FIRST_ELEMENT;
+    int num = papdu->asduh.num;
+
+    if ( avail < 0 )
+        avail = 0;
+    if ( num * elemsz > avail )
+        num = avail / elemsz; // truncated frame, do not read beyond it
+
+    out->base = papdu->sq9.ioa16 + ( (unsigned)papdu->sq9.ioa8 << 16 );
+    out->num = num;
+    out->type = papdu->asduh.type;
+    out->cause = papdu->asduh.cause;
+    out->pn = papdu->asduh.pn;
+    out->ca = papdu->asduh.ca;
+    return num;
+}
+
+int iec104_seqdecode::decodeScalar( const iec_apdu * papdu, int sz, iec_seqdata * out )
+{
+    int elemsz = seqElementSize( papdu->asduh.type );
+    if ( elemsz == 0 )
+        return -1;
+
+    int num = prepare( papdu, sz, out, elemsz );
+    seqScalar( seqElements( papdu ), elemsz, 0, num, out );
+    return num;
+}
+
+int iec104_seqdecode::decodeSSSE3( const iec_apdu * papdu, int sz, iec_seqdata * out )
+{
+    int elemsz = seqElementSize( papdu->asduh.type );
+    if ( elemsz == 0 )
+        return -1;
+
+    int num = prepare( papdu, sz, out, elemsz );
+    int avail = sz - SEQ_FIRST_ELEMENT;
+    const unsigned char * p = seqElements( papdu );
+    int i = 0;
+
+    if ( elemsz == 5 )
+    {
+        // 3 elements per 16 byte load: floats to dwords 0..2, quality bytes to dword 3
+        const __m128i mask = _mm_setr_epi8( 0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, 4, 9, 14, -1 );
+        __declspec(align(16)) unsigned int tmp[4];
+
+        for ( ; i + 3 <= num && 5 * i + 16 <= avail; i += 3 )
+        {
+            __m128i r = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)( p + 5 * i ) ), mask );
+            _mm_store_si128( (__m128i *)tmp, r );
+            memcpy( &out->value[i], tmp, 12 );
+            memcpy( &out->qds[i], &tmp[3], 3 );
+        }
+    }
+    else
+    {
+        // 4 elements per 16 byte load: values zero extended to dwords, quality bytes packed
+        const __m128i maskv = _mm_setr_epi8( 0, 1, -1, -1, 3, 4, -1, -1, 6, 7, -1, -1, 9, 10, -1, -1 );
+        const __m128i maskq = _mm_setr_epi8( 2, 5, 8, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+
+        for ( ; i + 4 <= num && 3 * i + 16 <= avail; i += 4 )
+        {
+            __m128i raw = _mm_loadu_si128( (const __m128i *)( p + 3 * i ) );
+            _mm_storeu_ps( &out->value[i], _mm_cvtepi32_ps( _mm_shuffle_epi8( raw, maskv ) ) );
+            int q = _mm_cvtsi128_si32( _mm_shuffle_epi8( raw, maskq ) );
+            memcpy( &out->qds[i], &q, 4 );
+        }
+    }
+
+    seqScalar( p, elemsz, i, num, out );
+    return num;
+}
+
+int iec104_seqdecode::decodeAVX2( const iec_apdu * papdu, int sz, iec_seqdata * out )
+{
+    int elemsz = seqElementSize( papdu->asduh.type );
+    if ( elemsz == 0 )
+        return -1;
+
+    int num = prepare( papdu, sz, out, elemsz );
+    int avail = sz - SEQ_FIRST_ELEMENT;
+    const unsigned char * p = seqElements( papdu );
+    int i = 0;
+    __declspec(align(32)) unsigned int tmp[8];
+
+    if ( elemsz == 5 )
+    {
+        // 6 elements per iteration, lanes loaded at +0 and +15 bytes, then compacted
+        const __m256i mask = _mm256_setr_epi8( 0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, 4, 9, 14, -1,
+                                               0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, 4, 9, 14, -1 );
+        const __m256i perm = _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 3, 7 );
+
+        for ( ; i + 6 <= num && 5 * i + 31 <= avail; i += 6 )
+        {
+            const unsigned char * q = p + 5 * i;
+            __m256i raw = _mm256_inserti128_si256(
+                              _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i *)q ) ),
+                              _mm_loadu_si128( (const __m128i *)( q + 15 ) ), 1 );
+            __m256i r = _mm256_permutevar8x32_epi32( _mm256_shuffle_epi8( raw, mask ), perm );
+            _mm256_store_si256( (__m256i *)tmp, r );
+            memcpy( &out->value[i], tmp, 24 );
+            memcpy( &out->qds[i], &tmp[6], 3 );
+            memcpy( &out->qds[i + 3], &tmp[7], 3 );
+        }
+    }
+    else
+    {
+        // 8 elements per iteration, lanes loaded at +0 and +12 bytes
+        const __m256i maskv = _mm256_setr_epi8( 0, 1, -1, -1, 3, 4, -1, -1, 6, 7, -1, -1, 9, 10, -1, -1,
+                                                0, 1, -1, -1, 3, 4, -1, -1, 6, 7, -1, -1, 9, 10, -1, -1 );
+        const __m256i maskq = _mm256_setr_epi8( 2, 5, 8, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                2, 5, 8, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+
+        for ( ; i + 8 <= num && 3 * i + 28 <= avail; i += 8 )
+        {
+            const unsigned char * q = p + 3 * i;
+            __m256i raw = _mm256_inserti128_si256(
+                              _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i *)q ) ),
+                              _mm_loadu_si128( (const __m128i *)( q + 12 ) ), 1 );
+            _mm256_storeu_ps( &out->value[i], _mm256_cvtepi32_ps( _mm256_shuffle_epi8( raw, maskv ) ) );
+            _mm256_store_si256( (__m256i *)tmp, _mm256_shuffle_epi8( raw, maskq ) );
+            memcpy( &out->qds[i], &tmp[0], 4 );
+            memcpy( &out->qds[i + 4], &tmp[4], 4 );
+        }
+    }
+    _mm256_zeroupper();
+
+    seqScalar( p, elemsz, i, num, out );
+    return num;
+}
+
+iec104_seqdecode::Level iec104_seqdecode::detectLevel()
+{
+    int info[4];
+
+    __cpuid( info, 0 );
+    int maxleaf = info[0];
+
+    __cpuid( info, 1 );
+    bool ssse3 = ( info[2] & ( 1 << 9 ) ) != 0;
+    bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+    bool avx = ( info[2] & ( 1 << 28 ) ) != 0;
+
+    if ( avx && osxsave && maxleaf >= 7 )
+    {
+        // the os must save the ymm registers
+        if ( ( _xgetbv( 0 ) & 0x6 ) == 0x6 )
+        {
+            __cpuidex( info, 7, 0 );
+            if ( info[1] & ( 1 << 5 ) )
+                return AVX2;
+        }
+    }
+
+    if ( ssse3 )
+        return SSSE3;
+
+    return SCALAR;
+}
+
+iec104_seqdecode::Level iec104_seqdecode::getLevel()
+{
+    if ( level < 0 )
+        level = detectLevel();
+    return (Level)level;
+}
+
+void iec104_seqdecode::setLevel( Level lvl )
+{
+    Level max = detectLevel();
+    level = ( lvl > max ) ? max : lvl;
+}
+
+int iec104_seqdecode::decode( const iec_apdu * papdu, int sz, iec_seqdata * out )
+{
+    switch ( getLevel() )
+    {
+    case AVX2:
+        return decodeAVX2( papdu, sz, out );
+    case SSSE3:
+        return decodeSSSE3( papdu, sz, out );
+    default:
+        return decodeScalar( papdu, sz, out );
+    }
+}
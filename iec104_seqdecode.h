@@ -0,0 +1,55 @@
+#include "stdafx.h"
+
+#ifndef IEC104_SEQDECODE_H
+#define IEC104_SEQDECODE_H
+
+// BULK DECODER FOR SEQUENCE (SQ=1) MEASURED VALUE ASDUs
+// M_ME_NA_1, M_ME_NB_1 and M_ME_NC_1 with SQ=1 carry one IOA followed by contiguous
+// fixed-size elements. The values and quality descriptors are gathered in one pass into
+// struct-of-arrays form, the address of element i is base+i.
+
+#include "iec104_types.h"
+
+#define IEC_SEQ_MAX 127
+
+struct iec_seqdata {
+    unsigned int base;  // address of the first element
+    int num; // number of elements decoded
+
+    unsigned char type; // iec type
+    unsigned char cause; //
+    unsigned char pn; // 0=positive, 1=negative
+    unsigned short ca;  // common addres of asdu
+
+    float value[IEC_SEQ_MAX]; // values, same conversion as the per object decoder
+    unsigned char qds[IEC_SEQ_MAX]; // raw quality descriptor: ov(bit0) bl(bit4) sb(bit5) nt(bit6) iv(bit7)
+};
+
+class iec104_seqdecode
+{
+    public:
+
+    enum Level { SCALAR = 0, SSSE3 = 1, AVX2 = 2 };
+
+    // true if the type has a bulk path (M_ME_NA_1, M_ME_NB_1, M_ME_NC_1)
+    static bool supports( unsigned char type );
+
+    // decode a SQ=1 apdu of sz bytes with the best path for this cpu
+    // returns the number of elements decoded (clamped to the frame size), -1 if not supported
+    static int decode( const iec_apdu * papdu, int sz, iec_seqdata * out );
+
+    // fixed paths, used for comparisons and as fallback
+    static int decodeScalar( const iec_apdu * papdu, int sz, iec_seqdata * out );
+    static int decodeSSSE3( const iec_apdu * papdu, int sz, iec_seqdata * out );
+    static int decodeAVX2( const iec_apdu * papdu, int sz, iec_seqdata * out );
+
+    static Level detectLevel(); // what the cpu (and os) supports
+    static Level getLevel(); // path used by decode()
+    static void setLevel( Level lvl ); // force a path (clamped to what is supported)
+
+    private:
+    static int level; // -1 = not detected yet
+    static int prepare( const iec_apdu * papdu, int sz, iec_seqdata * out, int elemsz );
+};
+
+#endif // IEC104_SEQDECODE_H
@@ -0,0 +1,270 @@
+#include "stdafx.h"
+#include <string.h>
+#include <stdio.h>
+
+#include "iec104_session.h"
+
+// U frame codes, as in iec104_class
+static const unsigned char U_STARTDTACT = 0x07;
+static const unsigned char U_STARTDTCON = 0x0B;
+static const unsigned char U_STOPDTACT = 0x13;
+static const unsigned char U_STOPDTCON = 0x23;
+static const unsigned char U_TESTFRACT = 0x43;
+static const unsigned char U_TESTFRCON = 0x83;
+
+iec104_session::iec104_session()
+{
+    t1 = 6;
+    t2 = 4;
+    t3 = 10;
+    w = 8;
+    giDelay = 10;
+    reconnectDelay = 5;
+
+    link = NULL;
+    st = IDLE;
+    tcp = false;
+    unacked = 0;
+    memset( timers, 0, sizeof( timers ) );
+}
+
+void iec104_session::attach( iec104_session_link * plink )
+{
+    link = plink;
+    arm( T_RECONNECT, reconnectDelay );
+}
+
+const char * iec104_session::stateName() const
+{
+    switch ( st )
+    {
+    case IDLE: return "IDLE";
+    case STARTING: return "STARTING";
+    case STARTED: return "STARTED";
+    case INTERROGATING: return "INTERROGATING";
+    case TRANSFER: return "TRANSFER";
+    case STOPPING: return "STOPPING";
+    }
+    return "?";
+}
+
+void iec104_session::enter( State s )
+{
+    if ( s == st )
+        return;
+    st = s;
+    char buf[64];
+    sprintf( buf, "*** SESSION %s", stateName() );
+    link->sessionLog( buf );
+}
+
+void iec104_session::arm( Timer t, int seconds )
+{
+    timers[t] = ( seconds > 0 ) ? seconds : 1;
+}
+
+void iec104_session::connected()
+{
+    tcp = true;
+    unacked = 0;
+    memset( timers, 0, sizeof( timers ) );
+    link->sessionSendU( U_STARTDTACT );
+    enter( STARTING );
+    arm( T_STARTDT, t1 );
+}
+
+void iec104_session::disconnected()
+{
+    tcp = false;
+    unacked = 0;
+    memset( timers, 0, sizeof( timers ) );
+    enter( IDLE );
+    arm( T_RECONNECT, reconnectDelay );
+}
+
+void iec104_session::tick()
+{
+    // collect first: a timeout may connect, disconnect and re-arm any timer
+    bool expired[TIMER_COUNT];
+    for ( int i = 0; i < TIMER_COUNT; i++ )
+    {
+        expired[i] = false;
+        if ( timers[i] > 0 && --timers[i] == 0 )
+            expired[i] = true;
+    }
+    for ( int i = 0; i < TIMER_COUNT; i++ )
+        if ( expired[i] && timers[i] == 0 )
+            timeout( (Timer)i );
+}
+
+void iec104_session::timeout( Timer t )
+{
+    switch ( t )
+    {
+    case T_RECONNECT:
+        if ( !tcp )
+        {
+            link->sessionConnect(); // connected() is called from here on success
+            if ( !tcp )
+                arm( T_RECONNECT, reconnectDelay );
+        }
+        break;
+
+    case T_STARTDT: // no STARTDTCON: retry
+        if ( st == STARTING )
+        {
+            link->sessionSendU( U_STARTDTACT );
+            arm( T_STARTDT, t1 );
+        }
+        break;
+
+    case T_GIDELAY:
+        if ( st == STARTED )
+            interrogate();
+        break;
+
+    case T_GICON: // no GI ACTCON: retry
+        if ( st == INTERROGATING )
+        {
+            link->sessionLog( "--> ERROR: NO INTERROGATION ACT CON" );
+            link->sessionSendGI();
+            arm( T_GICON, t1 );
+        }
+        break;
+
+    case T_SUPERVISORY:
+        acknowledge();
+        break;
+
+    case T_IDLE:
+        if ( canTransmit() )
+        {
+            link->sessionSendU( U_TESTFRACT );
+            arm( T_TESTFR, t1 );
+        }
+        break;
+
+    case T_TESTFR:
+        link->sessionLog( "--> ERROR: NO TESTFRCON" );
+        drop();
+        break;
+
+    case T_STOPDT:
+        link->sessionLog( "--> ERROR: NO STOPDTCON" );
+        drop();
+        break;
+
+    default:
+        break;
+    }
+}
+
+void iec104_session::drop()
+{
+    link->sessionDisconnect(); // disconnected() is called from here
+    if ( tcp ) // the connection could not be shut down cleanly, treat it as lost anyway
+        disconnected();
+}
+
+void iec104_session::frameReceived()
+{
+    if ( !tcp )
+        return;
+    cancel( T_TESTFR ); // anything received proves the link
+    arm( T_IDLE, t3 );
+}
+
+void iec104_session::controlReceived( unsigned char code )
+{
+    switch ( code )
+    {
+    case U_STARTDTCON:
+        if ( st == STARTING )
+        {
+            cancel( T_STARTDT );
+            enter( STARTED );
+            arm( T_GIDELAY, giDelay );
+        }
+        break;
+
+    case U_STOPDTCON:
+        if ( st == STOPPING )
+        {
+            cancel( T_STOPDT );
+            drop();
+        }
+        break;
+
+    case U_TESTFRCON:
+        cancel( T_TESTFR );
+        break;
+
+    default:
+        break;
+    }
+}
+
+void iec104_session::dataReceived()
+{
+    if ( !tcp )
+        return;
+    unacked++;
+    // acknowledge after w frames or t2 seconds, whichever comes first
+    if ( unacked >= w )
+        acknowledge();
+    else
+    if ( !armed( T_SUPERVISORY ) )
+        arm( T_SUPERVISORY, t2 );
+}
+
+void iec104_session::acknowledge()
+{
+    cancel( T_SUPERVISORY );
+    if ( unacked > 0 && tcp )
+    {
+        unacked = 0;
+        link->sessionSendS();
+    }
+}
+
+void iec104_session::acknowledged()
+{
+    cancel( T_SUPERVISORY );
+    unacked = 0;
+}
+
+void iec104_session::giConfirmed()
+{
+    cancel( T_GICON );
+}
+
+void iec104_session::giTerminated()
+{
+    cancel( T_GICON );
+    if ( st == INTERROGATING )
+        enter( TRANSFER );
+}
+
+void iec104_session::interrogate()
+{
+    if ( !canTransmit() )
+        return;
+    cancel( T_GIDELAY );
+    link->sessionSendGI();
+    enter( INTERROGATING );
+    arm( T_GICON, t1 );
+}
+
+void iec104_session::stop()
+{
+    if ( !tcp || st == STOPPING )
+        return;
+    // pending acknowledgements go out before data transfer stops
+    acknowledge();
+    cancel( T_STARTDT );
+    cancel( T_GIDELAY );
+    cancel( T_GICON );
+    link->sessionSendU( U_STOPDTACT );
+    enter( STOPPING );
+    arm( T_STOPDT, t1 );
+}
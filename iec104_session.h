@@ -0,0 +1,86 @@
+#ifndef IEC104_SESSION_H
+#define IEC104_SESSION_H
+
+// IEC 60870-5-104 master session life cycle:
+//   IDLE -> STARTING (STARTDT) -> STARTED (GI delay) -> INTERROGATING -> TRANSFER -> STOPPING -> IDLE
+// Every wait is a named timer armed on entry to a state and cancelled when the awaited
+// frame arrives; one second ticks and received frames are the only inputs, so a session
+// is a few dozen bytes driven by whatever thread already owns the connection.
+
+// actions the session asks of its connection
+class iec104_session_link
+{
+public:
+    virtual ~iec104_session_link() {}
+    virtual void sessionConnect() = 0;                   // open the tcp connection
+    virtual void sessionDisconnect() = 0;                // close the tcp connection
+    virtual void sessionSendU( unsigned char code ) = 0; // STARTDTACT, STOPDTACT, TESTFRACT
+    virtual void sessionSendS() = 0;                     // supervisory frame acknowledging VR
+    virtual void sessionSendGI() = 0;                    // general interrogation
+    virtual void sessionLog( const char * msg ) = 0;
+};
+
+class iec104_session
+{
+public:
+    enum State { IDLE, STARTING, STARTED, INTERROGATING, TRANSFER, STOPPING };
+    enum Timer {
+        T_RECONNECT,   // reconnect attempt while IDLE
+        T_STARTDT,     // t1, STARTDTCON expected
+        T_GIDELAY,     // pause between STARTDTCON and the first GI
+        T_GICON,       // t1, GI ACTCON expected
+        T_SUPERVISORY, // t2, acknowledge received I frames
+        T_IDLE,        // t3, nothing received: test the link
+        T_TESTFR,      // t1, TESTFRCON expected
+        T_STOPDT,      // t1, STOPDTCON expected
+        TIMER_COUNT
+    };
+
+    iec104_session();
+    void attach( iec104_session_link * plink );
+
+    // inputs
+    void connected();                      // tcp connection is up
+    void disconnected();                   // tcp connection is down
+    void tick();                           // once per second
+    void frameReceived();                  // any valid frame
+    void controlReceived( unsigned char code ); // U frame from the outstation
+    void dataReceived();                   // accounted I frame
+    void giConfirmed();
+    void giTerminated();
+    void acknowledged();                   // an I frame carrying VR was sent
+
+    // requests
+    void interrogate();                    // GI now, if data transfer is started
+    void stop();                           // STOPDT, then close
+
+    State state() const { return st; }
+    const char * stateName() const;
+    bool isConnected() const { return tcp; }
+    bool canTransmit() const { return st == STARTED || st == INTERROGATING || st == TRANSFER; }
+
+    // parameters in seconds, w in I frames
+    int t1;
+    int t2;
+    int t3;
+    int w;
+    int giDelay;
+    int reconnectDelay;
+
+private:
+    void enter( State s );
+    void arm( Timer t, int seconds );
+    void cancel( Timer t ) { timers[t] = 0; }
+    bool armed( Timer t ) const { return timers[t] > 0; }
+    void timeout( Timer t );
+    void acknowledge();
+    void drop();
+
+    iec104_session_link * link;
+    State st;
+    bool tcp;
+    int unacked;               // I frames received since the last acknowledgement
+    int timers[TIMER_COUNT];   // seconds left, 0 when not armed
+};
+
+#endif // IEC104_SESSION_H
@@ -0,0 +1,1106 @@
+#include "stdafx.h"
+#include <string.h>
+
+#include "iec104_sim.h"
+#include "iec104_seqdecode.h"
+
+// ---- iec104_sim_clock ---------------------------------------------------------
+
+iec104_sim_clock::iec104_sim_clock()
+{
+    tnow = 0;
+    seq = 0;
+    count = 0;
+}
+
+void iec104_sim_clock::at( __int64 t, iec104_sim_target * target, int what, unsigned int tag )
+{
+    event e;
+    e.t = ( t < tnow ) ? tnow : t;
+    e.seq = seq++;
+    e.target = target;
+    e.what = what;
+    e.tag = tag;
+    q.push( e );
+}
+
+bool iec104_sim_clock::step()
+{
+    if ( q.empty() )
+        return false;
+    event e = q.top();
+    q.pop();
+    tnow = e.t;
+    count++;
+    e.target->simEvent( e.what, e.tag );
+    return true;
+}
+
+void iec104_sim_clock::runUntil( __int64 t )
+{
+    while ( !q.empty() && q.top().t <= t )
+        step();
+    if ( tnow < t )
+        tnow = t;
+}
+
+// ---- iec104_sim_pipe ----------------------------------------------------------
+
+iec104_sim_pipe::iec104_sim_pipe()
+{
+    clock = NULL;
+    latency = 0;
+    reader = NULL;
+    readerWhat = 0;
+    head = 0;
+    ready = 0;
+    scheduled = false;
+}
+
+void iec104_sim_pipe::setup( iec104_sim_clock * pclock, int lat, iec104_sim_target * preader, int what )
+{
+    clock = pclock;
+    latency = lat;
+    reader = preader;
+    readerWhat = what;
+}
+
+void iec104_sim_pipe::write( const char * data, int sz )
+{
+    if ( sz <= 0 )
+        return;
+    if ( head > 0 && head == bytes.size() )
+    {
+        bytes.clear();
+        head = 0;
+    }
+    bytes.insert( bytes.end(), data, data + sz );
+    segments.push_back( std::make_pair( clock->now() + latency, sz ) );
+    // one delivery event per pipe at a time; writes arrive in order
+    if ( !scheduled )
+    {
+        scheduled = true;
+        clock->at( segments.front().first, this, 0 );
+    }
+}
+
+void iec104_sim_pipe::simEvent( int /*what*/, unsigned int /*tag*/ )
+{
+    scheduled = false;
+    bool arrived = false;
+    while ( !segments.empty() && segments.front().first <= clock->now() )
+    {
+        ready += segments.front().second;
+        segments.pop_front();
+        arrived = true;
+    }
+    if ( !segments.empty() )
+    {
+        scheduled = true;
+        clock->at( segments.front().first, this, 0 );
+    }
+    if ( arrived && reader != NULL )
+        reader->simEvent( readerWhat, 0 );
+}
+
+int iec104_sim_pipe::read( char * buf, int szmax )
+{
+    int n = ( szmax < ready ) ? szmax : ready;
+    if ( n > 0 )
+    {
+        memcpy( buf, &bytes[head], n );
+        head += n;
+        ready -= n;
+    }
+    // keep the buffer from growing while the reader keeps up
+    if ( head > 4096 && head * 2 > bytes.size() )
+    {
+        bytes.erase( bytes.begin(), bytes.begin() + head );
+        head = 0;
+    }
+    return n;
+}
+
+void iec104_sim_pipe::reset()
+{
+    // a pending delivery event finds nothing due and reschedules itself if needed
+    bytes.clear();
+    head = 0;
+    segments.clear();
+    ready = 0;
+}
+
+// ---- configuration -------------------------------------------------------------
+
+iec104_sim_faults::iec104_sim_faults()
+{
+    silentFrom = silentUntil = 0;
+    refuseFrom = refuseUntil = 0;
+    dropEvery = 0;
+    ignoreGI = false;
+    noGITerm = false;
+    changeInGI = false;
+    corruptSections = 0;
+}
+
+iec104_sim_config::iec104_sim_config()
+{
+    sessions = 1;
+    points = 100;
+    latency = 20;
+    period = 1000;
+    changes = 10;
+    seed = 1;
+    log = false;
+    faultySessions = 0;
+    upstream = 0;
+    fileSize = 0;
+}
+
+// ---- iec104_sim_master --------------------------------------------------------
+
+iec104_sim_master::iec104_sim_master( iec104_sim_clock * pclock, iec104_sim_peer * ppeer, int latency, int phase, bool log )
+{
+    clock = pclock;
+    peer = ppeer;
+    connected = false;
+    connects = refused = disconnects = gis = giCommits = objects = 0;
+    files = fileBytes = fileErrors = 0;
+
+    mLog.activateLog(); // also sets up the log lock
+    if ( !log )
+        mLog.deactivateLog();
+
+    up.setup( clock, latency, this, EV_READABLE );
+    clock->after( phase, this, EV_TICK );
+}
+
+iec104_sim_master::~iec104_sim_master()
+{
+    if ( mLog.isLogging() )
+        mLog.deactivateLog();
+}
+
+void iec104_sim_master::simEvent( int what, unsigned int /*tag*/ )
+{
+    switch ( what )
+    {
+    case EV_TICK:
+        onTimerSecond();
+        clock->after( 1000, this, EV_TICK );
+        break;
+    case EV_READABLE:
+        readable();
+        break;
+    case EV_PEERCLOSED:
+        if ( connected )
+        {
+            connected = false;
+            disconnects++;
+            up.reset();
+            onDisconnectTCP();
+        }
+        break;
+    }
+}
+
+void iec104_sim_master::readable()
+{
+    // packetReadyTCP takes one apdu per call; everything they answer goes out in one write
+    beginBatch();
+    while ( connected && up.available() > 0 )
+        packetReadyTCP();
+    endBatch();
+}
+
+void iec104_sim_master::connectTCP()
+{
+    if ( connected )
+        return;
+    if ( !peer->accept() )
+    {
+        refused++;
+        return;
+    }
+    up.reset();
+    connected = true;
+    connects++;
+    onConnectTCP();
+}
+
+void iec104_sim_master::disconnectTCP()
+{
+    if ( !connected )
+        return;
+    connected = false;
+    disconnects++;
+    up.reset();
+    peer->closed();
+    onDisconnectTCP();
+}
+
+void iec104_sim_master::peerClosed( int delay )
+{
+    clock->after( delay, this, EV_PEERCLOSED );
+}
+
+int iec104_sim_master::readTCP( char * buf, int szmax )
+{
+    return up.read( buf, szmax );
+}
+
+void iec104_sim_master::sendTCP( char * data, int sz )
+{
+    if ( connected )
+        peer->receive( data, sz );
+}
+
+void iec104_sim_master::dataIndication( iec_obj * obj, int numpoints )
+{
+    objects += numpoints;
+    if ( onData )
+        onData( obj, numpoints );
+}
+
+void iec104_sim_master::interrogationIndication( iec_obj * obj, int numpoints )
+{
+    giCommits++;
+    dataIndication( obj, numpoints );
+}
+
+void iec104_sim_master::interrogationActTermIndication()
+{
+    gis++;
+}
+
+void iec104_sim_master::fileTransferIndication( unsigned short /*nof*/, int result, unsigned long bytes )
+{
+    if ( result == iec104_file_transfer::OK )
+    {
+        files++;
+        fileBytes += bytes;
+    }
+    else
+        fileErrors++;
+}
+
+// ---- iec104_sim_outstation ----------------------------------------------------
+
+static const unsigned char SIM_START = 0x68;
+static const unsigned char SIM_M_ME_NC_1 = 13;
+static const unsigned char SIM_C_IC_NA_1 = 100;
+static const unsigned char SIM_F_FR_NA_1 = 120;
+static const unsigned char SIM_F_SR_NA_1 = 121;
+static const unsigned char SIM_F_SC_NA_1 = 122;
+static const unsigned char SIM_F_LS_NA_1 = 123;
+static const unsigned char SIM_F_AF_NA_1 = 124;
+static const unsigned char SIM_F_SG_NA_1 = 125;
+static const unsigned char SIM_F_DR_TA_1 = 126;
+static const unsigned char SIM_REQUEST = 5;
+static const unsigned char SIM_FILE_TRANSFER = 13;
+static const unsigned long SIM_FILE_SECTION = 4096;
+static const int SIM_FILE_SEGMENT = 200;
+static const unsigned char SIM_SPONTANEOUS = 3;
+static const unsigned char SIM_ACTIVATION = 6;
+static const unsigned char SIM_ACTCONFIRM = 7;
+static const unsigned char SIM_ACTTERM = 10;
+static const unsigned char SIM_INROGEN = 20;
+static const int SIM_MAX_APDU = 253;
+
+iec104_sim_outstation::iec104_sim_outstation( iec104_sim_clock * pclock, unsigned short pca, int points, int platency,
+                                              int pperiod, int pchanges, unsigned int seed, const iec104_sim_faults & pfaults )
+{
+    clock = pclock;
+    latency = platency;
+    master = NULL;
+    faults = pfaults;
+    ca = pca;
+    period = ( pperiod > 0 ) ? pperiod : 1000;
+    changes = pchanges;
+    rng = seed ? seed : 1;
+    connected = started = false;
+    epoch = 0;
+    vs = vr = ack = 0;
+    frames = testfr = supervisory = sent = 0;
+    fileSize = 0;
+    section = 0;
+    corrupted = 0;
+
+    values.resize( points > 0 ? points : 1 );
+    for ( size_t i = 0; i < values.size(); i++ )
+        values[i] = (float)( random() % 10000 ) / 100.0f;
+
+    down.setup( clock, latency, this, EV_READABLE );
+
+    if ( faults.dropEvery > 0 )
+        clock->after( faults.dropEvery, this, EV_DROP );
+}
+
+void iec104_sim_outstation::simEvent( int what, unsigned int tag )
+{
+    switch ( what )
+    {
+    case EV_READABLE:
+        readable();
+        break;
+    case EV_SPONTANEOUS:
+        if ( tag == epoch )
+            spontaneous();
+        break;
+    case EV_DROP:
+        dropLink();
+        break;
+    }
+}
+
+unsigned int iec104_sim_outstation::random()
+{
+    rng = rng * 1103515245u + 12345u;
+    return rng >> 8;
+}
+
+bool iec104_sim_outstation::silent() const
+{
+    return clock->now() >= faults.silentFrom && clock->now() < faults.silentUntil;
+}
+
+bool iec104_sim_outstation::accept()
+{
+    if ( clock->now() >= faults.refuseFrom && clock->now() < faults.refuseUntil )
+        return false;
+    down.reset();
+    pending.clear();
+    background.clear();
+    section = 0;
+    connected = true;
+    started = false;
+    epoch++;
+    vs = vr = ack = 0;
+    return true;
+}
+
+void iec104_sim_outstation::closed()
+{
+    down.reset();
+    pending.clear();
+    background.clear();
+    section = 0;
+    connected = started = false;
+    epoch++;
+}
+
+void iec104_sim_outstation::dropLink()
+{
+    if ( connected )
+    {
+        closed();
+        master->peerClosed( latency );
+    }
+    clock->after( faults.dropEvery, this, EV_DROP );
+}
+
+void iec104_sim_outstation::readable()
+{
+    unsigned char buf[2 + 255];
+    while ( connected && down.available() >= 2 )
+    {
+        // writes are whole apdus, so a header means the body is there too
+        down.read( (char *)buf, 2 );
+        int len = buf[1];
+        down.read( (char *)buf + 2, len );
+        if ( buf[0] == SIM_START && len >= 4 )
+            frame( buf, len + 2 );
+    }
+}
+
+void iec104_sim_outstation::frame( const unsigned char * p, int sz )
+{
+    frames++;
+    if ( silent() )
+        return;
+
+    unsigned char c = p[2];
+    if ( ( c & 0x03 ) == 0x03 ) // U frame
+    {
+        switch ( c )
+        {
+        case 0x07: // STARTDTACT
+            sendU( 0x0B );
+            if ( !started )
+            {
+                started = true;
+                clock->after( period, this, EV_SPONTANEOUS, epoch );
+            }
+            break;
+        case 0x13: // STOPDTACT
+            started = false;
+            epoch++; // ends the spontaneous schedule
+            sendU( 0x23 );
+            break;
+        case 0x43: // TESTFRACT
+            testfr++;
+            sendU( 0x83 );
+            break;
+        default:
+            break;
+        }
+        return;
+    }
+
+    // S and I frames acknowledge our I frames
+    ack = (unsigned short)( p[4] | ( p[5] << 8 ) );
+    if ( ( c & 0x01 ) == 0x01 )
+        supervisory++;
+    else
+    {
+        vr += 2;
+        if ( sz >= 16 && p[6] == SIM_C_IC_NA_1 && ( p[8] & 0x3F ) == SIM_ACTIVATION && started && !faults.ignoreGI )
+            sendGI();
+        else
+        if ( sz >= 6 + 6 + 3 + 4 && ( p[6] == SIM_F_SC_NA_1 || p[6] == SIM_F_AF_NA_1 ) && started && fileSize > 0 )
+            fileService( p + 6, sz - 6 );
+    }
+    flush();
+}
+
+void iec104_sim_outstation::sendU( unsigned char code )
+{
+    char f[6] = { (char)SIM_START, 4, (char)code, 0, 0, 0 };
+    master->receive( f, 6 );
+    sent++;
+}
+
+static void simHeader( std::string & f, unsigned char type, unsigned char num, bool sq, unsigned char cause, unsigned short ca )
+{
+    f.assign( 6, '\0' ); // start, length, NS, NR filled in when sent
+    f += (char)type;
+    f += (char)( num | ( sq ? 0x80 : 0 ) );
+    f += (char)cause;
+    f += (char)0;
+    f += (char)( ca & 0xFF );
+    f += (char)( ca >> 8 );
+}
+
+static void simIOA( std::string & f, unsigned int ioa )
+{
+    f += (char)( ioa & 0xFF );
+    f += (char)( ( ioa >> 8 ) & 0xFF );
+    f += (char)( ( ioa >> 16 ) & 0xFF );
+}
+
+static void simFloat( std::string & f, float v )
+{
+    char b[4];
+    memcpy( b, &v, 4 );
+    f.append( b, 4 );
+    f += (char)0; // quality: good
+}
+
+void iec104_sim_outstation::queueI( std::string & asdu )
+{
+    pending.push_back( std::string() );
+    pending.back().swap( asdu );
+    flush();
+}
+
+void iec104_sim_outstation::transmit( std::string & f )
+{
+    f[0] = (char)SIM_START;
+    f[1] = (char)( f.size() - 2 );
+    f[2] = (char)( vs & 0xFF );
+    f[3] = (char)( vs >> 8 );
+    f[4] = (char)( vr & 0xFF );
+    f[5] = (char)( vr >> 8 );
+    master->receive( &f[0], (int)f.size() );
+    vs += 2;
+    sent++;
+}
+
+void iec104_sim_outstation::flush()
+{
+    while ( connected && !pending.empty() && (unsigned short)( vs - ack ) < 2 * k )
+    {
+        transmit( pending.front() );
+        pending.pop_front();
+    }
+    // file segments only take the half of the window real-time frames leave free
+    while ( connected && pending.empty() && !background.empty() && (unsigned short)( vs - ack ) < k )
+    {
+        transmit( background.front() );
+        background.pop_front();
+    }
+}
+
+void iec104_sim_outstation::sendGI()
+{
+    std::string f;
+    simHeader( f, SIM_C_IC_NA_1, 1, false, SIM_ACTCONFIRM, ca );
+    simIOA( f, 0 );
+    f += (char)20;
+    queueI( f );
+
+    // values in SQ=1 blocks, as many as fit in one apdu
+    const int per = ( SIM_MAX_APDU - 2 - 10 - 3 ) / 5;
+    int n = (int)values.size();
+    for ( int first = 0; first < n; first += per )
+    {
+        int num = ( n - first < per ) ? n - first : per;
+        simHeader( f, SIM_M_ME_NC_1, (unsigned char)num, true, SIM_INROGEN, ca );
+        simIOA( f, first + 1 );
+        for ( int i = 0; i < num; i++ )
+            simFloat( f, values[first + i] );
+        queueI( f );
+    }
+
+    if ( faults.changeInGI )
+        change( changes );
+    if ( faults.noGITerm )
+        return;
+    simHeader( f, SIM_C_IC_NA_1, 1, false, SIM_ACTTERM, ca );
+    simIOA( f, 0 );
+    f += (char)20;
+    queueI( f );
+}
+
+void iec104_sim_outstation::spontaneous()
+{
+    if ( !connected || !started )
+        return;
+
+    if ( pending.size() < (size_t)( 4 * k ) ) // a stalled master does not grow the queue forever
+        change( changes );
+
+    clock->after( period, this, EV_SPONTANEOUS, epoch );
+}
+
+void iec104_sim_outstation::change( int num )
+{
+    // a random walk on random points, in one ASDU with individual addresses
+    const int per = ( SIM_MAX_APDU - 2 - 10 ) / 8;
+    if ( num > per )
+        num = per;
+    if ( num <= 0 )
+        return;
+    std::string f;
+    simHeader( f, SIM_M_ME_NC_1, (unsigned char)num, false, SIM_SPONTANEOUS, ca );
+    for ( int i = 0; i < num; i++ )
+    {
+        unsigned int j = random() % values.size();
+        values[j] += (float)( (int)( random() % 201 ) - 100 ) / 100.0f;
+        simIOA( f, j + 1 );
+        simFloat( f, values[j] );
+    }
+    queueI( f );
+}
+
+void iec104_sim_outstation::fileASDU( std::string & f, unsigned char type, unsigned char cause )
+{
+    simHeader( f, type, 1, false, cause, ca );
+    simIOA( f, 1 );
+    f += (char)1; // NOF
+    f += (char)0;
+}
+
+void iec104_sim_outstation::fileService( const unsigned char * asdu, int /*sz*/ )
+{
+    // NOF(2) NOS(1) SCQ or AFQ(1)
+    const unsigned char * o = asdu + 6 + 3;
+    unsigned char q = o[3] & 0x0F;
+    std::string f;
+
+    if ( asdu[0] == SIM_F_SC_NA_1 )
+    {
+        switch ( q )
+        {
+        case 0: // call directory: one file, the last of the directory
+            simHeader( f, SIM_F_DR_TA_1, 1, false, SIM_REQUEST, ca );
+            simIOA( f, 1 );
+            f += (char)1;
+            f += (char)0;
+            simIOA( f, fileSize );
+            f += (char)0x20;
+            f.append( 7, '\0' );
+            queueI( f );
+            break;
+        case 1: // select file
+            fileASDU( f, SIM_F_FR_NA_1, SIM_FILE_TRANSFER );
+            simIOA( f, fileSize );
+            f += (char)0;
+            queueI( f );
+            break;
+        case 2: // request file
+            section = 1;
+            sectionReady();
+            break;
+        case 3: // deactivate file
+            background.clear();
+            section = 0;
+            break;
+        case 6: // request section
+            if ( section > 0 && o[2] == section )
+                sendSection();
+            break;
+        }
+    }
+    else // F_AF_NA_1
+    {
+        switch ( q )
+        {
+        case 3: // section received
+            if ( section == 0 )
+                break;
+            if ( (unsigned long)section * SIM_FILE_SECTION < fileSize )
+            {
+                section++;
+                sectionReady();
+            }
+            else
+            {
+                unsigned char chs = 0;
+                for ( unsigned long i = 0; i < fileSize; i++ )
+                    chs += fileByte( ca, i );
+                fileASDU( f, SIM_F_LS_NA_1, SIM_FILE_TRANSFER );
+                f += (char)0; // NOS
+                f += (char)1; // file transfer without deactivation
+                f += (char)chs;
+                queueI( f );
+            }
+            break;
+        case 4: // section checksum error: offered again
+            if ( section > 0 )
+                sectionReady();
+            break;
+        default: // file received or refused
+            section = 0;
+            break;
+        }
+    }
+}
+
+void iec104_sim_outstation::sectionReady()
+{
+    unsigned long first = ( section - 1 ) * SIM_FILE_SECTION;
+    unsigned long len = ( fileSize - first < SIM_FILE_SECTION ) ? fileSize - first : SIM_FILE_SECTION;
+    std::string f;
+    fileASDU( f, SIM_F_SR_NA_1, SIM_FILE_TRANSFER );
+    f += (char)section;
+    simIOA( f, len );
+    f += (char)0;
+    queueI( f );
+}
+
+void iec104_sim_outstation::sendSection()
+{
+    unsigned long first = ( section - 1 ) * SIM_FILE_SECTION;
+    unsigned long end = ( fileSize - first < SIM_FILE_SECTION ) ? fileSize : first + SIM_FILE_SECTION;
+    unsigned char chs = 0;
+    std::string f;
+    for ( unsigned long i = first; i < end; i += SIM_FILE_SEGMENT )
+    {
+        int los = ( end - i < (unsigned long)SIM_FILE_SEGMENT ) ? (int)( end - i ) : SIM_FILE_SEGMENT;
+        fileASDU( f, SIM_F_SG_NA_1, SIM_FILE_TRANSFER );
+        f += (char)section;
+        f += (char)los;
+        for ( int j = 0; j < los; j++ )
+        {
+            unsigned char b = fileByte( ca, i + j );
+            f += (char)b;
+            chs += b;
+        }
+        background.push_back( std::string() );
+        background.back().swap( f );
+    }
+    if ( corrupted < faults.corruptSections )
+    {
+        corrupted++;
+        chs ^= 0xFF;
+    }
+    fileASDU( f, SIM_F_LS_NA_1, SIM_FILE_TRANSFER );
+    f += (char)section;
+    f += (char)3; // section transfer without deactivation
+    f += (char)chs;
+    background.push_back( std::string() );
+    background.back().swap( f );
+    flush();
+}
+
+// ---- iec104_sim_gateway -------------------------------------------------------
+
+iec104_sim_gateway::iec104_sim_gateway( iec104_sim_clock * pclock, const std::vector<iec_obj> * ppoints, int platency, int phase, bool log )
+{
+    clock = pclock;
+    master = NULL;
+    points = ppoints;
+    latency = platency;
+    connected = false;
+
+    mLog.activateLog(); // also sets up the log lock
+    if ( !log )
+        mLog.deactivateLog();
+
+    down.setup( clock, latency, this, EV_READABLE );
+    clock->after( phase, this, EV_TICK );
+}
+
+iec104_sim_gateway::~iec104_sim_gateway()
+{
+    if ( mLog.isLogging() )
+        mLog.deactivateLog();
+}
+
+void iec104_sim_gateway::simEvent( int what, unsigned int /*tag*/ )
+{
+    switch ( what )
+    {
+    case EV_TICK:
+        onTimerSecond();
+        clock->after( 1000, this, EV_TICK );
+        break;
+    case EV_READABLE:
+        // writes are whole apdus, so a header means the body is there too
+        while ( connected && down.available() >= 2 )
+            packetReadyTCP();
+        break;
+    }
+}
+
+bool iec104_sim_gateway::accept()
+{
+    down.reset();
+    connected = true;
+    onConnectTCP();
+    return true;
+}
+
+void iec104_sim_gateway::closed()
+{
+    if ( !connected )
+        return;
+    down.reset();
+    connected = false;
+    onDisconnectTCP();
+}
+
+void iec104_sim_gateway::disconnectTCP()
+{
+    if ( !connected )
+        return;
+    closed();
+    master->peerClosed( latency );
+}
+
+int iec104_sim_gateway::readTCP( char * buf, int szmax )
+{
+    return down.read( buf, szmax );
+}
+
+void iec104_sim_gateway::sendTCP( char * data, int sz )
+{
+    if ( connected )
+        master->receive( data, sz );
+}
+
+void iec104_sim_gateway::interrogationPoints( unsigned short ca, std::vector<iec_obj> & gi )
+{
+    for ( size_t i = 0; i < points->size(); i++ )
+        if ( ca == 0xFFFF || ( *points )[i].ca == ca )
+            gi.push_back( ( *points )[i] );
+}
+
+// ---- iec104_simulator ---------------------------------------------------------
+
+iec104_simulator::iec104_simulator( const iec104_sim_config & cfg )
+{
+    iec104_sim_faults none;
+    for ( int i = 0; i < cfg.sessions; i++ )
+    {
+        unsigned short ca = (unsigned short)( i + 1 );
+        iec104_sim_outstation * o = new iec104_sim_outstation( &clk, ca, cfg.points, cfg.latency, cfg.period, cfg.changes,
+                                                               cfg.seed * 2654435761u + i, i < cfg.faultySessions ? cfg.faults : none );
+        // ticks spread over the second, as independent threads would be
+        iec104_sim_master * m = new iec104_sim_master( &clk, o, cfg.latency, (int)( ( i * 7919u ) % 1000 ), cfg.log );
+        m->setSecondaryAddress( ca );
+        o->attach( m );
+        if ( cfg.fileSize > 0 )
+            o->setFile( cfg.fileSize );
+        if ( cfg.upstream > 0 )
+            m->onData = [this]( iec_obj * obj, int numpoints ) { received( obj, numpoints ); };
+        outstations.push_back( o );
+        masters.push_back( m );
+    }
+
+    for ( int i = 0; i < cfg.upstream; i++ )
+    {
+        int phase = (int)( ( i * 3571u + 500 ) % 1000 );
+        iec104_sim_gateway * g = new iec104_sim_gateway( &clk, &points, cfg.latency, phase, cfg.log );
+        iec104_sim_master * m = new iec104_sim_master( &clk, g, cfg.latency, phase, cfg.log );
+        m->setSecondaryAddress( 0xFFFF ); // GI for every ca
+        g->attach( m );
+        gateways.push_back( g );
+        upstream.push_back( m );
+    }
+}
+
+void iec104_simulator::received( iec_obj * obj, int numpoints )
+{
+    for ( int i = 0; i < numpoints; i++ )
+    {
+        unsigned __int64 key = ( (unsigned __int64)obj[i].ca << 24 ) | ( obj[i].address & 0xFFFFFF );
+        std::unordered_map<unsigned __int64, size_t>::iterator it = index.find( key );
+        if ( it == index.end() )
+        {
+            index[key] = points.size();
+            points.push_back( obj[i] );
+        }
+        else
+            points[it->second] = obj[i];
+    }
+    for ( size_t i = 0; i < gateways.size(); i++ )
+        gateways[i]->sendSpontaneous( obj, numpoints );
+}
+
+iec104_simulator::~iec104_simulator()
+{
+    for ( size_t i = 0; i < masters.size(); i++ )
+    {
+        delete masters[i];
+        delete outstations[i];
+    }
+    for ( size_t i = 0; i < upstream.size(); i++ )
+    {
+        delete upstream[i];
+        delete gateways[i];
+    }
+}
+
+void iec104_simulator::run( __int64 ms )
+{
+    clk.runUntil( clk.now() + ms );
+}
+
+void iec104_simulator::getStats( iec104_sim_stats & s ) const
+{
+    memset( &s, 0, sizeof( s ) );
+    s.events = clk.executed();
+    for ( size_t i = 0; i < masters.size(); i++ )
+    {
+        const iec104_sim_master * m = masters[i];
+        const iec104_sim_outstation * o = outstations[i];
+        s.connects += m->connects;
+        s.refused += m->refused;
+        s.disconnects += m->disconnects;
+        s.gis += m->gis;
+        s.giCommits += m->giCommits;
+        s.objects += m->objects;
+        s.files += m->files;
+        s.fileBytes += m->fileBytes;
+        s.fileErrors += m->fileErrors;
+        s.framesToMaster += o->sent;
+        s.framesToOutstation += o->frames;
+        s.testfr += o->testfr;
+        s.supervisory += o->supervisory;
+        iec_txstats tx = masters[i]->getTxStats();
+        s.writes += tx.writes;
+        s.suppressed += tx.suppressed;
+        if ( m->getSession().canTransmit() )
+            s.transferring++;
+    }
+    for ( size_t i = 0; i < upstream.size(); i++ )
+    {
+        const iec104_sim_master * m = upstream[i];
+        iec104_slave_stats gs = gateways[i]->getStats();
+        s.upstreamGis += m->gis;
+        s.upstreamObjects += m->objects;
+        s.upstreamFrames += gs.framesOut;
+        s.upstreamWrites += gs.writes;
+        s.upstreamDropped += gs.dropped;
+        if ( m->getSession().canTransmit() )
+            s.upstreamTransferring++;
+    }
+}
+
+// ---- decode load ----------------------------------------------------------------
+
+// a station's GI response: its floats in SQ=1 blocks, start and length filled in
+static void simGIFrames( std::vector<std::string> & frames, unsigned short ca, int points )
+{
+    std::string f;
+    const int per = ( SIM_MAX_APDU - 2 - 10 - 3 ) / 5;
+    for ( int first = 0; first < points; first += per )
+    {
+        int num = ( points - first < per ) ? points - first : per;
+        simHeader( f, SIM_M_ME_NC_1, (unsigned char)num, true, SIM_INROGEN, ca );
+        simIOA( f, first + 1 );
+        for ( int j = 0; j < num; j++ )
+            simFloat( f, (float)( first + j ) );
+        f[0] = (char)SIM_START;
+        f[1] = (char)( f.size() - 2 );
+        frames.push_back( f );
+    }
+}
+
+// master that only receives: frames come from memory, nothing is sent
+class iec104_sim_sink : public iec104_class
+{
+public:
+    iec104_sim_sink()
+    {
+        objects = 0;
+        vs = 0;
+        rp = NULL;
+        rleft = 0;
+        mLog.activateLog(); // also sets up the log lock
+        mLog.deactivateLog();
+        onConnectTCP();
+    }
+
+    ~iec104_sim_sink()
+    {
+        setDecoder( NULL ); // waits for the workers still decoding for this sink
+    }
+
+    // one frame at a time, as from a socket: the workers take txlock between them
+    void feed( std::vector<std::string> & frames )
+    {
+        for ( size_t i = 0; i < frames.size(); i++ )
+        {
+            std::string & f = frames[i];
+            f[2] = (char)( vs & 0xFF );
+            f[3] = (char)( vs >> 8 );
+            vs += 2;
+            rp = f.data();
+            rleft = (int)f.size();
+            packetReadyTCP();
+        }
+    }
+
+    unsigned __int64 objects;
+
+private:
+    void connectTCP() {}
+    void disconnectTCP() {}
+    int readTCP( char * buf, int szmax )
+    {
+        int n = ( szmax < rleft ) ? szmax : rleft;
+        memcpy( buf, rp, n );
+        rp += n;
+        rleft -= n;
+        return n;
+    }
+    void sendTCP( char * /*data*/, int /*sz*/ ) {}
+    void dataIndication( iec_obj * /*obj*/, int numpoints ) { objects += numpoints; }
+
+    unsigned short vs;
+    const char * rp;
+    int rleft;
+};
+
+void iec104_sim_decodeLoad( const iec104_sim_config & cfg, int rounds, iec104_decoder * decoder, iec104_sim_load & result )
+{
+    memset( &result, 0, sizeof( result ) );
+
+    std::vector<iec104_sim_sink *> sinks;
+    std::vector< std::vector<std::string> > frames( cfg.sessions );
+    unsigned int rng = cfg.seed ? cfg.seed : 1;
+    for ( int i = 0; i < cfg.sessions; i++ )
+    {
+        unsigned short ca = (unsigned short)( i + 1 );
+        iec104_sim_sink * m = new iec104_sim_sink;
+        m->setSecondaryAddress( ca );
+        m->setDecoder( decoder );
+        sinks.push_back( m );
+
+        // GI, then spontaneous changes with individual addresses
+        simGIFrames( frames[i], ca, cfg.points );
+        std::string f;
+        const int spont = ( SIM_MAX_APDU - 2 - 10 ) / 8;
+        int num = cfg.changes < spont ? cfg.changes : spont;
+        for ( int c = 0; c < 10 && num > 0; c++ )
+        {
+            simHeader( f, SIM_M_ME_NC_1, (unsigned char)num, false, SIM_SPONTANEOUS, ca );
+            for ( int j = 0; j < num; j++ )
+            {
+                rng = rng * 1103515245u + 12345u;
+                simIOA( f, ( rng >> 8 ) % ( cfg.points > 0 ? cfg.points : 1 ) + 1 );
+                simFloat( f, (float)j );
+            }
+            frames[i].push_back( f );
+        }
+        for ( size_t j = 0; j < frames[i].size(); j++ )
+        {
+            frames[i][j][0] = (char)SIM_START;
+            frames[i][j][1] = (char)( frames[i][j].size() - 2 );
+        }
+    }
+
+    DWORD t0 = GetTickCount();
+    for ( int r = 0; r < rounds; r++ )
+        for ( int i = 0; i < cfg.sessions; i++ )
+        {
+            sinks[i]->feed( frames[i] );
+            result.frames += frames[i].size();
+        }
+    if ( decoder != NULL )
+        decoder->drain();
+    result.seconds = ( GetTickCount() - t0 ) / 1000.0;
+
+    for ( int i = 0; i < cfg.sessions; i++ )
+    {
+        result.objects += sinks[i]->objects;
+        delete sinks[i];
+    }
+}
+
+void iec104_sim_seqDecodeLoad( const iec104_sim_config & cfg, int rounds, iec104_sim_seqload & result )
+{
+    memset( &result, 0, sizeof( result ) );
+    result.agree = true;
+
+    std::vector<std::string> frames;
+    for ( int i = 0; i < cfg.sessions; i++ )
+        simGIFrames( frames, (unsigned short)( i + 1 ), cfg.points );
+
+    typedef int ( *decodefn )( const iec_apdu *, int, iec_seqdata * );
+    static const decodefn paths[] = { iec104_seqdecode::decodeScalar, iec104_seqdecode::decodeSSSE3, iec104_seqdecode::decodeAVX2 };
+    iec104_seqdecode::Level best = iec104_seqdecode::detectLevel();
+    std::vector<double> sums( frames.size() * 2 );
+    iec_seqdata seq;
+    LARGE_INTEGER frequency, t0, t1;
+    QueryPerformanceFrequency( &frequency );
+
+    for ( int lvl = iec104_seqdecode::SCALAR; lvl <= best; lvl++ )
+    {
+        unsigned __int64 objects = 0;
+        QueryPerformanceCounter( &t0 );
+        for ( int r = 0; r < rounds; r++ )
+            for ( size_t j = 0; j < frames.size(); j++ )
+            {
+                int num = paths[lvl]( (const iec_apdu *)frames[j].data(), (int)frames[j].size(), &seq );
+                if ( num > 0 )
+                    objects += num;
+            }
+        QueryPerformanceCounter( &t1 );
+        result.seconds[lvl] = (double)( t1.QuadPart - t0.QuadPart ) / (double)frequency.QuadPart;
+        result.frames = (unsigned __int64)rounds * frames.size();
+        result.objects = objects;
+
+        // the values of every frame, which the vector paths must reproduce exactly
+        for ( size_t j = 0; j < frames.size(); j++ )
+        {
+            int num = paths[lvl]( (const iec_apdu *)frames[j].data(), (int)frames[j].size(), &seq );
+            double v = 0, q = 0;
+            for ( int k = 0; k < num; k++ )
+            {
+                v += seq.value[k] * ( k + 1 );
+                q += seq.qds[k] * ( k + 1 );
+            }
+            if ( lvl == iec104_seqdecode::SCALAR )
+            {
+                sums[2 * j] = v;
+                sums[2 * j + 1] = q;
+            }
+            else if ( sums[2 * j] != v || sums[2 * j + 1] != q )
+                result.agree = false;
+        }
+    }
+}
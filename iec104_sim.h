@@ -0,0 +1,324 @@
+#ifndef IEC104_SIM_H
+#define IEC104_SIM_H
+
+// IEC 60870-5-104 virtual time simulation: masters (iec104_class) and outstations talk over
+// in-memory pipes with latency, driven by a discrete event clock instead of sockets and wall
+// clock threads. Nothing depends on real time or thread scheduling, so a run with the same
+// configuration always produces the same frames, and hours of link behaviour take as long
+// as the events take to process. Optionally the received points are served again through
+// iec104_slave gateways to upstream masters, the loopback of the outstation gateway mode.
+
+#include <vector>
+#include <deque>
+#include <queue>
+#include <string>
+#include <functional>
+#include <unordered_map>
+
+#include "iec104_class.h"
+#include "iec104_slave.h"
+
+// receives the events it scheduled on the clock
+class iec104_sim_target
+{
+public:
+    virtual ~iec104_sim_target() {}
+    virtual void simEvent( int what, unsigned int tag ) = 0;
+};
+
+// discrete event clock, time in ms from the start of the run
+class iec104_sim_clock
+{
+public:
+    iec104_sim_clock();
+    __int64 now() const { return tnow; }
+    // t in the past runs at now; what and tag are handed back to the target
+    void at( __int64 t, iec104_sim_target * target, int what, unsigned int tag = 0 );
+    void after( __int64 dt, iec104_sim_target * target, int what, unsigned int tag = 0 )
+        { at( tnow + dt, target, what, tag ); }
+    bool step();                              // run the next event, false when there is none
+    void runUntil( __int64 t );               // run every event up to t, then stop at t
+    unsigned __int64 executed() const { return count; }
+
+private:
+    struct event {
+        __int64 t;
+        unsigned __int64 seq;                 // ties run in scheduling order
+        iec104_sim_target * target;
+        int what;
+        unsigned int tag;
+    };
+    struct later {
+        bool operator()( const event & x, const event & y ) const
+            { return x.t > y.t || ( x.t == y.t && x.seq > y.seq ); }
+    };
+    std::priority_queue< event, std::vector<event>, later > q;
+    __int64 tnow;
+    unsigned __int64 seq;
+    unsigned __int64 count;
+};
+
+// one direction of a connection: bytes written become readable latency ms later
+class iec104_sim_pipe : private iec104_sim_target
+{
+public:
+    iec104_sim_pipe();
+    // reader->simEvent( what, 0 ) is called when bytes arrive
+    void setup( iec104_sim_clock * pclock, int latency, iec104_sim_target * reader, int what );
+    void write( const char * data, int sz );
+    int read( char * buf, int szmax );        // only bytes that have arrived
+    int available() const { return ready; }
+    void reset();                             // connection closed, bytes in flight are lost
+
+private:
+    void simEvent( int what, unsigned int tag );
+
+    iec104_sim_clock * clock;
+    int latency;
+    iec104_sim_target * reader;
+    int readerWhat;
+    std::vector<char> bytes;                  // from head: arrived bytes, then bytes in flight
+    size_t head;
+    std::deque< std::pair<__int64, int> > segments; // arrival time and size of each write in flight
+    int ready;                                // arrived bytes from head
+    bool scheduled;                           // a delivery event is pending
+};
+
+// outstation misbehaviour, times in ms of virtual time
+struct iec104_sim_faults
+{
+    iec104_sim_faults();
+    __int64 silentFrom, silentUntil;          // frames received in this window are ignored
+    __int64 refuseFrom, refuseUntil;          // connections are refused in this window
+    __int64 dropEvery;                        // the outstation closes the connection every n ms, 0 never
+    bool ignoreGI;                            // GI is never confirmed
+    bool noGITerm;                            // GI is confirmed and answered, never terminated
+    bool changeInGI;                          // values change spontaneously between the GI answer and ACTTERM
+    int corruptSections;                      // the first n file sections sent have a wrong checksum
+};
+
+struct iec104_sim_config
+{
+    iec104_sim_config();
+    int sessions;
+    int points;                               // measured values per outstation
+    int latency;                              // ms, each direction
+    int period;                               // ms between spontaneous transmissions
+    int changes;                              // values per spontaneous transmission
+    unsigned int seed;
+    bool log;                                 // keep the masters' message logs
+    iec104_sim_faults faults;
+    int faultySessions;                       // the first n sessions get the faults
+    int upstream;                             // upstream masters, each served by its own gateway
+    int fileSize;                             // bytes of the record file each outstation offers, 0 none
+};
+
+struct iec104_sim_stats
+{
+    unsigned __int64 events;                  // clock events executed
+    unsigned __int64 connects;
+    unsigned __int64 refused;
+    unsigned __int64 disconnects;
+    unsigned __int64 gis;                     // GI terminations seen by the masters
+    unsigned __int64 giCommits;               // GI responses delivered to the masters as one indication
+    unsigned __int64 objects;                 // objects indicated to the masters
+    unsigned __int64 framesToMaster;
+    unsigned __int64 framesToOutstation;
+    unsigned __int64 testfr;                  // TESTFRACT received by the outstations
+    unsigned __int64 supervisory;             // S frames received by the outstations
+    unsigned __int64 writes;                  // sendTCP calls by the masters
+    unsigned __int64 suppressed;              // S frames the masters did not need to send
+    int transferring;                         // sessions that can transmit at the end
+    unsigned __int64 upstreamGis;             // GI terminations seen by the upstream masters
+    unsigned __int64 upstreamObjects;         // objects indicated to the upstream masters
+    unsigned __int64 upstreamFrames;          // I frames sent by the gateways
+    unsigned __int64 upstreamWrites;          // sendTCP calls by the gateways
+    unsigned __int64 upstreamDropped;         // frames the gateways discarded on overflow
+    int upstreamTransferring;                 // upstream masters that can transmit at the end
+    unsigned __int64 files;                   // file transfers completed by the masters
+    unsigned __int64 fileBytes;
+    unsigned __int64 fileErrors;              // file transfers that ended otherwise
+};
+
+// the far end of a master's connection
+class iec104_sim_peer
+{
+public:
+    virtual ~iec104_sim_peer() {}
+    virtual bool accept() = 0;                // master connects, false if refused
+    virtual void closed() = 0;                // master disconnected
+    virtual void receive( const char * data, int sz ) = 0; // from the master
+};
+
+// master side: the unmodified protocol engine on a simulated transport
+class iec104_sim_master : public iec104_class, private iec104_sim_target
+{
+public:
+    iec104_sim_master( iec104_sim_clock * pclock, iec104_sim_peer * ppeer, int latency, int phase, bool log );
+    ~iec104_sim_master();
+
+    void peerClosed( int delay );             // the peer closed the connection, seen after delay ms
+    void receive( const char * data, int sz ) { up.write( data, sz ); } // from the peer
+    bool isConnected() const { return connected; }
+
+    std::function<void( iec_obj *, int )> onData; // optional, sees every indication
+    unsigned __int64 connects, refused, disconnects, gis, giCommits, objects;
+    unsigned __int64 files, fileBytes, fileErrors;
+
+private:
+    enum { EV_TICK, EV_READABLE, EV_PEERCLOSED };
+    void simEvent( int what, unsigned int tag );
+    void readable();
+
+    void connectTCP();
+    void disconnectTCP();
+    int readTCP( char * buf, int szmax );
+    void sendTCP( char * data, int sz );
+    void dataIndication( iec_obj * obj, int numpoints );
+    void interrogationIndication( iec_obj * obj, int numpoints );
+    void interrogationActTermIndication();
+    void fileTransferIndication( unsigned short nof, int result, unsigned long bytes );
+
+    iec104_sim_clock * clock;
+    iec104_sim_peer * peer;
+    iec104_sim_pipe up;                       // peer to master
+    bool connected;
+};
+
+// outstation side: STARTDT/STOPDT/TESTFR, GI and spontaneous floats with k window flow control,
+// and one record file (NOF 1, IOA 1) whose segments only use the window real-time frames leave
+class iec104_sim_outstation : public iec104_sim_peer, private iec104_sim_target
+{
+public:
+    iec104_sim_outstation( iec104_sim_clock * pclock, unsigned short ca, int points, int latency,
+                           int period, int changes, unsigned int seed, const iec104_sim_faults & faults );
+
+    void attach( iec104_sim_master * pmaster ) { master = pmaster; }
+    void setFile( unsigned long size ) { fileSize = size; }
+    bool accept();
+    void closed();
+    void receive( const char * data, int sz ) { down.write( data, sz ); }
+
+    static unsigned char fileByte( unsigned short ca, unsigned long i ) { return (unsigned char)( i * 131 + ca ); }
+    unsigned __int64 frames, testfr, supervisory, sent;
+    static const int k = 12;                  // unacknowledged I frames before sending stops
+
+private:
+    enum { EV_READABLE, EV_SPONTANEOUS, EV_DROP };
+    void simEvent( int what, unsigned int tag );
+    void readable();
+    void frame( const unsigned char * p, int sz );
+    void sendU( unsigned char code );
+    void queueI( std::string & asdu );
+    void flush();
+    void sendGI();
+    void spontaneous();
+    void change( int num );                   // queues a random walk on num random points
+    void transmit( std::string & f );         // stamps sequence numbers and sends
+    void fileService( const unsigned char * asdu, int sz );
+    void fileASDU( std::string & f, unsigned char type, unsigned char cause ); // header, object address 1 and NOF 1
+    void sectionReady();
+    void sendSection();
+    void dropLink();
+    bool silent() const;
+    unsigned int random();
+
+    iec104_sim_clock * clock;
+    iec104_sim_master * master;
+    iec104_sim_pipe down;                     // master to outstation
+    iec104_sim_faults faults;
+    unsigned short ca;
+    int latency, period, changes;
+    unsigned int rng;
+    std::vector<float> values;
+    std::deque<std::string> pending;          // I frames held back by the k window
+    std::deque<std::string> background;       // file segments, sent when pending is empty
+    unsigned long fileSize;
+    unsigned char section;                    // file section being offered, from 1
+    int corrupted;
+    bool connected, started;
+    unsigned int epoch;                       // bumped on connect, close and STOPDT; stale timers check it
+    unsigned short vs, vr, ack;
+};
+
+// gateway side: the unmodified outstation engine answering an upstream master
+class iec104_sim_gateway : public iec104_sim_peer, public iec104_slave, private iec104_sim_target
+{
+public:
+    // GI is answered from points, which the simulator keeps current
+    iec104_sim_gateway( iec104_sim_clock * pclock, const std::vector<iec_obj> * ppoints, int latency, int phase, bool log );
+    ~iec104_sim_gateway();
+
+    void attach( iec104_sim_master * pmaster ) { master = pmaster; }
+    bool accept();
+    void closed();
+    void receive( const char * data, int sz ) { down.write( data, sz ); }
+
+private:
+    enum { EV_TICK, EV_READABLE };
+    void simEvent( int what, unsigned int tag );
+
+    void disconnectTCP();
+    int readTCP( char * buf, int szmax );
+    void sendTCP( char * data, int sz );
+    void interrogationPoints( unsigned short ca, std::vector<iec_obj> & points );
+
+    iec104_sim_clock * clock;
+    iec104_sim_master * master;
+    const std::vector<iec_obj> * points;
+    iec104_sim_pipe down;                     // master to gateway
+    int latency;
+    bool connected;
+};
+
+// decode throughput: each session's GI burst and spontaneous frames, built once as the simulated
+// outstations build them, received by the calling thread and decoded through decoder (NULL: on
+// the calling thread); wall clock, unlike the rest of the simulation
+struct iec104_sim_load
+{
+    unsigned __int64 frames;
+    unsigned __int64 objects;                 // objects indicated
+    double seconds;
+};
+void iec104_sim_decodeLoad( const iec104_sim_config & cfg, int rounds, iec104_decoder * decoder, iec104_sim_load & result );
+
+// bulk decode throughput of the scalar, SSSE3 and AVX2 paths of iec104_seqdecode on the GI
+// frames of iec104_sim_decodeLoad, each path the cpu supports timed on its own
+struct iec104_sim_seqload
+{
+    unsigned __int64 frames;                  // decoded by each path
+    unsigned __int64 objects;
+    double seconds[3];                        // by iec104_seqdecode::Level, 0 if not supported
+    bool agree;                               // the vector paths decoded what the scalar path did
+};
+void iec104_sim_seqDecodeLoad( const iec104_sim_config & cfg, int rounds, iec104_sim_seqload & result );
+
+class iec104_simulator
+{
+public:
+    explicit iec104_simulator( const iec104_sim_config & cfg );
+    ~iec104_simulator();
+
+    void run( __int64 ms );                   // advance virtual time by ms
+    void getStats( iec104_sim_stats & s ) const;
+    iec104_sim_clock & clock() { return clk; }
+    int sessions() const { return (int)masters.size(); }
+    iec104_sim_master * master( int i ) { return masters[i]; }
+    iec104_sim_outstation * outstation( int i ) { return outstations[i]; }
+    int upstreamSessions() const { return (int)upstream.size(); }
+    iec104_sim_master * upstreamMaster( int i ) { return upstream[i]; }
+    iec104_sim_gateway * gateway( int i ) { return gateways[i]; }
+
+private:
+    void received( iec_obj * obj, int numpoints ); // downstream data, kept and forwarded upstream
+
+    iec104_sim_clock clk;
+    std::vector<iec104_sim_master *> masters;
+    std::vector<iec104_sim_outstation *> outstations;
+    std::vector<iec104_sim_master *> upstream;
+    std::vector<iec104_sim_gateway *> gateways;
+    std::vector<iec_obj> points;              // latest value of every point received downstream
+    std::unordered_map<unsigned __int64, size_t> index; // (ca, address) to points
+};
+
+#endif // IEC104_SIM_H
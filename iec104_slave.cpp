@@ -0,0 +1,514 @@
+#include "stdafx.h"
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "iec104_slave.h"
+
+static const unsigned char START = 0x68;
+static const unsigned char STARTDTACT = 0x07;
+static const unsigned char STARTDTCON = 0x0B;
+static const unsigned char STOPDTACT = 0x13;
+static const unsigned char STOPDTCON = 0x23;
+static const unsigned char TESTFRACT = 0x43;
+static const unsigned char TESTFRCON = 0x83;
+
+static const unsigned char SPONTANEOUS = 3;
+static const unsigned char ACTIVATION = 6;
+static const unsigned char ACTCONFIRM = 7;
+static const unsigned char DEACTIVATION = 8;
+static const unsigned char ACTTERM = 10;
+static const unsigned char INROGEN = 20;
+static const unsigned char UNKNOWN_TYPE = 44;
+
+// type sent upstream for a received type, 0 when it is not forwarded
+static unsigned char slaveType( unsigned char type, bool timetag )
+{
+    switch ( type )
+    {
+    case iec104_class::M_SP_NA_1: return iec104_class::M_SP_NA_1;
+    case iec104_class::M_SP_TB_1: return timetag ? iec104_class::M_SP_TB_1 : iec104_class::M_SP_NA_1;
+    case iec104_class::M_DP_NA_1: return iec104_class::M_DP_NA_1;
+    case iec104_class::M_DP_TB_1: return timetag ? iec104_class::M_DP_TB_1 : iec104_class::M_DP_NA_1;
+    case iec104_class::M_ME_NA_1:
+    case iec104_class::M_ME_NB_1:
+    case iec104_class::M_ME_NC_1:
+    case iec104_class::M_ME_ND_1: return iec104_class::M_ME_NC_1;
+    case iec104_class::M_ME_TD_1:
+    case iec104_class::M_ME_TE_1:
+    case iec104_class::M_ME_TF_1: return timetag ? iec104_class::M_ME_TF_1 : iec104_class::M_ME_NC_1;
+    }
+    return 0;
+}
+
+// bytes of one information element, without the address
+static int slaveElementSize( unsigned char type )
+{
+    switch ( type )
+    {
+    case iec104_class::M_SP_NA_1:
+    case iec104_class::M_DP_NA_1: return 1;
+    case iec104_class::M_ME_NC_1: return 5;
+    case iec104_class::M_SP_TB_1:
+    case iec104_class::M_DP_TB_1: return 1 + 7;
+    case iec104_class::M_ME_TF_1: return 5 + 7;
+    }
+    return 0;
+}
+
+static void slaveElement( std::vector<unsigned char> & a, unsigned char type, const iec_obj & o )
+{
+    unsigned char q = ( o.bl << 4 ) | ( o.sb << 5 ) | ( o.nt << 6 ) | ( o.iv << 7 );
+    switch ( type )
+    {
+    case iec104_class::M_SP_NA_1:
+    case iec104_class::M_SP_TB_1:
+        a.push_back( q | ( o.value != 0 ? 1 : 0 ) );
+        break;
+    case iec104_class::M_DP_NA_1:
+    case iec104_class::M_DP_TB_1:
+        a.push_back( q | ( (int)o.value & 0x03 ) );
+        break;
+    default:
+        {
+        unsigned char b[4];
+        memcpy( b, &o.value, 4 );
+        a.insert( a.end(), b, b + 4 );
+        a.push_back( q | o.ov );
+        }
+        break;
+    }
+    if ( type == iec104_class::M_SP_TB_1 || type == iec104_class::M_DP_TB_1 || type == iec104_class::M_ME_TF_1 )
+    {
+        const unsigned char * t = (const unsigned char *)&o.timetag;
+        a.insert( a.end(), t, t + 7 );
+    }
+}
+
+static void slaveHeader( std::vector<unsigned char> & a, unsigned char type, unsigned char cause, unsigned short ca )
+{
+    a.clear();
+    a.push_back( type );
+    a.push_back( 0 ); // number of objects and SQ, set when the ASDU is complete
+    a.push_back( cause );
+    a.push_back( 0 ); // originator address
+    a.push_back( (unsigned char)( ca & 0xFF ) );
+    a.push_back( (unsigned char)( ca >> 8 ) );
+}
+
+static void slaveAddress( std::vector<unsigned char> & a, unsigned int address )
+{
+    a.push_back( (unsigned char)( address & 0xFF ) );
+    a.push_back( (unsigned char)( ( address >> 8 ) & 0xFF ) );
+    a.push_back( (unsigned char)( ( address >> 16 ) & 0xFF ) );
+}
+
+struct slave_key {
+    unsigned short ca;
+    unsigned char type;
+    unsigned int address;
+    int index;
+    bool operator<( const slave_key & k ) const
+    {
+        if ( ca != k.ca ) return ca < k.ca;
+        if ( type != k.type ) return type < k.type;
+        return address < k.address;
+    }
+};
+
+int iec104_slave::pack( std::vector<iec_obj> & points, unsigned char cause, bool sequence,
+                        std::vector< std::vector<unsigned char> > & asdus )
+{
+    asdus.clear();
+
+    // GI is sorted so consecutive addresses meet, changes keep their order
+    std::vector<slave_key> keys;
+    keys.reserve( points.size() );
+    for ( size_t i = 0; i < points.size(); i++ )
+    {
+        slave_key key;
+        key.ca = points[i].ca;
+        key.type = slaveType( points[i].type, !sequence );
+        key.address = points[i].address & 0xFFFFFF;
+        key.index = (int)i;
+        if ( key.type != 0 )
+            keys.push_back( key );
+    }
+    if ( sequence )
+        std::stable_sort( keys.begin(), keys.end() );
+
+    std::vector<unsigned char> single; // SQ=0 ASDU being filled
+    int nsingle = 0;
+    size_t g = 0;
+    while ( g < keys.size() )
+    {
+        // group: same ca and type
+        size_t ge = g + 1;
+        while ( ge < keys.size() && keys[ge].ca == keys[g].ca && keys[ge].type == keys[g].type )
+            ge++;
+        unsigned char type = keys[g].type;
+        int esz = slaveElementSize( type );
+        int maxseq = ( maxasdu - 6 - 3 ) / esz;
+        int maxsingle = ( maxasdu - 6 ) / ( 3 + esz );
+        if ( maxseq > 127 ) maxseq = 127;
+        if ( maxsingle > 127 ) maxsingle = 127;
+
+        size_t i = g;
+        while ( i < ge )
+        {
+            // run of consecutive addresses
+            size_t re = i + 1;
+            if ( sequence )
+                while ( re < ge && keys[re].address == keys[re - 1].address + 1 )
+                    re++;
+
+            if ( re - i >= 2 )
+            {
+                for ( size_t s = i; s < re; s += maxseq )
+                {
+                    int num = (int)( ( re - s < (size_t)maxseq ) ? re - s : maxseq );
+                    asdus.push_back( std::vector<unsigned char>() );
+                    std::vector<unsigned char> & a = asdus.back();
+                    slaveHeader( a, type, cause, keys[s].ca );
+                    a[1] = (unsigned char)( num | 0x80 );
+                    slaveAddress( a, keys[s].address );
+                    for ( int j = 0; j < num; j++ )
+                        slaveElement( a, type, points[keys[s + j].index] );
+                }
+            }
+            else
+            {
+                if ( nsingle == 0 )
+                    slaveHeader( single, type, cause, keys[i].ca );
+                slaveAddress( single, keys[i].address );
+                slaveElement( single, type, points[keys[i].index] );
+                if ( ++nsingle == maxsingle )
+                {
+                    single[1] = (unsigned char)nsingle;
+                    asdus.push_back( single );
+                    nsingle = 0;
+                }
+            }
+            i = re;
+        }
+        if ( nsingle > 0 )
+        {
+            single[1] = (unsigned char)nsingle;
+            asdus.push_back( single );
+            nsingle = 0;
+        }
+        g = ge;
+    }
+    return (int)keys.size();
+}
+
+iec104_slave::iec104_slave()
+{
+    connected = false;
+    started = false;
+    VS = VR = ackVS = 0;
+    unackedRx = 0;
+    sendS = false;
+    memset( timers, 0, sizeof( timers ) );
+    queueLimit = 10000;
+    memset( &stats, 0, sizeof( stats ) );
+}
+
+iec104_slave::~iec104_slave()
+{
+}
+
+iec104_slave_stats iec104_slave::getStats() const
+{
+    iec104_slave_stats st = stats;
+    st.queued = (unsigned int)txq.size();
+    return st;
+}
+
+void iec104_slave::onConnectTCP()
+{
+    connected = true;
+    started = false;
+    VS = VR = ackVS = 0;
+    unackedRx = 0;
+    sendS = false;
+    memset( timers, 0, sizeof( timers ) );
+    arm( T_IDLE, t3 );
+    txq.clear();
+    out.clear();
+    mLog.pushMsg( "*** MASTER CONNECTED" );
+}
+
+void iec104_slave::onDisconnectTCP()
+{
+    connected = false;
+    started = false;
+    memset( timers, 0, sizeof( timers ) );
+    txq.clear();
+    out.clear();
+    mLog.pushMsg( "*** MASTER DISCONNECTED" );
+}
+
+void iec104_slave::onTimerSecond()
+{
+    if ( !connected )
+        return;
+
+    for ( int i = 0; i < TIMER_COUNT && connected; i++ )
+    {
+        if ( timers[i] == 0 || --timers[i] > 0 )
+            continue;
+        switch ( i )
+        {
+        case T_ACK:
+            mLog.pushMsg( "--> ERROR: NO ACKNOWLEDGEMENT WITHIN T1" );
+            disconnectTCP();
+            return;
+        case T_SUPERVISORY:
+            if ( unackedRx > 0 )
+                sendS = true;
+            break;
+        case T_IDLE:
+            sendU( TESTFRACT );
+            arm( T_TESTFR, t1 );
+            break;
+        case T_TESTFR:
+            mLog.pushMsg( "--> ERROR: NO TESTFRCON" );
+            disconnectTCP();
+            return;
+        }
+    }
+    flush();
+}
+
+bool iec104_slave::readFull( unsigned char * buf, int sz )
+{
+    int got = 0;
+    while ( got < sz )
+    {
+        int n = readTCP( (char *)buf + got, sz - got );
+        if ( n <= 0 )
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+void iec104_slave::packetReadyTCP()
+{
+    unsigned char buf[2 + 255];
+
+    // look for a START
+    do {
+        if ( !readFull( buf, 1 ) )
+            return;
+    } while ( buf[0] != START );
+    if ( !readFull( buf + 1, 1 ) )
+        return;
+    if ( buf[1] < 4 )
+    {
+        mLog.pushMsg( "--> ERROR: INVALID FRAME" );
+        return;
+    }
+    if ( !readFull( buf + 2, buf[1] ) )
+    {
+        mLog.pushMsg( "--> Broken apdu" );
+        return;
+    }
+    parseAPDU( buf, buf[1] + 2 );
+    if ( connected )
+        flush();
+}
+
+void iec104_slave::parseAPDU( const unsigned char * p, int sz )
+{
+    stats.framesIn++;
+    arm( T_IDLE, t3 );
+
+    unsigned char c = p[2];
+    if ( ( c & 0x03 ) == 0x03 )
+    { // U frame
+        switch ( c )
+        {
+        case STARTDTACT:
+            started = true;
+            sendU( STARTDTCON );
+            break;
+        case STOPDTACT:
+            started = false;
+            if ( unackedRx > 0 )
+                sendS = true;
+            sendU( STOPDTCON );
+            break;
+        case TESTFRACT:
+            sendU( TESTFRCON );
+            break;
+        case TESTFRCON:
+            cancel( T_TESTFR );
+            break;
+        }
+        return;
+    }
+
+    acknowledged( (unsigned short)( p[4] | ( p[5] << 8 ) ) );
+    if ( ( c & 0x01 ) == 0x01 ) // S frame
+        return;
+
+    unsigned short ns = (unsigned short)( p[2] | ( p[3] << 8 ) );
+    if ( ns != VR )
+    {
+        mLog.pushMsg( "--> ERROR: SEQUENCE ORDER" );
+        disconnectTCP();
+        return;
+    }
+    VR += 2;
+    if ( ++unackedRx >= w )
+        sendS = true;
+    else
+    if ( timers[T_SUPERVISORY] == 0 )
+        arm( T_SUPERVISORY, t2 );
+
+    if ( sz > 6 + 6 )
+        parseASDU( p + 6, sz - 6 );
+}
+
+void iec104_slave::acknowledged( unsigned short nr )
+{
+    // nr must lie between the last acknowledgement and what was sent
+    if ( (unsigned short)( nr - ackVS ) > (unsigned short)( VS - ackVS ) )
+    {
+        mLog.pushMsg( "--> ERROR: ACKNOWLEDGES UNSENT FRAMES" );
+        return;
+    }
+    ackVS = nr;
+    if ( ackVS == VS )
+        cancel( T_ACK );
+    else
+        arm( T_ACK, t1 );
+}
+
+void iec104_slave::parseASDU( const unsigned char * asdu, int sz )
+{
+    unsigned char type = asdu[0];
+    unsigned char cause = asdu[2] & 0x3F;
+
+    if ( type == iec104_class::C_IC_NA_1 && cause == ACTIVATION )
+        interrogation( asdu, sz );
+    else
+    if ( type == iec104_class::C_CS_NA_1 && cause == ACTIVATION && sz >= 6 + 3 + 7 )
+    {
+        clockSyncIndication( (const cp56time2a *)( asdu + 9 ) );
+        confirm( asdu, sz, ACTCONFIRM, false );
+    }
+    else
+    if ( type == iec104_class::C_TS_TA_1 && cause == ACTIVATION )
+        confirm( asdu, sz, ACTCONFIRM, false );
+    else
+    if ( cause == ACTIVATION || cause == DEACTIVATION )
+    {
+        // commands are not forwarded to the RTUs
+        mLog.pushMsg( "--> COMMAND REJECTED" );
+        confirm( asdu, sz, UNKNOWN_TYPE, true );
+    }
+}
+
+void iec104_slave::confirm( const unsigned char * asdu, int sz, unsigned char cause, bool negative )
+{
+    std::vector<unsigned char> a( asdu, asdu + sz );
+    a[2] = (unsigned char)( cause | ( negative ? 0x40 : 0 ) );
+    queueASDU( a );
+}
+
+void iec104_slave::interrogation( const unsigned char * asdu, int sz )
+{
+    unsigned short ca = (unsigned short)( asdu[4] | ( asdu[5] << 8 ) );
+    if ( sz < 6 + 3 + 1 || asdu[9] != INROGEN )
+    { // only station interrogation
+        confirm( asdu, sz, ACTCONFIRM, true );
+        return;
+    }
+
+    confirm( asdu, sz, ACTCONFIRM, false );
+    gipoints.clear();
+    interrogationPoints( ca, gipoints );
+    stats.objects += pack( gipoints, INROGEN, true, packed );
+    for ( size_t i = 0; i < packed.size(); i++ )
+        queueASDU( packed[i] );
+    confirm( asdu, sz, ACTTERM, false );
+    stats.gis++;
+
+    char buf[80];
+    sprintf( buf, "<-- INTERROGATION CA %u: %u objects in %u ASDUs", (unsigned)ca, (unsigned)gipoints.size(), (unsigned)packed.size() );
+    mLog.pushMsg( buf );
+}
+
+void iec104_slave::sendSpontaneous( const iec_obj * obj, int numpoints )
+{
+    if ( !connected || numpoints <= 0 )
+        return;
+
+    std::vector<iec_obj> changes( obj, obj + numpoints );
+    int n = pack( changes, SPONTANEOUS, false, packed );
+    stats.objects += n;
+    stats.skipped += numpoints - n;
+    for ( size_t i = 0; i < packed.size(); i++ )
+    {
+        if ( txq.size() >= queueLimit )
+        {
+            txq.pop_front();
+            stats.dropped++;
+        }
+        queueASDU( packed[i] );
+    }
+    flush();
+}
+
+void iec104_slave::queueASDU( std::vector<unsigned char> & asdu )
+{
+    txq.push_back( std::vector<unsigned char>() );
+    txq.back().swap( asdu );
+}
+
+void iec104_slave::sendU( unsigned char code )
+{
+    unsigned char f[6] = { START, 4, code, 0, 0, 0 };
+    out.insert( out.end(), f, f + 6 );
+}
+
+void iec104_slave::flush()
+{
+    while ( started && !txq.empty() && (unsigned short)( VS - ackVS ) < 2 * k )
+    {
+        std::vector<unsigned char> & a = txq.front();
+        out.push_back( START );
+        out.push_back( (unsigned char)( a.size() + 4 ) );
+        out.push_back( (unsigned char)( VS & 0xFF ) );
+        out.push_back( (unsigned char)( VS >> 8 ) );
+        out.push_back( (unsigned char)( VR & 0xFF ) );
+        out.push_back( (unsigned char)( VR >> 8 ) );
+        out.insert( out.end(), a.begin(), a.end() );
+        txq.pop_front();
+        if ( VS == ackVS )
+            arm( T_ACK, t1 );
+        VS += 2;
+        stats.framesOut++;
+        // the I frame carries the acknowledgement
+        unackedRx = 0;
+        sendS = false;
+        cancel( T_SUPERVISORY );
+    }
+    if ( sendS )
+    {
+        unsigned char f[6] = { START, 4, 0x01, 0, (unsigned char)( VR & 0xFF ), (unsigned char)( VR >> 8 ) };
+        out.insert( out.end(), f, f + 6 );
+        unackedRx = 0;
+        sendS = false;
+        cancel( T_SUPERVISORY );
+    }
+    if ( !out.empty() )
+    {
+        sendTCP( (char *)&out[0], (int)out.size() );
+        stats.writes++;
+        out.clear();
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef IEC104_SLAVE_H
+#define IEC104_SLAVE_H
+
+// IEC 60870-5-104 BASE CLASS, SLAVE (OUTSTATION) IMPLEMENTATION
+// One instance per connected master. GI is answered from the points the user provides,
+// packed into as few ASDUs as the 253 byte APDU limit allows: runs of consecutive addresses
+// go out as SQ=1, the rest as SQ=0. Spontaneous changes wait in this connection's own
+// queue and are released as the k window opens.
+
+#include <vector>
+#include <deque>
+
+#include "iec104_class.h"
+
+struct iec104_slave_stats {
+    unsigned long framesIn; // frames received
+    unsigned long framesOut; // I frames sent
+    unsigned long writes; // sendTCP calls
+    unsigned long gis; // GIs answered
+    unsigned long objects; // objects sent, GI and spontaneous
+    unsigned long dropped; // queued frames discarded, the master did not keep up
+    unsigned long skipped; // objects of types that are not forwarded
+    unsigned int queued; // frames waiting now
+};
+
+class iec104_slave
+{
+public:
+    iec104_slave();
+    virtual ~iec104_slave();
+
+    TLogMsg mLog;
+
+    // ---- user called funcions ------------------------------------------------
+    void onConnectTCP(); // master connected
+    void onDisconnectTCP(); // connection closed
+    void onTimerSecond(); // each second
+    void packetReadyTCP(); // data ready to be read from the connection
+    void sendSpontaneous( const iec_obj * obj, int numpoints ); // queue changes, sent with cause spontaneous
+    bool isStarted() const { return started; }
+    void setQueueLimit( unsigned int frames ) { queueLimit = frames; }
+    iec104_slave_stats getStats() const;
+
+    // packs points into ASDUs (no APCI) of at most maxasdu bytes; returns the number of objects
+    // packed, objects of types with no mapping are left out
+    static int pack( std::vector<iec_obj> & points, unsigned char cause, bool sequence,
+                     std::vector< std::vector<unsigned char> > & asdus );
+
+    static const int k = 12; // unacknowledged I frames sent before waiting
+    static const int w = 8; // I frames received before acknowledging
+    static const int t1 = 15;
+    static const int t2 = 10;
+    static const int t3 = 20;
+    static const int maxasdu = 249; // 253 byte APDU less the 4 control octets
+
+protected:
+    // ---- pure virtual funcions, user defined on derived class (mandatory)---
+    virtual void disconnectTCP() = 0;
+    virtual int readTCP( char * buf, int szmax ) = 0;
+    virtual void sendTCP( char * data, int sz ) = 0;
+    // points to answer a GI for ca (0xFFFF: every ca)
+    virtual void interrogationPoints( unsigned short ca, std::vector<iec_obj> & points ) = 0;
+
+    // ---- virtual funcions, user defined on derived class (not mandatory)---
+    virtual void clockSyncIndication( const cp56time2a * /*time*/ ) {}
+
+private:
+    enum Timer { T_ACK, T_SUPERVISORY, T_IDLE, T_TESTFR, TIMER_COUNT };
+    void arm( Timer t, int seconds ) { timers[t] = seconds; }
+    void cancel( Timer t ) { timers[t] = 0; }
+
+    bool readFull( unsigned char * buf, int sz );
+    void parseAPDU( const unsigned char * p, int sz );
+    void parseASDU( const unsigned char * asdu, int sz );
+    void interrogation( const unsigned char * asdu, int sz );
+    void confirm( const unsigned char * asdu, int sz, unsigned char cause, bool negative );
+    void sendU( unsigned char code );
+    void queueASDU( std::vector<unsigned char> & asdu );
+    void acknowledged( unsigned short nr );
+    void flush(); // window permitting, queued I frames and pending acks go out in one write
+
+    bool connected;
+    bool started;
+    unsigned short VS; // next send sequence, as on the wire (<<1)
+    unsigned short VR; // next expected receive sequence
+    unsigned short ackVS; // our frames acknowledged up to here
+    int unackedRx; // I frames received since we last acknowledged
+    bool sendS; // an S frame is due
+    int timers[TIMER_COUNT]; // seconds left, 0 when not armed
+    std::deque< std::vector<unsigned char> > txq; // ASDUs waiting for the window
+    unsigned int queueLimit;
+    std::vector<unsigned char> out; // frames of one write
+    std::vector<iec_obj> gipoints;
+    std::vector< std::vector<unsigned char> > packed;
+    iec104_slave_stats stats;
+};
+
+#endif // IEC104_SLAVE_H
@@ -0,0 +1,76 @@
+#include "stdafx.h"
+#include <string.h>
+
+#include "iec104_stations.h"
+
+iec104_ca_table::iec104_ca_table()
+{
+    memset( pages, 0, sizeof( pages ) );
+}
+
+iec104_ca_table::~iec104_ca_table()
+{
+    clear();
+}
+
+void iec104_ca_table::set( unsigned short ca, int slot )
+{
+    int *& page = pages[ca >> 8];
+    if ( page == NULL )
+    {
+        page = new int [256];
+        for ( int i = 0; i < 256; i++ )
+            page[i] = -1;
+    }
+    page[ca & 0xFF] = slot;
+}
+
+void iec104_ca_table::clear()
+{
+    for ( int i = 0; i < 256; i++ )
+    {
+        delete[] pages[i];
+        pages[i] = NULL;
+    }
+}
+
+iec104_stations::iec104_stations()
+{
+    fixed = false;
+    rejected = 0;
+}
+
+int iec104_stations::append( unsigned short ca )
+{
+    iec104_station_stats st;
+    memset( &st, 0, sizeof( st ) );
+    st.ca = ca;
+    list.push_back( st );
+    table.set( ca, (int)list.size() - 1 );
+    return (int)list.size() - 1;
+}
+
+int iec104_stations::add( unsigned short ca )
+{
+    if ( !fixed )
+    { // stations learnt so far were not asked for
+        fixed = true;
+        table.clear();
+        list.clear();
+    }
+    int slot = table.find( ca );
+    return slot >= 0 ? slot : append( ca );
+}
+
+int iec104_stations::route( unsigned short ca )
+{
+    int slot = table.find( ca );
+    if ( slot >= 0 )
+        return slot;
+    if ( fixed )
+    {
+        rejected++;
+        return -1;
+    }
+    return append( ca );
+}
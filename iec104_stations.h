@@ -0,0 +1,70 @@
+#ifndef IEC104_STATIONS_H
+#define IEC104_STATIONS_H
+
+// Stations (common addresses of ASDU) carried on one IEC 104 connection. A gateway multiplexes
+// many outstations on one link; every ASDU is routed by its CA through a two level table of
+// 256 pages of 256 slots, a page allocated when one of its CAs is first used, so routing is two
+// array reads and a link with a few dozen stations costs a few kilobytes.
+
+#include <vector>
+
+static const unsigned short IEC104_CA_BROADCAST = 0xFFFF;
+
+// CA -> small integer
+class iec104_ca_table
+{
+public:
+    iec104_ca_table();
+    ~iec104_ca_table();
+
+    int find( unsigned short ca ) const // -1 if not set
+    {
+        const int * page = pages[ca >> 8];
+        return page ? page[ca & 0xFF] : -1;
+    }
+    void set( unsigned short ca, int slot );
+    void clear();
+
+private:
+    iec104_ca_table( const iec104_ca_table & );
+    iec104_ca_table & operator=( const iec104_ca_table & );
+
+    int * pages[256];
+};
+
+struct iec104_station_stats {
+    unsigned short ca;
+    unsigned __int64 asdus; // ASDUs received
+    unsigned __int64 objects; // objects indicated
+    unsigned __int64 gis; // GI terminations
+    unsigned __int64 commands; // commands sent
+    unsigned __int64 negative; // negative confirmations received
+    bool interrogating; // between GI ACTCON and ACTTERM
+};
+
+class iec104_stations
+{
+public:
+    iec104_stations();
+
+    // a station added here restricts routing to the added stations; with none added every CA
+    // is accepted and learnt as it arrives
+    int add( unsigned short ca );
+    int route( unsigned short ca ); // slot of the station, -1 if it is not one of ours
+    int find( unsigned short ca ) const { return table.find( ca ); }
+    iec104_station_stats & at( int slot ) { return list[slot]; }
+    int count() const { return (int)list.size(); }
+    bool configured() const { return fixed; }
+    unsigned __int64 unrouted() const { return rejected; } // ASDUs of unknown stations
+    void getStats( std::vector<iec104_station_stats> & out ) const { out = list; }
+
+private:
+    int append( unsigned short ca );
+
+    iec104_ca_table table;
+    std::vector<iec104_station_stats> list;
+    bool fixed;
+    unsigned __int64 rejected;
+};
+
+#endif // IEC104_STATIONS_H
@@ -163,6 +163,7 @@
 #define ID_PROVIDERS_MAPQUEST_OPEN_AERIAL 32852
 #define ID_INDICATOR_POSITION           0xE700
 #define ID_INDICATOR_LENGTH             59137
+#define ID_INDICATOR_TELEMETRY          59138
 
 // Next default values for new objects
 // 